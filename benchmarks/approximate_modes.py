@@ -0,0 +1,316 @@
+"""
+Measures what each approximate training or serving mode costs in quality, against an exact reference
+model, and what it gains in speed. For every mode it reports:
+    - recall@N of its top-N lists against the exact top-N of the reference model (scores from 'predict',
+      excluding the items seen in training), averaged over a sample of users. For the fold-in modes, the
+      reference is the top-N from factors folded in with the default solver run until convergence.
+    - Poisson log-likelihood on held-out data (and on the training data for training modes), and the
+      difference with respect to the reference.
+    - Latency percentiles for single-user queries (and fitting time for training modes).
+
+The modes compared are:
+    - Training: reduced-precision reads of the fixed factors ('fixed_precision'), and the fused and
+      stratified iteration schemes.
+    - Serving: native top-N (exact, as a control), item factors rounded to float32 or bfloat16 before
+      scoring, and pruned latent dimensions.
+    - Fold-in: recommending for the same users from their training data as if they were new, with the
+      default solver (the baseline for the latencies of this group), with the item-blocked layout of B,
+      with the cheaper PGD solver, and with smaller iteration budgets.
+
+The output is a JSON document, written to stdout or to the file passed in '--output', so that the
+operating points can be compared across machines or versions. New modes can be added to the
+'TRAIN_MODES' and 'SERVE_MODES' lists.
+
+Usage: python approximate_modes.py [--data file] [--nusers 10000] [--nitems 10000] [--nnz 1000000]
+                                   [--k 40] [--l2-reg 1e5] [--n 10] [--nthreads -1] [--output results.json]
+'--data' takes a CSV or parquet file with columns 'UserId', 'ItemId', 'Count'. If not passed,
+will generate random data.
+"""
+import sys, time, json, argparse, platform
+import numpy as np, pandas as pd
+from poismf import PoisMF
+import poismf
+
+def gen_data(nusers, nitems, nnz, seed = 1):
+    ### draws from a low-rank Poisson model, so that the top-N lists are not just noise
+    rng = np.random.RandomState(seed)
+    k_true = 10
+    A = rng.gamma(0.3, 1, size = (nusers, k_true))
+    B = rng.gamma(0.3, 1, size = (nitems, k_true))
+    users = rng.randint(nusers, size = nnz)
+    items = np.empty(nnz, dtype = int)
+    ### item for each entry: pick a dimension according to the user's weights, then an item according to it
+    probs = A / A.sum(axis = 1, keepdims = True)
+    dims = (probs[users].cumsum(axis = 1) > rng.random_sample(nnz)[:, None]).argmax(axis = 1)
+    Bcum = (B / B.sum(axis = 0, keepdims = True)).T.cumsum(axis = 1)
+    for d in range(k_true):
+        sel = dims == d
+        items[sel] = np.searchsorted(Bcum[d], rng.random_sample(sel.sum()) * Bcum[d, -1])
+    items = np.clip(items, 0, nitems - 1)
+    df = pd.DataFrame({"UserId" : users, "ItemId" : items, "Count" : 1})
+    return df.groupby(["UserId", "ItemId"], as_index = False)["Count"].sum()
+
+def read_data(fname):
+    df = pd.read_parquet(fname) if fname.endswith(".parquet") else pd.read_csv(fname)
+    df = df[["UserId", "ItemId", "Count"]]
+    df = df.loc[df.Count > 0].groupby(["UserId", "ItemId"], as_index = False)["Count"].sum()
+    ### IDs are mapped to 0..n-1 here, so that all the models share the same indices
+    df["UserId"] = pd.factorize(df.UserId)[0]
+    df["ItemId"] = pd.factorize(df.ItemId)[0]
+    return df
+
+def split_data(df, test_frac = 0.2, seed = 2):
+    rng = np.random.RandomState(seed)
+    is_test = rng.random_sample(df.shape[0]) < test_frac
+    train, test = df.loc[~is_test].reset_index(drop = True), df.loc[is_test].reset_index(drop = True)
+    ### users and items only in the test set can't be evaluated
+    test = test.loc[test.UserId.isin(train.UserId) & test.ItemId.isin(train.ItemId)].reset_index(drop = True)
+    return train, test
+
+def percentiles(times):
+    times = np.asarray(times) * 1e3
+    return {"mean_ms" : float(times.mean()), "p50_ms" : float(np.percentile(times, 50)),
+            "p90_ms" : float(np.percentile(times, 90)), "p99_ms" : float(np.percentile(times, 99)),
+            "max_ms" : float(times.max()), "nqueries" : int(times.shape[0])}
+
+def llk(A, B, df, full = False):
+    ### Poisson log-likelihood without the terms that don't depend on the parameters; 'full' subtracts
+    ### the predicted counts for every user-item pair (as in the fitting objective) instead of only for 'df'
+    pred = np.einsum("ij,ij->i", A[df.UserId.values], B[df.ItemId.values])
+    out = np.sum(df.Count.values * np.log(np.maximum(pred, 1e-300)))
+    if full:
+        return float(out - A.sum(axis = 0).dot(B.sum(axis = 0)))
+    return float(out - pred.sum())
+
+def exact_topn(model, users, seen, n):
+    ### reference top-N lists, computed from 'predict' over all the items
+    nitems = model.B.shape[0]
+    out = []
+    for u in users:
+        scores = np.asarray(model.predict(np.repeat(u, nitems), np.arange(nitems)), dtype = float)
+        scores[seen[u]] = -np.inf
+        top = np.argsort(-scores, kind = "stable")[:n]
+        out.append(set(top[np.isfinite(scores[top])].tolist()))
+    return out
+
+def exact_topn_foldin(model, sessions, n):
+    ### reference for the fold-in modes: factors from running the default solver until convergence,
+    ### scored against all the items (same formula as 'predict')
+    A = np.empty((len(sessions), model.k))
+    out = []
+    for ix, (items, counts) in enumerate(sessions):
+        A[ix] = model.predict_factors(pd.DataFrame({"ItemId" : items, "Count" : counts}), l2_reg = model.l2_reg,
+                                      solver = "cg", max_iter = 1000, max_fun_eval = 5000)
+        scores = model.B.dot(A[ix])
+        scores[items] = -np.inf
+        top = np.argsort(-scores, kind = "stable")[:n]
+        out.append(set(top[np.isfinite(scores[top])].tolist()))
+    return out, A
+
+def recall(approx, exact):
+    return float(np.mean([len(set(np.asarray(a).tolist()) & e) / max(len(e), 1) for a, e in zip(approx, exact)]))
+
+def time_queries(fun, queries, warmup = 3):
+    for q in queries[:warmup]:
+        fun(q)
+    times, out = [], []
+    for q in queries:
+        st = time.perf_counter()
+        out.append(fun(q))
+        times.append(time.perf_counter() - st)
+    return out, times
+
+def topn_native(model, users, n):
+    recs, times = time_queries(lambda u: model.topN_batch([u], n = n)[0], users)
+    return recs, times
+
+### Training modes: (name, PoisMF options overriding the reference ones)
+TRAIN_MODES = [
+    ("fixed_precision=float", {"fixed_precision" : "float"}),
+    ("fixed_precision=bfloat16", {"fixed_precision" : "bfloat16"}),
+    ("iter_scheme=fused", {"iter_scheme" : "fused"}),
+    ("iter_scheme=stratified", {"iter_scheme" : "stratified"}),
+    ("float_iters=5", {"float_iters" : 5}),
+    ("float_iters=10,float_tol=1e-3", {"float_iters" : 10, "float_tol" : 1e-3}),
+]
+
+def serve_exact(ref, ctx):
+    recs, times = topn_native(ref, ctx["users"], ctx["n"])
+    return {"recs" : recs, "times" : times, "A" : ref.A, "B" : ref.B}
+
+def serve_rounded(dtype):
+    def fun(ref, ctx):
+        B = ref.B
+        if dtype == "bfloat16":
+            ### rounds to nearest, keeping the upper 16 bits of the float32 representation
+            bits = B.astype(np.float32).view(np.uint32)
+            bits = (bits + np.uint32(0x7FFF) + ((bits >> np.uint32(16)) & np.uint32(1))) & np.uint32(0xFFFF0000)
+            Bq = bits.view(np.float32).astype(np.float64)
+        else:
+            Bq = B.astype(np.float32).astype(np.float64)
+        Bold = ref.B
+        ref.B = Bq
+        try:
+            recs, times = topn_native(ref, ctx["users"], ctx["n"])
+        finally:
+            ref.B = Bold
+        return {"recs" : recs, "times" : times, "A" : ref.A, "B" : Bq, "emulated" : True,
+                "bytes_B" : int(B.size * (4 if dtype == "float32" else 2))}
+    return fun
+
+def serve_pruned(min_share):
+    def fun(ref, ctx):
+        model = ref.prune_dimensions(min_share = min_share)
+        model.nthreads = ref.nthreads
+        recs, times = topn_native(model, ctx["users"], ctx["n"])
+        return {"recs" : recs, "times" : times, "A" : model.A, "B" : model.B, "k" : int(model.k)}
+    return fun
+
+def serve_foldin(block_size = None, **options):
+    def fun(ref, ctx):
+        sessions = ctx["sessions"]
+        options.setdefault("l2_reg", ref.l2_reg)
+        ref.set_item_blocks(block_size)
+        try:
+            recs, times = time_queries(lambda s: ref.recommend_from_interactions(s[0], s[1], n = ctx["n"], **options),
+                                       sessions)
+        finally:
+            ref.set_item_blocks(None)
+        ### the held-out log-likelihood is calculated with the folded-in factors of the same users
+        A = ref.A.copy()
+        for u, s in zip(ctx["users"], sessions):
+            A[u] = ref.predict_factors(pd.DataFrame({"ItemId" : s[0], "Count" : s[1]}), **options)
+        return {"recs" : recs, "times" : times, "A" : A, "B" : ref.B, "fold_in" : True}
+    return fun
+
+### Serving modes: (name, function taking the reference model and the evaluation context)
+SERVE_MODES = [
+    ("topN_batch", serve_exact),
+    ("rounded_B=float32", serve_rounded("float32")),
+    ("rounded_B=bfloat16", serve_rounded("bfloat16")),
+    ("pruned(min_share=1e-2)", serve_pruned(1e-2)),
+    ("pruned(min_share=5e-2)", serve_pruned(5e-2)),
+    ("fold_in(cg)", serve_foldin(solver = "cg")),
+    ("fold_in(cg,item_blocks=16)", serve_foldin(block_size = 16, solver = "cg")),
+    ("fold_in(pgd)", serve_foldin(solver = "pgd")),
+    ("fold_in(cg,max_iter=10)", serve_foldin(solver = "cg", max_iter = 10, max_fun_eval = 20)),
+    ("fold_in(pgd,max_iter=5)", serve_foldin(solver = "pgd", max_iter = 5)),
+]
+
+def run(args):
+    df = read_data(args.data) if args.data else gen_data(args.nusers, args.nitems, args.nnz)
+    train, test = split_data(df)
+    nusers, nitems = int(df.UserId.max()) + 1, int(df.ItemId.max()) + 1
+    base_opts = {"k" : args.k, "niter" : args.niter, "l2_reg" : args.l2_reg, "initial_step" : args.step,
+                 "nthreads" : args.nthreads,
+                 "reindex" : False, "produce_dicts" : False, "keep_data" : True}
+
+    rng = np.random.RandomState(3)
+    users = np.unique(train.UserId.values)
+    users = np.sort(rng.choice(users, size = min(args.nusers_eval, users.shape[0]), replace = False))
+    by_user = train.sort_values(["UserId", "ItemId"]).groupby("UserId")
+    seen = {u : g.ItemId.values for u, g in by_user if u in set(users.tolist())}
+    sessions = [(seen[u], by_user.get_group(u).Count.values.astype(float)) for u in users]
+    test_eval = test.loc[test.UserId.isin(users)]
+
+    results = {"data" : {"source" : args.data or "synthetic", "nusers" : nusers, "nitems" : nitems,
+                         "nnz_train" : int(train.shape[0]), "nnz_test" : int(test.shape[0])},
+               "settings" : {"k" : args.k, "niter" : args.niter, "l2_reg" : args.l2_reg, "step" : args.step, "n" : args.n, "nthreads" : args.nthreads,
+                             "nusers_eval" : int(users.shape[0])},
+               "system" : {"python" : platform.python_version(), "machine" : platform.machine(),
+                           "poismf" : getattr(poismf, "__version__", None)},
+               "modes" : []}
+
+    st = time.perf_counter()
+    ref = PoisMF(**base_opts).fit(train)
+    ref_fit_time = time.perf_counter() - st
+    exact = exact_topn(ref, users, seen, args.n)
+    ref_llk = {"llk_test" : llk(ref.A, ref.B, test), "llk_train" : llk(ref.A, ref.B, train, full = True),
+               "llk_test_users" : llk(ref.A, ref.B, test_eval)}
+    _, ref_times = topn_native(ref, users, args.n)
+    results["reference"] = dict(ref_llk, fit_seconds = ref_fit_time, latency = percentiles(ref_times))
+    exact_foldin, A_foldin = exact_topn_foldin(ref, sessions, args.n)
+    A_full = ref.A.copy()
+    A_full[users] = A_foldin
+    results["reference"]["fold_in"] = {"llk_test_users" : llk(A_full, ref.B, test_eval),
+                                       "recall_vs_fitted" : recall([list(r) for r in exact_foldin], exact)}
+
+    for name, opts in TRAIN_MODES:
+        if name in args.skip:
+            continue
+        st = time.perf_counter()
+        model = PoisMF(**dict(base_opts, **opts)).fit(train)
+        fit_time = time.perf_counter() - st
+        recs, times = topn_native(model, users, args.n)
+        entry = {"mode" : name, "kind" : "train", "options" : opts,
+                 "recall_at_n" : recall(recs, exact),
+                 "llk_test" : llk(model.A, model.B, test),
+                 "llk_train" : llk(model.A, model.B, train, full = True),
+                 "fit_seconds" : fit_time, "fit_speedup" : ref_fit_time / fit_time,
+                 "latency" : percentiles(times)}
+        entry["llk_test_delta"] = entry["llk_test"] - ref_llk["llk_test"]
+        entry["llk_train_delta"] = entry["llk_train"] - ref_llk["llk_train"]
+        results["modes"].append(entry)
+        print("%-28s recall@%d: %.4f  llk_test delta: %+.4g" % (name, args.n, entry["recall_at_n"],
+              entry["llk_test_delta"]), file = sys.stderr)
+
+    ctx = {"users" : users, "sessions" : sessions, "n" : args.n}
+    fold_in_latency = None
+    for name, fun in SERVE_MODES:
+        if name in args.skip:
+            continue
+        out = fun(ref, ctx)
+        entry = {"mode" : name, "kind" : "fold_in" if out.get("fold_in") else "serve",
+                 "latency" : percentiles(out["times"]), "emulated" : bool(out.get("emulated", False))}
+        ### fold-in modes are compared against the converged fold-in of the same users, as the
+        ### factors obtained in 'fit' are not what any fold-in solver would produce
+        if entry["kind"] == "fold_in":
+            entry["recall_at_n"] = recall(out["recs"], exact_foldin)
+            entry["recall_vs_fitted"] = recall(out["recs"], exact)
+        else:
+            entry["recall_at_n"] = recall(out["recs"], exact)
+        if "A" in out:
+            ### fold-in modes only change the factors of the evaluated users, so only their test data is used
+            if entry["kind"] == "fold_in":
+                entry["llk_test_users"] = llk(out["A"], out["B"], test_eval)
+                entry["llk_test_users_delta"] = entry["llk_test_users"] - results["reference"]["fold_in"]["llk_test_users"]
+            else:
+                entry["llk_test"] = llk(out["A"], out["B"], test)
+                entry["llk_test_delta"] = entry["llk_test"] - ref_llk["llk_test"]
+        for key in ["k", "bytes_B"]:
+            if key in out:
+                entry[key] = out[key]
+        ### fold-in latencies are compared against fold-in with the default solver, the rest against 'topN_batch'
+        base = results["reference"]["latency"] if entry["kind"] == "serve" else fold_in_latency
+        if base is None:
+            fold_in_latency = base = entry["latency"]
+        entry["latency_ratio"] = entry["latency"]["p50_ms"] / base["p50_ms"]
+        results["modes"].append(entry)
+        print("%-28s recall@%d: %.4f  p50: %.3fms" % (name, args.n, entry["recall_at_n"],
+              entry["latency"]["p50_ms"]), file = sys.stderr)
+    return results
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description = "Quality and speed of the approximate modes.")
+    parser.add_argument("--data", default = None)
+    parser.add_argument("--nusers", type = int, default = 10**4)
+    parser.add_argument("--nitems", type = int, default = 10**4)
+    parser.add_argument("--nnz", type = int, default = 10**6)
+    parser.add_argument("--k", type = int, default = 40)
+    parser.add_argument("--niter", type = int, default = 10)
+    ### the defaults of the package are meant for much larger datasets, for which these would underfit
+    parser.add_argument("--l2-reg", type = float, default = 1e5)
+    parser.add_argument("--step", type = float, default = 1e-7)
+    parser.add_argument("--n", type = int, default = 10)
+    parser.add_argument("--nusers-eval", type = int, default = 200)
+    parser.add_argument("--nthreads", type = int, default = -1)
+    parser.add_argument("--skip", nargs = "*", default = [], help = "Names of modes to leave out.")
+    parser.add_argument("--output", default = None)
+    args = parser.parse_args()
+    results = run(args)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent = 2)
+    else:
+        json.dump(results, sys.stdout, indent = 2)
+        print()
@@ -0,0 +1,37 @@
+"""
+Compares fitting times with the split (index array + value array) and the
+packed (8-byte index/value records) layouts for the non-zero entries.
+
+Usage: python packed_nonzeros.py [nusers] [nitems] [nnz] [k] [nthreads]
+"""
+import sys, time
+import numpy as np, pandas as pd
+from poismf import PoisMF
+
+def gen_data(nusers, nitems, nnz, seed = 1):
+    rng = np.random.RandomState(seed)
+    df = pd.DataFrame({
+        "UserId" : rng.randint(nusers, size = nnz),
+        "ItemId" : rng.randint(nitems, size = nnz),
+        "Count"  : rng.poisson(1, size = nnz) + 1
+    })
+    return df.drop_duplicates(["UserId", "ItemId"]).reset_index(drop = True)
+
+def time_fit(df, packed, **kwargs):
+    model = PoisMF(packed_nonzeros = packed, reindex = False, produce_dicts = False, keep_data = False, **kwargs)
+    st = time.time()
+    model.fit(df)
+    return time.time() - st
+
+if __name__ == "__main__":
+    args = [int(a) for a in sys.argv[1:]]
+    nusers, nitems, nnz, k, nthreads = args + [10**5, 10**5, 10**7, 10, -1][len(args):]
+    df = gen_data(nusers, nitems, nnz)
+    print("users: %d - items: %d - nnz: %d - k: %d" % (nusers, nitems, df.shape[0], k))
+    for scheme in ["alternating", "fused"]:
+        for use_cg in [False, True]:
+            if use_cg and scheme != "alternating":
+                continue
+            times = [time_fit(df, packed, k = k, iter_scheme = scheme, use_cg = use_cg, nthreads = nthreads)
+                     for packed in [False, True]]
+            print("%-12s cg=%-5s  split: %8.3fs  packed: %8.3fs" % (scheme, use_cg, times[0], times[1]))
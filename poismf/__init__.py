@@ -1,7 +1,11 @@
 import pandas as pd, numpy as np
-import multiprocessing, os, warnings, ctypes
-from scipy.sparse import coo_matrix, csr_matrix, csc_matrix
-from .poismf_c_wrapper import run_pgd, _predict_multiple, _predict_factors
+import multiprocessing, os, shutil, warnings, ctypes, struct, json, copy, tempfile, weakref
+from scipy.sparse import coo_matrix, csr_matrix
+from .poismf_c_wrapper import run_pgd, run_pgd_dense, _available_cpus, _predict_multiple, _predict_factors, \
+    _save_model_file, _read_model_header, _export_model_delta, _read_delta_header, \
+    _apply_model_delta, _read_delta_blobs, _calc_llk, _recommend_from_interactions, _topn_rows_for_items, \
+    _topn_items_shard, _merge_topn, _pack_items_blocked, _ModelReplicas, _SparseBuilder, \
+    _SeenIndex, _topn_items_seen, _recommend_from_pack
 pd.options.mode.chained_assignment = None
 
 class PoisMF:
@@ -53,6 +57,44 @@ class PoisMF:
         Initial step size to use (ignored for conjugate gradient method).
     use_cg : bool
         Whether to fit the model through conjugate gradient method (slower, but less prone to failure).
+    iter_scheme : str
+        How to structure each iteration (ignored for conjugate gradient method). One of 'alternating'
+        (update all the user factors, then all the item factors), 'fused' (update the user factors and
+        accumulate the gradients for the item factors in the same pass over the data, then update the item
+        factors in a dense pass), or 'stratified' (split users and items into blocks, and update user and item
+        factors together tile-by-tile, with each thread working on tiles that share no users or items with
+        the others). The 'fused' scheme reads the data only once per iteration and doesn't need
+        to build a column-major copy of it, but the item factors get only one update per iteration
+        regardless of 'npasses'.
+    nblocks : int
+        Number of user and item blocks to use with ``iter_scheme='stratified'``. If passing 0, will pick
+        a number that gives at least one tile per thread and blocks of item factors small enough
+        to stay in cache.
+    fixed_precision : str
+        Precision in which to read the factor matrix that is held fixed while the other one is being
+        updated. One of 'double', 'float', or 'bfloat16'. With 'float' or 'bfloat16', a reduced-precision
+        copy of it is made after each update, which takes less memory bandwidth to read, at the expense of
+        some precision in the calculated gradients. The factor matrices themselves and all the calculations
+        are kept in double precision. Ignored for ``iter_scheme='stratified'``.
+    packed_nonzeros : bool
+        Whether to internally make a copy of the data with each non-zero entry stored as a single 8-byte record
+        (32-bit index and 32-bit float value), which can be read as one memory stream instead of two. Takes
+        extra memory for the copy of the input data (the transposed copy made internally is kept only in
+        packed form). Ignored for ``iter_scheme='stratified'``, or if some value is not exactly representable
+        as a 32-bit float (e.g. non-integer counts), so that the values are never rounded.
+    float_iters : int
+        Maximum number of initial iterations to run entirely in single precision (factor matrices, data, and
+        calculations), after which the factors are promoted to double precision for the remaining iterations.
+        The first iterations move the factors far from their random initialization and don't benefit from the
+        extra precision, so this reads about half the bytes during them while the final iterations remain
+        the same as with the default procedure. These are always alternating proximal gradient updates
+        (regardless of 'iter_scheme'), so they need the column-major copy of the data. Ignored for
+        conjugate gradient.
+    float_tol : float
+        Switch to double precision before 'float_iters' once a single-precision iteration decreases
+        the objective function by less than this fraction of its value. Calculating the objective
+        adds a logarithm per non-zero entry to those iterations. If passing zero, will switch only
+        after 'float_iters' iterations.
     init_type : str
         How to initialize the model parameters. One of 'gamma' (will initialize them ~ Gamma(1, 1))
         or 'unif' (will initialize them ~ Unif(0, 1)).
@@ -60,13 +102,22 @@ class PoisMF:
         Random seed to use to initialize model parameters.
     nthreads : int
         Number of threads to use to parallelize computations.
-        If set to 0 or less, will use the maximum available on the computer.
+        If set to 0 or less, will use the number of CPUs available to the process, as determined by its
+        CPU affinity and, on Linux, by the CPU quota of its cgroup (e.g. the CPU limit of a container).
+    adapt_threads : bool
+        Whether to check again the CPUs available to the process during training (at most once per second,
+        between half-steps), running the next half-steps with that many threads. This adjusts the fitting
+        procedure to changes in the CPU quota or affinity (e.g. when a container's limit is lowered to make room
+        for other work), up to 'nthreads' threads, or up to the number of CPUs on the computer if 'nthreads'
+        was set to 0 or less. Note that results can differ slightly when running with different numbers of threads.
     reindex : bool
         Whether to reindex data internally.
     keep_data : bool
         Whether to keep information about which user was associated with each item
         in the training set, so as to exclude those items later when making Top-N
-        recommendations.
+        recommendations. These are kept in a compact index, storing the items of each
+        user either as a sorted array of 32-bit integers or as a bitmap over all the
+        items, whichever is smaller, which is also saved by 'save_model'.
     save_folder : str or None
         Folder where to save all model parameters as csv files.
     produce_dicts : bool
@@ -97,8 +148,9 @@ class PoisMF:
     [1] Cortes, David. "Fast Non-Bayesian Poisson Factorization for Implicit-Feedback Recommendations." arXiv preprint arXiv:1811.01908 (2018).
     """
     def __init__(self, k = 40, l2_reg = 1e9, l1_reg = 0.0, niter = 10, npasses = 1, initial_step = 1e-7,
-                 use_cg = False, init_type = 'gamma', random_seed = 1, nthreads = -1,
-                 reindex=True, keep_data = True, save_folder = None, produce_dicts = True):
+                 use_cg = False, iter_scheme = 'alternating', nblocks = 0, fixed_precision = 'double', packed_nonzeros = False,
+                 float_iters = 0, float_tol = 0.0, init_type = 'gamma', random_seed = 1, nthreads = -1,
+                 adapt_threads = False, reindex=True, keep_data = True, save_folder = None, produce_dicts = True):
 
         ## checking input
         assert k > 0
@@ -114,9 +166,20 @@ class PoisMF:
         assert isinstance(l1_reg, float)
         assert isinstance(initial_step, float)
         assert init_type in ['gamma', 'unif']
+        assert iter_scheme in ['alternating', 'fused', 'stratified']
+        assert isinstance(nblocks, int)
+        assert nblocks >= 0
+        assert fixed_precision in ['double', 'float', 'bfloat16']
+        assert isinstance(float_iters, int)
+        assert float_iters >= 0
+        assert float_tol >= 0
         
+        max_threads = nthreads
         if nthreads < 1:
-            nthreads = multiprocessing.cpu_count()
+            nthreads = _available_cpus()
+            max_threads = max(nthreads, multiprocessing.cpu_count())
+            if nthreads < 1:
+                nthreads = max_threads
         if nthreads is None:
             nthreads = 1
         assert nthreads > 0
@@ -143,7 +206,15 @@ class PoisMF:
         self.niter = niter
         self.npasses = npasses
         self.use_cg = int(bool(use_cg))
+        self.iter_scheme = iter_scheme
+        self.nblocks = nblocks
+        self.fixed_precision = fixed_precision
+        self.packed_nonzeros = bool(packed_nonzeros)
+        self.float_iters = float_iters
+        self.float_tol = float(float_tol)
         self.nthreads = nthreads
+        self.adapt_threads = bool(adapt_threads)
+        self._max_threads = max_threads
 
         self.reindex = bool(reindex)
         self.keep_data = bool(keep_data)
@@ -159,6 +230,10 @@ class PoisMF:
         self.item_mapping_ = None
         self.user_dict_ = None
         self.item_dict_ = None
+        self.item_block_size_ = None
+        self.B_blocked_ = None
+        self._replicas = None
+        self._shared_file = None
         self.is_fitted = False
     
     def fit(self, counts_df):
@@ -186,6 +261,184 @@ class PoisMF:
 
         ## running each sub-process
         self._process_data(counts_df)
+        return self._fit_processed()
+
+    def fit_chunks(self, chunks, nnz_hint = None):
+        """
+        Fit Poisson Model to sparse count data that comes in chunks
+
+        Same as 'fit', but taking the data from an iterable of chunks (e.g. a generator that reads
+        a large file piece by piece), which are consumed one at a time. The triplets from each chunk are
+        appended to compact arrays in compiled code, mapping the IDs to indices along the way, and at the end
+        they are rearranged into the CSR matrix used for fitting (the fitting procedure then builds its transposed
+        copy by itself). Unlike 'fit', this doesn't need to have the data as a single DataFrame plus its
+        intermediate COO copy, so the memory needed at the peak is close to that of the sparse matrices used
+        for fitting (16 bytes per non-zero entry for each of the two).
+
+        Note
+        ----
+        IDs are mapped in compiled code if they are integers, and through a Python dictionary otherwise
+        (slower). The type of the IDs is determined from the first chunk. The resulting mappings are the
+        same as if passing the concatenated chunks to 'fit'.
+
+        Note
+        ----
+        Entries which are repeated across or within chunks are summed.
+
+        Parameters
+        ----------
+        chunks : iterable
+            Chunks of data with one row per non-zero observation, each being a pandas DataFrame or Arrow
+            Table/RecordBatch with columns 'UserId', 'ItemId', 'Count', or a numpy array with these as
+            its first 3 columns.
+        nnz_hint : None or int
+            Expected total number of rows across chunks, if known. Avoids reallocations of the buffers.
+
+        Returns
+        -------
+        self : obj
+            This object
+        """
+        mode = None ### 'native' (integer IDs), 'dict' (other IDs), or 'direct' (reindex=False)
+        mappings = [{}, {}]
+        builder = None
+
+        for chunk in chunks:
+            users, items, counts = self._split_chunk(chunk)
+            if counts.shape[0] == 0:
+                continue
+            if builder is None:
+                if not self.reindex:
+                    mode = ["direct", "direct"]
+                else:
+                    mode = ["native" if ids.dtype.kind in "iub" else "dict" for ids in (users, items)]
+                builder = _SparseBuilder(int(mode[0] == "native"), int(mode[1] == "native"),
+                                         0 if nnz_hint is None else int(nnz_hint))
+
+            ids = [users, items]
+            if "dict" in mode:
+                ### IDs are only mapped if they have some non-zero entry, as in 'fit'
+                keep = counts > 0
+                if not np.all(keep):
+                    builder.n_dropped += int(counts.shape[0] - keep.sum())
+                    ids, counts = [users[keep], items[keep]], counts[keep]
+            for dim in range(2):
+                if mode[dim] == "dict":
+                    codes, uniq = pd.factorize(ids[dim])
+                    mapping = mappings[dim]
+                    if np.any(codes < 0):
+                        raise ValueError("IDs cannot be missing.")
+                    ix = np.array([mapping.setdefault(u, len(mapping)) for u in uniq], dtype = np.int64)
+                    ids[dim] = ix[codes]
+                elif ids[dim].dtype.kind in "iub":
+                    ids[dim] = ids[dim].astype(np.int64)
+                elif mode[dim] == "native":
+                    raise ValueError("Got non-integer IDs after integer IDs in earlier chunks.")
+                else:
+                    ids[dim] = ids[dim].astype(np.int64)
+            builder.add(np.ascontiguousarray(ids[0]), np.ascontiguousarray(ids[1]),
+                        np.ascontiguousarray(counts, dtype = ctypes.c_double))
+
+        if (builder is None) or (builder.nnz == 0):
+            raise ValueError("Data has no non-zero entries.")
+        if builder.n_dropped > 0:
+            msg = "'chunks' contain observations with a count value less than 1, these will be ignored."
+            msg += " Any user or item associated exclusively with zero-value observations will be excluded."
+            msg += " If using 'reindex=False', make sure that your data still meets the necessary criteria."
+            warnings.warn(msg)
+
+        builder.finish(0)
+        self.nusers, self.nitems = builder.shape
+        if self.reindex:
+            self.user_mapping_ = builder.ids(0) if mode[0] == "native" else np.array(list(mappings[0].keys()))
+            self.item_mapping_ = builder.ids(1) if mode[1] == "native" else np.array(list(mappings[1].keys()))
+            if self.save_folder is not None:
+                pd.Series(self.user_mapping_).to_csv(os.path.join(self.save_folder, 'users.csv'), index=False)
+                pd.Series(self.item_mapping_).to_csv(os.path.join(self.save_folder, 'items.csv'), index=False)
+        del mappings
+
+        ## these point to memory owned by the builder, which gets freed once they are deleted
+        self._csr = csr_matrix((self.nusers, self.nitems))
+        self._csr.data, self._csr.indices, self._csr.indptr = builder.csr()
+        del builder
+        return self._fit_processed()
+
+    def fit_dense(self, X):
+        """
+        Fit Poisson Model to a dense matrix of counts
+
+        Fits the model directly on a full matrix, with rows corresponding to users and columns to items,
+        without converting it to a sparse format first. The gradients are calculated for blocks of rows with
+        matrix multiplications, evaluating the Poisson ratios only for the non-zero entries, so each
+        iteration takes time proportional to nusers*nitems*k rather than to the number of non-zero entries
+        times k - this is faster than 'fit' when a sizeable fraction of the entries are non-zero (e.g. survey
+        data), but much slower for very sparse data.
+
+        Note
+        ----
+        The array is used as-is if it's of type float64 with non-negative strides (either C or Fortran order,
+        or a slice of a larger array), and is copied otherwise.
+
+        Note
+        ----
+        This always uses proximal gradient with alternating updates ('use_cg', 'iter_scheme',
+        'fixed_precision', and 'packed_nonzeros' are ignored). 'reindex' will be forced to 'False', so users
+        and items are referred to by their row and column numbers in 'X'.
+
+        Parameters
+        ----------
+        X : array (nusers, nitems)
+            Matrix with the counts for each user and item. Must be non-negative.
+
+        Returns
+        -------
+        self : obj
+            This object
+        """
+        X = np.asarray(X, dtype = ctypes.c_double)
+        assert len(X.shape) == 2
+        if (X.shape[0] == 0) or (X.shape[1] == 0):
+            raise ValueError("'X' has no rows or columns.")
+        if (X.strides[0] < 0) or (X.strides[1] < 0) or (X.strides[0] % X.itemsize) or (X.strides[1] % X.itemsize):
+            X = np.ascontiguousarray(X)
+        x_min = X.min()
+        if np.isnan(x_min):
+            raise ValueError("'X' contains missing values.")
+        if x_min < 0:
+            raise ValueError("'X' contains negative values.")
+
+        self.reindex = False
+        self.produce_dicts = False
+        self.nusers, self.nitems = X.shape
+        self._write_parameters()
+        self._initialize_matrices()
+        run_pgd_dense(X, self.A, self.B, self.l2_reg, self.l1_reg, self.initial_step,
+                      self.niter, self.npasses, self._train_threads(), int(self.adapt_threads))
+        self.Bsum = self.B.sum(axis = 0).reshape(-1).astype(ctypes.c_double) + self.l1_reg
+        self._refresh_serving_layout()
+
+        if self.keep_data:
+            rows, cols = np.nonzero(X)
+            indptr = np.r_[0, np.cumsum(np.bincount(rows, minlength = self.nusers))].astype(ctypes.c_size_t)
+            self._seen_index = _SeenIndex.from_csr(indptr, cols.astype(ctypes.c_size_t), self.nitems, self.nthreads)
+        self.is_fitted = True
+        return self
+
+    def _split_chunk(self, chunk):
+        if isinstance(chunk, np.ndarray):
+            assert len(chunk.shape) > 1
+            assert chunk.shape[1] >= 3
+            return chunk[:, 0], chunk[:, 1], chunk[:, 2].astype(ctypes.c_double)
+        elif chunk.__class__.__name__ == 'DataFrame':
+            cols = [chunk[c].to_numpy() for c in ['UserId', 'ItemId', 'Count']]
+        elif hasattr(chunk, 'column') and hasattr(chunk, 'schema'):
+            ### Arrow tables and record batches, without importing 'pyarrow'
+            cols = [np.asarray(chunk.column(c)) for c in ['UserId', 'ItemId', 'Count']]
+        else:
+            raise ValueError("Chunks must be pandas data frames, Arrow tables, or numpy arrays.")
+        return cols[0], cols[1], cols[2].astype(ctypes.c_double)
+
+    def _fit_processed(self):
         self._write_parameters()
         self._initialize_matrices()
         self._fit()
@@ -198,7 +451,6 @@ class PoisMF:
             self.item_dict_ = {self.item_mapping_[i]:i for i in range(self.item_mapping_.shape[0])}
         self.is_fitted = True
         del self._csr
-        del self._csc
         
         return self
 
@@ -209,6 +461,9 @@ class PoisMF:
                 pf.write("l2_reg: %.10f\n" % self.l2_reg)
                 pf.write("initial_step: %.10f\n" % self.initial_step)
                 pf.write("use_cg: %s\n" % self.use_cg)
+                pf.write("iter_scheme: %s\n" % self.iter_scheme)
+                pf.write("fixed_precision: %s\n" % self.fixed_precision)
+                pf.write("packed_nonzeros: %s\n" % self.packed_nonzeros)
                 pf.write("niter: %d\n" % self.niter)
                 pf.write("npasses: %d\n" % self.npasses)
                 pf.write("k: %d\n" % self.k)
@@ -285,23 +540,21 @@ class PoisMF:
             del self.input_df
 
         self._csr = csr_matrix(self._coo)
-        self._csc = csc_matrix(self._coo)
         del self._coo
+        if self.iter_scheme == 'stratified':
+            self._csr.sort_indices()
 
         self._csr.indptr  = self._csr.indptr.astype(ctypes.c_size_t)
         self._csr.indices = self._csr.indices.astype(ctypes.c_size_t)
         self._csr.data    = self._csr.data.astype(ctypes.c_double)
-        self._csc.indptr  = self._csc.indptr.astype(ctypes.c_size_t)
-        self._csc.indices = self._csc.indices.astype(ctypes.c_size_t)
-        self._csc.data    = self._csc.data.astype(ctypes.c_double)
 
         return None
             
     def _store_metadata(self):
-        ### https://github.com/numpy/numpy/issues/8333
-        self._n_seen_by_user = (self._csr.indptr[1:] - self._csr.indptr[:-1]).astype(int)
-        self._st_ix_user = self._csr.indptr[:-1].astype(int)
-        self._seen = self._csr.indices.astype(int)
+        self._seen_index = _SeenIndex.from_csr(self._csr.indptr, self._csr.indices, self.nitems, self.nthreads)
+
+    def _has_seen(self):
+        return self.keep_data and (getattr(self, "_seen_index", None) is not None)
 
     def _initialize_matrices(self):
         np.random.seed(self.random_seed)
@@ -313,13 +566,25 @@ class PoisMF:
             self.B = np.random.random(size = (self.nitems, self.k))
     
     def _fit(self):
+        ## the CSC copy of the data is built by the fitting procedure, overlapped with the first half-step
         run_pgd(
             self._csr.data, self._csr.indices, self._csr.indptr,
-            self._csc.data, self._csc.indices, self._csc.indptr,
             self.A, self.B,
             self.use_cg, self.l2_reg, self.l1_reg,
-            self.initial_step, self.niter, self.npasses, self.nthreads)
+            self.initial_step, self.niter, self.npasses,
+            {'alternating' : 0, 'fused' : 1, 'stratified' : 2}[self.iter_scheme],
+            self.nblocks,
+            {'double' : 0, 'float' : 1, 'bfloat16' : 2}[self.fixed_precision],
+            int(self.packed_nonzeros), self._train_threads(),
+            f32_iters = self.float_iters, f32_tol = self.float_tol, adapt_threads = int(self.adapt_threads))
         self.Bsum = self.B.sum(axis = 0).reshape(-1).astype(ctypes.c_double) + self.l1_reg
+        self._refresh_serving_layout()
+
+    def _train_threads(self):
+        ## with 'adapt_threads', this is the maximum, and the procedure picks how many to use
+        if self.adapt_threads:
+            return getattr(self, "_max_threads", self.nthreads)
+        return self.nthreads
 
     def _process_data_single(self, counts_df):
         assert self.is_fitted
@@ -352,7 +617,8 @@ class PoisMF:
         counts_df['Count']  = counts_df.Count.values.astype(ctypes.c_double)
         return counts_df
 
-    def predict_factors(self, counts_df, random_seed=1, l2_reg=1e3, l1_reg=0):
+    def predict_factors(self, counts_df, random_seed=1, l2_reg=1e3, l1_reg=0,
+                        solver="cg", max_iter=100, max_fun_eval=200, time_limit=None):
         """
         Gets latent factors for a user given her item counts
 
@@ -383,32 +649,57 @@ class PoisMF:
             with smaller regularization values.
         l1_reg : float
             Strength of the L1 regularization (see description of argument above).
+        solver : str
+            Method used to optimize the factors. Options are:
+            ``'cg'`` (conjugate gradient, same as the default for the model), and
+            ``'pgd'`` (projected gradient steps scaled by the diagonal of the Hessian, which are cheaper
+            and better suited for cases in which there's a hard limit on latency). Note that 'pgd' converges
+            much more slowly, so its factors can be of noticeably lower quality - in the benchmark under
+            'benchmarks/approximate_modes.py', its top-10 lists had a recall of around 0.65 against those
+            from 'cg' with the default limits, and around 0.2 with ``max_iter=5``.
+        max_iter : int
+            Maximum number of iterations of the solver.
+        max_fun_eval : int
+            Maximum number of function evaluations, each of which requires a pass over the items of the user.
+            Together with 'max_iter', this bounds the amount of work done per user.
+        time_limit : None or float
+            Maximum time in seconds to spend on optimizing the factors of each user, after which the
+            solver will return what it has. Only supported for ``solver='pgd'`` - passing it with
+            another solver will raise an error.
 
         Returns
         -------
         latent_factors : array (k,)
             Calculated latent factors for the user, given the input data
         """
-        return self._predict_factors(counts_df, random_seed, False, l2_reg, l1_reg)
+        return self._predict_factors(counts_df, random_seed, False, l2_reg, l1_reg,
+                                     solver, max_iter, max_fun_eval, time_limit)
 
-    def _predict_factors(self, counts_df, random_seed=1, return_counts=False, l2_reg=1e3, l1_reg=0):
+    def _predict_factors(self, counts_df, random_seed=1, return_counts=False, l2_reg=1e3, l1_reg=0,
+                         solver="cg", max_iter=100, max_fun_eval=200, time_limit=None, a_init=None):
         if random_seed is None:
             random_seed = np.random.randint(int(1e5)) + 1
         assert isinstance(random_seed, int)
         assert random_seed > 0
         assert l2_reg >= 0
         assert l1_reg >= 0
+        solver, max_iter, max_fun_eval, time_limit = _foldin_options(solver, max_iter, max_fun_eval, time_limit)
 
         ## processing the data
         counts_df = self._process_data_single(counts_df)
 
         ## calculating the latent factors
-        if self.init_type == "gamma":
-            a_vec = np.random.gamma(1, 1, size = self.k)
+        ## (uses its own random generator so as not to depend on or alter the global numpy seed)
+        if a_init is not None:
+            a_vec = np.array(a_init, dtype = ctypes.c_double).reshape(-1)
+            assert a_vec.shape[0] == self.k
+        elif self.init_type == "gamma":
+            a_vec = np.random.RandomState(random_seed).gamma(1, 1, size = self.k)
         else:
-            a_vec = np.random.random(size = self.k)
+            a_vec = np.random.RandomState(random_seed).random_sample(size = self.k)
         _predict_factors(a_vec, counts_df.Count.values, counts_df.ItemId.values,
-                         self.B, self.Bsum, l2_reg, l1_reg)
+                         self.B, self.Bsum, l2_reg, l1_reg,
+                         solver, max_iter, max_fun_eval, time_limit)
         ### Note: don't confuse with 'self._predict_factors'
 
         if np.any(np.isnan(a_vec)):
@@ -421,7 +712,125 @@ class PoisMF:
         else:
             return a_vec
 
-    def add_user(self, user_id, counts_df, update_existing=False, random_seed=1, l2_reg=1e3, l1_reg=0):
+    def recommend_from_interactions(self, items, counts = None, n = 10, exclude_given = True, return_scores = False,
+                                    random_seed = 1, l2_reg = 1e3, l1_reg = 0,
+                                    solver = "cg", max_iter = 100, max_fun_eval = 200, time_limit = None):
+        """
+        Recommend Top-N items for new users given their interactions
+
+        Obtains latent factors for users who are not in the model (e.g. anonymous sessions) in the same
+        way as 'predict_factors', and recommends the items with the highest predicted counts for them, all
+        in a single call to compiled code. Can take a batch of users, which are processed in parallel.
+
+        Note
+        ----
+        Items that were not in the training data are ignored. A user with no known items will get
+        all-zero factors, and the recommended items for it are arbitrary.
+
+        Parameters
+        ----------
+        items : array-like (nitems,) or list of array-like
+            Items with which the user interacted. Pass a list of arrays to process a batch of users.
+        counts : None, array-like (nitems,), or list of array-like
+            Counts for each of the items in 'items' (same structure). If passing None, will take them as all ones.
+        n : int
+            Number of top items to recommend.
+        exclude_given : bool
+            Whether to exclude from the recommendations the items passed in 'items'.
+        return_scores : bool
+            Whether to also return the predicted counts for the recommended items.
+        random_seed : int
+            Random seed used to initialize the latent factors.
+        l2_reg : float
+            Strength of L2 regularization to use for the latent factors (see 'predict_factors').
+        l1_reg : float
+            Strength of the L1 regularization to use for the latent factors, in addition to the one with
+            which the model was fitted (as in 'predict_factors').
+        solver : str
+            Method used to optimize the factors (see 'predict_factors').
+        max_iter : int
+            Maximum number of iterations of the solver for each user (see 'predict_factors').
+        max_fun_eval : int
+            Maximum number of function evaluations for each user (see 'predict_factors').
+        time_limit : None or float
+            Maximum time in seconds to spend on optimizing the factors of each user (see 'predict_factors').
+
+        Returns
+        -------
+        rec : array (n,) or list of arrays
+            Top-N recommended items for each user, in descending order of predicted count. If there are fewer
+            than 'n' candidates, only those are returned. If 'return_scores' is True, will return a tuple
+            with these and the predicted counts.
+        """
+        assert self.is_fitted
+        assert isinstance(n, int)
+        assert n > 0
+        assert l2_reg >= 0
+        assert l1_reg >= 0
+        solver, max_iter, max_fun_eval, time_limit = _foldin_options(solver, max_iter, max_fun_eval, time_limit)
+        n = min(n, self.nitems)
+
+        is_batch = isinstance(items, list) and (len(items) > 0) and \
+                   isinstance(items[0], (list, tuple, np.ndarray, pd.Series))
+        if not is_batch:
+            items = [items]
+            counts = [counts]
+        elif counts is None:
+            counts = [None] * len(items)
+        assert len(items) == len(counts)
+
+        sess_items, sess_counts = [], []
+        for it, ct in zip(items, counts):
+            it = np.asarray(it).reshape(-1)
+            ct = np.ones(it.shape[0]) if ct is None else np.asarray(ct, dtype = ctypes.c_double).reshape(-1)
+            assert it.shape[0] == ct.shape[0]
+            if self.reindex:
+                it = pd.Categorical(it, self.item_mapping_).codes.astype(int)
+            else:
+                it = it.astype(int)
+            keep = (it >= 0) & (it < self.nitems) & (ct > 0)
+            sess_items.append(it[keep])
+            sess_counts.append(ct[keep])
+
+        nsess = len(sess_items)
+        sess_indptr = np.r_[0, np.cumsum([x.shape[0] for x in sess_items])].astype(ctypes.c_size_t)
+        flat_items = np.concatenate(sess_items).astype(ctypes.c_size_t) if nsess else np.empty(0, dtype = ctypes.c_size_t)
+        flat_counts = np.concatenate(sess_counts).astype(ctypes.c_double) if nsess else np.empty(0, dtype = ctypes.c_double)
+
+        rng = np.random.RandomState(random_seed)
+        if self.init_type == "gamma":
+            factors = rng.gamma(1, 1, size = (nsess, self.k))
+        else:
+            factors = rng.random_sample(size = (nsess, self.k))
+        ## 'Bsum' already includes the regularization with which the model was fitted
+        Bsum = (self.Bsum + l1_reg) if (l1_reg > 0) else self.Bsum
+        out_items = np.empty((nsess, n), dtype = ctypes.c_size_t)
+        out_scores = np.empty((nsess, n), dtype = ctypes.c_double)
+        if getattr(self, "_replicas", None) is not None:
+            self._replicas.recommend(out_items, out_scores, factors, sess_indptr, flat_items, flat_counts,
+                                     Bsum, l2_reg, solver, max_iter, max_fun_eval, time_limit,
+                                     int(bool(exclude_given)))
+        else:
+            _recommend_from_interactions(out_items, out_scores, factors, sess_indptr, flat_items, flat_counts,
+                                         np.ascontiguousarray(self.B, dtype = ctypes.c_double), Bsum, l2_reg,
+                                         solver, max_iter, max_fun_eval, time_limit,
+                                         getattr(self, "B_blocked_", None), getattr(self, "item_block_size_", None) or 0,
+                                         int(bool(exclude_given)), self.nthreads)
+
+        recs, scores = [], []
+        for sess in range(nsess):
+            valid = ~np.isnan(out_scores[sess])
+            rec = out_items[sess][valid].astype(int)
+            recs.append(self.item_mapping_[rec] if self.reindex else rec)
+            scores.append(out_scores[sess][valid])
+        if not is_batch:
+            recs, scores = recs[0], scores[0]
+        if return_scores:
+            return recs, scores
+        return recs
+
+    def add_user(self, user_id, counts_df, update_existing=False, random_seed=1, l2_reg=1e3, l1_reg=0,
+                 solver="cg", max_iter=100, max_fun_eval=200, time_limit=None, warm_start=False):
         """
         Add a new user to the model or update parameters for a user according to new data
         
@@ -437,6 +846,11 @@ class PoisMF:
         ----
         This function is prone to producing all-zeros factors. For betters results, refit the model again from scratch.
 
+        Note
+        ----
+        This function cannot be used on models loaded with ``numa_replicas=True`` and ``replicate_users=True``,
+        as the user factors are then held in fixed-size copies per node.
+
         Parameters
         ----------
         user_id : obj
@@ -459,12 +873,26 @@ class PoisMF:
             with smaller regularization values.
         l1_reg : float
             Strength of the L1 regularization (see description of argument above).
+        solver : str
+            Method used to optimize the factors (see 'predict_factors').
+        max_iter : int
+            Maximum number of iterations of the solver (see 'predict_factors').
+        max_fun_eval : int
+            Maximum number of function evaluations (see 'predict_factors').
+        time_limit : None or float
+            Maximum time in seconds to spend on optimizing the factors (see 'predict_factors').
+        warm_start : bool
+            When updating an existing user, whether to start the optimization from the factors that the
+            user currently has instead of from a random initialization. This usually requires far fewer
+            iterations when the new data is similar to the old one. Ignored when adding a new user.
 
         Returns
         -------
         True : bool
             Will return True if the process finishes successfully.
         """
+        if (getattr(self, "_replicas", None) is not None) and (self._replicas.A_view(0) is not None):
+            raise ValueError("Cannot add or update users in a model with replicated user factors - reload it with 'replicate_users=False' instead.")
         if update_existing:
             ## checking that the user already exists
             if self.produce_dicts and self.reindex:
@@ -477,7 +905,9 @@ class PoisMF:
 
         ## calculating the latent factors
         # Theta = np.empty(self.k, dtype = ctypes.c_float)
-        a_vec, counts_df = self._predict_factors(counts_df, random_seed, True, l2_reg, l1_reg)
+        a_init = self.A[user_id] if (update_existing and warm_start) else None
+        a_vec, counts_df = self._predict_factors(counts_df, random_seed, True, l2_reg, l1_reg,
+                                                 solver, max_iter, max_fun_eval, time_limit, a_init)
 
         ## adding the data to the model
         if update_existing:
@@ -492,16 +922,10 @@ class PoisMF:
             self.nusers += 1
 
         ## updating the list of seen items for this user
-        if self.keep_data:
-            if update_existing:
-                n_seen_by_user_before = self._n_seen_by_user[user_id]
-                self._n_seen_by_user[user_id] = counts_df.shape[0]
-                self._seen = np.r_[self._seen[:user_id], counts_df.ItemId.values, self._seen[(user_id + 1):]]
-                self._st_ix_user[(user_id + 1):] += self._n_seen_by_user[user_id] - n_seen_by_user_before
-            else:
-                self._n_seen_by_user = np.r_[self._n_seen_by_user, counts_df.shape[0]]
-                self._st_ix_user = np.r_[self._st_ix_user, self._seen.shape[0]]
-                self._seen = np.r_[self._seen, counts_df.ItemId.values]
+        if self._has_seen():
+            self._seen_index.set_user(user_id if update_existing else (self.nusers - 1),
+                                      counts_df.ItemId.values.astype(ctypes.c_size_t))
+            self._unshare("_seen_index")
 
         return True
     
@@ -620,11 +1044,6 @@ class PoisMF:
         Can exclude the items for the user that were associated to her in the
         training set, and can also recommend from only a subset of user-provided items.
 
-        Note
-        ----
-        This function requires package 'hpfrec':
-        https://www.github.com/david-cortes/hpfrec
-
         Parameters
         ----------
         user : obj
@@ -641,16 +1060,262 @@ class PoisMF:
         rec : array (n,)
             Top-N recommended items.
         """
-        try:
-            from hpfrec import HPF
-        except:
-            self._throw_hpfrec_msg()
-        temp = self
-        temp.Theta = self.A
-        temp.Beta = self.B
-        temp.seen = self._seen
-        return HPF.topN(temp, user, int(n), exclude_seen, items_pool)
+        assert self.is_fitted
+        if exclude_seen and not self._has_seen():
+            raise ValueError("Can only exclude seen items when passing 'keep_data=True' to .fit")
+        if items_pool is None:
+            return self.topN_batch([user], n = int(n), exclude_seen = exclude_seen)[0]
+
+        if self.reindex:
+            user_ix = pd.Categorical(np.array([user]), self.user_mapping_).codes[0]
+            pool = np.asarray(items_pool).reshape(-1)
+            pool_ix = pd.Categorical(pool, self.item_mapping_).codes.astype(int)
+        else:
+            user_ix = int(user)
+            pool = np.asarray(items_pool).reshape(-1)
+            pool_ix = pool.astype(int)
+        if (user_ix < 0) or (user_ix >= self.nusers):
+            raise ValueError("Can only recommend for users that were in the training data.")
+        if np.any(pool_ix < 0) or np.any(pool_ix >= self.nitems):
+            raise ValueError("'items_pool' contains items that were not in the training data.")
+
+        scores = self.B[pool_ix].dot(self.A[user_ix])
+        if exclude_seen:
+            seen = self._seen_index.contains(user_ix, pool_ix.astype(ctypes.c_size_t))
+            pool, scores = pool[~seen], scores[~seen]
+        n = min(int(n), pool.shape[0])
+        top = np.argsort(-scores, kind = "stable")[:n]
+        return pool[top]
+
+
+    def top_users(self, items, n=10, exclude_seen=True, return_scores=False):
+        """
+        Find the Top-N users with the highest predicted counts for given items
+
+        This is the reverse of 'topN': for each item, outputs the users who are most likely to
+        interact with it according to the model, without computing the predictions for all the
+        users at once. Can take many items at once, which are processed in parallel.
+
+        Note
+        ----
+        Users are scored in blocks through matrix multiplications, and since all the factors are
+        non-negative, blocks of users that cannot make it to the Top-N of an item are skipped for it.
+        This makes it considerably faster than ranking the full output of 'predict' for each item.
+
+        Parameters
+        ----------
+        items : obj or array-like (nitems,)
+            Item(s) for which to find the top users.
+        n : int
+            Number of top users to output for each item.
+        exclude_seen : bool
+            Whether to exclude the users who had interactions with the item in the training data.
+            Only available when the model was fit with 'keep_data=True' (ignored otherwise).
+        return_scores : bool
+            Whether to also return the predicted counts for the selected users.
+
+        Returns
+        -------
+        users : array (n,) or list of arrays
+            Top-N users for each item, in descending order of predicted count. If passing an array
+            of items, will output a list with one array per item. If there are fewer than 'n' candidates,
+            only those are returned. If 'return_scores' is True, will return a tuple with these and
+            the predicted counts.
+        """
+        assert self.is_fitted
+        assert isinstance(n, int)
+        assert n > 0
+        n = min(n, self.nusers)
+
+        is_batch = isinstance(items, (list, tuple, np.ndarray, pd.Series))
+        items = np.asarray(items).reshape(-1) if is_batch else np.array([items])
+        if self.reindex:
+            items_ix = pd.Categorical(items, self.item_mapping_).codes.astype(int)
+        else:
+            items_ix = items.astype(int)
+        if np.any(items_ix < 0) or np.any(items_ix >= self.nitems):
+            raise ValueError("Can only find top users for items that were in the training data.")
+
+        ## repeated items are calculated only once
+        uniq, inverse = np.unique(items_ix, return_inverse = True)
+        Bsel = np.ascontiguousarray(self.B[uniq], dtype = ctypes.c_double)
+
+        excl_indptr, excl_ind = None, None
+        if exclude_seen and self._has_seen():
+            excl_indptr, excl_ind = self._seen_index.users_for_items(uniq.astype(ctypes.c_size_t), self.nthreads)
+
+        out_ix = np.empty((uniq.shape[0], n), dtype = ctypes.c_size_t)
+        out_val = np.empty((uniq.shape[0], n), dtype = ctypes.c_double)
+        _topn_rows_for_items(out_ix, out_val, np.ascontiguousarray(self.A, dtype = ctypes.c_double), Bsel,
+                             excl_indptr, excl_ind, self.nthreads)
+
+        users, scores = [], []
+        for ix in inverse.reshape(-1):
+            valid = ~np.isnan(out_val[ix])
+            rec = out_ix[ix][valid].astype(int)
+            users.append(self.user_mapping_[rec] if self.reindex else rec)
+            scores.append(out_val[ix][valid])
+        if not is_batch:
+            users, scores = users[0], scores[0]
+        if return_scores:
+            return users, scores
+        return users
+
+    def topN_batch(self, users, n = 10, exclude_seen = True, return_scores = False):
+        """
+        Recommend Top-N items for many users of the model at once
+
+        Computed in compiled code, in parallel across users, with the seen items excluded while selecting
+        the top scores.
+
+        Parameters
+        ----------
+        users : array-like (nusers,)
+            Users (as in the training data) for which to recommend.
+        n : int
+            Number of top items to recommend for each user.
+        exclude_seen : bool
+            Whether to exclude the items that each user had in the training data. Only available when
+            the model was fit with 'keep_data=True' (ignored otherwise).
+        return_scores : bool
+            Whether to also return the predicted counts for the recommended items.
+
+        Returns
+        -------
+        rec : list of arrays
+            Top-N items for each user, in descending order of predicted count. If there are fewer than 'n'
+            candidates, only those are returned. If 'return_scores' is True, will return a tuple with these
+            and the predicted counts.
+        """
+        assert self.is_fitted
+        assert isinstance(n, int)
+        assert n > 0
+        n = min(n, self.nitems)
+        users = np.asarray(users).reshape(-1)
+        if self.reindex:
+            users_ix = pd.Categorical(users, self.user_mapping_).codes.astype(int)
+        else:
+            users_ix = users.astype(int)
+        if np.any(users_ix < 0) or np.any(users_ix >= self.nusers):
+            raise ValueError("Can only recommend for users that were in the training data.")
+
+        seen = self._seen_index if (exclude_seen and self._has_seen()) else None
+        out_ix = np.empty((users_ix.shape[0], n), dtype = ctypes.c_size_t)
+        out_val = np.empty((users_ix.shape[0], n), dtype = ctypes.c_double)
+        if users_ix.shape[0] == 0:
+            pass
+        elif (getattr(self, "_replicas", None) is not None) and (self._replicas.A_view(0) is not None):
+            excl_indptr, excl_ind = (None, None) if seen is None else seen.excl_lists(users_ix.astype(ctypes.c_size_t))
+            self._replicas.topn_users(out_ix, out_val, users_ix.astype(ctypes.c_size_t), excl_indptr, excl_ind)
+        else:
+            _topn_items_seen(out_ix, out_val, np.ascontiguousarray(self.A, dtype = ctypes.c_double),
+                             users_ix.astype(ctypes.c_size_t), np.ascontiguousarray(self.B, dtype = ctypes.c_double),
+                             seen, self.nthreads)
+
+        recs, scores = [], []
+        for row in range(users_ix.shape[0]):
+            valid = ~np.isnan(out_val[row])
+            rec = out_ix[row][valid].astype(int)
+            recs.append(self.item_mapping_[rec] if self.reindex else rec)
+            scores.append(out_val[row][valid])
+        if return_scores:
+            return recs, scores
+        return recs
+
+    def numa_latency(self, nreps = 20):
+        """
+        Measure the latency of scoring from local versus remote NUMA replicas
+
+        For a model loaded with ``numa_replicas=True``, times scoring all the items for one user from a thread
+        pinned to each node, reading the copy of the item factors in each node. Comparing the diagonal (local
+        copies) against the rest tells how much is gained from the replicas, which can be weighed against the
+        extra memory reported in ``numa_report_``.
+
+        Parameters
+        ----------
+        nreps : int
+            Number of repetitions over which to average the timings.
+
+        Returns
+        -------
+        latency : array (nnodes, nnodes)
+            Average time in seconds for each combination of (node of the thread, node of the copy).
+        """
+        if getattr(self, "_replicas", None) is None:
+            raise ValueError("Model was not loaded with 'numa_replicas=True'.")
+        assert isinstance(nreps, int)
+        assert nreps > 0
+        nnodes = self.numa_report_["nodes"]
+        return np.array([[self._replicas.scan_latency(cpu_node, data_node, nreps)
+                          for data_node in range(nnodes)] for cpu_node in range(nnodes)])
+
+    def set_item_blocks(self, block_size = 16):
+        """
+        Keep a copy of the item factors in a blocked layout for faster scans of the catalog
+
+        Stores a copy of the item-factor matrix 'B' in which items are grouped in blocks of 'block_size',
+        with each block stored dimension-major (i.e. transposed). Scoring a user against all the items
+        in 'recommend_from_interactions' then uses this copy, which allows computing the scores
+        of all the items in a block at once with SIMD instructions, instead of one short dot product per item.
+
+        Note
+        ----
+        The copy takes the same memory as 'B', and is rebuilt automatically whenever 'B' changes through
+        the methods of this class. If modifying 'B' manually, call this function again afterwards.
+
+        Parameters
+        ----------
+        block_size : int or None
+            Number of items per block. Must be either 8 or 16 (16 is better suited for CPUs with AVX512).
+            Passing None will remove the blocked copy.
+
+        Returns
+        -------
+        self : obj
+            This object
+        """
+        if block_size is not None:
+            assert block_size in (8, 16)
+        self.item_block_size_ = block_size
+        self._refresh_serving_layout()
+        return self
+
+    def _refresh_serving_layout(self):
+        if (getattr(self, "item_block_size_", None) is None) or (self.B is None):
+            self.B_blocked_ = None
+        else:
+            self.B_blocked_ = _pack_items_blocked(np.ascontiguousarray(self.B, dtype = ctypes.c_double),
+                                                  self.item_block_size_, self.nthreads)
+
+    def make_item_shards(self, nshards):
+        """
+        Split the item factors into shards for serving them from different processes
+
+        Produces objects of class 'ItemShard', each containing a contiguous range of rows of the
+        item-factor matrix 'B' along with the column sums of the full 'B' matrix (plus the L1 regularization
+        of the model), which are needed for obtaining factors of new users. Top-N recommendations can then be produced by querying all
+        the shards through a 'ShardCoordinator', which merges their results.
 
+        Parameters
+        ----------
+        nshards : int
+            Number of shards into which to split the items. Items are split in contiguous ranges
+            of (almost) equal sizes.
+
+        Returns
+        -------
+        shards : list[ItemShard]
+            Shards containing the item factors, in order.
+        """
+        assert self.is_fitted
+        assert isinstance(nshards, int)
+        assert nshards > 0
+        nshards = min(nshards, self.nitems)
+        limits = np.linspace(0, self.nitems, nshards + 1).astype(int)
+        return [ItemShard(self.B[limits[sh] : limits[sh + 1]], self.Bsum, limits[sh], self.nitems,
+                          self.item_mapping_[limits[sh] : limits[sh + 1]] if self.reindex else None,
+                          self.init_type, self.nthreads)
+                for sh in range(nshards)]
     
     def eval_llk(self, input_df, full_llk=False):
         """
@@ -706,8 +1371,1370 @@ class PoisMF:
         return out
 
 
-    def _throw_hpfrec_msg(self):
-        install_msg  = "This function requires package 'hpfrec':\n"
-        install_msg += "https://www.github.com/david-cortes/hpfrec\n"
-        install_msg += "Can be installed with 'pip install hpfrec'."
-        raise ValueError(install_msg)
+    def _process_data_multiple(self, counts_df):
+        ### Converts data about existing users and items into a CSR matrix, leaving out the unknown ones
+        if counts_df.__class__.__name__ == 'coo_matrix':
+            counts_df = pd.DataFrame({'UserId' : counts_df.row, 'ItemId' : counts_df.col, 'Count' : counts_df.data})
+        elif isinstance(counts_df, np.ndarray):
+            assert len(counts_df.shape) > 1
+            assert counts_df.shape[1] >= 3
+            counts_df = pd.DataFrame(counts_df[:, :3], columns = ['UserId', 'ItemId', 'Count'])
+        elif counts_df.__class__.__name__ == 'DataFrame':
+            assert 'UserId' in counts_df.columns.values
+            assert 'ItemId' in counts_df.columns.values
+            assert 'Count'  in counts_df.columns.values
+        else:
+            raise ValueError("'counts_df' must be a pandas data frame, numpy array, or scipy sparse coo_matrix.")
+
+        if self.reindex:
+            users = pd.Categorical(counts_df.UserId.values, self.user_mapping_).codes
+            items = pd.Categorical(counts_df.ItemId.values, self.item_mapping_).codes
+        else:
+            users = counts_df.UserId.values.astype(int)
+            items = counts_df.ItemId.values.astype(int)
+        counts = counts_df.Count.values.astype(ctypes.c_double)
+        keep = (users >= 0) & (users < self.nusers) & (items >= 0) & (items < self.nitems) & (counts > 0)
+
+        X = csr_matrix((counts[keep], (users[keep], items[keep])), shape = (self.nusers, self.nitems))
+        X.indptr  = X.indptr.astype(ctypes.c_size_t)
+        X.indices = X.indices.astype(ctypes.c_size_t)
+        X.data    = X.data.astype(ctypes.c_double)
+        return X
+
+    def prune_dimensions(self, counts_df = None, min_share = 1e-3, max_k = None, refine_iter = 0):
+        """
+        Produce a smaller model without the latent dimensions that contribute little to the predictions
+
+        The total predicted count across all users and items is sum(A*B') = <colsum(A), colsum(B)>, so each
+        latent dimension 'd' contributes a share colsum(A)[d] * colsum(B)[d] / sum(A*B') to it. Dimensions with
+        a share below 'min_share' are dropped (as are the ones beyond the 'max_k' with the largest shares), which
+        reduces the cost of calculating predictions. With L1 regularization, many dimensions might end up with
+        a share close to zero.
+
+        Note
+        ----
+        This model is not modified, a new one is returned instead.
+
+        Parameters
+        ----------
+        counts_df : None, DataFrame (nobs, 3), or coo_matrix
+            Data with columns 'UserId', 'ItemId', 'Count', as passed to 'fit', on which to report the
+            log-likelihood before and after pruning, and to refine the remaining dimensions.
+            Users and items not present in the model are ignored.
+        min_share : float
+            Minimum share of the total predicted count for a dimension to be kept.
+        max_k : None or int
+            Maximum number of dimensions to keep.
+        refine_iter : int
+            Number of iterations to run on the pruned model starting from its current values (with the same
+            hyperparameters as this model, and the step size at which its fit ended), in order to compensate for
+            the removed dimensions. Requires 'counts_df'.
+
+        Returns
+        -------
+        model : PoisMF
+            A copy of this model with fewer latent dimensions. Its attribute 'pruning_report_' contains
+            a dictionary with the shares of each dimension, the dimensions kept, and the log-likelihood
+            (see 'eval_llk') before and after pruning if passing 'counts_df', and after refining if passing
+            'refine_iter' (unless the refinement failed, in which case the pruned factors are kept as they were).
+        """
+        assert self.is_fitted
+        assert min_share >= 0
+        if max_k is not None:
+            assert isinstance(max_k, int)
+            assert max_k > 0
+        assert isinstance(refine_iter, int)
+        assert refine_iter >= 0
+        if (refine_iter > 0) and (counts_df is None):
+            raise ValueError("Must pass 'counts_df' in order to refine the pruned model.")
+
+        mass = self.A.sum(axis = 0) * self.B.sum(axis = 0)
+        shares = mass / mass.sum()
+        kept = np.argsort(-shares, kind = 'stable')
+        kept = kept[shares[kept] >= min_share]
+        if max_k is not None:
+            kept = kept[:max_k]
+        if kept.shape[0] == 0:
+            kept = np.argsort(-shares, kind = 'stable')[:1]
+        kept = np.sort(kept)
+
+        new_model = copy.copy(self)
+        new_model.k = int(kept.shape[0])
+        new_model.A = np.ascontiguousarray(self.A[:, kept], dtype = ctypes.c_double)
+        new_model.B = np.ascontiguousarray(self.B[:, kept], dtype = ctypes.c_double)
+        report = {'k_before' : self.k, 'k_after' : new_model.k, 'kept_dims' : kept, 'shares' : shares}
+
+        if counts_df is not None:
+            X = self._process_data_multiple(counts_df)
+            report['llk_before'] = _calc_llk(X.data, X.indices, X.indptr,
+                                             np.ascontiguousarray(self.A, dtype = ctypes.c_double),
+                                             np.ascontiguousarray(self.B, dtype = ctypes.c_double), self.nthreads)
+            report['llk_pruned'] = _calc_llk(X.data, X.indices, X.indptr, new_model.A, new_model.B, self.nthreads)
+            if refine_iter > 0:
+                ## the fit halved the step size after each iteration, so the refinement continues from where it ended,
+                ## as restarting at the initial step from converged factors overshoots
+                A_pruned, B_pruned = new_model.A.copy(), new_model.B.copy()
+                run_pgd(
+                    X.data, X.indices, X.indptr,
+                    new_model.A, new_model.B,
+                    self.use_cg, self.l2_reg, self.l1_reg,
+                    self.initial_step * 0.5**self.niter, refine_iter, self.npasses,
+                    {'alternating' : 0, 'fused' : 1, 'stratified' : 2}[self.iter_scheme],
+                    self.nblocks,
+                    {'double' : 0, 'float' : 1, 'bfloat16' : 2}[self.fixed_precision],
+                    int(self.packed_nonzeros), self._train_threads(), adapt_threads = int(self.adapt_threads))
+                if (not np.all(np.isfinite(new_model.A))) or (not np.all(np.isfinite(new_model.B))):
+                    warnings.warn("Refining the pruned model produced non-finite factors, these were discarded.")
+                    new_model.A, new_model.B = A_pruned, B_pruned
+                else:
+                    report['llk_refined'] = _calc_llk(X.data, X.indices, X.indptr, new_model.A, new_model.B, self.nthreads)
+
+        new_model.Bsum = new_model.B.sum(axis = 0).reshape(-1).astype(ctypes.c_double) + self.l1_reg
+        new_model._replicas = None
+        if getattr(self, "_seen_index", None) is not None:
+            new_model._seen_index = copy.copy(self._seen_index)
+        new_model._refresh_serving_layout()
+        new_model.pruning_report_ = report
+        return new_model
+
+    def save_model(self, fname):
+        """
+        Save the fitted model to a binary file
+
+        Saves the latent factors in a format which can be memory-mapped by 'load_model', along with
+        the hyperparameters and the user/item IDs. Models saved this way can be later updated through
+        'export_delta' and 'apply_delta' / 'apply_delta_to_file'.
+
+        Note
+        ----
+        The file is written in the byte order of the machine. If the model was fitted with
+        ``keep_data=True``, the items seen by each user are also saved, and will be excluded
+        by the Top-N functions of the loaded model. If the file already exists, it is replaced
+        atomically (see 'apply_delta_to_file').
+
+        Parameters
+        ----------
+        fname : str
+            File path where to save the model.
+
+        Returns
+        -------
+        self : obj
+            This object
+        """
+        assert self.is_fitted
+        fname = os.path.expanduser(fname)
+        meta = _encode_metadata(self, self.user_mapping_ if self.reindex else None,
+                                self.item_mapping_ if self.reindex else None)
+        seen = self._seen_index.to_bytes() if self._has_seen() else b""
+        A, B = np.ascontiguousarray(self.A), np.ascontiguousarray(self.B)
+        _replace_file(fname, lambda tmp_fname: _save_model_file(tmp_fname, A, B, meta, seen))
+        return self
+
+    @classmethod
+    def load_model(cls, fname, mmap_mode = None, produce_dicts = True, nthreads = -1,
+                   numa_replicas = False, replicate_users = False, max_nodes = None):
+        """
+        Load a model saved through 'save_model'
+
+        Parameters
+        ----------
+        fname : str
+            File path from which to load the model.
+        mmap_mode : None or str
+            If passing None, will read the latent factors into memory. Otherwise, will memory-map them from
+            the file, with this as the mode ('r' for read-only, 'r+' to also write changes to the file, or 'c' for
+            copy-on-write) - see the documentation of ``numpy.memmap`` for details.
+        produce_dicts : bool
+            Whether to produce Python dictionaries for the user and item IDs.
+        nthreads : int
+            Number of threads to use in the loaded model.
+        numa_replicas : bool
+            Whether to load one copy of the item factors per NUMA node (e.g. per socket in multi-socket servers),
+            each placed in the memory of its node, for serving. If passing True, 'recommend_from_interactions' and
+            'topN_batch' will split their threads among the nodes, pinning each thread to the CPUs of its node and
+            having it read only the local copy. The item factors become read-only. The memory used and time taken
+            are reported in attribute ``numa_report_``, and the latency of scoring from local versus remote copies
+            can be measured through 'numa_latency'. Only has an effect on Linux - on other systems, or if there
+            is a single node, there will be one copy and threads will not be pinned.
+        replicate_users : bool
+            When passing ``numa_replicas=True``, whether to also make one copy of the user factors per node
+            (otherwise, these are loaded according to 'mmap_mode'). The user factors will then be read-only.
+        max_nodes : None or int
+            Maximum number of NUMA nodes to use when passing ``numa_replicas=True``. If passing None, will use all.
+
+        Returns
+        -------
+        model : PoisMF
+            The loaded model.
+        """
+        assert mmap_mode in [None, 'r', 'r+', 'c']
+        if max_nodes is not None:
+            assert isinstance(max_nodes, int)
+            assert max_nodes > 0
+        fname = os.path.expanduser(fname)
+        header = _read_model_header(fname)
+        with open(fname, "rb") as f:
+            f.seek(header["offset_ids"])
+            params, user_ids, item_ids = _decode_metadata(f.read(header["ids_size"]))
+
+        model = cls(nthreads = nthreads, produce_dicts = produce_dicts, keep_data = False,
+                    **{p : params[p] for p in _saved_params if p in params})
+        shape_A = (header["dimA"], header["k"])
+        shape_B = (header["dimB"], header["k"])
+        if numa_replicas and (mmap_mode is None):
+            if not replicate_users:
+                with open(fname, "rb") as f:
+                    f.seek(header["offset_A"])
+                    model.A = np.fromfile(f, dtype = ctypes.c_double, count = shape_A[0] * shape_A[1]).reshape(shape_A)
+        elif mmap_mode is None:
+            with open(fname, "rb") as f:
+                f.seek(header["offset_A"])
+                model.A = np.fromfile(f, dtype = ctypes.c_double, count = shape_A[0] * shape_A[1]).reshape(shape_A)
+                model.B = np.fromfile(f, dtype = ctypes.c_double, count = shape_B[0] * shape_B[1]).reshape(shape_B)
+        else:
+            model.A = np.memmap(fname, dtype = ctypes.c_double, mode = mmap_mode, offset = header["offset_A"], shape = shape_A)
+            model.B = np.memmap(fname, dtype = ctypes.c_double, mode = mmap_mode, offset = header["offset_B"], shape = shape_B)
+
+        if numa_replicas:
+            model._replicas = _ModelReplicas(fname, int(bool(replicate_users)), 0 if max_nodes is None else max_nodes,
+                                             model.nthreads)
+            model.B = model._replicas.B_view(0)
+            if replicate_users:
+                model.A = model._replicas.A_view(0)
+            model.numa_report_ = model._replicas.report()
+
+        model.nusers, model.nitems = shape_A[0], shape_B[0]
+        model.user_mapping_, model.item_mapping_ = user_ids, item_ids
+        if header["seen_size"] > 0:
+            with open(fname, "rb") as f:
+                f.seek(header["offset_seen"])
+                model._seen_index = _SeenIndex.from_bytes(f.read(header["seen_size"]))
+            model.keep_data = True
+        model._finish_loading()
+        return model
+
+    def _finish_loading(self):
+        self.Bsum = self.B.sum(axis = 0).reshape(-1).astype(ctypes.c_double) + self.l1_reg
+        self._refresh_serving_layout()
+        if self.produce_dicts and self.reindex:
+            self.user_dict_ = {self.user_mapping_[i]:i for i in range(self.user_mapping_.shape[0])}
+            self.item_dict_ = {self.item_mapping_[i]:i for i in range(self.item_mapping_.shape[0])}
+        self.is_fitted = True
+
+    def share_memory(self, folder = None):
+        """
+        Move the large arrays of the model to shared memory
+
+        Copies the latent factors, the blocked item factors, the user/item IDs (unless they are Python
+        objects such as strings), and the items seen by each user to a file in shared memory, and
+        memory-maps the model's arrays from it. Pickling the model afterwards (e.g. for passing it to
+        'joblib' or 'multiprocessing' workers) will only send the location of these arrays in the file,
+        and the unpickled models will map the same physical pages in copy-on-write mode, instead of
+        each receiving a copy.
+
+        Note
+        ----
+        Without calling this method, pickling with protocol 5 already sends the arrays as out-of-band
+        buffers, without copying them into the pickled bytes. The ID dictionaries are never pickled -
+        unpickled models build them again. Arrays that are replaced afterwards (e.g. when adding users)
+        are pickled again by value.
+
+        The file is deleted when calling 'release_shared_memory' or when this object is garbage-collected,
+        after which pickled copies can no longer be loaded, but models that were already unpickled keep
+        working.
+
+        Parameters
+        ----------
+        folder : None or str
+            Folder in which to create the file. If passing None, will use '/dev/shm' if it exists,
+            or the temporary folder of the system otherwise.
+
+        Returns
+        -------
+        self : obj
+            This object
+        """
+        assert self.is_fitted
+        if getattr(self, "_replicas", None) is not None:
+            raise ValueError("Cannot share the memory of a model with NUMA replicas.")
+        self.release_shared_memory()
+        if folder is None:
+            folder = "/dev/shm" if os.path.isdir("/dev/shm") else tempfile.gettempdir()
+
+        arrays = {attr : getattr(self, attr) for attr in _shared_attrs
+                  if isinstance(getattr(self, attr, None), np.ndarray) and not getattr(self, attr).dtype.hasobject}
+        if self._has_seen():
+            arrays["_seen_index"] = self._seen_index.to_array()
+        ## arrays are placed at offsets aligned to cache lines
+        layout, size = {}, 0
+        for attr, arr in arrays.items():
+            layout[attr] = (size, arr.dtype.str, arr.shape)
+            size += (arr.nbytes + 63) & ~63
+
+        fd, fname = tempfile.mkstemp(prefix = "poismf_", suffix = ".bin", dir = os.path.expanduser(folder))
+        os.close(fd)
+        finalizer = weakref.finalize(self, _remove_file, fname)
+        mapped = np.memmap(fname, dtype = np.uint8, mode = 'w+', shape = (max(size, 1),))
+        shared = {}
+        for attr, arr in arrays.items():
+            view = _view_shared(mapped, layout[attr])
+            view[...] = arr
+            if attr == "_seen_index":
+                shared[attr] = (self._seen_index, layout[attr])
+            else:
+                setattr(self, attr, view)
+                shared[attr] = (view, layout[attr])
+        mapped.flush()
+
+        self._shared_file = fname
+        self._shared_arrays = shared
+        self._shared_finalizer = finalizer
+        return self
+
+    def release_shared_memory(self):
+        """
+        Move the arrays of the model back to private memory
+
+        Undoes 'share_memory', copying the arrays back to the memory of this process and deleting the
+        shared file. Does nothing if the model's memory was not shared.
+
+        Returns
+        -------
+        self : obj
+            This object
+        """
+        if getattr(self, "_shared_file", None) is None:
+            return self
+        for attr, (obj, layout) in self._shared_arrays.items():
+            if (attr != "_seen_index") and (self.__dict__.get(attr) is obj):
+                setattr(self, attr, np.array(obj))
+        self._shared_finalizer()
+        self._shared_file, self._shared_arrays, self._shared_finalizer = None, None, None
+        return self
+
+    def _unshare(self, attr):
+        ## for arrays modified in-place which are not backed by the shared file
+        if getattr(self, "_shared_arrays", None) is not None:
+            self._shared_arrays.pop(attr, None)
+
+    def __copy__(self):
+        new_model = self.__class__.__new__(self.__class__)
+        new_model.__dict__.update(self.__dict__)
+        for attr in ["_shared_file", "_shared_arrays", "_shared_finalizer"]:
+            new_model.__dict__.pop(attr, None)
+        return new_model
+
+    def __reduce_ex__(self, protocol):
+        state = {attr : val for attr, val in self.__dict__.items() if attr not in _unpickled_attrs}
+        for attr, val in state.items():
+            ## memory-mapped arrays would otherwise be copied into the pickled bytes
+            if isinstance(val, np.memmap):
+                state[attr] = val.view(np.ndarray)
+        if self._has_seen():
+            state["_seen_index"] = self._seen_index.to_array()
+        shared = None
+        if getattr(self, "_shared_file", None) is not None:
+            layout = {attr : lt for attr, (obj, lt) in self._shared_arrays.items() if self.__dict__.get(attr) is obj}
+            for attr in layout:
+                state.pop(attr, None)
+            shared = (self._shared_file, layout)
+        return (_rebuild_model, (self.__class__, state, shared))
+
+    def export_delta(self, previous, fname, tol = 1e-6):
+        """
+        Write the differences between this model and a previous version of it
+
+        Writes to a binary file the rows of the user and item factors which differ by more than
+        'tol' in any entry from those of a previous version of the same model (e.g. before an incremental
+        update or before adding users), plus the rows and IDs of the users and items which were added
+        since. Applying this file to the previous model through 'apply_delta' or 'apply_delta_to_file'
+        will produce this model (up to the tolerance).
+
+        If this model has the items seen by each user (see 'keep_data'), the delta will also contain
+        the seen items of the users for which they differ from the previous model (or of all the users,
+        if the previous model doesn't have them), so that the updated model excludes them too.
+
+        Note
+        ----
+        Users and items present in the previous model must be in the same positions in this model,
+        which is the case for models updated through 'add_user'.
+
+        Parameters
+        ----------
+        previous : PoisMF
+            Previous version of this model.
+        fname : str
+            File path where to write the delta.
+        tol : float
+            Maximum absolute difference in a latent factor for a row to be considered unchanged.
+
+        Returns
+        -------
+        changed : dict
+            Number of user and item rows written to the delta.
+        """
+        assert self.is_fitted
+        assert previous.is_fitted
+        assert tol >= 0
+        if previous.k != self.k:
+            raise ValueError("Models have different number of latent factors.")
+        if (previous.nusers > self.nusers) or (previous.nitems > self.nitems):
+            raise ValueError("Previous model has more users or items than the current one.")
+        if previous.reindex != self.reindex:
+            raise ValueError("Models must either both have reindexed IDs or both not.")
+        new_users, new_items = None, None
+        if self.reindex:
+            if not np.array_equal(self.user_mapping_[:previous.nusers], previous.user_mapping_) or \
+               not np.array_equal(self.item_mapping_[:previous.nitems], previous.item_mapping_):
+                raise ValueError("Users and items from the previous model are not in the same positions.")
+            new_users = self.user_mapping_[previous.nusers:]
+            new_items = self.item_mapping_[previous.nitems:]
+
+        meta = _encode_metadata(self, new_users, new_items)
+        seen = b""
+        if self._has_seen():
+            if previous._has_seen():
+                seen_users = self._seen_index.changed_users(previous._seen_index, self.nthreads)
+            else:
+                seen_users = np.arange(self._seen_index.nusers).astype(ctypes.c_size_t)
+            seen = self._seen_index.rows_to_bytes(seen_users)
+        nA, nB = _export_model_delta(os.path.expanduser(fname),
+                                     np.ascontiguousarray(previous.A), np.ascontiguousarray(previous.B),
+                                     np.ascontiguousarray(self.A), np.ascontiguousarray(self.B),
+                                     tol, meta, seen, self.nthreads)
+        return {"users" : nA, "items" : nB}
+
+    def apply_delta(self, fname):
+        """
+        Update this model in-place with a delta produced by 'export_delta'
+
+        Changed rows are written directly into the existing latent factors, including when they are
+        memory-mapped (in which case they must have been loaded with mode 'r+' or 'c'). If the delta
+        adds new users or items, the factors will be reallocated in memory with the new rows. If this
+        model has the items seen by each user, the ones contained in the delta are merged into them.
+
+        Parameters
+        ----------
+        fname : str
+            File path of the delta, as produced by calling 'export_delta' on a newer version of this model.
+
+        Returns
+        -------
+        self : obj
+            This object
+        """
+        assert self.is_fitted
+        if getattr(self, "_replicas", None) is not None:
+            raise ValueError("Cannot apply deltas to a model with NUMA replicas - apply it to the file and reload instead.")
+        fname = os.path.expanduser(fname)
+        header = _read_delta_header(fname)
+        if (header["k"] != self.k) or (header["dimA_old"] != self.nusers) or (header["dimB_old"] != self.nitems):
+            raise ValueError("Delta was produced from a model with different dimensions.")
+        ids, seen = _read_delta_blobs(fname, header["ids_size"], header["seen_size"])
+        params, new_users, new_items = _decode_metadata(ids)
+
+        n_new_users = header["dimA_new"] - header["dimA_old"]
+        n_new_items = header["dimB_new"] - header["dimB_old"]
+        if n_new_users:
+            self.A = np.r_[self.A, np.zeros((n_new_users, self.k), dtype = ctypes.c_double)]
+        if n_new_items:
+            self.B = np.r_[self.B, np.zeros((n_new_items, self.k), dtype = ctypes.c_double)]
+        _apply_model_delta(fname, self.A, self.B)
+        if isinstance(self.A, np.memmap):
+            self.A.flush()
+        if isinstance(self.B, np.memmap):
+            self.B.flush()
+
+        self.nusers, self.nitems = self.A.shape[0], self.B.shape[0]
+        if self.reindex:
+            self.user_mapping_ = np.r_[self.user_mapping_, new_users] if n_new_users else self.user_mapping_
+            self.item_mapping_ = np.r_[self.item_mapping_, new_items] if n_new_items else self.item_mapping_
+        ## new items change the size of the bitmaps, and then the sets of the changed users are replaced
+        if self._has_seen() and ((n_new_items > 0) or len(seen)):
+            self._seen_index.resize_items(self.nitems)
+            if len(seen):
+                self._seen_index.set_rows_from_bytes(seen)
+            self._unshare("_seen_index")
+        self._finish_loading()
+        return self
+
+    @staticmethod
+    def apply_delta_to_file(model_fname, delta_fname):
+        """
+        Update a model file saved through 'save_model' with a delta produced by 'export_delta'
+
+        The updated model is written to a temporary file in the same folder, which is flushed to disk and
+        then renamed over the original, so that processes reading the file see either the old or the new
+        model in full, even if the update is interrupted (processes which memory-mapped the old file
+        keep seeing the old model until they load it again). This needs free space for a second copy.
+
+        Parameters
+        ----------
+        model_fname : str
+            File path of the model to update.
+        delta_fname : str
+            File path of the delta.
+        """
+        model_fname = os.path.expanduser(model_fname)
+        delta_fname = os.path.expanduser(delta_fname)
+        header = _read_delta_header(delta_fname)
+        if (header["dimA_new"] == header["dimA_old"]) and (header["dimB_new"] == header["dimB_old"]) and \
+           (header["seen_size"] == 0):
+            ## only the changed rows need to be written, so they go into a copy of the file
+            def write_fn(tmp_fname):
+                shutil.copyfile(model_fname, tmp_fname)
+                model = PoisMF.load_model(tmp_fname, mmap_mode = 'r+', produce_dicts = False, nthreads = 1)
+                model.apply_delta(delta_fname)
+                del model
+            _replace_file(model_fname, write_fn)
+        else:
+            model = PoisMF.load_model(model_fname, produce_dicts = False, nthreads = 1)
+            model.apply_delta(delta_fname)
+            model.save_model(model_fname)
+
+    def _throw_hpfrec_msg(self):
+        install_msg  = "This function requires package 'hpfrec':\n"
+        install_msg += "https://www.github.com/david-cortes/hpfrec\n"
+        install_msg += "Can be installed with 'pip install hpfrec'."
+        raise ValueError(install_msg)
+
+
+class ItemShard:
+    """
+    Contiguous range of item factors from a Poisson factorization model
+
+    Holds the rows of the item-factor matrix 'B' for items 'item_offset' to
+    'item_offset + B.shape[0] - 1', along with the column sums of the full 'B' matrix (so that
+    new users can be folded in exactly as with the full model). Meant to be served from separate
+    processes and queried through a 'ShardCoordinator'. Usually produced by 'PoisMF.make_item_shards'.
+
+    Note
+    ----
+    Items are always referred to by their index in the full model ("global" index) in the
+    methods of this class - the coordinator takes care of translating them to and from IDs.
+
+    Parameters
+    ----------
+    B : array (nitems_shard, k)
+        Item factors for the items in this shard.
+    Bsum : array (k,)
+        Column sums of the full item-factor matrix, plus the L1 regularization with which the model was fitted.
+    item_offset : int
+        Index of the first item of this shard in the full model.
+    nitems_total : int
+        Number of items in the full model.
+    item_ids : None or array (nitems_shard,)
+        IDs of the items in this shard, if the model was reindexing them.
+    init_type : str
+        Initialization used for the model ('gamma' or 'unif'), used when folding in new users.
+    nthreads : int
+        Number of threads to use.
+    """
+    def __init__(self, B, Bsum, item_offset, nitems_total, item_ids = None, init_type = "gamma", nthreads = 1):
+        self.B = np.ascontiguousarray(B, dtype = ctypes.c_double)
+        self.Bsum = np.ascontiguousarray(Bsum, dtype = ctypes.c_double).reshape(-1)
+        assert len(self.B.shape) == 2
+        assert self.B.shape[1] == self.Bsum.shape[0]
+        self.item_offset = int(item_offset)
+        self.nitems_total = int(nitems_total)
+        assert self.item_offset >= 0
+        assert self.item_offset + self.B.shape[0] <= self.nitems_total
+        self.item_ids = None if item_ids is None else np.asarray(item_ids)
+        self.init_type = init_type
+        self.nthreads = int(nthreads)
+
+    def describe(self):
+        """
+        Get the metadata of this shard that a coordinator needs
+
+        Returns
+        -------
+        info : dict
+            Dictionary with the item range, dimensionality, column sums and item IDs of the shard.
+        """
+        return {"item_offset" : self.item_offset, "nitems" : self.B.shape[0], "nitems_total" : self.nitems_total,
+                "k" : self.B.shape[1], "Bsum" : self.Bsum, "item_ids" : self.item_ids, "init_type" : self.init_type}
+
+    def get_rows(self, items):
+        """
+        Get the factors for the items that belong to this shard
+
+        Parameters
+        ----------
+        items : array (nitems,)
+            Global indices of items, which might or might not belong to this shard.
+
+        Returns
+        -------
+        mask : array (nitems,)
+            Whether each item belongs to this shard.
+        rows : array (mask.sum(), k)
+            Factors of the items that belong to this shard, in the same order as they were passed.
+        """
+        items = np.asarray(items, dtype = int).reshape(-1)
+        mask = (items >= self.item_offset) & (items < self.item_offset + self.B.shape[0])
+        return mask, self.B[items[mask] - self.item_offset]
+
+    def topN_partial(self, factors, n = 10, exclude = None):
+        """
+        Top-N items from this shard for the given user factors
+
+        Parameters
+        ----------
+        factors : array (k,) or (nusers, k)
+            Latent factors of the users for which to recommend.
+        n : int
+            Number of top items to output for each user.
+        exclude : None, array, or list of arrays
+            Global indices of the items to exclude for each user (one array per row of 'factors').
+            These can contain items that are not in this shard.
+
+        Returns
+        -------
+        items : array (nusers, n)
+            Global indices of the top items, in descending order of predicted count, with -1
+            where there are fewer than 'n' candidates.
+        scores : array (nusers, n)
+            Predicted counts for the items above, with NaN where there are fewer than 'n' candidates.
+        """
+        factors = np.ascontiguousarray(factors, dtype = ctypes.c_double)
+        if len(factors.shape) == 1:
+            factors = factors.reshape((1, -1))
+        assert factors.shape[1] == self.B.shape[1]
+        assert isinstance(n, int)
+        assert n > 0
+        excl_indptr, excl_ind = None, None
+        if exclude is not None:
+            if not isinstance(exclude, list):
+                exclude = [exclude]
+            assert len(exclude) == factors.shape[0]
+            exclude = [np.asarray(ex, dtype = int).reshape(-1) for ex in exclude]
+            excl_indptr = np.r_[0, np.cumsum([ex.shape[0] for ex in exclude])].astype(ctypes.c_size_t)
+            excl_ind = np.concatenate(exclude).astype(ctypes.c_size_t)
+        out_ix = np.empty((factors.shape[0], n), dtype = ctypes.c_size_t)
+        out_val = np.empty((factors.shape[0], n), dtype = ctypes.c_double)
+        _topn_items_shard(out_ix, out_val, factors, self.B, self.item_offset, excl_indptr, excl_ind, self.nthreads)
+        out_ix = out_ix.astype(np.int64)
+        out_ix[np.isnan(out_val)] = -1
+        return out_ix, out_val
+
+
+class ShardCoordinator:
+    """
+    Top-N recommendations from items split across shards
+
+    Obtains latent factors for users given their interactions (gathering the required item factors from
+    the shards), sends them to all the shards, and merges the partial top-N lists that these return.
+    The results are the same as when recommending from the full model.
+
+    Note
+    ----
+    Shards can be 'ItemShard' objects living in the same process, or any objects with the same methods
+    ('describe', 'get_rows', 'topN_partial') which forward the calls to other processes - for example,
+    proxies from a ``multiprocessing.managers.BaseManager`` serving each shard over a local socket.
+    Pass an executor (e.g. a ``concurrent.futures.ThreadPoolExecutor``) to query them concurrently.
+
+    Parameters
+    ----------
+    shards : list
+        Shards covering all the items of the model, as produced by 'PoisMF.make_item_shards'.
+    executor : None or Executor
+        Executor through which to send the calls to the shards. If passing None, will call them sequentially.
+    nthreads : int
+        Number of threads to use for merging results.
+    """
+    def __init__(self, shards, executor = None, nthreads = 1):
+        assert len(shards) > 0
+        self.shards = list(shards)
+        self.executor = executor
+        self.nthreads = int(nthreads)
+        info = self._scatter(lambda sh: sh.describe())
+        order = np.argsort([inf["item_offset"] for inf in info])
+        self.shards = [self.shards[ix] for ix in order]
+        info = [info[ix] for ix in order]
+
+        self.k = info[0]["k"]
+        self.nitems = info[0]["nitems_total"]
+        self.init_type = info[0]["init_type"]
+        self.Bsum = np.asarray(info[0]["Bsum"], dtype = ctypes.c_double)
+        expected_offset = 0
+        for inf in info:
+            if (inf["k"] != self.k) or (inf["nitems_total"] != self.nitems) or (inf["item_offset"] != expected_offset):
+                raise ValueError("Shards must come from the same model and cover all of its items.")
+            if not np.allclose(inf["Bsum"], self.Bsum):
+                raise ValueError("Shards have different column sums of 'B'.")
+            expected_offset += inf["nitems"]
+        if expected_offset != self.nitems:
+            raise ValueError("Shards must come from the same model and cover all of its items.")
+
+        self.reindex = info[0]["item_ids"] is not None
+        self.item_mapping_ = np.concatenate([inf["item_ids"] for inf in info]) if self.reindex else None
+
+    def _scatter(self, fun):
+        if self.executor is None:
+            return [fun(sh) for sh in self.shards]
+        futures = [self.executor.submit(fun, sh) for sh in self.shards]
+        return [fut.result() for fut in futures]
+
+    def _items_to_index(self, items):
+        items = np.asarray(items).reshape(-1)
+        if self.reindex:
+            return pd.Categorical(items, self.item_mapping_).codes.astype(int)
+        return items.astype(int)
+
+    def fold_in(self, items, counts = None, random_seed = 1, l2_reg = 1e3, l1_reg = 0,
+                solver = "cg", max_iter = 100, max_fun_eval = 200, time_limit = None):
+        """
+        Obtain latent factors for a user given her interactions
+
+        Same as 'PoisMF.predict_factors', but taking the item factors from the shards.
+
+        Parameters
+        ----------
+        items : array-like (nitems,)
+            Items with which the user interacted. Items that were not in the model are ignored.
+        counts : None or array-like (nitems,)
+            Counts for each of the items. If passing None, will take them as all ones.
+        random_seed : int
+            Random seed used to initialize the factors.
+        l2_reg : float
+            Strength of L2 regularization to use for the factors.
+        l1_reg : float
+            Strength of L1 regularization to use for the factors, in addition to the one with which
+            the model was fitted (as in 'PoisMF.predict_factors').
+        solver : str
+            Method used to optimize the factors (see 'PoisMF.predict_factors').
+        max_iter : int
+            Maximum number of iterations of the solver.
+        max_fun_eval : int
+            Maximum number of function evaluations.
+        time_limit : None or float
+            Maximum time in seconds to spend on optimizing the factors.
+
+        Returns
+        -------
+        factors : array (k,)
+            Latent factors for the user.
+        """
+        assert l2_reg >= 0
+        assert l1_reg >= 0
+        solver, max_iter, max_fun_eval, time_limit = _foldin_options(solver, max_iter, max_fun_eval, time_limit)
+        items = self._items_to_index(items)
+        counts = np.ones(items.shape[0]) if counts is None else np.asarray(counts, dtype = ctypes.c_double).reshape(-1)
+        assert items.shape[0] == counts.shape[0]
+        keep = (items >= 0) & (items < self.nitems) & (counts > 0)
+        items, counts = items[keep], counts[keep]
+
+        F = np.empty((items.shape[0], self.k), dtype = ctypes.c_double)
+        for mask, rows in self._scatter(lambda sh: sh.get_rows(items)):
+            F[np.asarray(mask)] = rows
+
+        rng = np.random.RandomState(random_seed)
+        if self.init_type == "gamma":
+            a_vec = rng.gamma(1, 1, size = self.k)
+        else:
+            a_vec = rng.random_sample(size = self.k)
+        if items.shape[0] == 0:
+            return np.zeros(self.k)
+        _predict_factors(a_vec, np.ascontiguousarray(counts, dtype = ctypes.c_double),
+                         np.arange(items.shape[0]).astype(ctypes.c_size_t), F, self.Bsum + l1_reg, l2_reg, 0,
+                         solver, max_iter, max_fun_eval, time_limit)
+        return a_vec
+
+    def topN(self, factors, n = 10, exclude = None, return_scores = False):
+        """
+        Top-N items across all shards for the given user factors
+
+        Parameters
+        ----------
+        factors : array (k,) or (nusers, k)
+            Latent factors of the users for which to recommend (e.g. as produced by 'fold_in').
+        n : int
+            Number of top items to recommend.
+        exclude : None, array-like, or list of array-like
+            Items (IDs as in the model) to exclude for each user, such as those that were already seen.
+        return_scores : bool
+            Whether to also return the predicted counts for the recommended items.
+
+        Returns
+        -------
+        rec : array (n,) or list of arrays
+            Top-N items for each user, in descending order of predicted count (one array per user when
+            passing a 2D 'factors'). If there are fewer than 'n' candidates, only those are returned.
+            If 'return_scores' is True, will return a tuple with these and the predicted counts.
+        """
+        factors = np.ascontiguousarray(factors, dtype = ctypes.c_double)
+        is_batch = len(factors.shape) == 2
+        if not is_batch:
+            factors = factors.reshape((1, -1))
+            if exclude is not None:
+                exclude = [exclude]
+        assert factors.shape[1] == self.k
+        assert isinstance(n, int)
+        assert n > 0
+        n = min(n, self.nitems)
+        if exclude is not None:
+            assert len(exclude) == factors.shape[0]
+            exclude = [self._items_to_index(ex) for ex in exclude]
+            exclude = [ex[ex >= 0] for ex in exclude]
+
+        parts = self._scatter(lambda sh: sh.topN_partial(factors, n, exclude))
+        part_ix = np.stack([np.asarray(p[0]) for p in parts])
+        part_val = np.stack([np.asarray(p[1]) for p in parts]).astype(ctypes.c_double)
+        part_ix = np.where(part_ix < 0, np.iinfo(ctypes.c_size_t).max, part_ix).astype(ctypes.c_size_t)
+        out_ix = np.empty((factors.shape[0], n), dtype = ctypes.c_size_t)
+        out_val = np.empty((factors.shape[0], n), dtype = ctypes.c_double)
+        _merge_topn(out_ix, out_val, np.ascontiguousarray(part_ix), np.ascontiguousarray(part_val), self.nthreads)
+
+        recs, scores = [], []
+        for row in range(factors.shape[0]):
+            valid = ~np.isnan(out_val[row])
+            rec = out_ix[row][valid].astype(int)
+            recs.append(self.item_mapping_[rec] if self.reindex else rec)
+            scores.append(out_val[row][valid])
+        if not is_batch:
+            recs, scores = recs[0], scores[0]
+        if return_scores:
+            return recs, scores
+        return recs
+
+    def recommend_from_interactions(self, items, counts = None, n = 10, exclude_given = True, return_scores = False, **kwargs):
+        """
+        Recommend Top-N items for a new user given her interactions
+
+        Same as 'PoisMF.recommend_from_interactions' for a single user, but querying the shards.
+
+        Parameters
+        ----------
+        items : array-like (nitems,)
+            Items with which the user interacted.
+        counts : None or array-like (nitems,)
+            Counts for each of the items. If passing None, will take them as all ones.
+        n : int
+            Number of top items to recommend.
+        exclude_given : bool
+            Whether to exclude from the recommendations the items passed in 'items'.
+        return_scores : bool
+            Whether to also return the predicted counts for the recommended items.
+        **kwargs
+            Additional arguments to pass to 'fold_in'.
+
+        Returns
+        -------
+        rec : array (n,)
+            Top-N recommended items. If 'return_scores' is True, will return a tuple with these and
+            the predicted counts.
+        """
+        a_vec = self.fold_in(items, counts, **kwargs)
+        return self.topN(a_vec, n, np.asarray(items).reshape(-1) if exclude_given else None, return_scores)
+
+
+class ModelPack:
+    """
+    Many small models stored in a single file
+
+    Serves Top-N recommendations from a file with the latent factors and user/item IDs of many models
+    (e.g. one model per market), as written by 'ModelPack.write'. The file is memory-mapped in a single
+    call, and requests are routed to their models in compiled code, so that the memory used is that of
+    the arrays in the file (brought into memory by the operating system as they are used, and shared among
+    processes serving the same file), without Python objects for each model.
+
+    Note
+    ----
+    Within the file, the users and items of each model are sorted by their IDs, and IDs are looked
+    up through binary searches. Model IDs are converted to strings. The items seen by each user
+    (see 'PoisMF.save_model') are not stored, and the file is in the byte order of the machine.
+
+    Parameters
+    ----------
+    fname : str
+        File path of the pack.
+    nthreads : int
+        Number of threads to use for routing batches of requests.
+    """
+    def __init__(self, fname, nthreads = 1):
+        self.fname = os.path.expanduser(fname)
+        self.nthreads = int(nthreads)
+        assert self.nthreads > 0
+        self._mapped = np.memmap(self.fname, dtype = np.uint8, mode = 'r')
+        if (self._mapped.shape[0] < _PACK_HEADER_SIZE) or (bytes(self._mapped[:8]) != _PACK_MAGIC):
+            raise ValueError("File is not in the expected format.")
+        nmodels, offset_index, names_width = np.frombuffer(self._mapped, dtype = ctypes.c_size_t, count = 3, offset = 8)
+        self.nmodels = int(nmodels)
+        self._index = np.frombuffer(self._mapped, dtype = _pack_index_dtype, count = self.nmodels, offset = int(offset_index))
+        self._names = np.frombuffer(self._mapped, dtype = "S%d" % max(int(names_width), 1), count = self.nmodels,
+                                    offset = int(offset_index) + self._index.nbytes)
+        ## the compiled code takes these as contiguous arrays
+        self._k = np.ascontiguousarray(self._index["k"]).astype(ctypes.c_size_t)
+        self._dimB = np.ascontiguousarray(self._index["dimB"]).astype(ctypes.c_size_t)
+        self._offset_B = np.ascontiguousarray(self._index["offset_B"]).astype(ctypes.c_size_t)
+        self._offset_Bsum = np.ascontiguousarray(self._index["offset_Bsum"]).astype(ctypes.c_size_t)
+
+    @staticmethod
+    def write(fname, models):
+        """
+        Write many fitted models to a single file
+
+        Parameters
+        ----------
+        fname : str
+            File path where to write the pack.
+        models : dict
+            Fitted 'PoisMF' models, with the model IDs as keys.
+
+        Returns
+        -------
+        nbytes : int
+            Size of the written file.
+        """
+        assert len(models) > 0
+        names = [str(m).encode("utf-8") for m in models]
+        if len(set(names)) != len(names):
+            raise ValueError("Model IDs must be unique after converting them to strings.")
+        order = np.argsort(np.array(names, dtype = object), kind = 'stable')
+        models = list(models.values())
+        index = np.zeros(len(models), dtype = _pack_index_dtype)
+
+        with open(os.path.expanduser(fname), "wb") as f:
+            f.write(b"\x00" * _PACK_HEADER_SIZE)
+            for pos, ix in enumerate(order):
+                model = models[ix]
+                assert model.is_fitted
+                user_kind, user_ids, user_order = _pack_ids(model.user_mapping_ if model.reindex else None, model.nusers)
+                item_kind, item_ids, item_order = _pack_ids(model.item_mapping_ if model.reindex else None, model.nitems)
+                B = np.ascontiguousarray(model.B[item_order], dtype = ctypes.c_double)
+                arrays = [("A", np.ascontiguousarray(model.A[user_order], dtype = ctypes.c_double)), ("B", B),
+                          ("Bsum", np.ascontiguousarray(model.Bsum, dtype = ctypes.c_double).reshape(-1)),
+                          ("user_ids", user_ids), ("item_ids", item_ids)]
+                for field, arr in arrays:
+                    _pack_align(f)
+                    index[pos]["offset_" + field] = f.tell()
+                    f.write(memoryview(arr).cast("B"))
+                index[pos]["k"], index[pos]["dimA"], index[pos]["dimB"] = model.k, model.nusers, model.nitems
+                index[pos]["user_ids_kind"], index[pos]["user_ids_width"] = user_kind, user_ids.dtype.itemsize
+                index[pos]["item_ids_kind"], index[pos]["item_ids_width"] = item_kind, item_ids.dtype.itemsize
+                index[pos]["init_type"] = int(model.init_type != "gamma")
+
+            _pack_align(f)
+            offset_index = f.tell()
+            f.write(index.tobytes())
+            names = np.array([names[ix] for ix in order], dtype = bytes)
+            f.write(names.tobytes())
+            nbytes = f.tell()
+            f.seek(0)
+            f.write(_PACK_MAGIC + np.array([len(models), offset_index, names.dtype.itemsize], dtype = ctypes.c_size_t).tobytes())
+        return nbytes
+
+    def __len__(self):
+        return self.nmodels
+
+    def __contains__(self, model_id):
+        return self._find_models([model_id])[0] >= 0
+
+    @property
+    def model_ids(self):
+        """IDs of the models in the pack, sorted"""
+        return np.array([name.decode("utf-8") for name in self._names], dtype = object)
+
+    def _find_models(self, model_ids):
+        keys = np.array([str(m).encode("utf-8") for m in model_ids], dtype = bytes)
+        pos = np.searchsorted(self._names, keys).clip(max = max(self.nmodels - 1, 0))
+        found = (self.nmodels > 0) & (self._names[pos] == keys)
+        return np.where(found, pos, -1)
+
+    def _get_models(self, model_ids):
+        models = self._find_models(model_ids)
+        if np.any(models < 0):
+            missing = [m for m, pos in zip(model_ids, models) if pos < 0]
+            raise ValueError("Models not in the pack: " + ", ".join(str(m) for m in missing[:10]))
+        return models
+
+    def _view(self, model, field, count):
+        if field in ["A", "B", "Bsum"]:
+            dt = ctypes.c_double
+        else:
+            kind = self._index[model][field + "_kind"]
+            dt = ctypes.c_double if kind == 0 else (np.int64 if kind == 1 else "S%d" % self._index[model][field + "_width"])
+            if kind == 0:
+                return None
+        return np.frombuffer(self._mapped, dtype = dt, count = count, offset = int(self._index[model]["offset_" + field]))
+
+    def _ids_to_index(self, model, ids, dim, field):
+        ids = np.asarray(ids).reshape(-1)
+        sorted_ids = self._view(model, field, dim)
+        if sorted_ids is None:
+            ix = ids.astype(int)
+            return np.where((ix >= 0) & (ix < dim), ix, -1)
+        if sorted_ids.dtype.kind == "S":
+            ids = np.array([str(el).encode("utf-8") for el in ids], dtype = bytes)
+        elif not np.issubdtype(ids.dtype, np.integer):
+            return np.full(ids.shape[0], -1)
+        if dim == 0:
+            return np.full(ids.shape[0], -1)
+        pos = np.searchsorted(sorted_ids, ids).clip(max = dim - 1)
+        return np.where(sorted_ids[pos] == ids, pos, -1)
+
+    def _index_to_ids(self, model, ix):
+        sorted_ids = self._view(model, "item_ids", int(self._index[model]["dimB"]))
+        if sorted_ids is None:
+            return ix
+        if sorted_ids.dtype.kind == "S":
+            return np.array([el.decode("utf-8") for el in sorted_ids[ix]], dtype = object)
+        return sorted_ids[ix]
+
+    def get_model(self, model_id, nthreads = 1):
+        """
+        Get a model from the pack as a 'PoisMF' object
+
+        Parameters
+        ----------
+        model_id : obj
+            ID of the model.
+        nthreads : int
+            Number of threads to use in the returned model.
+
+        Returns
+        -------
+        model : PoisMF
+            The model, with its latent factors being read-only arrays from the memory-mapped file, and its users
+            and items sorted by ID. Its hyperparameters other than 'k' and 'init_type' are not stored in the pack.
+        """
+        model = self._get_models([model_id])[0]
+        rec = self._index[model]
+        k, dimA, dimB = int(rec["k"]), int(rec["dimA"]), int(rec["dimB"])
+        user_ids = self._view(model, "user_ids", dimA)
+        item_ids = self._view(model, "item_ids", dimB)
+        out = PoisMF(k = k, init_type = "unif" if rec["init_type"] else "gamma", nthreads = nthreads, keep_data = False,
+                     reindex = user_ids is not None)
+        out.A = self._view(model, "A", dimA * k).reshape((dimA, k))
+        out.B = self._view(model, "B", dimB * k).reshape((dimB, k))
+        out.nusers, out.nitems = dimA, dimB
+        if out.reindex:
+            decode = lambda ids: ids if ids.dtype.kind != "S" else np.array([el.decode("utf-8") for el in ids], dtype = object)
+            out.user_mapping_, out.item_mapping_ = decode(np.array(user_ids)), decode(np.array(item_ids))
+        out._finish_loading()
+        ## the stored sums include the L1 regularization of the model, which is not otherwise kept in the pack
+        out.Bsum = np.array(self._view(model, "Bsum", k))
+        return out
+
+    def _route(self, model_ids, is_batch, sess_items, sess_counts, factors_from, n, exclude_given, return_scores,
+               random_seed, l2_reg, l1_reg, solver, max_iter, max_fun_eval, time_limit):
+        models = self._get_models(model_ids)
+        nsess = models.shape[0]
+        max_k = int(self._k[models].max()) if nsess else 1
+        max_dimB = int(self._dimB[models].max()) if nsess else 1
+        n_out = min(n, max_dimB)
+
+        items_ix, counts_flat = [], []
+        for sess in range(nsess):
+            model = models[sess]
+            it = self._ids_to_index(model, sess_items[sess], int(self._dimB[model]), "item_ids")
+            ct = np.ones(it.shape[0]) if sess_counts[sess] is None \
+                 else np.asarray(sess_counts[sess], dtype = ctypes.c_double).reshape(-1)
+            assert it.shape[0] == ct.shape[0]
+            keep = (it >= 0) & (ct > 0)
+            items_ix.append(it[keep])
+            counts_flat.append(ct[keep])
+        sess_indptr = np.r_[0, np.cumsum([x.shape[0] for x in items_ix])].astype(ctypes.c_size_t)
+        flat_items = np.concatenate(items_ix).astype(ctypes.c_size_t) if nsess else np.empty(0, dtype = ctypes.c_size_t)
+        flat_counts = np.concatenate(counts_flat).astype(ctypes.c_double) if nsess else np.empty(0, dtype = ctypes.c_double)
+
+        if factors_from is None:
+            rng = np.random.RandomState(random_seed)
+            is_unif = self._index["init_type"][models] != 0
+            factors = np.empty((nsess, max_k))
+            if not np.all(is_unif):
+                factors[~is_unif] = rng.gamma(1, 1, size = (int((~is_unif).sum()), max_k))
+            if np.any(is_unif):
+                factors[is_unif] = rng.random_sample(size = (int(is_unif.sum()), max_k))
+        else:
+            factors = factors_from(models, max_k)
+
+        out_items = np.empty((nsess, n_out), dtype = ctypes.c_size_t)
+        out_scores = np.empty((nsess, n_out), dtype = ctypes.c_double)
+        _recommend_from_pack(out_items, out_scores, np.ascontiguousarray(factors, dtype = ctypes.c_double),
+                             models.astype(ctypes.c_size_t), sess_indptr, flat_items, flat_counts, self._mapped,
+                             self._k, self._dimB, self._offset_B, self._offset_Bsum, max_dimB,
+                             l1_reg, l2_reg, solver, max_iter, max_fun_eval, time_limit,
+                             int(bool(exclude_given)), int(factors_from is None), self.nthreads)
+
+        recs, scores = [], []
+        for sess in range(nsess):
+            valid = ~np.isnan(out_scores[sess])
+            recs.append(self._index_to_ids(models[sess], out_items[sess][valid].astype(int)))
+            scores.append(out_scores[sess][valid])
+        if not is_batch:
+            recs, scores = recs[0], scores[0]
+        if return_scores:
+            return recs, scores
+        return recs
+
+    def recommend_from_interactions(self, model_ids, items, counts = None, n = 10, exclude_given = True,
+                                    return_scores = False, random_seed = 1, l2_reg = 1e3, l1_reg = 0,
+                                    solver = "cg", max_iter = 100, max_fun_eval = 200, time_limit = None):
+        """
+        Recommend Top-N items for new users of given models
+
+        Same as 'PoisMF.recommend_from_interactions', but with each user (e.g. a request) being
+        routed to a model of the pack. A batch of users for different models is processed in a single
+        call to compiled code, in parallel.
+
+        Parameters
+        ----------
+        model_ids : obj or list
+            ID of the model to use, or list with the model for each user when passing a batch.
+        items : array-like (nitems,) or list of array-like
+            Items with which the user interacted. Pass a list of arrays to process a batch of users.
+            Items that are not in the model are ignored.
+        counts : None, array-like (nitems,), or list of array-like
+            Counts for each of the items in 'items' (same structure). If passing None, will take them as all ones.
+        n : int
+            Number of top items to recommend.
+        exclude_given : bool
+            Whether to exclude from the recommendations the items passed in 'items'.
+        return_scores : bool
+            Whether to also return the predicted counts for the recommended items.
+        random_seed : int
+            Random seed used to initialize the latent factors.
+        l2_reg : float
+            Strength of L2 regularization to use for the latent factors.
+        l1_reg : float
+            Strength of the L1 regularization to use for the latent factors, in addition to the one with
+            which each model was fitted.
+        solver : str
+            Method used to optimize the factors (see 'PoisMF.predict_factors').
+        max_iter : int
+            Maximum number of iterations of the solver for each user.
+        max_fun_eval : int
+            Maximum number of function evaluations for each user.
+        time_limit : None or float
+            Maximum time in seconds to spend on optimizing the factors of each user.
+
+        Returns
+        -------
+        rec : array (n,) or list of arrays
+            Top-N recommended items for each user, in descending order of predicted count. If there are fewer
+            than 'n' candidates, only those are returned. If 'return_scores' is True, will return a tuple
+            with these and the predicted counts.
+        """
+        assert isinstance(n, int)
+        assert n > 0
+        assert l2_reg >= 0
+        assert l1_reg >= 0
+        solver, max_iter, max_fun_eval, time_limit = _foldin_options(solver, max_iter, max_fun_eval, time_limit)
+        is_batch = isinstance(items, list) and (len(items) > 0) and \
+                   isinstance(items[0], (list, tuple, np.ndarray, pd.Series))
+        if not is_batch:
+            model_ids, items, counts = [model_ids], [items], [counts]
+        elif counts is None:
+            counts = [None] * len(items)
+        assert len(model_ids) == len(items)
+        assert len(items) == len(counts)
+        return self._route(model_ids, is_batch, items, counts, None, n, exclude_given, return_scores,
+                           random_seed, l2_reg, l1_reg, solver, max_iter, max_fun_eval, time_limit)
+
+    def topN(self, model_ids, users, n = 10, exclude = None, return_scores = False):
+        """
+        Top-N items for existing users of given models
+
+        Parameters
+        ----------
+        model_ids : obj or array-like
+            ID of the model to use, or the model for each user when passing several users.
+        users : obj or array-like
+            User IDs (as in each model), one per entry of 'model_ids'.
+        n : int
+            Number of top items to recommend.
+        exclude : None, array-like, or list of array-like
+            Items (IDs as in the model) to exclude for each user, such as those that were already seen.
+        return_scores : bool
+            Whether to also return the predicted counts for the recommended items.
+
+        Returns
+        -------
+        rec : array (n,) or list of arrays
+            Top-N items for each user, in descending order of predicted count (one array per user when
+            passing several users). If 'return_scores' is True, will return a tuple with these and the
+            predicted counts.
+        """
+        assert isinstance(n, int)
+        assert n > 0
+        is_batch = isinstance(users, (list, tuple, np.ndarray, pd.Series))
+        if not is_batch:
+            model_ids, users = [model_ids], [users]
+            exclude = None if exclude is None else [exclude]
+        elif isinstance(model_ids, (str, bytes)) or not hasattr(model_ids, "__len__"):
+            model_ids = [model_ids] * len(users)
+        assert len(model_ids) == len(users)
+        if exclude is None:
+            exclude = [np.empty(0, dtype = int)] * len(users)
+        assert len(exclude) == len(users)
+
+        def gather_factors(models, max_k):
+            factors = np.zeros((models.shape[0], max_k))
+            for sess, (model, user) in enumerate(zip(models, users)):
+                k, dimA = int(self._k[model]), int(self._index[model]["dimA"])
+                ix = self._ids_to_index(model, [user], dimA, "user_ids")[0]
+                if ix < 0:
+                    raise ValueError("User " + str(user) + " is not in model " + str(model_ids[sess]) + ".")
+                factors[sess, :k] = self._view(model, "A", dimA * k)[ix*k : (ix + 1)*k]
+            return factors
+
+        return self._route(model_ids, is_batch, exclude, [None] * len(users), gather_factors, n,
+                           True, return_scores, 1, 0., 0., 0, 1, 1, 0.)
+
+
+### Metadata stored along with the matrices in binary model and delta files:
+### (uint32 length, JSON with hyperparameters), then user IDs and item IDs, each as
+### (uint8 type, uint64 count, data), with type 0 = no IDs, 1 = int64 array, 2 = UTF-8
+### strings with a uint32 length before each. IDs which are not integers are stored as strings.
+_saved_params = ['k', 'l1_reg', 'l2_reg', 'niter', 'npasses', 'initial_step', 'use_cg', 'iter_scheme',
+                 'nblocks', 'fixed_precision', 'packed_nonzeros', 'float_iters', 'float_tol', 'init_type',
+                 'random_seed', 'reindex']
+
+def _encode_ids(ids):
+    if ids is None:
+        return struct.pack("<BQ", 0, 0)
+    ids = np.asarray(ids)
+    if np.issubdtype(ids.dtype, np.integer):
+        return struct.pack("<BQ", 1, ids.shape[0]) + ids.astype("<i8").tobytes()
+    parts = [struct.pack("<BQ", 2, ids.shape[0])]
+    for el in ids:
+        el = str(el).encode("utf-8")
+        parts += [struct.pack("<I", len(el)), el]
+    return b"".join(parts)
+
+def _decode_ids(buf, pos):
+    tp, n = struct.unpack_from("<BQ", buf, pos)
+    pos += struct.calcsize("<BQ")
+    if tp == 0:
+        return None, pos
+    if tp == 1:
+        ids = np.frombuffer(buf, dtype = "<i8", count = n, offset = pos).astype(np.int64)
+        return ids, pos + 8 * n
+    ids = np.empty(n, dtype = object)
+    for i in range(n):
+        ln = struct.unpack_from("<I", buf, pos)[0]
+        pos += 4
+        ids[i] = buf[pos : pos + ln].decode("utf-8")
+        pos += ln
+    return ids, pos
+
+def _encode_metadata(model, user_ids, item_ids):
+    params = json.dumps({p : getattr(model, p) for p in _saved_params}).encode("utf-8")
+    return struct.pack("<I", len(params)) + params + _encode_ids(user_ids) + _encode_ids(item_ids)
+
+def _decode_metadata(buf):
+    ln = struct.unpack_from("<I", buf, 0)[0]
+    params = json.loads(buf[4 : 4 + ln].decode("utf-8"))
+    user_ids, pos = _decode_ids(buf, 4 + ln)
+    item_ids, pos = _decode_ids(buf, pos)
+    return params, user_ids, item_ids
+
+### Pickling - arrays are sent by value (out-of-band with protocol 5), or as locations in the
+### file created by 'PoisMF.share_memory', which is then mapped by the unpickled models
+_shared_attrs = ['A', 'B', 'B_blocked_', 'user_mapping_', 'item_mapping_']
+_unpickled_attrs = ['_replicas', 'user_dict_', 'item_dict_', '_seen_index',
+                    '_shared_file', '_shared_arrays', '_shared_finalizer']
+
+def _view_shared(mapped, layout):
+    offset, dtype, shape = layout
+    nbytes = int(np.prod(shape)) * np.dtype(dtype).itemsize
+    return mapped[offset : offset + nbytes].view(dtype).reshape(shape)
+
+def _remove_file(fname):
+    try:
+        os.remove(fname)
+    except OSError:
+        pass
+
+def _replace_file(fname, write_fn):
+    ## the new contents are written by 'write_fn' to a temporary file in the same folder, which is
+    ## flushed to disk and then renamed over 'fname' - readers see either the old or the new file
+    ## in full, and the ones which memory-mapped the old file keep their mapping
+    if not os.path.exists(fname):
+        write_fn(fname)
+        return
+    folder = os.path.dirname(os.path.abspath(fname))
+    fd, tmp_fname = tempfile.mkstemp(dir = folder, prefix = "." + os.path.basename(fname) + ".", suffix = ".tmp")
+    os.close(fd)
+    try:
+        shutil.copymode(fname, tmp_fname)
+        write_fn(tmp_fname)
+        with open(tmp_fname, "rb+") as f:
+            os.fsync(f.fileno())
+        os.replace(tmp_fname, fname)
+    except BaseException:
+        _remove_file(tmp_fname)
+        raise
+    if os.name == "posix":
+        dir_fd = os.open(folder, os.O_RDONLY)
+        try:
+            os.fsync(dir_fd)
+        finally:
+            os.close(dir_fd)
+
+def _rebuild_model(cls, state, shared):
+    model = cls.__new__(cls)
+    model.__dict__.update(state)
+    model._replicas = None
+    if shared is not None:
+        fname, layout = shared
+        mapped = np.memmap(fname, dtype = np.uint8, mode = 'c')
+        for attr in layout:
+            setattr(model, attr, _view_shared(mapped, layout[attr]))
+    if isinstance(model.__dict__.get("_seen_index"), np.ndarray):
+        model._seen_index = _SeenIndex.from_bytes(model._seen_index)
+    if model.is_fitted and model.produce_dicts and model.reindex:
+        model.user_dict_ = {model.user_mapping_[i]:i for i in range(model.user_mapping_.shape[0])}
+        model.item_dict_ = {model.item_mapping_[i]:i for i in range(model.item_mapping_.shape[0])}
+    return model
+
+### Model pack files - see 'ModelPack'. Numbers are in the byte order of the machine:
+###   header : char[8] magic, then uint64: number of models, offset of the index, width of the model IDs (64 bytes)
+###   data   : for each model: A (dimA*k doubles), B (dimB*k doubles), column sums of B (k doubles), then the user
+###            IDs and item IDs, sorted, as int64 or as fixed-width UTF-8 strings, each at an offset aligned
+###            to 64 bytes. The rows of A and B are permuted in the same order as their IDs.
+###   index  : one record of '_pack_index_dtype' per model, sorted by model ID, then the model IDs as
+###            fixed-width UTF-8 strings. IDs of kind 0 are absent (indices are the IDs), 1 = int64, 2 = strings.
+_PACK_MAGIC = b"PoisMFPk"
+_PACK_HEADER_SIZE = 64
+_pack_index_dtype = np.dtype([(f, ctypes.c_size_t) for f in
+                              ["k", "dimA", "dimB", "offset_A", "offset_B", "offset_Bsum",
+                               "user_ids_kind", "user_ids_width", "offset_user_ids",
+                               "item_ids_kind", "item_ids_width", "offset_item_ids",
+                               "init_type", "reserved1", "reserved2", "reserved3"]])
+
+def _pack_align(f):
+    f.write(b"\x00" * ((-f.tell()) % 64))
+
+def _pack_ids(ids, dim):
+    if ids is None:
+        return 0, np.empty(0, dtype = np.int64), np.arange(dim)
+    ids = np.asarray(ids).reshape(-1)
+    if np.issubdtype(ids.dtype, np.integer):
+        ids = ids.astype(np.int64)
+        kind = 1
+    else:
+        ids = np.array([str(el).encode("utf-8") for el in ids], dtype = bytes)
+        kind = 2
+    order = np.argsort(ids, kind = 'stable')
+    return kind, np.ascontiguousarray(ids[order]), order
+
+### Solvers for obtaining factors of new users - see 'PoisMF.predict_factors'
+_foldin_solvers = {"cg" : 0, "pgd" : 1}
+
+def _foldin_options(solver, max_iter, max_fun_eval, time_limit):
+    if solver not in _foldin_solvers:
+        raise ValueError("'solver' must be one of " + ", ".join(["'%s'" % s for s in _foldin_solvers]) + ".")
+    assert isinstance(max_iter, int)
+    assert isinstance(max_fun_eval, int)
+    assert max_iter > 0
+    assert max_fun_eval > 0
+    if time_limit is None:
+        time_limit = 0.
+    assert time_limit >= 0
+    if (time_limit > 0) and (solver != "pgd"):
+        raise ValueError("'time_limit' is only supported for solver='pgd'.")
+    return _foldin_solvers[solver], max_iter, max_fun_eval, float(time_limit)
@@ -1,5 +1,7 @@
 import numpy as np
 cimport numpy as np
+from libc.stdint cimport uint64_t, int64_t, uint32_t
+from libc.string cimport memset
 
 cdef extern from "../src/pgd.c":
 	void run_poismf(
@@ -7,33 +9,673 @@ cdef extern from "../src/pgd.c":
 		double *B, double *Xc, size_t *Xc_indptr, size_t *Xc_indices,
 		size_t dimA, size_t dimB, size_t k,
 		double l2_reg, double l1_reg, int use_cg, double step_size,
-		size_t numiter, size_t npass, int ncores)
+		size_t numiter, size_t npass, int iter_scheme, size_t nblocks, int fixed_prec, int packed_nnz,
+		size_t f32_iters, double f32_tol, int adapt_threads, int ncores)
+	int run_poismf_dense(
+		double *A, double *B, double *X, size_t x_row_stride, size_t x_col_stride,
+		size_t dimA, size_t dimB, size_t k, double l2_reg, double l1_reg, double step_size,
+		size_t numiter, size_t npass, int adapt_threads, int ncores)
+	int available_cpus()
 	void optimize_cg_single(double *curr, double *X, size_t *X_ind, size_t nnz_this, double *F, double *Fsum, int k, double l2_reg)
+	void fold_in_single(double *curr, double *X, size_t *X_ind, size_t nnz_this, double *F, double *Fsum, int k, double l2_reg,
+						int solver, size_t max_iter, size_t max_feval, double max_seconds, double *buffer)
 	void predict_multiple(double *out, double *A, double *B, size_t *ix_u, size_t *ix_i, size_t n, int k, int nthreads)
+	double calc_llk(double *A, double *B, double *Xr, size_t *Xr_indptr, size_t *Xr_indices, size_t dimA, size_t dimB, size_t k, int nthreads)
+	void recommend_from_interactions(
+		size_t *out_items, double *out_scores, double *factors,
+		size_t nsessions, size_t *sess_indptr, size_t *items, double *counts,
+		double *B, double *Bsum, size_t dimB, size_t k, double l2_reg,
+		int solver, size_t max_iter, size_t max_feval, double max_seconds,
+		double *B_blocked, size_t block_size,
+		size_t n, int exclude_given, int nthreads)
+	void recommend_from_pack(
+		size_t *out_items, double *out_scores, double *factors, size_t max_k,
+		size_t nsessions, size_t *sess_model, size_t *sess_indptr, size_t *items, double *counts,
+		char *base, size_t *model_k, size_t *model_dimB,
+		size_t *model_offset_B, size_t *model_offset_Bsum, size_t max_dimB,
+		double l1_reg, double l2_reg, int solver, size_t max_iter, size_t max_feval, double max_seconds,
+		size_t n, int exclude_given, int fold_in, int nthreads)
+	size_t blocked_size(size_t dimB, size_t k, size_t block_size)
+	void pack_items_blocked(double *B_blocked, double *B, size_t dimB, size_t k, size_t block_size, int nthreads)
+
+	int topn_rows_for_items(
+		size_t *out_ix, double *out_val,
+		double *A, size_t dimA, double *Bsel, size_t nsel, size_t k, size_t n,
+		size_t *excl_indptr, size_t *excl_ind, int nthreads)
+	int topn_items_shard(
+		size_t *out_ix, double *out_val, double *factors, size_t nrows,
+		double *B_shard, size_t dim_shard, size_t item_offset, size_t k,
+		size_t *excl_indptr, size_t *excl_ind, size_t n, int nthreads)
+	void merge_topn(
+		size_t *out_ix, double *out_val,
+		size_t *part_ix, double *part_val, size_t nparts, size_t nrows, size_t n, int nthreads)
+
+cdef extern from "../src/model_io.c":
+	ctypedef struct model_delta_header:
+		uint64_t k
+		uint64_t dimA_old
+		uint64_t dimB_old
+		uint64_t dimA_new
+		uint64_t dimB_new
+		uint64_t nA
+		uint64_t nB
+		uint64_t ids_size
+		uint64_t seen_size
+		double tol
+	int save_model_file(char *fname, double *A, double *B, size_t dimA, size_t dimB, size_t k, char *ids, size_t ids_size,
+						char *seen, size_t seen_size)
+	int read_model_header(char *fname, size_t *dimA, size_t *dimB, size_t *k, size_t *ids_size,
+						  size_t *offset_A, size_t *offset_B, size_t *offset_ids, size_t *seen_size, size_t *offset_seen)
+	int export_model_delta(char *fname,
+						   double *A_old, double *B_old, size_t dimA_old, size_t dimB_old,
+						   double *A_new, double *B_new, size_t dimA_new, size_t dimB_new,
+						   size_t k, double tol, char *ids, size_t ids_size, char *seen, size_t seen_size,
+						   size_t *nA_changed, size_t *nB_changed, int ncores)
+	int read_delta_header(char *fname, model_delta_header *header)
+	int apply_model_delta(char *fname, double *A, double *B, size_t dimA, size_t dimB, size_t k)
+	int read_delta_blobs(char *fname, char *ids, char *seen)
+
+cdef extern from "../src/numa.c":
+	ctypedef struct model_replicas:
+		size_t dimA
+		size_t dimB
+		size_t k
+		int nnodes
+		int pinned
+		int ncpus[64]
+		int *cpus[64]
+		double *A[64]
+		double *B[64]
+		double load_seconds[64]
+	int load_model_replicas(char *fname, model_replicas *rep, int replicate_A, int max_nodes)
+	void free_model_replicas(model_replicas *rep)
+	int recommend_replicated(
+		model_replicas *rep,
+		size_t *out_items, double *out_scores, double *factors,
+		size_t nsessions, size_t *sess_indptr, size_t *items, double *counts,
+		double *Bsum, double l2_reg,
+		int solver, size_t max_iter, size_t max_feval, double max_seconds,
+		size_t n, int exclude_given, int threads_per_node)
+	int topn_users_replicated(
+		model_replicas *rep, size_t *out_items, double *out_scores,
+		size_t *users, size_t nusers, size_t *excl_indptr, size_t *excl_ind,
+		size_t n, int threads_per_node)
+	double time_replica_scan(model_replicas *rep, int cpu_node, int data_node, size_t nreps)
+
+cdef extern from "../src/ingest.c":
+	ctypedef struct id_map:
+		int64_t *ids
+		size_t n
+	ctypedef struct sparse_builder:
+		id_map maps[2]
+		size_t dims[2]
+		size_t nnz
+		size_t *cols
+		double *vals
+		size_t *Xr_indptr
+		size_t *Xc_indptr
+		size_t *Xc_indices
+		double *Xc
+		int finished
+	int init_sparse_builder(sparse_builder *b, int hash_rows, int hash_cols, size_t nnz_hint)
+	int add_to_sparse_builder(sparse_builder *b, int64_t *row_ids, int64_t *col_ids, double *counts, size_t n, size_t *n_dropped)
+	int finish_sparse_builder(sparse_builder *b, int build_csc)
+	void free_sparse_builder(sparse_builder *b)
+
+cdef extern from "../src/seen_index.c":
+	ctypedef struct seen_index:
+		size_t nusers
+		size_t nitems
+		uint32_t *count
+	bint seen_index_contains(seen_index *idx, size_t user, size_t item)
+	size_t seen_index_get_user(seen_index *idx, size_t user, uint32_t *out)
+	void free_seen_index(seen_index *idx)
+	int seen_index_build(seen_index *idx, size_t nusers, size_t nitems, size_t *indptr, size_t *indices, int nthreads)
+	int seen_index_compact(seen_index *idx, size_t new_nitems)
+	int seen_index_set_user(seen_index *idx, size_t user, size_t *items, size_t n)
+	int seen_index_changed_users(seen_index *idx, seen_index *prev, size_t *out, size_t *nout, int nthreads)
+	int seen_index_users_for_items(seen_index *idx, size_t *items, size_t nsel, size_t *out_indptr, size_t *out_ind, int nthreads)
+	size_t seen_index_memory(seen_index *idx)
+	size_t seen_index_serialized_size(seen_index *idx)
+	void seen_index_serialize(seen_index *idx, char *out)
+	int seen_index_deserialize(seen_index *idx, char *buf, size_t size)
+	int topn_items_seen(
+		size_t *out_ix, double *out_val, double *A, size_t *users, size_t nusers,
+		double *B, size_t dimB, size_t k, seen_index *idx, size_t n, int nthreads)
+
+np.import_array()
 
 def run_pgd(np.ndarray[double, ndim=1] Xr, np.ndarray[size_t, ndim=1] Xr_indices, np.ndarray[size_t, ndim=1] Xr_indptr,
-			np.ndarray[double, ndim=1] Xc, np.ndarray[size_t, ndim=1] Xc_indices, np.ndarray[size_t, ndim=1] Xc_indptr,
 			np.ndarray[double, ndim=2] A, np.ndarray[double, ndim=2] B,
-			int use_cg=0, double l2_reg=1e9, double l1_reg=0, double step_size=1e-7, size_t niter=10, size_t npass=1, int nthreads=1):
+			int use_cg=0, double l2_reg=1e9, double l1_reg=0, double step_size=1e-7, size_t niter=10, size_t npass=1,
+			int iter_scheme=0, size_t nblocks=0, int fixed_prec=0, int packed_nnz=0, int nthreads=1,
+			size_t f32_iters=0, double f32_tol=0, int adapt_threads=0):
 
 	cdef size_t dimA = A.shape[0]
 	cdef size_t dimB = B.shape[0]
 	cdef size_t k = A.shape[1]
 
+	### the CSC copy of the data is built by 'run_poismf' when needed
 	run_poismf(
 		&A[0,0], &Xr[0], &Xr_indptr[0], &Xr_indices[0],
-		&B[0,0], &Xc[0], &Xc_indptr[0], &Xc_indices[0],
+		&B[0,0], NULL, NULL, NULL,
 		dimA, dimB, k,
 		l2_reg, l1_reg, use_cg, step_size,
-		niter, npass, nthreads
+		niter, npass, iter_scheme, nblocks, fixed_prec, packed_nnz,
+		f32_iters, f32_tol, adapt_threads, nthreads
 		)
 
+def run_pgd_dense(np.ndarray[double, ndim=2] X, np.ndarray[double, ndim=2] A, np.ndarray[double, ndim=2] B,
+				  double l2_reg=1e9, double l1_reg=0, double step_size=1e-7, size_t niter=10, size_t npass=1, int nthreads=1,
+				  int adapt_threads=0):
+	### 'X' can have any layout, as long as the strides are non-negative
+	cdef size_t x_row_stride = X.strides[0] // sizeof(double)
+	cdef size_t x_col_stride = X.strides[1] // sizeof(double)
+	cdef int status = run_poismf_dense(&A[0,0], &B[0,0], &X[0,0], x_row_stride, x_col_stride,
+									   A.shape[0], B.shape[0], A.shape[1], l2_reg, l1_reg, step_size,
+									   niter, npass, adapt_threads, nthreads)
+	if status != 0:
+		raise MemoryError("Could not allocate memory.")
+
+def _available_cpus():
+	return available_cpus()
+
 def _predict_multiple(np.ndarray[double, ndim=1] out, np.ndarray[double, ndim=2] A, np.ndarray[double, ndim=2] B,
 					  np.ndarray[size_t, ndim=1] ix_u, np.ndarray[size_t, ndim=1] ix_i, int nthreads):
 	predict_multiple(&out[0], &A[0,0], &B[0,0], &ix_u[0], &ix_i[0], ix_u.shape[0], A.shape[1], nthreads)
 
+def _calc_llk(np.ndarray[double, ndim=1] Xr, np.ndarray[size_t, ndim=1] Xr_indices, np.ndarray[size_t, ndim=1] Xr_indptr,
+			  np.ndarray[double, ndim=2] A, np.ndarray[double, ndim=2] B, int nthreads):
+	cdef double *ptr_Xr = NULL
+	cdef size_t *ptr_Xr_indices = NULL
+	if Xr.shape[0]:
+		ptr_Xr = &Xr[0]
+		ptr_Xr_indices = &Xr_indices[0]
+	return calc_llk(&A[0,0], &B[0,0], ptr_Xr, &Xr_indptr[0], ptr_Xr_indices, A.shape[0], B.shape[0], A.shape[1], nthreads)
+
+def _recommend_from_interactions(np.ndarray[size_t, ndim=2] out_items, np.ndarray[double, ndim=2] out_scores,
+								 np.ndarray[double, ndim=2] factors, np.ndarray[size_t, ndim=1] sess_indptr,
+								 np.ndarray[size_t, ndim=1] items, np.ndarray[double, ndim=1] counts,
+								 np.ndarray[double, ndim=2] B, np.ndarray[double, ndim=1] Bsum, double l2_reg,
+								 int solver, size_t max_iter, size_t max_feval, double max_seconds,
+								 B_blocked, size_t block_size, int exclude_given, int nthreads):
+	cdef double *ptr_B_blocked = NULL
+	cdef np.ndarray[double, ndim=1] B_blocked_arr
+	if B_blocked is not None:
+		B_blocked_arr = B_blocked
+		ptr_B_blocked = &B_blocked_arr[0]
+	cdef size_t *ptr_items = NULL
+	cdef double *ptr_counts = NULL
+	if items.shape[0]:
+		ptr_items = &items[0]
+		ptr_counts = &counts[0]
+	recommend_from_interactions(
+		&out_items[0,0], &out_scores[0,0], &factors[0,0],
+		factors.shape[0], &sess_indptr[0], ptr_items, ptr_counts,
+		&B[0,0], &Bsum[0], B.shape[0], B.shape[1], l2_reg,
+		solver, max_iter, max_feval, max_seconds,
+		ptr_B_blocked, block_size,
+		out_items.shape[1], exclude_given, nthreads)
+
+### 'base' is the memory of the pack file (e.g. a read-only 'numpy.memmap'), which is not written to
+def _recommend_from_pack(np.ndarray[size_t, ndim=2] out_items, np.ndarray[double, ndim=2] out_scores,
+						 np.ndarray[double, ndim=2] factors, np.ndarray[size_t, ndim=1] sess_model,
+						 np.ndarray[size_t, ndim=1] sess_indptr, np.ndarray[size_t, ndim=1] items,
+						 np.ndarray[double, ndim=1] counts, const unsigned char[::1] base,
+						 np.ndarray[size_t, ndim=1] model_k, np.ndarray[size_t, ndim=1] model_dimB,
+						 np.ndarray[size_t, ndim=1] model_offset_B, np.ndarray[size_t, ndim=1] model_offset_Bsum,
+						 size_t max_dimB, double l1_reg, double l2_reg,
+						 int solver, size_t max_iter, size_t max_feval, double max_seconds,
+						 int exclude_given, int fold_in, int nthreads):
+	cdef size_t *ptr_items = NULL
+	cdef double *ptr_counts = NULL
+	if items.shape[0]:
+		ptr_items = &items[0]
+		ptr_counts = &counts[0]
+	if (sess_model.shape[0] == 0) or (out_items.shape[1] == 0):
+		return None
+	recommend_from_pack(
+		&out_items[0,0], &out_scores[0,0], &factors[0,0], factors.shape[1],
+		sess_model.shape[0], &sess_model[0], &sess_indptr[0], ptr_items, ptr_counts,
+		<char*> &base[0], &model_k[0], &model_dimB[0],
+		&model_offset_B[0], &model_offset_Bsum[0], max_dimB,
+		l1_reg, l2_reg, solver, max_iter, max_feval, max_seconds,
+		out_items.shape[1], exclude_given, fold_in, nthreads)
+
+def _pack_items_blocked(np.ndarray[double, ndim=2] B, size_t block_size, int nthreads):
+	cdef np.ndarray[double, ndim=1] B_blocked = np.zeros(blocked_size(B.shape[0], B.shape[1], block_size), dtype=np.float64)
+	if B.shape[0]:
+		pack_items_blocked(&B_blocked[0], &B[0,0], B.shape[0], B.shape[1], block_size, nthreads)
+	return B_blocked
+
+def _topn_rows_for_items(np.ndarray[size_t, ndim=2] out_ix, np.ndarray[double, ndim=2] out_val,
+						 np.ndarray[double, ndim=2] A, np.ndarray[double, ndim=2] Bsel,
+						 excl_indptr, excl_ind, int nthreads):
+	cdef size_t *ptr_excl_indptr = NULL
+	cdef size_t *ptr_excl_ind = NULL
+	cdef np.ndarray[size_t, ndim=1] excl_indptr_arr
+	cdef np.ndarray[size_t, ndim=1] excl_ind_arr
+	if excl_indptr is not None:
+		excl_indptr_arr = excl_indptr
+		ptr_excl_indptr = &excl_indptr_arr[0]
+		if excl_ind.shape[0]:
+			excl_ind_arr = excl_ind
+			ptr_excl_ind = &excl_ind_arr[0]
+	cdef int status = topn_rows_for_items(
+		&out_ix[0,0], &out_val[0,0],
+		&A[0,0], A.shape[0], &Bsel[0,0], Bsel.shape[0], A.shape[1], out_ix.shape[1],
+		ptr_excl_indptr, ptr_excl_ind, nthreads)
+	if status != 0:
+		raise MemoryError("Could not allocate memory.")
+
+def _topn_items_shard(np.ndarray[size_t, ndim=2] out_ix, np.ndarray[double, ndim=2] out_val,
+					  np.ndarray[double, ndim=2] factors, np.ndarray[double, ndim=2] B_shard, size_t item_offset,
+					  excl_indptr, excl_ind, int nthreads):
+	cdef double *ptr_B = NULL
+	cdef size_t *ptr_excl_indptr = NULL
+	cdef size_t *ptr_excl_ind = NULL
+	cdef np.ndarray[size_t, ndim=1] excl_indptr_arr
+	cdef np.ndarray[size_t, ndim=1] excl_ind_arr
+	if B_shard.shape[0]:
+		ptr_B = &B_shard[0,0]
+	if excl_indptr is not None:
+		excl_indptr_arr = excl_indptr
+		ptr_excl_indptr = &excl_indptr_arr[0]
+		if excl_ind.shape[0]:
+			excl_ind_arr = excl_ind
+			ptr_excl_ind = &excl_ind_arr[0]
+	cdef int status = topn_items_shard(
+		&out_ix[0,0], &out_val[0,0], &factors[0,0], factors.shape[0],
+		ptr_B, B_shard.shape[0], item_offset, factors.shape[1],
+		ptr_excl_indptr, ptr_excl_ind, out_ix.shape[1], nthreads)
+	if status != 0:
+		raise MemoryError("Could not allocate memory.")
+
+def _merge_topn(np.ndarray[size_t, ndim=2] out_ix, np.ndarray[double, ndim=2] out_val,
+				np.ndarray[size_t, ndim=3] part_ix, np.ndarray[double, ndim=3] part_val, int nthreads):
+	merge_topn(&out_ix[0,0], &out_val[0,0], &part_ix[0,0,0], &part_val[0,0,0],
+			   part_ix.shape[0], part_ix.shape[1], part_ix.shape[2], nthreads)
+
 def _predict_factors(np.ndarray[double, ndim=1] a_init, np.ndarray[double, ndim=1] counts, np.ndarray[size_t, ndim=1] ix,
-					 np.ndarray[double, ndim=2] B, np.ndarray[double, ndim=1] Bsum, double l2_reg, double l1_reg):
+					 np.ndarray[double, ndim=2] B, np.ndarray[double, ndim=1] Bsum, double l2_reg, double l1_reg,
+					 int solver=0, size_t max_iter=100, size_t max_feval=200, double max_seconds=0):
 	if l1_reg > 0:
-		Bsum += l1_reg
-	optimize_cg_single(&a_init[0], &counts[0], &ix[0], counts.shape[0], &B[0,0], &Bsum[0], B.shape[1], l2_reg)
+		Bsum = Bsum + l1_reg
+	fold_in_single(&a_init[0], &counts[0], &ix[0], counts.shape[0], &B[0,0], &Bsum[0], B.shape[1], l2_reg,
+				   solver, max_iter, max_feval, max_seconds, NULL)
+
+_io_errors = {
+	1 : "Could not open file.",
+	2 : "Error reading file - might be truncated.",
+	3 : "Error writing file.",
+	4 : "File is not in the expected format.",
+	5 : "Dimensions in the file don't match with the model.",
+	6 : "Could not allocate memory."
+}
+
+def _check_io(int status):
+	if status != 0:
+		raise ValueError(_io_errors.get(status, "Unexpected error."))
+
+def _save_model_file(fname, np.ndarray[double, ndim=2] A, np.ndarray[double, ndim=2] B, bytes ids, bytes seen):
+	fname_b = fname.encode()
+	_check_io(save_model_file(fname_b, &A[0,0], &B[0,0], A.shape[0], B.shape[0], A.shape[1], ids, len(ids),
+							  seen, len(seen)))
+
+def _read_model_header(fname):
+	cdef size_t dimA, dimB, k, ids_size, offset_A, offset_B, offset_ids, seen_size, offset_seen
+	fname_b = fname.encode()
+	_check_io(read_model_header(fname_b, &dimA, &dimB, &k, &ids_size, &offset_A, &offset_B, &offset_ids,
+								&seen_size, &offset_seen))
+	return {"dimA" : dimA, "dimB" : dimB, "k" : k, "ids_size" : ids_size,
+			"offset_A" : offset_A, "offset_B" : offset_B, "offset_ids" : offset_ids,
+			"seen_size" : seen_size, "offset_seen" : offset_seen}
+
+def _export_model_delta(fname, np.ndarray[double, ndim=2] A_old, np.ndarray[double, ndim=2] B_old,
+						np.ndarray[double, ndim=2] A_new, np.ndarray[double, ndim=2] B_new,
+						double tol, bytes ids, bytes seen, int nthreads):
+	cdef size_t nA_changed = 0
+	cdef size_t nB_changed = 0
+	fname_b = fname.encode()
+	_check_io(export_model_delta(fname_b,
+								 &A_old[0,0], &B_old[0,0], A_old.shape[0], B_old.shape[0],
+								 &A_new[0,0], &B_new[0,0], A_new.shape[0], B_new.shape[0],
+								 A_new.shape[1], tol, ids, len(ids), seen, len(seen),
+								 &nA_changed, &nB_changed, nthreads))
+	return nA_changed, nB_changed
+
+def _read_delta_header(fname):
+	cdef model_delta_header header
+	fname_b = fname.encode()
+	_check_io(read_delta_header(fname_b, &header))
+	return header
+
+def _apply_model_delta(fname, np.ndarray[double, ndim=2] A, np.ndarray[double, ndim=2] B):
+	fname_b = fname.encode()
+	_check_io(apply_model_delta(fname_b, &A[0,0], &B[0,0], A.shape[0], B.shape[0], A.shape[1]))
+
+def _read_delta_blobs(fname, size_t ids_size, size_t seen_size):
+	ids = bytearray(max(ids_size, 1))
+	seen = bytearray(max(seen_size, 1))
+	cdef char *ptr_ids = ids
+	cdef char *ptr_seen = seen
+	fname_b = fname.encode()
+	_check_io(read_delta_blobs(fname_b, ptr_ids, ptr_seen))
+	return bytes(ids[:ids_size]), bytes(seen[:seen_size])
+
+cdef class _ModelReplicas:
+	"""Copies of the matrices from a model file, one per NUMA node (see 'numa.c')"""
+	cdef model_replicas rep
+	cdef int loaded
+	cdef public int threads_per_node
+
+	def __cinit__(self, fname, int replicate_A, int max_nodes, int nthreads):
+		self.loaded = 0
+		fname_b = fname.encode()
+		_check_io(load_model_replicas(fname_b, &self.rep, replicate_A, max_nodes))
+		self.loaded = 1
+		self.threads_per_node = max(1, nthreads // self.rep.nnodes)
+
+	def __dealloc__(self):
+		if self.loaded:
+			free_model_replicas(&self.rep)
+
+	cdef _view(self, double *ptr, size_t nrows):
+		cdef np.npy_intp dims[2]
+		dims[0] = nrows
+		dims[1] = self.rep.k
+		arr = np.PyArray_SimpleNewFromData(2, dims, np.NPY_DOUBLE, <void*>ptr)
+		np.set_array_base(arr, self)
+		arr.flags.writeable = False
+		return arr
+
+	def B_view(self, int node = 0):
+		return self._view(self.rep.B[node], self.rep.dimB)
+
+	def A_view(self, int node = 0):
+		if self.rep.A[node] == NULL:
+			return None
+		return self._view(self.rep.A[node], self.rep.dimA)
+
+	def report(self):
+		cdef size_t bytes_B = self.rep.dimB * self.rep.k * sizeof(double)
+		cdef size_t bytes_A = (self.rep.dimA * self.rep.k * sizeof(double)) if self.rep.A[0] != NULL else 0
+		return {
+			"nodes" : self.rep.nnodes,
+			"pinned" : bool(self.rep.pinned),
+			"cpus_per_node" : [[self.rep.cpus[node][cpu] for cpu in range(self.rep.ncpus[node])] for node in range(self.rep.nnodes)],
+			"threads_per_node" : self.threads_per_node,
+			"replicated_users" : bytes_A > 0,
+			"bytes_per_replica" : bytes_A + bytes_B,
+			"bytes_total" : (bytes_A + bytes_B) * self.rep.nnodes,
+			"bytes_extra" : (bytes_A + bytes_B) * (self.rep.nnodes - 1),
+			"load_seconds" : [self.rep.load_seconds[node] for node in range(self.rep.nnodes)]
+		}
+
+	def recommend(self, np.ndarray[size_t, ndim=2] out_items, np.ndarray[double, ndim=2] out_scores,
+				  np.ndarray[double, ndim=2] factors, np.ndarray[size_t, ndim=1] sess_indptr,
+				  np.ndarray[size_t, ndim=1] items, np.ndarray[double, ndim=1] counts,
+				  np.ndarray[double, ndim=1] Bsum, double l2_reg,
+				  int solver, size_t max_iter, size_t max_feval, double max_seconds, int exclude_given):
+		cdef size_t *ptr_items = NULL
+		cdef double *ptr_counts = NULL
+		if items.shape[0]:
+			ptr_items = &items[0]
+			ptr_counts = &counts[0]
+		cdef int status = recommend_replicated(
+			&self.rep, &out_items[0,0], &out_scores[0,0], &factors[0,0],
+			factors.shape[0], &sess_indptr[0], ptr_items, ptr_counts, &Bsum[0], l2_reg,
+			solver, max_iter, max_feval, max_seconds,
+			out_items.shape[1], exclude_given, self.threads_per_node)
+		if status != 0:
+			raise MemoryError("Could not allocate memory.")
+
+	def topn_users(self, np.ndarray[size_t, ndim=2] out_items, np.ndarray[double, ndim=2] out_scores,
+				   np.ndarray[size_t, ndim=1] users, excl_indptr, excl_ind):
+		if self.rep.A[0] == NULL:
+			raise ValueError("Users were not replicated.")
+		cdef size_t *ptr_excl_indptr = NULL
+		cdef size_t *ptr_excl_ind = NULL
+		cdef np.ndarray[size_t, ndim=1] excl_indptr_arr
+		cdef np.ndarray[size_t, ndim=1] excl_ind_arr
+		if excl_indptr is not None:
+			excl_indptr_arr = excl_indptr
+			ptr_excl_indptr = &excl_indptr_arr[0]
+			if excl_ind.shape[0]:
+				excl_ind_arr = excl_ind
+				ptr_excl_ind = &excl_ind_arr[0]
+		cdef int status = topn_users_replicated(
+			&self.rep, &out_items[0,0], &out_scores[0,0], &users[0], users.shape[0],
+			ptr_excl_indptr, ptr_excl_ind, out_items.shape[1], self.threads_per_node)
+		if status != 0:
+			raise MemoryError("Could not allocate memory.")
+
+	def scan_latency(self, int cpu_node, int data_node, size_t nreps):
+		return time_replica_scan(&self.rep, cpu_node, data_node, nreps)
+
+_ingest_errors = {
+	1 : "Could not allocate memory.",
+	2 : "IDs must be non-negative integers when using 'reindex=False'.",
+	3 : "Data was already compacted - no more chunks can be added."
+}
+
+cdef class _SparseBuilder:
+	"""Builds the CSR and CSC matrices from chunks of triplets (see 'ingest.c')"""
+	cdef sparse_builder b
+	cdef public size_t n_dropped
+
+	def __cinit__(self, int hash_rows, int hash_cols, size_t nnz_hint = 0):
+		self.n_dropped = 0
+		cdef int status = init_sparse_builder(&self.b, hash_rows, hash_cols, nnz_hint)
+		if status != 0:
+			free_sparse_builder(&self.b)
+			raise MemoryError(_ingest_errors[status])
+
+	def __dealloc__(self):
+		free_sparse_builder(&self.b)
+
+	def add(self, np.ndarray[int64_t, ndim=1] rows, np.ndarray[int64_t, ndim=1] cols, np.ndarray[double, ndim=1] counts):
+		if rows.shape[0] == 0:
+			return
+		cdef int status = add_to_sparse_builder(&self.b, &rows[0], &cols[0], &counts[0], rows.shape[0], &self.n_dropped)
+		if status == 1:
+			raise MemoryError(_ingest_errors[status])
+		elif status != 0:
+			raise ValueError(_ingest_errors[status])
+
+	def finish(self, int build_csc):
+		cdef int status = finish_sparse_builder(&self.b, build_csc)
+		if status == 1:
+			raise MemoryError(_ingest_errors[status])
+		elif status != 0:
+			raise ValueError(_ingest_errors[status])
+
+	@property
+	def shape(self):
+		return (self.b.dims[0], self.b.dims[1])
+
+	@property
+	def nnz(self):
+		return self.b.nnz
+
+	def ids(self, int dim):
+		if self.b.maps[dim].n == 0:
+			return np.empty(0, dtype = np.int64)
+		return np.asarray(<int64_t[:self.b.maps[dim].n]> self.b.maps[dim].ids).copy()
+
+	cdef _view(self, void *ptr, size_t n, int typenum):
+		cdef np.npy_intp dims[1]
+		dims[0] = n
+		arr = np.PyArray_SimpleNewFromData(1, dims, typenum, ptr)
+		np.set_array_base(arr, self)
+		return arr
+
+	def csr(self):
+		"""(data, indices, indptr) - these are views of memory owned by this object"""
+		if not self.b.finished:
+			raise ValueError("Must call 'finish' first.")
+		return (self._view(self.b.vals, self.b.nnz, np.NPY_DOUBLE),
+				self._view(self.b.cols, self.b.nnz, np.NPY_UINTP),
+				self._view(self.b.Xr_indptr, self.b.dims[0] + 1, np.NPY_UINTP))
+
+	def csc(self):
+		if (not self.b.finished) or (self.b.Xc_indptr == NULL):
+			return None
+		return (self._view(self.b.Xc, self.b.nnz, np.NPY_DOUBLE),
+				self._view(self.b.Xc_indices, self.b.nnz, np.NPY_UINTP),
+				self._view(self.b.Xc_indptr, self.b.dims[1] + 1, np.NPY_UINTP))
+
+_seen_errors = {
+	1 : "Could not allocate memory.",
+	2 : "Item indices out of range.",
+	3 : "Seen items data is corrupted or in an unexpected format."
+}
+
+cdef _check_seen(int status):
+	if status == 1:
+		raise MemoryError(_seen_errors[status])
+	elif status != 0:
+		raise ValueError(_seen_errors.get(status, "Unexpected error."))
+
+def _seen_index_from_bytes(data):
+	return _SeenIndex.from_bytes(data)
+
+cdef class _SeenIndex:
+	"""Items seen by each user, as sorted arrays or bitmaps (see 'seen_index.c')"""
+	cdef seen_index idx
+
+	def __cinit__(self):
+		memset(&self.idx, 0, sizeof(seen_index))
+
+	def __dealloc__(self):
+		free_seen_index(&self.idx)
+
+	@staticmethod
+	def from_csr(np.ndarray[size_t, ndim=1] indptr, np.ndarray[size_t, ndim=1] indices, size_t nitems, int nthreads):
+		cdef _SeenIndex out = _SeenIndex()
+		cdef size_t *ptr_indices = NULL
+		if indices.shape[0]:
+			ptr_indices = &indices[0]
+		_check_seen(seen_index_build(&out.idx, indptr.shape[0] - 1, nitems, &indptr[0], ptr_indices, nthreads))
+		return out
+
+	@staticmethod
+	def from_bytes(data):
+		### accepts any buffer, e.g. 'bytes' or arrays from 'to_array'
+		cdef const unsigned char[::1] buf = data
+		cdef _SeenIndex out = _SeenIndex()
+		_check_seen(seen_index_deserialize(&out.idx, <char*> &buf[0] if buf.shape[0] else NULL, buf.shape[0]))
+		return out
+
+	def to_bytes(self):
+		cdef size_t size = seen_index_serialized_size(&self.idx)
+		out = bytearray(size)
+		cdef char *ptr_out = out
+		seen_index_serialize(&self.idx, ptr_out)
+		return bytes(out)
+
+	def to_array(self):
+		### same as 'to_bytes', but as an array, which pickle protocol 5 can send out-of-band
+		cdef np.ndarray[unsigned char, ndim=1] out = np.empty(seen_index_serialized_size(&self.idx), dtype = np.uint8)
+		seen_index_serialize(&self.idx, <char*> &out[0])
+		return out
+
+	def __reduce__(self):
+		return (_seen_index_from_bytes, (self.to_array(),))
+
+	@property
+	def nusers(self):
+		return self.idx.nusers
+
+	@property
+	def nitems(self):
+		return self.idx.nitems
+
+	@property
+	def nbytes(self):
+		return seen_index_memory(&self.idx)
+
+	def count(self, size_t user):
+		return self.idx.count[user] if user < self.idx.nusers else 0
+
+	def items(self, size_t user):
+		cdef size_t n = self.count(user)
+		cdef np.ndarray[uint32_t, ndim=1] out = np.empty(n, dtype = np.uint32)
+		if n:
+			seen_index_get_user(&self.idx, user, &out[0])
+		return out.astype(int)
+
+	def contains(self, size_t user, np.ndarray[size_t, ndim=1] items):
+		cdef np.ndarray[np.uint8_t, ndim=1] out = np.empty(items.shape[0], dtype = np.uint8)
+		cdef size_t i
+		for i in range(items.shape[0]):
+			out[i] = seen_index_contains(&self.idx, user, items[i])
+		return out.astype(bool)
+
+	def set_user(self, size_t user, np.ndarray[size_t, ndim=1] items):
+		cdef size_t *ptr_items = NULL
+		if items.shape[0]:
+			ptr_items = &items[0]
+		_check_seen(seen_index_set_user(&self.idx, user, ptr_items, items.shape[0]))
+
+	def changed_users(self, _SeenIndex prev, int nthreads):
+		"""Users whose items differ from the ones in 'prev'"""
+		cdef np.ndarray[size_t, ndim=1] out = np.empty(max(self.idx.nusers, prev.idx.nusers, 1), dtype = np.uintp)
+		cdef size_t nout = 0
+		_check_seen(seen_index_changed_users(&self.idx, &prev.idx, &out[0], &nout, nthreads))
+		return out[:nout]
+
+	def rows_to_bytes(self, np.ndarray[size_t, ndim=1] users):
+		"""Items of some users, as uint64 'n' and 'users[n]', followed by an index with only those users"""
+		indptr, ind = self.excl_lists(users)
+		sub = _SeenIndex.from_csr(indptr, ind, self.idx.nitems, 1)
+		return np.r_[users.shape[0], users].astype(np.uint64).tobytes() + sub.to_bytes()
+
+	def set_rows_from_bytes(self, data):
+		"""Replaces the items of the users in a blob from 'rows_to_bytes'"""
+		cdef size_t n = np.frombuffer(data, dtype = np.uint64, count = 1)[0]
+		users = np.frombuffer(data, dtype = np.uint64, count = n, offset = 8)
+		cdef _SeenIndex sub = _SeenIndex.from_bytes(data[8 * (n + 1):])
+		if (sub.nusers != n) or (sub.nitems > self.idx.nitems):
+			raise ValueError("Invalid seen items.")
+		cdef size_t i
+		for i in range(n):
+			self.set_user(users[i], sub.items(i).astype(np.uintp))
+
+	def resize_items(self, size_t nitems):
+		if nitems != self.idx.nitems:
+			_check_seen(seen_index_compact(&self.idx, nitems))
+
+	def excl_lists(self, np.ndarray[size_t, ndim=1] users):
+		"""Items of each user in row-sparse format (indptr, indices)"""
+		cdef np.ndarray[size_t, ndim=1] indptr = np.zeros(users.shape[0] + 1, dtype = np.uintp)
+		cdef size_t i
+		for i in range(users.shape[0]):
+			indptr[i + 1] = indptr[i] + self.count(users[i])
+		cdef np.ndarray[uint32_t, ndim=1] ind = np.empty(indptr[users.shape[0]], dtype = np.uint32)
+		for i in range(users.shape[0]):
+			if indptr[i + 1] > indptr[i]:
+				seen_index_get_user(&self.idx, users[i], &ind[indptr[i]])
+		return indptr, ind.astype(np.uintp)
+
+	def users_for_items(self, np.ndarray[size_t, ndim=1] items, int nthreads = 1):
+		"""Users who have seen each item in row-sparse format (indptr, indices)"""
+		cdef np.ndarray[size_t, ndim=1] indptr = np.zeros(items.shape[0] + 1, dtype = np.uintp)
+		cdef size_t *ptr_items = NULL
+		if items.shape[0]:
+			ptr_items = &items[0]
+		_check_seen(seen_index_users_for_items(&self.idx, ptr_items, items.shape[0], &indptr[0], NULL, nthreads))
+		cdef np.ndarray[size_t, ndim=1] ind = np.empty(max(indptr[items.shape[0]], 1), dtype = np.uintp)
+		_check_seen(seen_index_users_for_items(&self.idx, ptr_items, items.shape[0], &indptr[0], &ind[0], nthreads))
+		return indptr, ind[:indptr[items.shape[0]]]
+
+def _topn_items_seen(np.ndarray[size_t, ndim=2] out_ix, np.ndarray[double, ndim=2] out_val,
+					 np.ndarray[double, ndim=2] A, np.ndarray[size_t, ndim=1] users,
+					 np.ndarray[double, ndim=2] B, _SeenIndex seen, int nthreads):
+	cdef seen_index *ptr_idx = NULL
+	if seen is not None:
+		ptr_idx = &seen.idx
+	cdef int status = topn_items_seen(&out_ix[0,0], &out_val[0,0], &A[0,0], &users[0], users.shape[0],
+									  &B[0,0], B.shape[0], B.shape[1], ptr_idx, out_ix.shape[1], nthreads)
+	if status != 0:
+		raise MemoryError("Could not allocate memory.")
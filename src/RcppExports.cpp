@@ -5,9 +5,19 @@
 
 using namespace Rcpp;
 
+// r_wrapper_available_cpus
+int r_wrapper_available_cpus();
+RcppExport SEXP _poismf_r_wrapper_available_cpus() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(r_wrapper_available_cpus());
+    return rcpp_result_gen;
+END_RCPP
+}
 // r_wrapper_poismf
-void r_wrapper_poismf(Rcpp::NumericVector A, Rcpp::NumericVector B, size_t dimA, size_t dimB, size_t k, Rcpp::NumericVector Xr, Rcpp::IntegerVector Xr_ind_int, Rcpp::IntegerVector Xr_indptr_int, Rcpp::NumericVector Xc, Rcpp::IntegerVector Xc_ind_int, Rcpp::IntegerVector Xc_indptr_int, size_t nnz, double l1_reg, double l2_reg, size_t niter, size_t npass, double step_size, int use_cg, int nthreads);
-RcppExport SEXP _poismf_r_wrapper_poismf(SEXP ASEXP, SEXP BSEXP, SEXP dimASEXP, SEXP dimBSEXP, SEXP kSEXP, SEXP XrSEXP, SEXP Xr_ind_intSEXP, SEXP Xr_indptr_intSEXP, SEXP XcSEXP, SEXP Xc_ind_intSEXP, SEXP Xc_indptr_intSEXP, SEXP nnzSEXP, SEXP l1_regSEXP, SEXP l2_regSEXP, SEXP niterSEXP, SEXP npassSEXP, SEXP step_sizeSEXP, SEXP use_cgSEXP, SEXP nthreadsSEXP) {
+void r_wrapper_poismf(Rcpp::NumericVector A, Rcpp::NumericVector B, size_t dimA, size_t dimB, size_t k, Rcpp::NumericVector Xr, Rcpp::IntegerVector Xr_ind_int, Rcpp::IntegerVector Xr_indptr_int, size_t nnz, double l1_reg, double l2_reg, size_t niter, size_t npass, double step_size, int use_cg, int iter_scheme, size_t nblocks, int fixed_prec, int packed_nnz, size_t float_iters, double float_tol, int adapt_threads, int nthreads);
+RcppExport SEXP _poismf_r_wrapper_poismf(SEXP ASEXP, SEXP BSEXP, SEXP dimASEXP, SEXP dimBSEXP, SEXP kSEXP, SEXP XrSEXP, SEXP Xr_ind_intSEXP, SEXP Xr_indptr_intSEXP, SEXP nnzSEXP, SEXP l1_regSEXP, SEXP l2_regSEXP, SEXP niterSEXP, SEXP npassSEXP, SEXP step_sizeSEXP, SEXP use_cgSEXP, SEXP iter_schemeSEXP, SEXP nblocksSEXP, SEXP fixed_precSEXP, SEXP packed_nnzSEXP, SEXP float_itersSEXP, SEXP float_tolSEXP, SEXP adapt_threadsSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type A(ASEXP);
@@ -18,9 +28,6 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::NumericVector >::type Xr(XrSEXP);
     Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type Xr_ind_int(Xr_ind_intSEXP);
     Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type Xr_indptr_int(Xr_indptr_intSEXP);
-    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type Xc(XcSEXP);
-    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type Xc_ind_int(Xc_ind_intSEXP);
-    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type Xc_indptr_int(Xc_indptr_intSEXP);
     Rcpp::traits::input_parameter< size_t >::type nnz(nnzSEXP);
     Rcpp::traits::input_parameter< double >::type l1_reg(l1_regSEXP);
     Rcpp::traits::input_parameter< double >::type l2_reg(l2_regSEXP);
@@ -28,8 +35,37 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< size_t >::type npass(npassSEXP);
     Rcpp::traits::input_parameter< double >::type step_size(step_sizeSEXP);
     Rcpp::traits::input_parameter< int >::type use_cg(use_cgSEXP);
+    Rcpp::traits::input_parameter< int >::type iter_scheme(iter_schemeSEXP);
+    Rcpp::traits::input_parameter< size_t >::type nblocks(nblocksSEXP);
+    Rcpp::traits::input_parameter< int >::type fixed_prec(fixed_precSEXP);
+    Rcpp::traits::input_parameter< int >::type packed_nnz(packed_nnzSEXP);
+    Rcpp::traits::input_parameter< size_t >::type float_iters(float_itersSEXP);
+    Rcpp::traits::input_parameter< double >::type float_tol(float_tolSEXP);
+    Rcpp::traits::input_parameter< int >::type adapt_threads(adapt_threadsSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    r_wrapper_poismf(A, B, dimA, dimB, k, Xr, Xr_ind_int, Xr_indptr_int, nnz, l1_reg, l2_reg, niter, npass, step_size, use_cg, iter_scheme, nblocks, fixed_prec, packed_nnz, float_iters, float_tol, adapt_threads, nthreads);
+    return R_NilValue;
+END_RCPP
+}
+// r_wrapper_poismf_dense
+void r_wrapper_poismf_dense(Rcpp::NumericVector A, Rcpp::NumericVector B, size_t dimA, size_t dimB, size_t k, Rcpp::NumericVector X, double l1_reg, double l2_reg, size_t niter, size_t npass, double step_size, int adapt_threads, int nthreads);
+RcppExport SEXP _poismf_r_wrapper_poismf_dense(SEXP ASEXP, SEXP BSEXP, SEXP dimASEXP, SEXP dimBSEXP, SEXP kSEXP, SEXP XSEXP, SEXP l1_regSEXP, SEXP l2_regSEXP, SEXP niterSEXP, SEXP npassSEXP, SEXP step_sizeSEXP, SEXP adapt_threadsSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type A(ASEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type B(BSEXP);
+    Rcpp::traits::input_parameter< size_t >::type dimA(dimASEXP);
+    Rcpp::traits::input_parameter< size_t >::type dimB(dimBSEXP);
+    Rcpp::traits::input_parameter< size_t >::type k(kSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type X(XSEXP);
+    Rcpp::traits::input_parameter< double >::type l1_reg(l1_regSEXP);
+    Rcpp::traits::input_parameter< double >::type l2_reg(l2_regSEXP);
+    Rcpp::traits::input_parameter< size_t >::type niter(niterSEXP);
+    Rcpp::traits::input_parameter< size_t >::type npass(npassSEXP);
+    Rcpp::traits::input_parameter< double >::type step_size(step_sizeSEXP);
+    Rcpp::traits::input_parameter< int >::type adapt_threads(adapt_threadsSEXP);
     Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
-    r_wrapper_poismf(A, B, dimA, dimB, k, Xr, Xr_ind_int, Xr_indptr_int, Xc, Xc_ind_int, Xc_indptr_int, nnz, l1_reg, l2_reg, niter, npass, step_size, use_cg, nthreads);
+    r_wrapper_poismf_dense(A, B, dimA, dimB, k, X, l1_reg, l2_reg, niter, npass, step_size, adapt_threads, nthreads);
     return R_NilValue;
 END_RCPP
 }
@@ -50,6 +86,23 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// r_wrapper_top_rows
+Rcpp::List r_wrapper_top_rows(Rcpp::NumericVector A, size_t dimA, Rcpp::NumericVector Bsel, size_t nsel, size_t k, size_t n, int nthreads);
+RcppExport SEXP _poismf_r_wrapper_top_rows(SEXP ASEXP, SEXP dimASEXP, SEXP BselSEXP, SEXP nselSEXP, SEXP kSEXP, SEXP nSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type A(ASEXP);
+    Rcpp::traits::input_parameter< size_t >::type dimA(dimASEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type Bsel(BselSEXP);
+    Rcpp::traits::input_parameter< size_t >::type nsel(nselSEXP);
+    Rcpp::traits::input_parameter< size_t >::type k(kSEXP);
+    Rcpp::traits::input_parameter< size_t >::type n(nSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(r_wrapper_top_rows(A, dimA, Bsel, nsel, k, n, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
 // calc_fun_single_R
 double calc_fun_single_R(Rcpp::NumericVector x_R, Rcpp::NumericVector X_R, Rcpp::IntegerVector X_ind, int nnz_this, Rcpp::NumericVector F_R, Rcpp::NumericVector Fsum, int n, double l2_reg, Rcpp::NumericVector grad);
 RcppExport SEXP _poismf_calc_fun_single_R(SEXP x_RSEXP, SEXP X_RSEXP, SEXP X_indSEXP, SEXP nnz_thisSEXP, SEXP F_RSEXP, SEXP FsumSEXP, SEXP nSEXP, SEXP l2_regSEXP, SEXP gradSEXP) {
@@ -100,17 +153,54 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// r_wrapper_save_model
+void r_wrapper_save_model(std::string fname, Rcpp::NumericVector A, Rcpp::NumericVector B, size_t dimA, size_t dimB, size_t k, std::string params, Rcpp::Nullable<Rcpp::CharacterVector> ids_A, Rcpp::Nullable<Rcpp::CharacterVector> ids_B);
+RcppExport SEXP _poismf_r_wrapper_save_model(SEXP fnameSEXP, SEXP ASEXP, SEXP BSEXP, SEXP dimASEXP, SEXP dimBSEXP, SEXP kSEXP, SEXP paramsSEXP, SEXP ids_ASEXP, SEXP ids_BSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type fname(fnameSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type A(ASEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type B(BSEXP);
+    Rcpp::traits::input_parameter< size_t >::type dimA(dimASEXP);
+    Rcpp::traits::input_parameter< size_t >::type dimB(dimBSEXP);
+    Rcpp::traits::input_parameter< size_t >::type k(kSEXP);
+    Rcpp::traits::input_parameter< std::string >::type params(paramsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::CharacterVector> >::type ids_A(ids_ASEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::CharacterVector> >::type ids_B(ids_BSEXP);
+    r_wrapper_save_model(fname, A, B, dimA, dimB, k, params, ids_A, ids_B);
+    return R_NilValue;
+END_RCPP
+}
+// r_wrapper_load_model
+Rcpp::List r_wrapper_load_model(std::string fname, bool use_mmap);
+RcppExport SEXP _poismf_r_wrapper_load_model(SEXP fnameSEXP, SEXP use_mmapSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type fname(fnameSEXP);
+    Rcpp::traits::input_parameter< bool >::type use_mmap(use_mmapSEXP);
+    rcpp_result_gen = Rcpp::wrap(r_wrapper_load_model(fname, use_mmap));
+    return rcpp_result_gen;
+END_RCPP
+}
 
+void poismf_init_altrep(DllInfo* dll);
 static const R_CallMethodDef CallEntries[] = {
-    {"_poismf_r_wrapper_poismf", (DL_FUNC) &_poismf_r_wrapper_poismf, 19},
+    {"_poismf_r_wrapper_available_cpus", (DL_FUNC) &_poismf_r_wrapper_available_cpus, 0},
+    {"_poismf_r_wrapper_poismf", (DL_FUNC) &_poismf_r_wrapper_poismf, 23},
+    {"_poismf_r_wrapper_poismf_dense", (DL_FUNC) &_poismf_r_wrapper_poismf_dense, 13},
     {"_poismf_predict_multiple", (DL_FUNC) &_poismf_predict_multiple, 8},
+    {"_poismf_r_wrapper_top_rows", (DL_FUNC) &_poismf_r_wrapper_top_rows, 7},
     {"_poismf_calc_fun_single_R", (DL_FUNC) &_poismf_calc_fun_single_R, 9},
     {"_poismf_calc_grad_single_R", (DL_FUNC) &_poismf_calc_grad_single_R, 9},
     {"_poismf_select_topN", (DL_FUNC) &_poismf_select_topN, 3},
+    {"_poismf_r_wrapper_save_model", (DL_FUNC) &_poismf_r_wrapper_save_model, 9},
+    {"_poismf_r_wrapper_load_model", (DL_FUNC) &_poismf_r_wrapper_load_model, 2},
     {NULL, NULL, 0}
 };
 
 RcppExport void R_init_poismf(DllInfo *dll) {
     R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
+    poismf_init_altrep(dll);
 }
@@ -0,0 +1,452 @@
+ /*
+	Poisson Factorization for sparse matrices
+
+	Incremental construction of the sparse data matrices from chunks of triplets.
+
+	When the data doesn't fit in memory all at once in its original form (e.g. it comes as a stream
+	of data frames), the triplets (row, column, count) from each chunk are appended here to compact
+	arrays, mapping the IDs to consecutive indices along the way (in order of first appearance, which
+	matches 'pd.factorize' over the concatenated data) and counting the entries per row. Once all the
+	chunks are in, the triplets are rearranged in-place by row, and the CSR and CSC matrices are built
+	from them with counting sorts, which sum duplicated entries and leave the indices sorted. Memory
+	used at the peak is close to that of the final CSR and CSC matrices.
+
+	Functions return 0 on success or one of the 'ingest_status' codes on failure. After a failure,
+	the builder can only be freed.
+
+	BSD 2-Clause License
+
+	Copyright (c) 2019, David Cortes
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice, this
+	  list of conditions and the following disclaimer.
+
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+	FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+	DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+	SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+	CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+	OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+/* Aliasing for compiler optimizations */
+#ifdef __cplusplus
+	#if defined(__GNUG__) || defined(__GNUC__) || defined(_MSC_VER) || defined(__clang__) || defined(__INTEL_COMPILER)
+		#define restrict __restrict
+	#else
+		#define restrict 
+	#endif
+#elif defined(_MSC_VER)
+	#define restrict __restrict
+#elif !defined(__STDC_VERSION__) || (__STDC_VERSION__ < 199901L)
+	#define restrict 
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum ingest_status {
+	ingest_ok = 0,
+	ingest_out_of_memory = 1,
+	ingest_bad_index = 2,
+	ingest_finished = 3
+} ingest_status;
+
+/*	Open-addressing hash table from IDs to consecutive indices */
+typedef struct id_map {
+	int64_t *keys;
+	size_t *codes;   /* SIZE_MAX marks an empty slot */
+	size_t cap;      /* power of 2 */
+	int64_t *ids;    /* ID of each index, in order of first appearance */
+	size_t n;
+	size_t ids_cap;
+} id_map;
+
+typedef struct sparse_builder {
+	int hash_ids[2];   /* whether to map the row/column IDs, or take them as indices */
+	id_map maps[2];
+	size_t dims[2];
+	size_t nnz;
+	size_t cap;
+	size_t *rows;
+	size_t *cols;      /* becomes the CSR indices */
+	double *vals;      /* becomes the CSR values */
+	size_t *row_counts;
+	size_t row_counts_cap;
+	int finished;
+	size_t *Xr_indptr;
+	size_t *Xc_indptr;
+	size_t *Xc_indices;
+	double *Xc;
+} sparse_builder;
+
+#define MIN_BUILDER_CAP 1024
+
+static inline uint64_t hash_id(int64_t key)
+{
+	/* finalizer from splitmix64 */
+	uint64_t x = (uint64_t) key;
+	x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return x ^ (x >> 31);
+}
+
+static int rehash_id_map(id_map *map, size_t new_cap)
+{
+	int64_t *keys = (int64_t*) malloc(sizeof(int64_t) * new_cap);
+	size_t *codes = (size_t*) malloc(sizeof(size_t) * new_cap);
+	if (keys == NULL || codes == NULL) {
+		free(keys); free(codes);
+		return ingest_out_of_memory;
+	}
+	for (size_t ix = 0; ix < new_cap; ix++) { codes[ix] = SIZE_MAX; }
+
+	size_t slot;
+	for (size_t code = 0; code < map->n; code++)
+	{
+		slot = hash_id(map->ids[code]) & (new_cap - 1);
+		while (codes[slot] != SIZE_MAX) { slot = (slot + 1) & (new_cap - 1); }
+		keys[slot] = map->ids[code];
+		codes[slot] = code;
+	}
+
+	free(map->keys);
+	free(map->codes);
+	map->keys = keys;
+	map->codes = codes;
+	map->cap = new_cap;
+	return ingest_ok;
+}
+
+/*	Index for an ID, assigning the next one if it wasn't seen before */
+static int map_id(id_map *map, int64_t key, size_t *code)
+{
+	if (2 * (map->n + 1) > map->cap)
+	{
+		if (rehash_id_map(map, map->cap? (2 * map->cap) : MIN_BUILDER_CAP)) { return ingest_out_of_memory; }
+	}
+
+	size_t slot = hash_id(key) & (map->cap - 1);
+	while (map->codes[slot] != SIZE_MAX)
+	{
+		if (map->keys[slot] == key) {
+			*code = map->codes[slot];
+			return ingest_ok;
+		}
+		slot = (slot + 1) & (map->cap - 1);
+	}
+
+	if (map->n == map->ids_cap)
+	{
+		size_t new_cap = map->ids_cap? (map->ids_cap + map->ids_cap / 2) : MIN_BUILDER_CAP;
+		int64_t *ids = (int64_t*) realloc(map->ids, sizeof(int64_t) * new_cap);
+		if (ids == NULL) { return ingest_out_of_memory; }
+		map->ids = ids;
+		map->ids_cap = new_cap;
+	}
+	map->keys[slot] = key;
+	map->codes[slot] = map->n;
+	map->ids[map->n] = key;
+	*code = map->n++;
+	return ingest_ok;
+}
+
+/*	Grows the arrays of triplets by a factor of 1.5 (rather than 2), since they are the largest
+	objects here and a reallocation might need both the old and new arrays at the same time */
+static int grow_triplets(sparse_builder *b, size_t needed)
+{
+	size_t new_cap = b->cap + b->cap / 2;
+	if (new_cap < needed) { new_cap = needed; }
+	if (new_cap < MIN_BUILDER_CAP) { new_cap = MIN_BUILDER_CAP; }
+
+	size_t *rows = (size_t*) realloc(b->rows, sizeof(size_t) * new_cap);
+	if (rows == NULL) { return ingest_out_of_memory; }
+	b->rows = rows;
+	size_t *cols = (size_t*) realloc(b->cols, sizeof(size_t) * new_cap);
+	if (cols == NULL) { return ingest_out_of_memory; }
+	b->cols = cols;
+	double *vals = (double*) realloc(b->vals, sizeof(double) * new_cap);
+	if (vals == NULL) { return ingest_out_of_memory; }
+	b->vals = vals;
+	b->cap = new_cap;
+	return ingest_ok;
+}
+
+static int grow_row_counts(sparse_builder *b, size_t row)
+{
+	size_t new_cap = b->row_counts_cap + b->row_counts_cap / 2;
+	if (new_cap <= row) { new_cap = row + 1; }
+	if (new_cap < MIN_BUILDER_CAP) { new_cap = MIN_BUILDER_CAP; }
+	size_t *row_counts = (size_t*) realloc(b->row_counts, sizeof(size_t) * new_cap);
+	if (row_counts == NULL) { return ingest_out_of_memory; }
+	memset(row_counts + b->row_counts_cap, 0, sizeof(size_t) * (new_cap - b->row_counts_cap));
+	b->row_counts = row_counts;
+	b->row_counts_cap = new_cap;
+	return ingest_ok;
+}
+
+/*	Initializes an empty builder
+	hash_rows, hash_cols : Whether to map the IDs passed for rows and columns to consecutive indices. If not,
+	                       the IDs are taken as the indices, and the dimension is given by the largest one.
+	nnz_hint             : Expected number of triplets, if known (pass 0 otherwise). Avoids reallocations. */
+int init_sparse_builder(sparse_builder *b, int hash_rows, int hash_cols, size_t nnz_hint)
+{
+	memset(b, 0, sizeof(sparse_builder));
+	b->hash_ids[0] = hash_rows;
+	b->hash_ids[1] = hash_cols;
+	if (nnz_hint) { return grow_triplets(b, nnz_hint); }
+	return ingest_ok;
+}
+
+/*	Appends a chunk of triplets. Entries with counts that are not positive are skipped,
+	and their number added to 'n_dropped'. */
+int add_to_sparse_builder(sparse_builder *b, int64_t *restrict row_ids, int64_t *restrict col_ids,
+	double *restrict counts, size_t n, size_t *n_dropped)
+{
+	if (b->finished) { return ingest_finished; }
+
+	/* negative indices are checked first, so that the chunk is either added entirely or not at all */
+	for (int dim = 0; dim < 2; dim++)
+	{
+		if (b->hash_ids[dim]) { continue; }
+		int64_t *ids = dim? col_ids : row_ids;
+		for (size_t ix = 0; ix < n; ix++)
+		{
+			if (ids[ix] < 0 && counts[ix] > 0) { return ingest_bad_index; }
+		}
+	}
+
+	if (b->nnz + n > b->cap)
+	{
+		if (grow_triplets(b, b->nnz + n)) { return ingest_out_of_memory; }
+	}
+
+	size_t row, col;
+	for (size_t ix = 0; ix < n; ix++)
+	{
+		/* written this way so that NaNs are dropped too */
+		if (!(counts[ix] > 0)) {
+			(*n_dropped)++;
+			continue;
+		}
+
+		if (b->hash_ids[0]) {
+			if (map_id(&b->maps[0], row_ids[ix], &row)) { return ingest_out_of_memory; }
+		}
+		else {
+			row = (size_t) row_ids[ix];
+		}
+		if (b->hash_ids[1]) {
+			if (map_id(&b->maps[1], col_ids[ix], &col)) { return ingest_out_of_memory; }
+		}
+		else {
+			col = (size_t) col_ids[ix];
+		}
+
+		if (row >= b->row_counts_cap)
+		{
+			if (grow_row_counts(b, row)) { return ingest_out_of_memory; }
+		}
+		b->row_counts[row]++;
+		if (row >= b->dims[0]) { b->dims[0] = row + 1; }
+		if (col >= b->dims[1]) { b->dims[1] = col + 1; }
+
+		b->rows[b->nnz] = row;
+		b->cols[b->nnz] = col;
+		b->vals[b->nnz] = counts[ix];
+		b->nnz++;
+	}
+	return ingest_ok;
+}
+
+/*	Builds the CSR matrix (and the CSC one if 'build_csc' is true) from the triplets added so far.
+	After this, 'Xr_indptr', 'cols', 'vals' hold the CSR matrix, with 'nnz' entries and 'dims'
+	rows and columns, and 'Xc_indptr', 'Xc_indices', 'Xc' the CSC matrix. No more triplets can be added. */
+int finish_sparse_builder(sparse_builder *b, int build_csc)
+{
+	if (b->finished) { return ingest_finished; }
+	size_t nrows = b->dims[0];
+	size_t ncols = b->dims[1];
+	size_t nnz = b->nnz;
+	size_t *restrict next = NULL;
+	size_t *restrict pos = NULL;
+
+	/* the hash tables are not needed anymore, only the IDs */
+	for (int dim = 0; dim < 2; dim++)
+	{
+		free(b->maps[dim].keys); b->maps[dim].keys = NULL;
+		free(b->maps[dim].codes); b->maps[dim].codes = NULL;
+	}
+
+	b->Xr_indptr = (size_t*) calloc(nrows + 1, sizeof(size_t));
+	b->Xc_indptr = (size_t*) calloc(ncols + 1, sizeof(size_t));
+	next = (size_t*) malloc(sizeof(size_t) * (nrows? nrows : 1));
+	if (b->Xr_indptr == NULL || b->Xc_indptr == NULL || next == NULL) { goto throw_oom; }
+
+	size_t *restrict Xr_indptr = b->Xr_indptr;
+	size_t *restrict Xc_indptr = b->Xc_indptr;
+	size_t *restrict rows = b->rows;
+	size_t *restrict cols = b->cols;
+	double *restrict vals = b->vals;
+
+	/* rearrange the triplets in-place so that rows are contiguous - each swap puts one entry in its final place */
+	for (size_t row = 0; row < nrows; row++)
+	{
+		Xr_indptr[row + 1] = Xr_indptr[row] + b->row_counts[row];
+	}
+	free(b->row_counts); b->row_counts = NULL;
+	memcpy(next, Xr_indptr, sizeof(size_t) * nrows);
+
+	size_t dest, tmp_ix;
+	double tmp_val;
+	for (size_t row = 0; row < nrows; row++)
+	{
+		while (next[row] < Xr_indptr[row + 1])
+		{
+			size_t ix = next[row];
+			if (rows[ix] == row) {
+				next[row]++;
+				continue;
+			}
+			dest = next[rows[ix]]++;
+			tmp_ix = rows[dest]; rows[dest] = rows[ix]; rows[ix] = tmp_ix;
+			tmp_ix = cols[dest]; cols[dest] = cols[ix]; cols[ix] = tmp_ix;
+			tmp_val = vals[dest]; vals[dest] = vals[ix]; vals[ix] = tmp_val;
+		}
+	}
+	free(next); next = NULL;
+	free(b->rows); b->rows = NULL;
+	/* the spare capacity is released before allocating the CSC matrix */
+	if (nnz && nnz < b->cap)
+	{
+		size_t *new_cols = (size_t*) realloc(b->cols, sizeof(size_t) * nnz);
+		if (new_cols != NULL) { b->cols = new_cols; }
+		double *new_vals = (double*) realloc(b->vals, sizeof(double) * nnz);
+		if (new_vals != NULL) { b->vals = new_vals; }
+		cols = b->cols;
+		vals = b->vals;
+	}
+
+	/* CSC through a counting sort - rows are visited in order, so they end up sorted within each column */
+	b->Xc_indices = (size_t*) malloc(sizeof(size_t) * (nnz? nnz : 1));
+	b->Xc = (double*) malloc(sizeof(double) * (nnz? nnz : 1));
+	pos = (size_t*) malloc(sizeof(size_t) * (ncols? ncols : 1));
+	if (b->Xc_indices == NULL || b->Xc == NULL || pos == NULL) { goto throw_oom; }
+	size_t *restrict Xc_indices = b->Xc_indices;
+	double *restrict Xc = b->Xc;
+
+	for (size_t ix = 0; ix < nnz; ix++) { Xc_indptr[cols[ix] + 1]++; }
+	for (size_t col = 0; col < ncols; col++) { Xc_indptr[col + 1] += Xc_indptr[col]; }
+	memcpy(pos, Xc_indptr, sizeof(size_t) * ncols);
+	for (size_t row = 0; row < nrows; row++)
+	{
+		for (size_t ix = Xr_indptr[row]; ix < Xr_indptr[row + 1]; ix++)
+		{
+			dest = pos[cols[ix]]++;
+			Xc_indices[dest] = row;
+			Xc[dest] = vals[ix];
+		}
+	}
+
+	/* repeated entries are now next to each other - these get summed up */
+	size_t n_out = 0;
+	size_t st = 0;
+	size_t end;
+	for (size_t col = 0; col < ncols; col++)
+	{
+		end = Xc_indptr[col + 1];
+		Xc_indptr[col] = n_out;
+		for (size_t ix = st; ix < end; ix++)
+		{
+			if (n_out > Xc_indptr[col] && Xc_indices[n_out - 1] == Xc_indices[ix]) {
+				Xc[n_out - 1] += Xc[ix];
+			}
+			else {
+				Xc_indices[n_out] = Xc_indices[ix];
+				Xc[n_out] = Xc[ix];
+				n_out++;
+			}
+		}
+		st = end;
+	}
+	Xc_indptr[ncols] = n_out;
+	nnz = n_out;
+	b->nnz = nnz;
+
+	/* CSR from the CSC matrix in the same way, which leaves the columns sorted within each row */
+	memset(Xr_indptr, 0, sizeof(size_t) * (nrows + 1));
+	for (size_t ix = 0; ix < nnz; ix++) { Xr_indptr[Xc_indices[ix] + 1]++; }
+	for (size_t row = 0; row < nrows; row++) { Xr_indptr[row + 1] += Xr_indptr[row]; }
+	free(pos);
+	pos = (size_t*) malloc(sizeof(size_t) * (nrows? nrows : 1));
+	if (pos == NULL) { goto throw_oom; }
+	memcpy(pos, Xr_indptr, sizeof(size_t) * nrows);
+	for (size_t col = 0; col < ncols; col++)
+	{
+		for (size_t ix = Xc_indptr[col]; ix < Xc_indptr[col + 1]; ix++)
+		{
+			dest = pos[Xc_indices[ix]]++;
+			cols[dest] = col;
+			vals[dest] = Xc[ix];
+		}
+	}
+	free(pos); pos = NULL;
+
+	if (!build_csc)
+	{
+		free(b->Xc_indptr); b->Xc_indptr = NULL;
+		free(b->Xc_indices); b->Xc_indices = NULL;
+		free(b->Xc); b->Xc = NULL;
+	}
+	b->finished = 1;
+	return ingest_ok;
+
+	throw_oom:
+	{
+		free(next);
+		free(pos);
+		return ingest_out_of_memory;
+	}
+}
+
+void free_sparse_builder(sparse_builder *b)
+{
+	for (int dim = 0; dim < 2; dim++)
+	{
+		free(b->maps[dim].keys);
+		free(b->maps[dim].codes);
+		free(b->maps[dim].ids);
+	}
+	free(b->rows);
+	free(b->cols);
+	free(b->vals);
+	free(b->row_counts);
+	free(b->Xr_indptr);
+	free(b->Xc_indptr);
+	free(b->Xc_indices);
+	free(b->Xc);
+	memset(b, 0, sizeof(sparse_builder));
+}
+
+#ifdef __cplusplus
+}
+#endif
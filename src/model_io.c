@@ -0,0 +1,371 @@
+ /*
+	Poisson Factorization for sparse matrices
+
+	Binary model files and model deltas.
+
+	A model file contains the fitted A and B matrices (row-major, as they are used by the rest of
+	the code) after a fixed-size header, so that they can be memory-mapped directly:
+		header : char[8] magic, then uint64: k, dimA, dimB, ids_size, seen_size, and 2 reserved fields (64 bytes)
+		A      : dimA*k doubles
+		B      : dimB*k doubles
+		ids    : 'ids_size' bytes with the user/item IDs, in a format defined by the caller
+		seen   : 'seen_size' bytes with the items seen by each user (see 'seen_index.c'), or nothing
+
+	A delta file contains the rows of A and B which differ (by more than a tolerance) between
+	two versions of a model, plus all the rows added in the newer version:
+		header : char[8] magic, then uint64: k, dimA_old, dimB_old, dimA_new, dimB_new, nA, nB, ids_size,
+		         seen_size, then double: tolerance (88 bytes)
+		rows A : nA uint64 row indices, sorted, followed by nA*k doubles with the new values of those rows
+		rows B : nB uint64 row indices, sorted, followed by nB*k doubles
+		ids    : 'ids_size' bytes with the IDs of the new users/items, in a format defined by the caller
+		seen   : 'seen_size' bytes with the items seen by the added or updated users, in a format defined
+		         by the caller, or nothing
+	Deltas written before the seen items were stored have a different magic, no 'seen_size' in the header
+	(80 bytes), and are read as having 'seen_size' zero.
+
+	Numbers are stored in the byte order of the machine that wrote them. Functions return 0 on success or
+	one of the 'model_io_status' codes on failure.
+
+	BSD 2-Clause License
+
+	Copyright (c) 2019, David Cortes
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice, this
+	  list of conditions and the following disclaimer.
+
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+	FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+	DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+	SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+	CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+	OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/* Aliasing for compiler optimizations */
+#ifdef __cplusplus
+	#if defined(__GNUG__) || defined(__GNUC__) || defined(_MSC_VER) || defined(__clang__) || defined(__INTEL_COMPILER)
+		#define restrict __restrict
+	#else
+		#define restrict 
+	#endif
+#elif defined(_MSC_VER)
+	#define restrict __restrict
+#elif !defined(__STDC_VERSION__) || (__STDC_VERSION__ < 199901L)
+	#define restrict 
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+
+#ifndef size_t_for
+	#ifdef _OPENMP
+		#if (_OPENMP > 200801) && !defined(_WIN32) && !defined(_WIN64) /* OpenMP > 3.0 */
+			#define size_t_for size_t
+		#else
+			#define size_t_for
+		#endif
+	#else
+		#define size_t_for size_t
+	#endif
+#endif
+
+#define MODEL_FILE_MAGIC "PoisMF\x01\x00"
+#define DELTA_FILE_MAGIC "PoisMF\x02\x44"
+#define DELTA_FILE_MAGIC_V1 "PoisMF\x01\x44"
+#define MODEL_HEADER_SIZE 64
+
+typedef enum model_io_status {
+	io_ok = 0,
+	io_cannot_open = 1,
+	io_read_error = 2,
+	io_write_error = 3,
+	io_bad_format = 4,
+	io_dim_mismatch = 5,
+	io_out_of_memory = 6
+} model_io_status;
+
+typedef struct model_delta_header {
+	uint64_t k;
+	uint64_t dimA_old;
+	uint64_t dimB_old;
+	uint64_t dimA_new;
+	uint64_t dimB_new;
+	uint64_t nA;
+	uint64_t nB;
+	uint64_t ids_size;
+	uint64_t seen_size;
+	double tol;
+} model_delta_header;
+
+/*	Saves the model matrices and optional blobs with IDs and seen items. After writing it, the matrices can be
+	memory-mapped at offsets MODEL_HEADER_SIZE (A) and MODEL_HEADER_SIZE + dimA*k*sizeof(double) (B). */
+int save_model_file(const char *fname, double *A, double *B, size_t dimA, size_t dimB, size_t k,
+	const char *ids, size_t ids_size, const char *seen, size_t seen_size)
+{
+	uint64_t header[7] = {k, dimA, dimB, ids_size, seen_size, 0, 0};
+	FILE *f = fopen(fname, "wb");
+	if (f == NULL) { return io_cannot_open; }
+	int status = io_ok;
+
+	if (
+		fwrite(MODEL_FILE_MAGIC, 1, 8, f) != 8 ||
+		fwrite(header, sizeof(uint64_t), 7, f) != 7 ||
+		fwrite(A, sizeof(double), dimA * k, f) != dimA * k ||
+		fwrite(B, sizeof(double), dimB * k, f) != dimB * k ||
+		(ids_size && fwrite(ids, 1, ids_size, f) != ids_size) ||
+		(seen_size && fwrite(seen, 1, seen_size, f) != seen_size)
+	) { status = io_write_error; }
+
+	if (fclose(f) != 0) { status = io_write_error; }
+	return status;
+}
+
+/*	Reads the dimensions from a model file. The matrices, IDs and seen items can then be read or mapped
+	at offsets 'offset_A', 'offset_B', 'offset_ids', 'offset_seen'. Files written before the seen items
+	were stored have 'seen_size' zero. */
+int read_model_header(const char *fname, size_t *dimA, size_t *dimB, size_t *k, size_t *ids_size,
+	size_t *offset_A, size_t *offset_B, size_t *offset_ids, size_t *seen_size, size_t *offset_seen)
+{
+	char magic[8];
+	uint64_t header[7];
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) { return io_cannot_open; }
+	int status = io_ok;
+
+	if (fread(magic, 1, 8, f) != 8 || fread(header, sizeof(uint64_t), 7, f) != 7) {
+		status = io_read_error;
+	} else if (memcmp(magic, MODEL_FILE_MAGIC, 8) != 0) {
+		status = io_bad_format;
+	} else {
+		*k = header[0];
+		*dimA = header[1];
+		*dimB = header[2];
+		*ids_size = header[3];
+		*offset_A = MODEL_HEADER_SIZE;
+		*offset_B = *offset_A + header[1] * header[0] * sizeof(double);
+		*offset_ids = *offset_B + header[2] * header[0] * sizeof(double);
+		*seen_size = header[4];
+		*offset_seen = *offset_ids + header[3];
+	}
+
+	fclose(f);
+	return status;
+}
+
+/*	Marks the rows which changed by more than 'tol' in any entry (or are new), and returns how many */
+size_t find_changed_rows(bool *restrict changed, double *restrict F_old, double *restrict F_new,
+	size_t dim_old, size_t dim_new, size_t k, double tol, int ncores)
+{
+	size_t nchanged = 0;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long row;
+	#endif
+
+	#pragma omp parallel for schedule(static) num_threads(ncores) reduction(+:nchanged) firstprivate(changed, F_old, F_new, dim_old, dim_new, k, tol)
+	for (size_t_for row = 0; row < dim_new; row++)
+	{
+		changed[row] = (size_t)row >= dim_old;
+		for (size_t kk = 0; kk < k && !changed[row]; kk++) {
+			changed[row] = fabs(F_new[row*k + kk] - F_old[row*k + kk]) > tol || isnan(F_new[row*k + kk]);
+		}
+		nchanged += changed[row];
+	}
+	return nchanged;
+}
+
+int write_delta_rows(FILE *f, bool *restrict changed, double *restrict F_new, size_t dim_new, size_t k)
+{
+	uint64_t row64;
+	for (size_t row = 0; row < dim_new; row++)
+	{
+		if (!changed[row]) { continue; }
+		row64 = row;
+		if (fwrite(&row64, sizeof(uint64_t), 1, f) != 1) { return io_write_error; }
+	}
+	for (size_t row = 0; row < dim_new; row++)
+	{
+		if (!changed[row]) { continue; }
+		if (fwrite(F_new + row*k, sizeof(double), k, f) != k) { return io_write_error; }
+	}
+	return io_ok;
+}
+
+/*	Writes the rows of A_new and B_new which differ from A_old and B_old by more than 'tol' (absolute
+	difference in any entry), plus the rows beyond the old dimensions, and optional blobs with the IDs
+	of the new rows and the seen items of the changed users. The newer model cannot have fewer rows than
+	the older one. The number of rows of each matrix written to the delta is returned in 'nA_changed'
+	and 'nB_changed'. */
+int export_model_delta(const char *fname,
+	double *A_old, double *B_old, size_t dimA_old, size_t dimB_old,
+	double *A_new, double *B_new, size_t dimA_new, size_t dimB_new,
+	size_t k, double tol, const char *ids, size_t ids_size, const char *seen, size_t seen_size,
+	size_t *nA_changed, size_t *nB_changed, int ncores)
+{
+	if (dimA_new < dimA_old || dimB_new < dimB_old) { return io_dim_mismatch; }
+
+	bool *changedA = (bool*) malloc(sizeof(bool) * (dimA_new? dimA_new : 1));
+	bool *changedB = (bool*) malloc(sizeof(bool) * (dimB_new? dimB_new : 1));
+	FILE *f = NULL;
+	int status = io_ok;
+	if (changedA == NULL || changedB == NULL) { status = io_out_of_memory; goto cleanup; }
+
+	model_delta_header header;
+	uint64_t header_arr[9];
+	header.k = k;
+	header.dimA_old = dimA_old;
+	header.dimB_old = dimB_old;
+	header.dimA_new = dimA_new;
+	header.dimB_new = dimB_new;
+	header.nA = find_changed_rows(changedA, A_old, A_new, dimA_old, dimA_new, k, tol, ncores);
+	header.nB = find_changed_rows(changedB, B_old, B_new, dimB_old, dimB_new, k, tol, ncores);
+	header.ids_size = ids_size;
+	header.seen_size = seen_size;
+	header.tol = tol;
+	*nA_changed = header.nA;
+	*nB_changed = header.nB;
+	header_arr[0] = header.k; header_arr[1] = header.dimA_old; header_arr[2] = header.dimB_old;
+	header_arr[3] = header.dimA_new; header_arr[4] = header.dimB_new;
+	header_arr[5] = header.nA; header_arr[6] = header.nB; header_arr[7] = header.ids_size;
+	header_arr[8] = header.seen_size;
+
+	f = fopen(fname, "wb");
+	if (f == NULL) { status = io_cannot_open; goto cleanup; }
+	if (
+		fwrite(DELTA_FILE_MAGIC, 1, 8, f) != 8 ||
+		fwrite(header_arr, sizeof(uint64_t), 9, f) != 9 ||
+		fwrite(&header.tol, sizeof(double), 1, f) != 1
+	) { status = io_write_error; goto cleanup; }
+
+	status = write_delta_rows(f, changedA, A_new, dimA_new, k);
+	if (status != io_ok) { goto cleanup; }
+	status = write_delta_rows(f, changedB, B_new, dimB_new, k);
+	if (status != io_ok) { goto cleanup; }
+	if (
+		(ids_size && fwrite(ids, 1, ids_size, f) != ids_size) ||
+		(seen_size && fwrite(seen, 1, seen_size, f) != seen_size)
+	) { status = io_write_error; }
+
+	cleanup:
+		free(changedA);
+		free(changedB);
+		if (f != NULL && fclose(f) != 0 && status == io_ok) { status = io_write_error; }
+		return status;
+}
+
+int read_delta_header_file(FILE *f, model_delta_header *header)
+{
+	char magic[8];
+	uint64_t header_arr[9];
+	if (fread(magic, 1, 8, f) != 8) { return io_read_error; }
+	bool is_v1 = memcmp(magic, DELTA_FILE_MAGIC_V1, 8) == 0;
+	if (!is_v1 && memcmp(magic, DELTA_FILE_MAGIC, 8) != 0) { return io_bad_format; }
+	size_t nfields = is_v1? 8 : 9;
+	header_arr[8] = 0;
+	if (
+		fread(header_arr, sizeof(uint64_t), nfields, f) != nfields ||
+		fread(&header->tol, sizeof(double), 1, f) != 1
+	) { return io_read_error; }
+	header->k = header_arr[0]; header->dimA_old = header_arr[1]; header->dimB_old = header_arr[2];
+	header->dimA_new = header_arr[3]; header->dimB_new = header_arr[4];
+	header->nA = header_arr[5]; header->nB = header_arr[6]; header->ids_size = header_arr[7];
+	header->seen_size = header_arr[8];
+	return io_ok;
+}
+
+/* Reads the dimensions of a delta, which are needed in order to know how large the matrices need to be */
+int read_delta_header(const char *fname, model_delta_header *header)
+{
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) { return io_cannot_open; }
+	int status = read_delta_header_file(f, header);
+	fclose(f);
+	return status;
+}
+
+int read_delta_rows(FILE *f, double *restrict F, size_t dim, size_t k, size_t nrows)
+{
+	if (nrows == 0) { return io_ok; }
+	uint64_t *rows = (uint64_t*) malloc(sizeof(uint64_t) * nrows);
+	if (rows == NULL) { return io_out_of_memory; }
+	int status = io_ok;
+
+	if (fread(rows, sizeof(uint64_t), nrows, f) != nrows) { status = io_read_error; goto cleanup; }
+	for (size_t i = 0; i < nrows; i++) {
+		if (rows[i] >= dim) { status = io_dim_mismatch; goto cleanup; }
+	}
+	/* rows are read straight into their place, which also works if F is memory-mapped */
+	for (size_t i = 0; i < nrows; i++)
+	{
+		if (fread(F + rows[i] * k, sizeof(double), k, f) != k) { status = io_read_error; goto cleanup; }
+	}
+
+	cleanup:
+		free(rows);
+		return status;
+}
+
+/*	Applies a delta in-place to matrices A and B, which must have at least 'dimA_new' and 'dimB_new' rows
+	as given in the delta header (rows beyond the current ones must be allocated by the caller beforehand).
+	'dimA' and 'dimB' are the numbers of rows allocated. Rows are written in-place, so for updating a model file
+	which others may be reading, the delta should be applied to a copy of it which then gets renamed over it. */
+int apply_model_delta(const char *fname, double *A, double *B, size_t dimA, size_t dimB, size_t k)
+{
+	model_delta_header header;
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) { return io_cannot_open; }
+	int status = read_delta_header_file(f, &header);
+	if (status != io_ok) { goto cleanup; }
+	if (header.k != k || header.dimA_new > dimA || header.dimB_new > dimB) { status = io_dim_mismatch; goto cleanup; }
+
+	status = read_delta_rows(f, A, dimA, k, header.nA);
+	if (status != io_ok) { goto cleanup; }
+	status = read_delta_rows(f, B, dimB, k, header.nB);
+
+	cleanup:
+		fclose(f);
+		return status;
+}
+
+/*	Reads the blobs from the end of a delta into 'ids' and 'seen', which must have 'ids_size' and 'seen_size'
+	bytes as given in the header (either can be NULL to skip it) */
+int read_delta_blobs(const char *fname, char *ids, char *seen)
+{
+	model_delta_header header;
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) { return io_cannot_open; }
+	int status = read_delta_header_file(f, &header);
+	if (status == io_ok && (header.ids_size + header.seen_size) > 0)
+	{
+		long offset = - (long) (header.ids_size + header.seen_size);
+		if (
+			fseek(f, offset, SEEK_END) != 0 ||
+			(ids != NULL && header.ids_size && fread(ids, 1, header.ids_size, f) != header.ids_size) ||
+			(ids == NULL && fseek(f, (long) header.ids_size, SEEK_CUR) != 0) ||
+			(seen != NULL && header.seen_size && fread(seen, 1, header.seen_size, f) != header.seen_size)
+		) { status = io_read_error; }
+	}
+	fclose(f);
+	return status;
+}
@@ -0,0 +1,435 @@
+ /*
+	Poisson Factorization for sparse matrices
+
+	NUMA-aware serving from binary model files.
+
+	On machines with more than one NUMA node (e.g. multi-socket servers), threads which read the model
+	matrices from memory attached to a different node pay extra latency and share the interconnect
+	bandwidth. The functions here load one copy of B (and optionally A) per node from a model file
+	(see 'model_io.c'). Each copy is read by a thread pinned to the CPUs of its node, so that the
+	operating system places its pages in that node's memory on first touch. Scoring threads are then
+	pinned to a node and only read the local copy.
+
+	Nodes are detected from '/sys/devices/system/node' and threads are pinned through 'sched_setaffinity',
+	without depending on libnuma. On other systems, or if the nodes can't be determined, there will
+	be a single copy and threads are not pinned, so the same code paths can be used anywhere.
+
+	These functions use the serving helpers from 'pgd.c' (compiled with '_FOR_PYTHON').
+
+	BSD 2-Clause License
+
+	Copyright (c) 2019, David Cortes
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice, this
+	  list of conditions and the following disclaimer.
+
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+	FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+	DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+	SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+	CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+	OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+#ifdef __linux__
+	#ifndef _GNU_SOURCE
+		#define _GNU_SOURCE
+	#endif
+	#include <sched.h>
+	/* 'CPU_SET' is only available if nothing was included before without '_GNU_SOURCE' */
+	#ifdef CPU_SET
+		#define HAS_THREAD_AFFINITY
+	#endif
+#endif
+
+/* Aliasing for compiler optimizations */
+#ifdef __cplusplus
+	#if defined(__GNUG__) || defined(__GNUC__) || defined(_MSC_VER) || defined(__clang__) || defined(__INTEL_COMPILER)
+		#define restrict __restrict
+	#else
+		#define restrict
+	#endif
+#elif defined(_MSC_VER)
+	#define restrict __restrict
+#elif !defined(__STDC_VERSION__) || (__STDC_VERSION__ < 199901L)
+	#define restrict
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+
+#ifdef _FOR_PYTHON
+
+#include "findblas.h"  /* https://www.github.com/david-cortes/findblas */
+
+#ifndef size_t_for
+	#ifdef _OPENMP
+		#if (_OPENMP > 200801) && !defined(_WIN32) && !defined(_WIN64) /* OpenMP > 3.0 */
+			#define size_t_for size_t
+		#else
+			#define size_t_for
+		#endif
+	#else
+		#define size_t_for size_t
+	#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* From 'model_io.c' and 'pgd.c' */
+int read_model_header(const char *fname, size_t *dimA, size_t *dimB, size_t *k, size_t *ids_size,
+	size_t *offset_A, size_t *offset_B, size_t *offset_ids, size_t *seen_size, size_t *offset_seen);
+void recommend_session(
+	size_t *restrict out_items, double *restrict out_scores, double *restrict a,
+	double *restrict X, size_t *restrict X_ind, size_t nnz_this,
+	double *restrict B, double *restrict Bsum, size_t dimB, size_t k, double l2_reg,
+	int solver, size_t max_iter, size_t max_feval, double max_seconds,
+	double *restrict B_blocked, size_t block_size, size_t n, int exclude_given,
+	double *restrict scores, double *restrict cg_buffer, char *restrict excl_mask);
+void select_topn(size_t *restrict out_ix, double *restrict out_val, double *restrict scores, size_t dim, size_t n);
+double get_time_seconds();
+
+#define MAX_NUMA_NODES 64
+#define MAX_NUMA_CPUS 4096
+
+typedef struct model_replicas {
+	size_t dimA;
+	size_t dimB;
+	size_t k;
+	int nnodes;
+	int pinned;                           /* whether threads get pinned to the nodes */
+	int ncpus[MAX_NUMA_NODES];            /* number of CPUs in each node */
+	int *cpus[MAX_NUMA_NODES];            /* CPU numbers in each node */
+	double *A[MAX_NUMA_NODES];            /* NULL when users are not replicated */
+	double *B[MAX_NUMA_NODES];
+	double load_seconds[MAX_NUMA_NODES];  /* time taken to read each copy */
+} model_replicas;
+
+/* Parses a list such as "0-3,8,10-11" as found in sysfs, returning the number of entries written to 'out' */
+int parse_cpu_list(const char *str, int *out, int max_out)
+{
+	int nout = 0;
+	long first, last;
+	char *end;
+	while (*str != '\0' && *str != '\n')
+	{
+		first = strtol(str, &end, 10);
+		if (end == str) { break; }
+		last = first;
+		str = end;
+		if (*str == '-') {
+			last = strtol(str + 1, &end, 10);
+			str = end;
+		}
+		for (long cpu = first; cpu <= last && nout < max_out; cpu++) { out[nout++] = (int)cpu; }
+		if (*str == ',') { str++; }
+	}
+	return nout;
+}
+
+/* Fills the nodes and their CPUs, or a single node without CPU information if they can't be determined */
+void detect_numa_nodes(model_replicas *rep, int max_nodes)
+{
+	rep->nnodes = 1;
+	rep->pinned = 0;
+	rep->ncpus[0] = 0;
+	rep->cpus[0] = NULL;
+
+	#ifdef HAS_THREAD_AFFINITY
+	char fname[64];
+	char *line = (char*) malloc(16384);
+	int *buffer = (int*) malloc(sizeof(int) * MAX_NUMA_CPUS);
+	int nnodes = 0;
+	if (line == NULL || buffer == NULL) { goto cleanup; }
+	if (max_nodes <= 0 || max_nodes > MAX_NUMA_NODES) { max_nodes = MAX_NUMA_NODES; }
+
+	for (int node = 0; node < MAX_NUMA_NODES && nnodes < max_nodes; node++)
+	{
+		snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *f = fopen(fname, "r");
+		if (f == NULL) { continue; }
+		int ncpus = 0;
+		if (fgets(line, 16384, f) != NULL) { ncpus = parse_cpu_list(line, buffer, MAX_NUMA_CPUS); }
+		fclose(f);
+		/* nodes with only memory are skipped */
+		if (ncpus == 0) { continue; }
+		rep->cpus[nnodes] = (int*) malloc(sizeof(int) * ncpus);
+		if (rep->cpus[nnodes] == NULL) { break; }
+		memcpy(rep->cpus[nnodes], buffer, sizeof(int) * ncpus);
+		rep->ncpus[nnodes] = ncpus;
+		nnodes++;
+	}
+
+	if (nnodes > 0) {
+		rep->nnodes = nnodes;
+		rep->pinned = 1;
+	}
+
+	cleanup:
+		free(line);
+		free(buffer);
+	#endif
+}
+
+/*	Pins the calling thread to the CPUs of a node, storing its previous affinity in 'prev' (which must
+	have size 'affinity_size()'). Returns 1 if the thread was pinned, or 0 if not. */
+size_t affinity_size()
+{
+	#ifdef HAS_THREAD_AFFINITY
+	return sizeof(cpu_set_t);
+	#else
+	return 1;
+	#endif
+}
+
+int pin_thread_to_node(model_replicas *rep, int node, void *prev)
+{
+	#ifdef HAS_THREAD_AFFINITY
+	if (!rep->pinned) { return 0; }
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	for (int cpu = 0; cpu < rep->ncpus[node]; cpu++) {
+		if (rep->cpus[node][cpu] < CPU_SETSIZE) { CPU_SET(rep->cpus[node][cpu], &mask); }
+	}
+	if (sched_getaffinity(0, sizeof(cpu_set_t), (cpu_set_t*)prev) != 0) { return 0; }
+	return sched_setaffinity(0, sizeof(cpu_set_t), &mask) == 0;
+	#else
+	return 0;
+	#endif
+}
+
+void restore_thread_affinity(int was_pinned, void *prev)
+{
+	#ifdef HAS_THREAD_AFFINITY
+	if (was_pinned) { sched_setaffinity(0, sizeof(cpu_set_t), (cpu_set_t*)prev); }
+	#endif
+}
+
+int read_matrix_at(const char *fname, size_t offset, double *out, size_t n)
+{
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) { return 1; }
+	int status = 0;
+	#ifdef _WIN32
+	if (_fseeki64(f, (long long)offset, SEEK_SET) != 0) { status = 2; }
+	#else
+	if (fseek(f, (long)offset, SEEK_SET) != 0) { status = 2; }
+	#endif
+	if (!status && fread(out, sizeof(double), n, f) != n) { status = 2; }
+	fclose(f);
+	return status;
+}
+
+void free_model_replicas(model_replicas *rep)
+{
+	for (int node = 0; node < rep->nnodes; node++)
+	{
+		free(rep->A[node]);
+		free(rep->B[node]);
+		free(rep->cpus[node]);
+		rep->A[node] = NULL;
+		rep->B[node] = NULL;
+		rep->cpus[node] = NULL;
+	}
+}
+
+/*	Loads one copy of B (and of A if 'replicate_A' is non-zero) per NUMA node from a model file, each one read by a
+	thread pinned to its node. 'max_nodes' <= 0 means all of them. Returns one of the 'model_io_status' codes. */
+int load_model_replicas(const char *fname, model_replicas *rep, int replicate_A, int max_nodes)
+{
+	size_t ids_size, offset_A, offset_B, offset_ids, seen_size, offset_seen;
+	memset(rep, 0, sizeof(model_replicas));
+	int status = read_model_header(fname, &rep->dimA, &rep->dimB, &rep->k, &ids_size, &offset_A, &offset_B, &offset_ids, &seen_size, &offset_seen);
+	if (status) { return status; }
+	detect_numa_nodes(rep, max_nodes);
+	int nnodes = rep->nnodes;
+	size_t dimA = rep->dimA, dimB = rep->dimB, k = rep->k;
+
+	#pragma omp parallel for schedule(static, 1) num_threads(nnodes) firstprivate(rep, fname, replicate_A, dimA, dimB, k, offset_A, offset_B) shared(status)
+	for (int node = 0; node < nnodes; node++)
+	{
+		void *prev = malloc(affinity_size());
+		int was_pinned = (prev == NULL)? 0 : pin_thread_to_node(rep, node, prev);
+		double t0 = get_time_seconds();
+		int node_status = 0;
+
+		/* pages are placed on the node of the thread which first writes to them, which is the one reading here */
+		rep->B[node] = (double*) malloc(sizeof(double) * ((dimB * k > 0)? (dimB * k) : 1));
+		if (replicate_A) { rep->A[node] = (double*) malloc(sizeof(double) * ((dimA * k > 0)? (dimA * k) : 1)); }
+		if (rep->B[node] == NULL || (replicate_A && rep->A[node] == NULL)) { node_status = 6; }
+		if (!node_status) { node_status = read_matrix_at(fname, offset_B, rep->B[node], dimB * k); }
+		if (!node_status && replicate_A) { node_status = read_matrix_at(fname, offset_A, rep->A[node], dimA * k); }
+
+		rep->load_seconds[node] = get_time_seconds() - t0;
+		restore_thread_affinity(was_pinned, prev);
+		free(prev);
+		if (node_status) { status = node_status; }
+	}
+
+	if (status) { free_model_replicas(rep); }
+	return status;
+}
+
+/*	Same as 'recommend_from_interactions', but using 'threads_per_node' threads in each NUMA node, each pinned
+	to its node and reading from the local copy of B. Returns 0 if it succeeds or 1 if it runs out of memory. */
+int recommend_replicated(
+	model_replicas *rep,
+	size_t *restrict out_items, double *restrict out_scores, double *restrict factors,
+	size_t nsessions, size_t *restrict sess_indptr, size_t *restrict items, double *restrict counts,
+	double *restrict Bsum, double l2_reg,
+	int solver, size_t max_iter, size_t max_feval, double max_seconds,
+	size_t n, int exclude_given, int threads_per_node)
+{
+	int nthreads = rep->nnodes * threads_per_node;
+	size_t dimB = rep->dimB, k = rep->k;
+	int status = 0;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long sess;
+	#endif
+
+	#pragma omp parallel num_threads(nthreads) firstprivate(rep, out_items, out_scores, factors, nsessions, sess_indptr, items, counts, Bsum, dimB, k, l2_reg, solver, max_iter, max_feval, max_seconds, n, exclude_given, threads_per_node) shared(status)
+	{
+		#ifdef _OPENMP
+		int node = omp_get_thread_num() / threads_per_node;
+		#else
+		int node = 0;
+		#endif
+		void *prev = malloc(affinity_size());
+		int was_pinned = (prev == NULL)? 0 : pin_thread_to_node(rep, node, prev);
+
+		/* allocated after pinning, so that these are also local */
+		double *scores = (double*) malloc(sizeof(double) * dimB);
+		double *cg_buffer = (double*) malloc(sizeof(double) * k * 4);
+		if (scores == NULL || cg_buffer == NULL) { status = 1; }
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for sess = 0; sess < nsessions; sess++)
+		{
+			if (scores == NULL || cg_buffer == NULL) { continue; }
+			size_t st = sess_indptr[sess];
+			recommend_session(out_items + sess*n, out_scores + sess*n, factors + sess*k,
+							  counts + st, items + st, sess_indptr[sess + 1] - st, rep->B[node], Bsum, dimB, k, l2_reg,
+							  solver, max_iter, max_feval, max_seconds, NULL, 0, n, exclude_given,
+							  scores, cg_buffer, NULL);
+		}
+
+		free(scores);
+		free(cg_buffer);
+		restore_thread_affinity(was_pinned, prev);
+		free(prev);
+	}
+	return status;
+}
+
+/*	Top-N items for users of the model, taking their factors from the local copy of A (must have been loaded with
+	'replicate_A'). Items to exclude for each user can be passed in row-sparse format ('excl_indptr', 'excl_ind'),
+	or NULL. Outputs have dimensions nusers*n. Returns 0 if it succeeds or 1 if it runs out of memory. */
+int topn_users_replicated(
+	model_replicas *rep, size_t *restrict out_items, double *restrict out_scores,
+	size_t *restrict users, size_t nusers, size_t *restrict excl_indptr, size_t *restrict excl_ind,
+	size_t n, int threads_per_node)
+{
+	int nthreads = rep->nnodes * threads_per_node;
+	size_t dimB = rep->dimB, k = rep->k;
+	int status = 0;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long row;
+	#endif
+
+	#pragma omp parallel num_threads(nthreads) firstprivate(rep, out_items, out_scores, users, nusers, excl_indptr, excl_ind, dimB, k, n, threads_per_node) shared(status)
+	{
+		#ifdef _OPENMP
+		int node = omp_get_thread_num() / threads_per_node;
+		#else
+		int node = 0;
+		#endif
+		void *prev = malloc(affinity_size());
+		int was_pinned = (prev == NULL)? 0 : pin_thread_to_node(rep, node, prev);
+		double *scores = (double*) malloc(sizeof(double) * ((dimB > 0)? dimB : 1));
+		if (scores == NULL) { status = 1; }
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for row = 0; row < nusers; row++)
+		{
+			if (scores == NULL) { continue; }
+			if (dimB > 0) {
+				cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)dimB, (int)k, 1, rep->B[node], (int)k,
+							rep->A[node] + users[row]*k, 1, 0, scores, 1);
+			}
+			if (excl_indptr != NULL) {
+				for (size_t i = excl_indptr[row]; i < excl_indptr[row + 1]; i++) { scores[excl_ind[i]] = NAN; }
+			}
+			select_topn(out_items + row*n, out_scores + row*n, scores, dimB, n);
+		}
+
+		free(scores);
+		restore_thread_affinity(was_pinned, prev);
+		free(prev);
+	}
+	return status;
+}
+
+/*	Average time in seconds of scoring all the items for one user, from a thread pinned to node 'cpu_node' reading
+	the copy of B in node 'data_node'. Comparing local (same node) against remote timings tells how much the
+	replication is worth it for a given model size. Returns NaN if it runs out of memory. */
+double time_replica_scan(model_replicas *rep, int cpu_node, int data_node, size_t nreps)
+{
+	size_t dimB = rep->dimB, k = rep->k;
+	void *prev = malloc(affinity_size());
+	double *scores = (double*) malloc(sizeof(double) * ((dimB > 0)? dimB : 1));
+	double *a = (double*) malloc(sizeof(double) * k);
+	size_t out_ix[10];
+	double out_val[10];
+	double elapsed = NAN;
+	if (prev == NULL || scores == NULL || a == NULL) { goto cleanup; }
+	int was_pinned = pin_thread_to_node(rep, cpu_node, prev);
+
+	for (size_t kk = 0; kk < k; kk++) { a[kk] = 1; }
+	double t0 = get_time_seconds();
+	for (size_t rep_num = 0; rep_num < nreps; rep_num++)
+	{
+		if (dimB > 0) {
+			cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)dimB, (int)k, 1, rep->B[data_node], (int)k, a, 1, 0, scores, 1);
+		}
+		select_topn(out_ix, out_val, scores, dimB, (dimB < 10)? dimB : 10);
+	}
+	elapsed = (get_time_seconds() - t0) / (double)((nreps > 0)? nreps : 1);
+	restore_thread_affinity(was_pinned, prev);
+
+	cleanup:
+		free(prev);
+		free(scores);
+		free(a);
+	return elapsed;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FOR_PYTHON */
@@ -49,14 +49,28 @@
    so don't move this piece of code down with the others, otherwise the
    function prototypes will not compile */
 
+/* 'CPU_COUNT' is only available if nothing was included before without '_GNU_SOURCE' */
+#ifdef __linux__
+	#ifndef _GNU_SOURCE
+		#define _GNU_SOURCE
+	#endif
+	#include <sched.h>
+	#include <stdio.h>
+#endif
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
 #ifndef _FOR_R
 	#include <stdio.h>
 #endif
 #include <stddef.h>
+#include <stdint.h>
 #ifndef _FOR_R
 	/* https://www.github.com/david-cortes/nonneg_cg */
 	typedef void fun_eval(double x[], int n, double *f, void *data);
@@ -87,10 +101,41 @@ extern "C" {
 	double cblas_ddot(int n, double *x, int incx, double *y, int incy) { return ddot_(&n, x, &incx, y, &incy); }
 	void cblas_daxpy(int n, double a, double *x, int incx, double *y, int incy) { daxpy_(&n, &a, x, &incx, y, &incy); }
 	void cblas_dscal(int n, double alpha, double *x, int incx) { dscal_(&n, &alpha, x, &incx); }
+	#ifndef FCONE
+		#define FCONE
+	#endif
+	typedef enum CBLAS_ORDER {CblasRowMajor=101, CblasColMajor=102} CBLAS_ORDER;
+	typedef enum CBLAS_TRANSPOSE {CblasNoTrans=111, CblasTrans=112, CblasConjTrans=113} CBLAS_TRANSPOSE;
+	/* Only row-major matrices are used here, which the Fortran routine sees as transposed */
+	void cblas_dgemv(const CBLAS_ORDER order, const CBLAS_TRANSPOSE trans, const int m, const int n,
+					 const double alpha, const double *a, const int lda, const double *x, const int incx,
+					 const double beta, double *y, const int incy)
+	{
+		char trans_f = (trans == CblasNoTrans)? 'T' : 'N';
+		F77_CALL(dgemv)(&trans_f, &n, &m, &alpha, a, &lda, x, &incx, &beta, y, &incy FCONE);
+	}
+	void cblas_dgemm(const CBLAS_ORDER order, const CBLAS_TRANSPOSE transA, const CBLAS_TRANSPOSE transB,
+					 const int m, const int n, const int k, const double alpha, const double *a, const int lda,
+					 const double *b, const int ldb, const double beta, double *c, const int ldc)
+	{
+		char transA_f = (transA == CblasNoTrans)? 'N' : 'T';
+		char transB_f = (transB == CblasNoTrans)? 'N' : 'T';
+		F77_CALL(dgemm)(&transB_f, &transA_f, &n, &m, &k, &alpha, b, &ldb, a, &lda, &beta, c, &ldc FCONE FCONE);
+	}
 #else
 	double cblas_ddot(const int n, const double *x, const int incx, const double *y, const int incy);
 	void cblas_daxpy(const int n, const double alpha, const double *x, const int incx, double *y, const int incy);
 	void cblas_dscal(const int N, const double alpha, double *X, const int incX);
+	#ifndef CBLAS_H
+		typedef enum CBLAS_ORDER {CblasRowMajor=101, CblasColMajor=102} CBLAS_ORDER;
+		typedef enum CBLAS_TRANSPOSE {CblasNoTrans=111, CblasTrans=112, CblasConjTrans=113} CBLAS_TRANSPOSE;
+	#endif
+	void cblas_dgemv(const CBLAS_ORDER order, const CBLAS_TRANSPOSE trans, const int m, const int n,
+					 const double alpha, const double *a, const int lda, const double *x, const int incx,
+					 const double beta, double *y, const int incy);
+	void cblas_dgemm(const CBLAS_ORDER order, const CBLAS_TRANSPOSE transA, const CBLAS_TRANSPOSE transB,
+					 const int m, const int n, const int k, const double alpha, const double *a, const int lda,
+					 const double *b, const int ldb, const double beta, double *c, const int ldc);
 
 	#ifndef cblas_ddot
 		double cblas_ddot(const int n, const double *x, const int incx, const double *y, const int incy) {
@@ -100,6 +145,35 @@ extern "C" {
 		}
 		void cblas_daxpy(const int n, const double alpha, const double *x, const int incx, double *y, const int incy) { for (int i = 0; i < n; i++) { y[i] += alpha * x[i]; } }
 		void cblas_dscal(const int N, const double alpha, double *X, const int incX) { for (int i = 0; i < N; i++) { X[i] *= alpha; } }
+		/* row-major only */
+		void cblas_dgemv(const CBLAS_ORDER order, const CBLAS_TRANSPOSE trans, const int m, const int n,
+						 const double alpha, const double *a, const int lda, const double *x, const int incx,
+						 const double beta, double *y, const int incy)
+		{
+			if (trans == CblasNoTrans) {
+				for (int i = 0; i < m; i++) { y[i] = ((beta == 0)? 0 : beta * y[i]) + alpha * cblas_ddot(n, a + (size_t)i * lda, 1, x, 1); }
+			} else {
+				if (beta == 0) { memset(y, 0, sizeof(double) * n); } else { cblas_dscal(n, beta, y, 1); }
+				for (int i = 0; i < m; i++) { cblas_daxpy(n, alpha * x[i], a + (size_t)i * lda, 1, y, 1); }
+			}
+		}
+		/* row-major only, C = alpha*op(A)*op(B) + beta*C */
+		void cblas_dgemm(const CBLAS_ORDER order, const CBLAS_TRANSPOSE transA, const CBLAS_TRANSPOSE transB,
+						 const int m, const int n, const int k, const double alpha, const double *a, const int lda,
+						 const double *b, const int ldb, const double beta, double *c, const int ldc)
+		{
+			double val;
+			for (int i = 0; i < m; i++) {
+				for (int j = 0; j < n; j++) {
+					val = 0;
+					for (int kk = 0; kk < k; kk++) {
+						val += ((transA == CblasNoTrans)? a[(size_t)i * lda + kk] : a[(size_t)kk * lda + i])
+							 * ((transB == CblasNoTrans)? b[(size_t)kk * ldb + j] : b[(size_t)j * ldb + kk]);
+					}
+					c[(size_t)i * ldc + j] = alpha * val + ((beta == 0)? 0 : beta * c[(size_t)i * ldc + j]);
+				}
+			}
+		}
 	#endif
 #endif
 
@@ -131,6 +205,9 @@ extern "C" {
 /* Helper functions */
 #define nonneg(x) ((x) > 0)? (x) : 0
 
+/* Ways of structuring each iteration of the main procedure */
+typedef enum iter_scheme_t {alternating_iter = 0, fused_iter = 1, stratified_iter = 2} iter_scheme_t;
+
 void sum_by_cols(double *restrict out, double *restrict M, size_t nrow, size_t ncol, int ncores)
 {
 	memset(out, 0, sizeof(double) * ncol);
@@ -154,6 +231,156 @@ void sum_by_cols(double *restrict out, double *restrict M, size_t nrow, size_t n
 double *buffer_arr;
 #pragma omp threadprivate(buffer_arr)
 
+/*	Rows of the fixed matrix that are used for the current row are scattered in memory. When they are going
+	to be read more than once (several PGD passes, or many function evaluations in CG), they are first copied
+	into this contiguous thread-local panel, as long as they fit in the cache budget below.
+	The panel is followed by space for one number per row that it can hold. */
+double *panel_arr;
+#pragma omp threadprivate(panel_arr)
+#define PANEL_CACHE_BYTES ((size_t)1 << 18)
+
+size_t calc_panel_max_nnz(size_t k)
+{
+	size_t max_nnz = PANEL_CACHE_BYTES / (k * sizeof(double));
+	return (max_nnz > 0)? max_nnz : 1;
+}
+
+/*	With larger k, the per-non-zero dot/axpy calls are replaced by two matrix-vector products on the gathered
+	rows (first all the denominators, then the gradient from the vector of ratios), which BLAS can block better.
+	Rows that don't fit in the panel are processed in chunks of its size. */
+#define LARGE_K_THRESHOLD 128
+#define LARGE_K_MIN_NNZ 8
+
+/*	During each half-step the fixed matrix is only read, so it can optionally be read from a reduced-precision
+	copy (refreshed after the half-step that modifies it), which takes 1/2 (float) or 1/4 (bfloat16) of the
+	memory bandwidth for the gathers. Rows are widened to double when copied into the panel, so all the
+	arithmetic is still done in double precision, and the master copies of A and B remain in double. */
+typedef enum prec_t {prec_double = 0, prec_float = 1, prec_bfloat16 = 2} prec_t;
+
+uint16_t double_to_bf16(double x)
+{
+	float xf = (float) x;
+	uint32_t u;
+	memcpy(&u, &xf, sizeof(uint32_t));
+	u += 0x7FFF + ((u >> 16) & 1); /* round to nearest even */
+	return (uint16_t) (u >> 16);
+}
+
+double bf16_to_double(uint16_t x)
+{
+	uint32_t u = ((uint32_t) x) << 16;
+	float xf;
+	memcpy(&xf, &u, sizeof(uint32_t));
+	return (double) xf;
+}
+
+void refresh_lowp_copy(void *restrict F_lowp, double *restrict F, size_t n, int prec, int ncores)
+{
+	float *F_f32 = (float*) F_lowp;
+	uint16_t *F_bf16 = (uint16_t*) F_lowp;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long i;
+	#endif
+
+	if (prec == prec_float) {
+		#pragma omp parallel for schedule(static) num_threads(ncores) firstprivate(F, F_f32, n)
+		for (size_t_for i = 0; i < n; i++) { F_f32[i] = (float) F[i]; }
+	} else {
+		#pragma omp parallel for schedule(static) num_threads(ncores) firstprivate(F, F_bf16, n)
+		for (size_t_for i = 0; i < n; i++) { F_bf16[i] = double_to_bf16(F[i]); }
+	}
+}
+
+/*	Optional packed layout for the non-zero entries, with the index and the value interleaved in a single 8-byte
+	record, so that each row is read as one sequential stream instead of two. Values are stored in single
+	precision, so the records are only used for the double-precision iterations if every value is exactly
+	representable as a float (e.g. counts up to 2^24) - otherwise the original arrays are read. Records are laid
+	out in the same order as the CSR/CSC arrays from which they are built, so they share the same 'indptr', and
+	the functions below read the non-zeros from them whenever they are passed. */
+typedef struct nnz_rec {
+	uint32_t ind;
+	float val;
+} nnz_rec;
+
+#define nnz_ind(Xind, Xp, i) ( ((Xp) != NULL)? (size_t)(Xp)[(i)].ind : (Xind)[(i)] )
+#define nnz_val(X, Xp, i) ( ((Xp) != NULL)? (double)(Xp)[(i)].val : (X)[(i)] )
+
+/*	Returns NULL if it runs out of memory, or if passing 'exact' and some value would be rounded */
+nnz_rec* pack_nonzeros(double *restrict X, size_t *restrict Xind, size_t nnz, bool exact, int ncores)
+{
+	nnz_rec *Xp = (nnz_rec*) malloc(sizeof(nnz_rec) * (nnz? nnz : 1));
+	if (Xp == NULL) { return NULL; }
+	int n_rounded = 0;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long i;
+	#endif
+
+	#pragma omp parallel for schedule(static) num_threads(ncores) firstprivate(X, Xind, Xp, nnz) reduction(+:n_rounded)
+	for (size_t_for i = 0; i < nnz; i++)
+	{
+		Xp[i].ind = (uint32_t) Xind[i];
+		Xp[i].val = (float) X[i];
+		if ((double) Xp[i].val != X[i]) { n_rounded++; }
+	}
+
+	if (exact && n_rounded)
+	{
+		free(Xp);
+		return NULL;
+	}
+	return Xp;
+}
+
+void gather_panel(double *restrict panel, double *restrict F, size_t *restrict Xind, nnz_rec *restrict Xp, size_t nnz_this, size_t k)
+{
+	for (size_t i = 0; i < nnz_this; i++) {
+		memcpy(panel + i*k, F + nnz_ind(Xind, Xp, i) * k, sizeof(double) * k);
+	}
+}
+
+void gather_panel_lowp(double *restrict panel, void *restrict F_lowp, int prec, size_t *restrict Xind, nnz_rec *restrict Xp, size_t nnz_this, size_t k)
+{
+	float *row_f32;
+	uint16_t *row_bf16;
+	for (size_t i = 0; i < nnz_this; i++)
+	{
+		if (prec == prec_float) {
+			row_f32 = (float*)F_lowp + nnz_ind(Xind, Xp, i) * k;
+			for (size_t kk = 0; kk < k; kk++) { panel[i*k + kk] = (double) row_f32[kk]; }
+		} else {
+			row_bf16 = (uint16_t*)F_lowp + nnz_ind(Xind, Xp, i) * k;
+			for (size_t kk = 0; kk < k; kk++) { panel[i*k + kk] = bf16_to_double(row_bf16[kk]); }
+		}
+	}
+}
+
+double dot_lowp(double *restrict x, void *restrict F_lowp, int prec, size_t row, size_t k)
+{
+	double out = 0;
+	float *row_f32 = (float*)F_lowp + row * k;
+	uint16_t *row_bf16 = (uint16_t*)F_lowp + row * k;
+	if (prec == prec_float) {
+		for (size_t kk = 0; kk < k; kk++) { out += x[kk] * (double) row_f32[kk]; }
+	} else {
+		for (size_t kk = 0; kk < k; kk++) { out += x[kk] * bf16_to_double(row_bf16[kk]); }
+	}
+	return out;
+}
+
+/* out += alpha * (row 'row' of the reduced-precision copy) */
+void axpy_lowp(double alpha, void *restrict F_lowp, int prec, size_t row, size_t k, double *restrict out)
+{
+	float *row_f32 = (float*)F_lowp + row * k;
+	uint16_t *row_bf16 = (uint16_t*)F_lowp + row * k;
+	if (prec == prec_float) {
+		for (size_t kk = 0; kk < k; kk++) { out[kk] += alpha * (double) row_f32[kk]; }
+	} else {
+		for (size_t kk = 0; kk < k; kk++) { out[kk] += alpha * bf16_to_double(row_bf16[kk]); }
+	}
+}
+
 /* Functions for Proximal Gradient */
 void calc_grad_pgd(double *out, double *curr, double *F, double *X, size_t *Xind, size_t nnz_this, int k)
 {
@@ -163,36 +390,507 @@ void calc_grad_pgd(double *out, double *curr, double *F, double *X, size_t *Xind
 	}
 }
 
+void calc_grad_pgd_packed(double *out, double *curr, double *F, nnz_rec *Xp, size_t nnz_this, int k)
+{
+	memset(out, 0, sizeof(double) * k);
+	for (size_t i = 0; i < nnz_this; i++){
+		cblas_daxpy(k, (double)Xp[i].val / cblas_ddot(k, F + (size_t)Xp[i].ind * k, 1, curr, 1), F + (size_t)Xp[i].ind * k, 1, out, 1);
+	}
+}
+
+/*	Same gradient as above, but computed from rows copied into the panel, either all at once (if they were
+	already gathered) or in chunks of the panel size, optionally using matrix-vector products for large k */
+void calc_grad_pgd_panel(double *out, double *curr, double *F, void *F_lowp, int prec, double *X, size_t *Xind, nnz_rec *Xp,
+	size_t nnz_this, int k, double *panel, size_t panel_max_nnz, bool is_gathered, bool use_gemv)
+{
+	size_t k_szt = (size_t) k;
+	double *ratio = panel + panel_max_nnz * k_szt;
+	size_t chunk;
+	memset(out, 0, sizeof(double) * k);
+	for (size_t st = 0; st < nnz_this; st += panel_max_nnz)
+	{
+		chunk = (nnz_this - st < panel_max_nnz)? (nnz_this - st) : panel_max_nnz;
+		if (!is_gathered)
+		{
+			if (F_lowp != NULL) {
+				gather_panel_lowp(panel, F_lowp, prec, (Xind == NULL)? NULL : (Xind + st), (Xp == NULL)? NULL : (Xp + st), chunk, k_szt);
+			} else {
+				gather_panel(panel, F, (Xind == NULL)? NULL : (Xind + st), (Xp == NULL)? NULL : (Xp + st), chunk, k_szt);
+			}
+		}
+
+		if (use_gemv)
+		{
+			cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)chunk, k, 1, panel, k, curr, 1, 0, ratio, 1);
+			for (size_t i = 0; i < chunk; i++) { ratio[i] = nnz_val(X, Xp, st + i) / ratio[i]; }
+			cblas_dgemv(CblasRowMajor, CblasTrans, (int)chunk, k, 1, panel, k, ratio, 1, 1, out, 1);
+		}
+
+		else
+		{
+			for (size_t i = 0; i < chunk; i++) {
+				cblas_daxpy(k, nnz_val(X, Xp, st + i) / cblas_ddot(k, panel + i * k_szt, 1, curr, 1), panel + i * k_szt, 1, out, 1);
+			}
+		}
+	}
+}
+
+/*	Takes 'npass' proximal gradient steps on a single row 'a', with the rows of 'F' in 'Xind' fixed.
+	'cnst_sum' must contain -step_size * (colsum(F) + l1_reg), 'grad' is a buffer of size k, and
+	'panel' is a buffer with space for 'panel_max_nnz' rows (can be NULL if not using it).
+	If passing 'F_lowp', rows of F will be read from it instead (requires the panel). If passing 'Xp' (the
+	same non-zeros in packed format), the non-zeros are read from it, and 'X' and 'Xind' can be NULL. */
+void pgd_update_row(double *restrict a, double *restrict F, void *restrict F_lowp, int prec,
+	double *restrict X, size_t *restrict Xind, nnz_rec *restrict Xp, size_t nnz_this, size_t k,
+	double cnst_div, double *restrict cnst_sum, double step_size, size_t npass,
+	double *restrict grad, double *restrict panel, size_t panel_max_nnz)
+{
+	int k_int = (int) k;
+	bool use_lowp = (F_lowp != NULL) && (panel != NULL);
+	bool use_gemv = (k >= LARGE_K_THRESHOLD) && (nnz_this >= LARGE_K_MIN_NNZ) && (panel != NULL);
+	bool use_panel = (npass > 1 || use_gemv || use_lowp) && (panel != NULL) && (nnz_this <= panel_max_nnz);
+	if (use_panel)
+	{
+		if (use_lowp) {
+			gather_panel_lowp(panel, F_lowp, prec, Xind, Xp, nnz_this, k);
+		} else {
+			gather_panel(panel, F, Xind, Xp, nnz_this, k);
+		}
+	}
+
+	for (size_t p = 0; p < npass; p++)
+	{
+		if (use_panel || use_gemv || use_lowp) {
+			calc_grad_pgd_panel(grad, a, F, use_lowp? F_lowp : NULL, prec, X, Xind, Xp, nnz_this, k_int,
+								panel, panel_max_nnz, use_panel, use_gemv);
+		} else if (Xp != NULL) {
+			calc_grad_pgd_packed(grad, a, F, Xp, nnz_this, k_int);
+		} else {
+			calc_grad_pgd(grad, a, F, X, Xind, nnz_this, k_int);
+		}
+		cblas_daxpy(k_int, step_size, grad, 1, a, 1);
+
+		cblas_daxpy(k_int, 1, cnst_sum, 1, a, 1);
+		cblas_dscal(k_int, cnst_div, a, 1);
+		for (size_t i = 0; i < k; i++) {a[i] = nonneg(a[i]);}
+	}
+}
+
+/*	The column-sparse copy of the data, if not passed to 'run_poismf', is built from the row-sparse one by a
+	single thread while the others start updating A in the first half-step (which doesn't need it). That thread
+	then joins the updates, so the B half-step only waits for it if the transposition takes longer. */
+typedef struct csc_build {
+	double *Xr;
+	size_t *Xr_indptr;
+	size_t *Xr_indices;
+	size_t dimA;
+	size_t dimB;
+	double *Xc;
+	size_t *Xc_indptr;
+	size_t *Xc_indices;
+	int status;      /* 1 if it ran out of memory */
+} csc_build;
+
+/*	Counting sort by column - rows are visited in order, so indices end up sorted within each column. The column
+	pointers are used as insertion positions and shifted back afterwards, so no other memory is needed. */
+void build_csc(csc_build *job)
+{
+	size_t nnz = job->Xr_indptr[job->dimA];
+	size_t dimB = job->dimB;
+	job->Xc = (double*) malloc(sizeof(double) * (nnz? nnz : 1));
+	job->Xc_indices = (size_t*) malloc(sizeof(size_t) * (nnz? nnz : 1));
+	job->Xc_indptr = (size_t*) calloc(dimB + 1, sizeof(size_t));
+	if (job->Xc == NULL || job->Xc_indices == NULL || job->Xc_indptr == NULL) { job->status = 1; return; }
+
+	size_t *restrict indptr = job->Xc_indptr;
+	for (size_t i = 0; i < nnz; i++) { indptr[job->Xr_indices[i] + 1]++; }
+	for (size_t col = 0; col < dimB; col++) { indptr[col + 1] += indptr[col]; }
+	size_t dest;
+	for (size_t row = 0; row < job->dimA; row++)
+	{
+		for (size_t i = job->Xr_indptr[row]; i < job->Xr_indptr[row + 1]; i++)
+		{
+			dest = indptr[job->Xr_indices[i]]++;
+			job->Xc[dest] = job->Xr[i];
+			job->Xc_indices[dest] = row;
+		}
+	}
+	for (size_t col = dimB; col > 0; col--) { indptr[col] = indptr[col - 1]; }
+	indptr[0] = 0;
+}
+
+/* Once the built data is packed (see 'pack_nonzeros'), only its 'indptr' is read */
+void release_split_csc(csc_build *job)
+{
+	free(job->Xc);
+	free(job->Xc_indices);
+	job->Xc = NULL;
+	job->Xc_indices = NULL;
+}
+
 /*	This function is written having in mind the A matrix being optimized, with the B matrix being fixed, and the data passed in row-sparse format.
-	For optimizing B, swap any mention of A and B, and pass the data in column-sparse format */
-void pgd_iteration(double *A, double *B, double *Xr, size_t *Xr_indptr, size_t *Xr_indices, size_t dimA, size_t k,
-	double cnst_div, double *cnst_sum, double step_size, size_t npass, int ncores)
+	For optimizing B, swap any mention of A and B, and pass the data in column-sparse format.
+	If passing 'Xr_packed', 'Xr' and 'Xr_indices' can be NULL.
+	If passing 'csc_job', one of the threads builds the column-sparse data in the meantime (see 'build_csc'). */
+void pgd_iteration(double *A, double *B, void *B_lowp, int prec, double *Xr, size_t *Xr_indptr, size_t *Xr_indices, nnz_rec *Xr_packed, size_t dimA, size_t k,
+	double cnst_div, double *cnst_sum, double step_size, size_t npass, csc_build *csc_job, int ncores)
+{
+	size_t nnz_this;
+	size_t panel_max_nnz = calc_panel_max_nnz(k);
+
+	#ifdef _OPENMP
+		#if (_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64) /* OpenMP < 3.0 */
+			long ia;
+		#endif
+	#endif
+
+	#pragma omp parallel num_threads(ncores) shared(A) private(nnz_this) firstprivate(B, B_lowp, prec, k, cnst_sum, cnst_div, npass, Xr, Xr_indptr, Xr_indices, Xr_packed, panel_max_nnz, csc_job)
+	{
+		if (csc_job != NULL)
+		{
+			#pragma omp single nowait
+			build_csc(csc_job);
+		}
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for ia = 0; ia < dimA; ia++)
+		{
+
+			nnz_this = Xr_indptr[ia + 1] - Xr_indptr[ia];
+			pgd_update_row(A + ia*k, B, B_lowp, prec,
+						   (Xr == NULL)? NULL : (Xr + Xr_indptr[ia]), (Xr_indices == NULL)? NULL : (Xr_indices + Xr_indptr[ia]),
+						   (Xr_packed == NULL)? NULL : (Xr_packed + Xr_indptr[ia]), nnz_this, k,
+						   cnst_div, cnst_sum, step_size, npass, buffer_arr, panel_arr, panel_max_nnz);
+
+		}
+	}
+}
+
+/*	Fused variant of the two PGD half-steps, which reads the row-sparse data only once per iteration.
+	Each row of A is updated exactly as in 'pgd_iteration', and right after, that row's contributions
+	to the gradient of B (X[i,j] / <A[i], B[j]> * A[i]) are scattered into accumulators, together with
+	the column sums of the updated A. The proximal step for B is then applied in a dense pass over its rows.
+	The B gradient is evaluated with the new A and old B, so for npass=1 this produces the same result as
+	the alternating scheme, but B gets only one update per iteration regardless of 'npass'.
+
+	Accumulators are either one per thread (gradB_buffer of dimensions nthreads*dimB*k), or a single
+	shared one (dimensions dimB*k) which is updated atomically, depending on what is passed in 'per_thread'.
+	Asum_buffer must have dimensions nthreads*k. */
+void pgd_iteration_fused(double *A, double *B, void *B_lowp, int prec, double *Xr, size_t *Xr_indptr, size_t *Xr_indices, nnz_rec *Xr_packed,
+	size_t dimA, size_t dimB, size_t k,
+	double cnst_div, double *cnst_sum, double step_size, double l1_reg, size_t npass,
+	double *gradB_buffer, double *Asum_buffer, bool per_thread, int ncores)
 {
 	int k_int = (int) k;
 	size_t nnz_this;
+	size_t dimBk = dimB * k;
+	double *gradB_this;
+	double *Asum_this;
+	double ratio;
+	size_t ix_b;
+	int tid = 0;
+	size_t panel_max_nnz = calc_panel_max_nnz(k);
 
 	#ifdef _OPENMP
 		#if (_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64) /* OpenMP < 3.0 */
 			long ia;
+			long ib;
 		#endif
 	#endif
 
-	#pragma omp parallel for schedule(dynamic) num_threads(ncores) shared(A) private(nnz_this) firstprivate(B, k, k_int, cnst_sum, cnst_div, npass, Xr, Xr_indptr, Xr_indices)
-	for (size_t_for ia = 0; ia < dimA; ia++)
+	int nslices = per_thread? ncores : 1;
+	memset(Asum_buffer, 0, sizeof(double) * k * (size_t)ncores);
+
+	#pragma omp parallel num_threads(ncores) private(gradB_this, Asum_this, nnz_this, ratio, ix_b, tid) firstprivate(A, B, k, k_int, dimA, dimBk, cnst_sum, cnst_div, step_size, npass, Xr, Xr_indptr, Xr_indices, Xr_packed, gradB_buffer, Asum_buffer, per_thread, nslices, panel_max_nnz, B_lowp, prec)
+	{
+		int t;
+		/* the team might end up having fewer threads than requested, so all slices are zeroed */
+		#pragma omp for schedule(static)
+		for (t = 0; t < nslices; t++) { memset(gradB_buffer + (size_t)t * dimBk, 0, sizeof(double) * dimBk); }
+
+		#ifdef _OPENMP
+		tid = omp_get_thread_num();
+		#endif
+		Asum_this = Asum_buffer + (size_t)tid * k;
+		gradB_this = per_thread? (gradB_buffer + (size_t)tid * dimBk) : gradB_buffer;
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for ia = 0; ia < dimA; ia++)
+		{
+			nnz_this = Xr_indptr[ia + 1] - Xr_indptr[ia];
+			pgd_update_row(A + ia*k, B, B_lowp, prec, Xr + Xr_indptr[ia], Xr_indices + Xr_indptr[ia],
+						   (Xr_packed == NULL)? NULL : (Xr_packed + Xr_indptr[ia]), nnz_this, k,
+						   cnst_div, cnst_sum, step_size, npass, buffer_arr, panel_arr, panel_max_nnz);
+
+			cblas_daxpy(k_int, 1, A + ia*k, 1, Asum_this, 1);
+			for (size_t i = Xr_indptr[ia]; i < Xr_indptr[ia + 1]; i++)
+			{
+				if (Xr_packed != NULL) {
+					ix_b = Xr_packed[i].ind;
+					ratio = Xr_packed[i].val;
+				} else {
+					ix_b = Xr_indices[i];
+					ratio = Xr[i];
+				}
+				if (B_lowp != NULL) {
+					ratio /= dot_lowp(A + ia*k, B_lowp, prec, ix_b, k);
+				} else {
+					ratio /= cblas_ddot(k_int, A + ia*k, 1, B + ix_b * k, 1);
+				}
+				if (per_thread) {
+					cblas_daxpy(k_int, ratio, A + ia*k, 1, gradB_this + ix_b * k, 1);
+				} else {
+					for (size_t kk = 0; kk < k; kk++) {
+						#pragma omp atomic
+						gradB_this[ix_b * k + kk] += ratio * A[ia*k + kk];
+					}
+				}
+			}
+		}
+	}
+
+	/* Constant term for B: -step * (colsum(A) + l1) */
+	memset(cnst_sum, 0, sizeof(double) * k);
+	for (int t = 0; t < ncores; t++) { cblas_daxpy(k_int, 1, Asum_buffer + (size_t)t * k, 1, cnst_sum, 1); }
+	if (l1_reg > 0) { for (size_t kk = 0; kk < k; kk++) { cnst_sum[kk] += l1_reg; } }
+	cblas_dscal(k_int, -step_size, cnst_sum, 1);
+
+	#pragma omp parallel for schedule(static) num_threads(ncores) firstprivate(B, k, k_int, dimB, dimBk, cnst_sum, cnst_div, step_size, gradB_buffer, nslices)
+	for (size_t_for ib = 0; ib < dimB; ib++)
+	{
+		for (int t = 0; t < nslices; t++) {
+			cblas_daxpy(k_int, step_size, gradB_buffer + (size_t)t * dimBk + ib*k, 1, B + ib*k, 1);
+		}
+		cblas_daxpy(k_int, 1, cnst_sum, 1, B + ib*k, 1);
+		cblas_dscal(k_int, cnst_div, B + ib*k, 1);
+		for (size_t i = 0; i < k; i++) {B[ib*k + i] = nonneg(B[ib*k + i]);}
+	}
+}
+
+/*	Stratified block scheme: rows of A and rows of B are split into 'nblocks' contiguous blocks each, which
+	partitions the data into a grid of nblocks x nblocks tiles. At stratum 's', tile (u, (u+s) mod nblocks) is
+	processed for every user block 'u' - these tiles touch disjoint rows of both A and B, so each thread can
+	update both matrices for its tile without locks and without waiting for the other half-step. After all the
+	strata have been processed, each entry in the data has been visited once.
+
+	Within a tile, rows of A take 'npass' PGD steps on the part of the objective that comes from that tile, followed
+	by the same for rows of B. Since each row appears in 'nblocks' tiles, the terms that don't depend on the data
+	(regularization) are split evenly across them. The column sums of the fixed side are taken from the rows of
+	that block only, which are small enough to stay in cache.
+
+	Requires the indices in Xr_indices and Xc_indices to be sorted within each row/column. Uses 2*k entries in the
+	thread-local 'buffer_arr'. */
+size_t find_first_geq(size_t *arr, size_t n, size_t val)
+{
+	size_t lo = 0;
+	size_t hi = n;
+	size_t mid;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (arr[mid] < val) { lo = mid + 1; } else { hi = mid; }
+	}
+	return lo;
+}
+
+void pgd_update_tile(double *A, double *B, double *Xr, size_t *Xr_indptr, size_t *Xr_indices,
+	size_t stA, size_t endA, size_t stB, size_t endB, size_t k,
+	double cnst_div, double l1_reg_tile, double step_size, size_t npass, double *buffer, double *panel)
+{
+	int k_int = (int) k;
+	size_t panel_max_nnz = calc_panel_max_nnz(k);
+	double *grad = buffer;
+	double *cnst_sum = buffer + k;
+	size_t st_this, end_this;
+
+	/* sum of the fixed rows within this block, scaled by the step size */
+	memset(cnst_sum, 0, sizeof(double) * k);
+	for (size_t ib = stB; ib < endB; ib++) { cblas_daxpy(k_int, 1, B + ib*k, 1, cnst_sum, 1); }
+	if (l1_reg_tile > 0) { for (size_t kk = 0; kk < k; kk++) { cnst_sum[kk] += l1_reg_tile; } }
+	cblas_dscal(k_int, -step_size, cnst_sum, 1);
+
+	for (size_t ia = stA; ia < endA; ia++)
 	{
+		st_this = Xr_indptr[ia] + find_first_geq(Xr_indices + Xr_indptr[ia], Xr_indptr[ia + 1] - Xr_indptr[ia], stB);
+		end_this = st_this + find_first_geq(Xr_indices + st_this, Xr_indptr[ia + 1] - st_this, endB);
+		pgd_update_row(A + ia*k, B, NULL, prec_double, Xr + st_this, Xr_indices + st_this, NULL, end_this - st_this, k,
+					   cnst_div, cnst_sum, step_size, npass, grad, panel, panel_max_nnz);
+	}
+}
+
+void stratified_iteration(double *A, double *B,
+	double *Xr, size_t *Xr_indptr, size_t *Xr_indices,
+	double *Xc, size_t *Xc_indptr, size_t *Xc_indices,
+	size_t dimA, size_t dimB, size_t k, double l2_reg, double l1_reg, double step_size, size_t npass,
+	size_t nblocks, int ncores)
+{
+	double cnst_div = 1 / (1 + 2 * (l2_reg / (double)nblocks) * step_size);
+	double l1_reg_tile = l1_reg / (double)nblocks;
+	size_t blk_B;
+	size_t stA, endA, stB, endB;
+
+	#ifdef _OPENMP
+		#if (_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64) /* OpenMP < 3.0 */
+			long blk_A;
+		#endif
+	#endif
 
-		nnz_this = Xr_indptr[ia + 1] - Xr_indptr[ia];
-		for (size_t p = 0; p < npass; p++)
+	for (size_t stratum = 0; stratum < nblocks; stratum++)
+	{
+		#pragma omp parallel for schedule(dynamic) num_threads(ncores) private(blk_B, stA, endA, stB, endB) firstprivate(A, B, Xr, Xr_indptr, Xr_indices, Xc, Xc_indptr, Xc_indices, dimA, dimB, k, cnst_div, l1_reg_tile, step_size, npass, nblocks, stratum)
+		for (size_t_for blk_A = 0; blk_A < nblocks; blk_A++)
 		{
-			calc_grad_pgd(buffer_arr, A + ia*k, B, Xr + Xr_indptr[ia], Xr_indices + Xr_indptr[ia], nnz_this, k_int);
-			cblas_daxpy(k_int, step_size, buffer_arr, 1, A + ia*k, 1);
+			blk_B = (blk_A + stratum) % nblocks;
+			stA = (dimA * blk_A) / nblocks;
+			endA = (dimA * (blk_A + 1)) / nblocks;
+			stB = (dimB * blk_B) / nblocks;
+			endB = (dimB * (blk_B + 1)) / nblocks;
+
+			pgd_update_tile(A, B, Xr, Xr_indptr, Xr_indices, stA, endA, stB, endB, k,
+							cnst_div, l1_reg_tile, step_size, npass, buffer_arr, panel_arr);
+			pgd_update_tile(B, A, Xc, Xc_indptr, Xc_indices, stB, endB, stA, endA, k,
+							cnst_div, l1_reg_tile, step_size, npass, buffer_arr, panel_arr);
+		}
+	}
+}
+
+/*	Picks the number of blocks for the stratified scheme so that there's at least one tile per thread
+	and a block of B fits in the cache budget below */
+#define STRATUM_CACHE_BYTES ((size_t)1 << 20)
+size_t choose_nblocks(size_t dimA, size_t dimB, size_t k, int ncores)
+{
+	size_t nblocks = (dimB * k * sizeof(double) + STRATUM_CACHE_BYTES - 1) / STRATUM_CACHE_BYTES;
+	if (nblocks < (size_t)ncores) { nblocks = (size_t)ncores; }
+	if (nblocks > dimA) { nblocks = dimA; }
+	if (nblocks > dimB) { nblocks = dimB; }
+	return (nblocks > 0)? nblocks : 1;
+}
+
+double get_time_seconds()
+{
+	#ifdef _OPENMP
+	return omp_get_wtime();
+	#else
+	return (double) clock() / (double) CLOCKS_PER_SEC;
+	#endif
+}
+
+#ifdef __linux__
+/*	CPU quota of a cgroup directory as a number of CPUs (cgroup v2: 'cpu.max', v1: 'cpu.cfs_quota_us' and
+	'cpu.cfs_period_us'). Returns 0 if it has no quota or the files can't be read. */
+double cgroup_dir_quota(const char *dir, bool v2)
+{
+	char fname[4200];
+	char word[32];
+	double quota = 0, period = 0;
+	FILE *f;
+	if (v2)
+	{
+		snprintf(fname, sizeof(fname), "%s/cpu.max", dir);
+		if ((f = fopen(fname, "r")) == NULL) { return 0; }
+		if (fscanf(f, "%31s %lf", word, &period) == 2 && strcmp(word, "max") != 0) { quota = strtod(word, NULL); }
+		fclose(f);
+	}
+	else
+	{
+		snprintf(fname, sizeof(fname), "%s/cpu.cfs_quota_us", dir);
+		if ((f = fopen(fname, "r")) == NULL) { return 0; }
+		if (fscanf(f, "%lf", &quota) != 1) { quota = 0; }
+		fclose(f);
+		snprintf(fname, sizeof(fname), "%s/cpu.cfs_period_us", dir);
+		if ((f = fopen(fname, "r")) == NULL) { return 0; }
+		if (fscanf(f, "%lf", &period) != 1) { period = 0; }
+		fclose(f);
+	}
+	return (quota > 0 && period > 0)? (quota / period) : 0;
+}
+
+/*	Smallest CPU quota among the cgroup of this process and its parents, as listed in '/proc/self/cgroup'. The
+	cgroup paths are looked up under the usual mount points - inside containers, these might show the cgroup of
+	the container at the root of the mount while the listed path is that of the host, hence the parents are
+	checked until reaching the root. Returns 0 if there's no quota. */
+double cgroup_cpu_quota(void)
+{
+	const char *mounts_v2[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+	const char *mounts_v1[] = {"/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpuacct,cpu"};
+	char line[4096];
+	char dir[4200];
+	char *controllers, *path, *end, *tok;
+	bool v2, has_cpu;
+	size_t nmounts, len;
+	double limit = 0, quota;
 
-			cblas_daxpy(k_int, 1, cnst_sum, 1, A + ia*k, 1);
-			cblas_dscal(k_int, cnst_div, A + ia*k, 1);
-			for (size_t i = 0; i < k; i++) {A[ia*k + i] = nonneg(A[ia*k + i]);}
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL) { return 0; }
+	/* lines are "hierarchy-ID:controllers:path", with hierarchy 0 and no controllers for v2 */
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+		if ((controllers = strchr(line, ':')) == NULL) { continue; }
+		controllers++;
+		if ((path = strchr(controllers, ':')) == NULL) { continue; }
+		*path++ = '\0';
+		v2 = (strncmp(line, "0:", 2) == 0) && (*controllers == '\0');
+		has_cpu = v2;
+		for (tok = controllers; *tok != '\0' && !has_cpu; tok += len + (tok[len] == ',')) {
+			len = strcspn(tok, ",");
+			has_cpu = (len == 3) && (strncmp(tok, "cpu", 3) == 0);
 		}
+		if (!has_cpu) { continue; }
 
+		nmounts = v2? (sizeof(mounts_v2) / sizeof(char*)) : (sizeof(mounts_v1) / sizeof(char*));
+		for (size_t m = 0; m < nmounts; m++)
+		{
+			snprintf(dir, sizeof(dir), "%s%s", v2? mounts_v2[m] : mounts_v1[m], (strcmp(path, "/") == 0)? "" : path);
+			len = strlen(v2? mounts_v2[m] : mounts_v1[m]);
+			while (true)
+			{
+				quota = cgroup_dir_quota(dir, v2);
+				if (quota > 0 && (limit == 0 || quota < limit)) { limit = quota; }
+				if (strlen(dir) <= len || (end = strrchr(dir, '/')) == NULL) { break; }
+				*end = '\0';
+			}
+		}
 	}
+	fclose(f);
+	return limit;
+}
+#endif
+
+/*	Number of CPUs that this process can use: the CPUs in its affinity mask, capped by the CPU quota of its cgroup
+	(rounded down, as threads that exceed the quota get throttled while the others wait for them). Containers get
+	limited through quotas while still seeing all the cores of the host, which is what 'omp_get_num_procs' and
+	similar functions report. Returns 0 if the number can't be determined. */
+int available_cpus(void)
+{
+	int ncpus = 0;
+	#if defined(__linux__) && defined(CPU_COUNT)
+	cpu_set_t mask;
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &mask) == 0) { ncpus = CPU_COUNT(&mask); }
+	#endif
+	#ifdef _OPENMP
+	if (ncpus <= 0) { ncpus = omp_get_num_procs(); }
+	#endif
+
+	#ifdef __linux__
+	double quota = cgroup_cpu_quota();
+	if (quota > 0 && (ncpus <= 0 || quota < (double)ncpus)) { ncpus = (quota >= 1)? (int) quota : 1; }
+	#endif
+	return ncpus;
+}
+
+/*	When training with 'adapt_threads', the CPUs available are checked again before a half-step if this much time
+	has passed since the last check, and the next half-steps use that many threads (up to the number requested). */
+#define THREADS_CHECK_SECONDS 1.0
+
+int adapt_nthreads(int nthreads, int max_threads, double *t_next_check)
+{
+	double t = get_time_seconds();
+	if (t < *t_next_check) { return nthreads; }
+	*t_next_check = t + THREADS_CHECK_SECONDS;
+	int ncpus = available_cpus();
+	if (ncpus <= 0) { return nthreads; }
+	return (ncpus < max_threads)? ncpus : max_threads;
 }
 
 #ifndef _FOR_R
@@ -204,17 +902,41 @@ typedef struct fdata {
 	size_t *X_ind;
 	size_t nnz_this;
 	double l2_reg;
+	double *ratio; /* buffer of size nnz_this, only used with a gathered panel and large k (NULL otherwise) */
+	nnz_rec *Xp; /* same non-zeros in packed format, read instead of 'X' and 'X_ind' if not NULL */
+	void *F_lowp; /* reduced-precision copy of 'F' from which to read the rows of the non-zeros instead (NULL if not used) */
+	int prec;
+	bool gathered; /* whether 'F' is a panel with the rows gathered in the same order as the non-zeros */
 } fdata;
 
+#define fdata_ind(fun_data, i) nnz_ind((fun_data)->X_ind, (fun_data)->Xp, (i))
+#define fdata_val(fun_data, i) nnz_val((fun_data)->X, (fun_data)->Xp, (i))
+#define fdata_row(fun_data, i, n) ( (fun_data)->F + ((fun_data)->gathered? (i) : fdata_ind((fun_data), (i))) * (size_t)(n) )
+
 void calc_fun_single(double x[], int n, double *f, void *data)
 {
 	fdata* fun_data = (fdata*) data;
 	double out = cblas_ddot(n, fun_data->Fsum, 1, x, 1);
 	double norm_sq = cblas_ddot(n, x, 1, x, 1);
 	out += fun_data->l2_reg * norm_sq;
+	if (fun_data->ratio != NULL)
+	{
+		cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)fun_data->nnz_this, n, 1, fun_data->F, n, x, 1, 0, fun_data->ratio, 1);
+		for (size_t i = 0; i < fun_data->nnz_this; i++) { out -= fdata_val(fun_data, i) * log(fun_data->ratio[i]); }
+		*f = out;
+		return;
+	}
+	if (fun_data->F_lowp != NULL)
+	{
+		for (size_t i = 0; i < fun_data->nnz_this; i++) {
+			out -= fdata_val(fun_data, i) * log( dot_lowp(x, fun_data->F_lowp, fun_data->prec, fdata_ind(fun_data, i), (size_t)n) );
+		}
+		*f = out;
+		return;
+	}
 	for (size_t i = 0; i < fun_data->nnz_this; i++)
 	{
-		out -= fun_data->X[i] * log( cblas_ddot(n, x, 1, fun_data->F + fun_data->X_ind[i] * n, 1) );
+		out -= fdata_val(fun_data, i) * log( cblas_ddot(n, x, 1, fdata_row(fun_data, i, n), 1) );
 	}
 	*f = out;
 }
@@ -224,17 +946,32 @@ void calc_grad_single(double x[], int n, double grad[], void *data)
 	fdata* fun_data = (fdata*) data;
 	memcpy(grad, fun_data->Fsum, sizeof(double) * n);
 	cblas_daxpy(n, 2 * n * fun_data->l2_reg, x, 1, grad, 1);
+	if (fun_data->ratio != NULL)
+	{
+		cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)fun_data->nnz_this, n, 1, fun_data->F, n, x, 1, 0, fun_data->ratio, 1);
+		for (size_t i = 0; i < fun_data->nnz_this; i++) { fun_data->ratio[i] = - fdata_val(fun_data, i) / fun_data->ratio[i]; }
+		cblas_dgemv(CblasRowMajor, CblasTrans, (int)fun_data->nnz_this, n, 1, fun_data->F, n, fun_data->ratio, 1, 1, grad, 1);
+		return;
+	}
+	if (fun_data->F_lowp != NULL)
+	{
+		for (size_t i = 0; i < fun_data->nnz_this; i++) {
+			axpy_lowp(- fdata_val(fun_data, i) / dot_lowp(x, fun_data->F_lowp, fun_data->prec, fdata_ind(fun_data, i), (size_t)n),
+					  fun_data->F_lowp, fun_data->prec, fdata_ind(fun_data, i), (size_t)n, grad);
+		}
+		return;
+	}
 	for (size_t i = 0; i < fun_data->nnz_this; i++)
 	{
-		cblas_daxpy(n, - fun_data->X[i] / cblas_ddot(n, x, 1, fun_data->F + fun_data->X_ind[i] * n, 1),
-					fun_data->F + fun_data->X_ind[i] * n, 1, grad, 1);
+		cblas_daxpy(n, - fdata_val(fun_data, i) / cblas_ddot(n, x, 1, fdata_row(fun_data, i, n), 1),
+					fdata_row(fun_data, i, n), 1, grad, 1);
 	}
 }
 
 void optimize_cg_single(double curr[], double X[], size_t X_ind[], size_t nnz_this, double F[], double Fsum[], int k, double l2_reg)
 {
 
-	fdata data = { F, Fsum, X, X_ind, nnz_this, l2_reg };
+	fdata data = { F, Fsum, X, X_ind, nnz_this, l2_reg, NULL, NULL };
 	double fun_val;
 	size_t niter;
 	size_t nfeval;
@@ -247,44 +984,392 @@ void optimize_cg_single(double curr[], double X[], size_t X_ind[], size_t nnz_th
 		1, NULL, 1, 0);
 }
 
-void cg_iteration(double *A, double *B, double *Xr, size_t *Xr_indptr, size_t *Xr_indices, size_t dimA, size_t k,
-	double *Bsum, size_t npass, double l2_reg, int ncores)
+/*	Fold-in of a single row with a bounded amount of work, for when latency matters.
+	Solvers:
+		foldin_cg: same conjugate gradient procedure as 'optimize_cg_single', limited to 'max_iter' iterations
+		           and 'max_feval' function evaluations ('max_seconds' is not checked).
+		foldin_pgd: projected gradient steps scaled by the inverse of the diagonal of the Hessian, with
+		            step-halving when the objective doesn't decrease. Each iteration makes one pass over the
+		            non-zeros for the gradient and another per function evaluation. Stops after 'max_iter'
+		            iterations, 'max_feval' function evaluations, or 'max_seconds' seconds (if > 0),
+		            whichever comes first.
+	'curr' must contain the starting point (e.g. the current factors for a warm start). 'buffer' must have
+	space for 4*k entries (or pass NULL to allocate it). */
+typedef enum foldin_solver_t {foldin_cg = 0, foldin_pgd = 1} foldin_solver_t;
+
+void fold_in_single(double curr[], double X[], size_t X_ind[], size_t nnz_this, double F[], double Fsum[], int k, double l2_reg,
+	int solver, size_t max_iter, size_t max_feval, double max_seconds, double *buffer)
+{
+	fdata data = { F, Fsum, X, X_ind, nnz_this, l2_reg, NULL, NULL };
+	double fun_val;
+	size_t niter;
+	size_t nfeval;
+	bool free_buffer = false;
+	if (buffer == NULL)
+	{
+		buffer = (double*) malloc(sizeof(double) * k * 4);
+		if (buffer == NULL) { return; }
+		free_buffer = true;
+	}
+
+	if (solver == foldin_cg)
+	{
+		minimize_nonneg_cg(
+			curr, k, &fun_val,
+			calc_fun_single, calc_grad_single, NULL, (void*) &data,
+			1e-1, max_feval, max_iter, &niter, &nfeval,
+			0.25, 0.01, 20,
+			1, buffer, 1, 0);
+		goto cleanup;
+	}
+
+	double *grad = buffer;
+	double *hess_diag = buffer + k;
+	double *new_x = buffer + 2 * k;
+	double *row;
+	double pred, ratio, step, new_fun_val;
+	double t_end = (max_seconds > 0)? (get_time_seconds() + max_seconds) : HUGE_VAL;
+	size_t feval = 1;
+	calc_fun_single(curr, k, &fun_val, (void*) &data);
+
+	for (size_t iter = 0; iter < max_iter && feval < max_feval; iter++)
+	{
+		/* gradient: Fsum + 2*l2*x - sum(X[i]/<F[i], x> * F[i]),  diag(Hessian): 2*l2 + sum(X[i]/<F[i], x>^2 * F[i]^2) */
+		for (int kk = 0; kk < k; kk++) {
+			grad[kk] = Fsum[kk] + 2 * l2_reg * curr[kk];
+			hess_diag[kk] = 2 * l2_reg;
+		}
+		for (size_t i = 0; i < nnz_this; i++)
+		{
+			row = F + X_ind[i] * (size_t)k;
+			pred = cblas_ddot(k, row, 1, curr, 1);
+			ratio = X[i] / pred;
+			for (int kk = 0; kk < k; kk++) {
+				grad[kk] -= ratio * row[kk];
+				hess_diag[kk] += ratio / pred * row[kk] * row[kk];
+			}
+		}
+
+		step = 1;
+		new_fun_val = HUGE_VAL;
+		while (feval < max_feval && get_time_seconds() < t_end)
+		{
+			for (int kk = 0; kk < k; kk++) {
+				new_x[kk] = nonneg(curr[kk] - step * grad[kk] / fmax(hess_diag[kk], 1e-12));
+			}
+			calc_fun_single(new_x, k, &new_fun_val, (void*) &data);
+			feval++;
+			if (new_fun_val < fun_val) { break; }
+			step *= 0.5;
+		}
+
+		if (!(new_fun_val < fun_val)) { break; }
+		memcpy(curr, new_x, sizeof(double) * k);
+		if ((fun_val - new_fun_val) <= 1e-8 * fabs(fun_val)) { break; }
+		fun_val = new_fun_val;
+		if (get_time_seconds() >= t_end) { break; }
+	}
+
+	cleanup:
+		if (free_buffer) { free(buffer); }
+}
+
+void cg_iteration(double *A, double *B, void *B_lowp, int prec, double *Xr, size_t *Xr_indptr, size_t *Xr_indices, nnz_rec *Xr_packed, size_t dimA, size_t k,
+	double *Bsum, size_t npass, double l2_reg, csc_build *csc_job, int ncores)
 {
 
 	int k_int = (int) k;
 
-	fdata data = { B, Bsum, NULL, NULL, 0, l2_reg };
+	fdata data = { B, Bsum, NULL, NULL, 0, l2_reg, NULL, NULL };
 	double fun_val;
 	size_t niter;
 	size_t nfeval;
+	size_t panel_max_nnz = calc_panel_max_nnz(k);
 
 	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
 	long ia;
 	#endif
 
-	#pragma omp parallel for schedule(dynamic) num_threads(ncores) private(fun_val, niter, nfeval) firstprivate(data, dimA, Xr, Xr_indptr, Xr_indices, npass, A, k, k_int)
-	for (size_t_for ia = 0; ia < dimA; ia++)
+	#pragma omp parallel num_threads(ncores) private(fun_val, niter, nfeval) firstprivate(data, dimA, Xr, Xr_indptr, Xr_indices, Xr_packed, npass, A, B, B_lowp, prec, k, k_int, panel_max_nnz, csc_job)
 	{
-		data.X = Xr + Xr_indptr[ia];
-		data.X_ind = Xr_indices + Xr_indptr[ia];
-		data.nnz_this = Xr_indptr[ia + 1] - Xr_indptr[ia];
-
-		minimize_nonneg_cg(
-			A + ia*k, k_int, &fun_val,
-			calc_fun_single, calc_grad_single, NULL, (void*) &data,
-			1e-5, 150, 50, &niter, &nfeval,
-			0.25, 0.01, 25,
-			1, buffer_arr, 1, 0);
+		if (csc_job != NULL)
+		{
+			#pragma omp single nowait
+			build_csc(csc_job);
+		}
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for ia = 0; ia < dimA; ia++)
+		{
+			data.X = (Xr == NULL)? NULL : (Xr + Xr_indptr[ia]);
+			data.X_ind = (Xr_indices == NULL)? NULL : (Xr_indices + Xr_indptr[ia]);
+			data.nnz_this = Xr_indptr[ia + 1] - Xr_indptr[ia];
+			data.F = B;
+			data.ratio = NULL;
+			data.Xp = (Xr_packed == NULL)? NULL : (Xr_packed + Xr_indptr[ia]);
+			data.F_lowp = NULL;
+			data.gathered = false;
+
+			/* the same rows are read in every function and gradient evaluation, so they are gathered once into
+			   the panel (widened to double) if they fit in it - otherwise, they are read from the reduced-precision
+			   copy in each evaluation, so that the results are the same either way */
+			if (B_lowp != NULL && (panel_arr == NULL || data.nnz_this > panel_max_nnz))
+			{
+				data.F_lowp = B_lowp;
+				data.prec = prec;
+			}
+			else if (panel_arr != NULL && data.nnz_this <= panel_max_nnz)
+			{
+				if (B_lowp != NULL) {
+					gather_panel_lowp(panel_arr, B_lowp, prec, data.X_ind, data.Xp, data.nnz_this, k);
+				} else {
+					gather_panel(panel_arr, B, data.X_ind, data.Xp, data.nnz_this, k);
+				}
+				data.F = panel_arr;
+				data.gathered = true;
+				if (k >= LARGE_K_THRESHOLD && data.nnz_this >= LARGE_K_MIN_NNZ) {
+					data.ratio = panel_arr + panel_max_nnz * k;
+				}
+			}
+
+			minimize_nonneg_cg(
+				A + ia*k, k_int, &fun_val,
+				calc_fun_single, calc_grad_single, NULL, (void*) &data,
+				1e-5, 150, 50, &niter, &nfeval,
+				0.25, 0.01, 25,
+				1, buffer_arr, 1, 0);
+		}
 	}
 }
 #endif
 
 
+/*	Single-precision phase, which can optionally be used for the first iterations, as these move the factors far
+	from their random initialization and don't need double precision. A and B are copied to float, and the
+	non-zeros are read from the packed records, so that the whole procedure reads half the bytes. The kernels are
+	plain loops instead of BLAS calls, since R's BLAS doesn't provide single-precision routines, and are marked for
+	vectorization, as compilers won't do it by themselves at -O2 without reassociating the sums. */
+#if defined(_OPENMP) && (_OPENMP >= 201307) /* OpenMP >= 4.0 */
+	#define F32_SIMD
+#endif
+void f32_colsums(double *restrict out, double *restrict sumsq, float *restrict M, size_t nrow, size_t k)
+{
+	memset(out, 0, sizeof(double) * k);
+	*sumsq = 0;
+	for (size_t row = 0; row < nrow; row++) {
+		for (size_t kk = 0; kk < k; kk++) {
+			out[kk] += M[row*k + kk];
+			*sumsq += (double)M[row*k + kk] * (double)M[row*k + kk];
+		}
+	}
+}
+
+/*	Same as 'pgd_iteration' with float factors, with 'grad_buffer' having space for k floats per thread. If passing
+	'calc_llk', returns sum(X * log(<A[i], B[j]>)) over the non-zeros, as they were before the updates. */
+double f32_pgd_iteration(float *restrict A, float *restrict B, nnz_rec *restrict Xp, size_t *restrict indptr, size_t dimA, size_t k,
+	float cnst_div, float *restrict cnst_sum, float step_size, size_t npass, bool calc_llk, float *restrict grad_buffer, int ncores)
+{
+	double llk = 0;
+	float *restrict grad;
+	float *restrict a;
+	float *restrict b;
+	float pred;
+	int tid = 0;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long ia;
+	#endif
+
+	#pragma omp parallel num_threads(ncores) private(grad, a, b, pred, tid) firstprivate(A, B, Xp, indptr, dimA, k, cnst_div, cnst_sum, step_size, npass, calc_llk, grad_buffer) reduction(+:llk)
+	{
+		#ifdef _OPENMP
+		tid = omp_get_thread_num();
+		#endif
+		grad = grad_buffer + (size_t)tid * k;
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for ia = 0; ia < dimA; ia++)
+		{
+			a = A + ia*k;
+			for (size_t p = 0; p < npass; p++)
+			{
+				memset(grad, 0, sizeof(float) * k);
+				for (size_t i = indptr[ia]; i < indptr[ia + 1]; i++)
+				{
+					b = B + (size_t)Xp[i].ind * k;
+					pred = 0;
+					#ifdef F32_SIMD
+					#pragma omp simd reduction(+:pred)
+					#endif
+					for (size_t kk = 0; kk < k; kk++) { pred += a[kk] * b[kk]; }
+					if (calc_llk && p == 0) { llk += Xp[i].val * log(pred); }
+					pred = Xp[i].val / pred;
+					#ifdef F32_SIMD
+					#pragma omp simd
+					#endif
+					for (size_t kk = 0; kk < k; kk++) { grad[kk] += pred * b[kk]; }
+				}
+				#ifdef F32_SIMD
+				#pragma omp simd
+				#endif
+				for (size_t kk = 0; kk < k; kk++) {
+					a[kk] = (a[kk] + step_size * grad[kk] + cnst_sum[kk]) * cnst_div;
+					a[kk] = nonneg(a[kk]);
+				}
+			}
+		}
+	}
+	return llk;
+}
+
+/*	Runs up to 'maxiter' alternating PGD iterations in single precision, updating A, B, and the step size. If 'tol' > 0,
+	stops earlier once an iteration decreases the objective by less than 'tol' times its value. Returns the number of
+	iterations that were run (zero if it couldn't allocate memory, in which case A and B are not modified). */
+size_t run_f32_phase(double *restrict A, double *restrict B, nnz_rec *restrict Xr_packed, size_t *restrict Xr_indptr,
+	nnz_rec *restrict Xc_packed, size_t *restrict Xc_indptr, size_t dimA, size_t dimB, size_t k,
+	double l2_reg, double l1_reg, double *restrict step_size, size_t maxiter, double tol, size_t npass,
+	int adapt_threads, int ncores)
+{
+	int nthreads = ncores;
+	double t_next_check = 0;
+	float *A32 = (float*) malloc(sizeof(float) * dimA * k);
+	float *B32 = (float*) malloc(sizeof(float) * dimB * k);
+	float *grad_buffer = (float*) malloc(sizeof(float) * k * (size_t)ncores);
+	float *cnst_sum = (float*) malloc(sizeof(float) * k);
+	double *Asum = (double*) malloc(sizeof(double) * k);
+	double *Bsum = (double*) malloc(sizeof(double) * k);
+	size_t niter = 0;
+	if (A32 == NULL || B32 == NULL || grad_buffer == NULL || cnst_sum == NULL || Asum == NULL || Bsum == NULL) {
+		goto cleanup;
+	}
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long i;
+	#endif
+	#pragma omp parallel for schedule(static) num_threads(ncores) firstprivate(A, A32, dimA, k)
+	for (size_t_for i = 0; i < dimA * k; i++) { A32[i] = (float) A[i]; }
+	#pragma omp parallel for schedule(static) num_threads(ncores) firstprivate(B, B32, dimB, k)
+	for (size_t_for i = 0; i < dimB * k; i++) { B32[i] = (float) B[i]; }
+
+	bool calc_llk = tol > 0;
+	double fun_val = HUGE_VAL, fun_prev = HUGE_VAL;
+	double Asumsq, Bsumsq, llk;
+	float cnst_div;
+	for (niter = 0; niter < maxiter; )
+	{
+		cnst_div = (float) (1 / (1 + 2 * l2_reg * (*step_size)));
+
+		if (adapt_threads) { nthreads = adapt_nthreads(nthreads, ncores, &t_next_check); }
+		f32_colsums(Bsum, &Bsumsq, B32, dimB, k);
+		if (calc_llk) { f32_colsums(Asum, &Asumsq, A32, dimA, k); }
+		for (size_t kk = 0; kk < k; kk++) { cnst_sum[kk] = (float) (-(*step_size) * (Bsum[kk] + l1_reg)); }
+		llk = f32_pgd_iteration(A32, B32, Xr_packed, Xr_indptr, dimA, k, cnst_div, cnst_sum, (float) *step_size,
+								npass, calc_llk, grad_buffer, nthreads);
+
+		/* objective at the start of this iteration */
+		if (calc_llk)
+		{
+			fun_val = - llk + l2_reg * (Asumsq + Bsumsq);
+			for (size_t kk = 0; kk < k; kk++) { fun_val += Asum[kk] * Bsum[kk] + l1_reg * (Asum[kk] + Bsum[kk]); }
+		}
+
+		if (adapt_threads) { nthreads = adapt_nthreads(nthreads, ncores, &t_next_check); }
+		f32_colsums(Asum, &Asumsq, A32, dimA, k);
+		for (size_t kk = 0; kk < k; kk++) { cnst_sum[kk] = (float) (-(*step_size) * (Asum[kk] + l1_reg)); }
+		f32_pgd_iteration(B32, A32, Xc_packed, Xc_indptr, dimB, k, cnst_div, cnst_sum, (float) *step_size,
+						  npass, false, grad_buffer, nthreads);
+
+		*step_size *= 0.5;
+		niter++;
+		if (calc_llk && fun_prev - fun_val < tol * fabs(fun_val)) { break; }
+		fun_prev = fun_val;
+	}
+
+	#pragma omp parallel for schedule(static) num_threads(ncores) firstprivate(A, A32, dimA, k)
+	for (size_t_for i = 0; i < dimA * k; i++) { A[i] = (double) A32[i]; }
+	#pragma omp parallel for schedule(static) num_threads(ncores) firstprivate(B, B32, dimB, k)
+	for (size_t_for i = 0; i < dimB * k; i++) { B[i] = (double) B32[i]; }
+
+	cleanup:
+		free(A32);
+		free(B32);
+		free(grad_buffer);
+		free(cnst_sum);
+		free(Asum);
+		free(Bsum);
+		return niter;
+}
+
+
+/*	Allocates the thread-local buffers of the threads in a team of 'nthreads' that don't have them yet, so that
+	the number of threads can change between half-steps. 'panel_arr' is optional (pass 'panel_size' = 0 to skip).
+	Returns 0 if it succeeds or 1 if some 'buffer_arr' could not be allocated, in which case all the threads
+	other than the main one free their buffers before leaving, as the team will not be used with them. */
+int alloc_thread_buffers(size_t buffer_size, size_t panel_size, int nthreads)
+{
+	int status = 0;
+	#pragma omp parallel num_threads(nthreads) firstprivate(buffer_size, panel_size) shared(status)
+	{
+		int tid = 0;
+		#ifdef _OPENMP
+		tid = omp_get_thread_num();
+		#endif
+		if (buffer_arr == NULL) { buffer_arr = (double*) malloc(sizeof(double) * buffer_size); }
+		if (buffer_arr == NULL) { status = 1; }
+		if (panel_arr == NULL && panel_size > 0) { panel_arr = (double*) malloc(sizeof(double) * panel_size); }
+
+		#pragma omp barrier
+		if (status && tid > 0)
+		{
+			free(buffer_arr);
+			free(panel_arr);
+			buffer_arr = NULL;
+			panel_arr = NULL;
+		}
+	}
+	return status;
+}
+
+/*	Frees the thread-local buffers of the threads numbered 'keep' and above in a team of 'nthreads' */
+void release_thread_buffers(int keep, int nthreads)
+{
+	#pragma omp parallel num_threads(nthreads) firstprivate(keep)
+	{
+		int tid = 0;
+		#ifdef _OPENMP
+		tid = omp_get_thread_num();
+		#endif
+		if (tid >= keep)
+		{
+			free(buffer_arr);
+			free(panel_arr);
+			buffer_arr = NULL;
+			panel_arr = NULL;
+		}
+	}
+}
+
+/*	Threads to use for the next half-step when adapting to the CPUs available. Threadprivate variables are not
+	guaranteed to persist when the size of the team changes (e.g. GNU's runtime ends the threads that are left
+	out when it shrinks), so the threads that leave release their buffers, and the new team allocates the ones
+	that it's missing. If that fails, continues with only the main thread, whose buffers are always kept (the
+	other threads free theirs in 'alloc_thread_buffers'). */
+int resize_threads(int nthreads, int max_threads, double *t_next_check, size_t buffer_size, size_t panel_size)
+{
+	int new_nthreads = adapt_nthreads(nthreads, max_threads, t_next_check);
+	if (new_nthreads == nthreads) { return nthreads; }
+	if (new_nthreads < nthreads) { release_thread_buffers(new_nthreads, nthreads); }
+	if (alloc_thread_buffers(buffer_size, panel_size, new_nthreads)) { return 1; }
+	return new_nthreads;
+}
+
 /* Main function for Proximal Gradient and Conjugate Gradient solvers
 	A                           : Pointer to the already-initialized A matrix (user-factor)
 	Xr, Xr_indptr, Xr_indices   : Pointers to the X matrix in row-sparse format
 	B                           : Pointer to the already-initialized B matrix (item-factor)
-	Xc, Xc_indptr, Xc_indices   : Pointers to the X matrix in column-sparse format
+	Xc, Xc_indptr, Xc_indices   : Pointers to the X matrix in column-sparse format. Can pass NULL, in which case it will
+	                              be built from the row-sparse data if needed, overlapping with the first half-step
+	                              when possible (see 'build_csc'). Indices will be sorted.
 	dimA                        : Number of rows in the A matrix
 	dimB                        : Number of rows in the B matrix
 	k                           : Dimensionality for the factorizing matrices (number of columns of A and B matrices)
@@ -294,7 +1379,40 @@ void cg_iteration(double *A, double *B, double *Xr, size_t *Xr_indptr, size_t *X
 	step_size                   : Initial step size for PGD updates (will be decreased by 1/2 every iteration - ignored for CG)
 	numiter                     : Number of iterations for which to run the procedure
 	npass                       : Number of updates to the same matrix per iteration
-	ncores                      : Number of threads to use
+	iter_scheme                 : How to structure each iteration - one of:
+	                                alternating_iter: update all of A from the CSR data, then all of B from the CSC data.
+	                                fused_iter: update A from the CSR data, scattering the gradients for B in the same
+	                                            sweep, then apply the B update in a dense pass. Reads the sparse data
+	                                            once per iteration and does not use the CSC data (can pass NULL), but
+	                                            B gets only one update per iteration. Ignored for CG.
+	                                stratified_iter: split the data into a grid of nblocks x nblocks tiles, and update
+	                                                 both A and B tile-by-tile, with threads working on tiles that
+	                                                 don't share rows. Requires sorted indices. Ignored for CG.
+	nblocks                     : Number of blocks for the stratified scheme (pass 0 to determine it automatically)
+	fixed_prec                  : Precision in which to read the matrix that is held fixed in each half-step - one of:
+	                                prec_double: read it directly from A or B.
+	                                prec_float, prec_bfloat16: read it from a reduced-precision copy which is refreshed
+	                                                           after each half-step. Calculations and the A and B
+	                                                           matrices are still in double precision. Ignored for
+	                                                           the stratified scheme.
+	packed_nnz                  : Whether to make copies of the non-zero entries with the indices and values interleaved
+	                              (as 32-bit integers and floats), which the gradient calculations can read in a single
+	                              stream. The CSC data built internally is then kept only in packed form. Ignored for
+	                              the stratified scheme, if a dimension doesn't fit in 32 bits, or if some value is not
+	                              exactly representable as a float (e.g. non-integer counts), as the values would get
+	                              rounded otherwise.
+	f32_iters                   : Maximum number of initial iterations to run entirely in single precision (with float
+	                              copies of A and B and packed non-zeros), after which the factors are promoted back to
+	                              double for the remaining iterations (see 'run_f32_phase'). These are always alternating
+	                              PGD iterations, and need the CSC data regardless of 'iter_scheme'. Ignored for CG, or
+	                              if a dimension doesn't fit in 32 bits.
+	f32_tol                     : Switch to double precision earlier once a single-precision iteration decreases the
+	                              objective by less than this fraction of its value (pass 0 to switch only after
+	                              'f32_iters' iterations)
+	adapt_threads               : Whether to check the CPUs available to the process (affinity mask and cgroup quota,
+	                              see 'available_cpus') before the half-steps, and run them with that many threads,
+	                              up to 'ncores'. The CPUs are checked at most once per THREADS_CHECK_SECONDS.
+	ncores                      : Number of threads to use (maximum number if passing 'adapt_threads')
 Matrices A and B are optimized in-place.
 Function does not have a return value.
 */
@@ -303,27 +1421,90 @@ void run_poismf(
 	double *restrict B, double *restrict Xc, size_t *restrict Xc_indptr, size_t *restrict Xc_indices,
 	const size_t dimA, const size_t dimB, const size_t k,
 	const double l2_reg, const double l1_reg, const int use_cg, double step_size,
-	const size_t numiter, const size_t npass, const int ncores)
+	const size_t numiter, const size_t npass, const int iter_scheme, size_t nblocks, const int fixed_prec, const int packed_nnz,
+	const size_t f32_iters, const double f32_tol, const int adapt_threads, const int ncores)
 {
 
+	int nthreads = ncores;
+	double t_next_check = 0;
+	if (adapt_threads) { nthreads = adapt_nthreads(nthreads, ncores, &t_next_check); }
 	double *cnst_sum = (double*) malloc(sizeof(double) * k);
 	double cnst_div;
 	int k_int = (int) k;
 	double neg_step_sz = -step_size;
 	bool buffer_alloc_error = false;
-	#pragma omp parallel firstprivate(use_cg)
+	bool use_stratified = (iter_scheme == stratified_iter) && !use_cg;
+	if (use_stratified && nblocks == 0) { nblocks = choose_nblocks(dimA, dimB, k, ncores); }
+
+	/* Fused iterations accumulate the gradient for B with one copy per thread if that takes no more memory
+	   than the CSC representation of the data which they avoid reading, or with a single shared copy otherwise */
+	bool use_fused = (iter_scheme == fused_iter) && !use_cg;
+	bool fused_per_thread = false;
+	double *gradB_buffer = NULL;
+	double *Asum_buffer = NULL;
+	if (use_fused)
 	{
-		if (use_cg) {
-			buffer_arr = (double*) malloc(sizeof(double) * k * 4);
-		} else {
-			buffer_arr = (double*) malloc(sizeof(double) * k);
+		fused_per_thread = ((size_t)ncores * dimB * k * sizeof(double)) <= (Xr_indptr[dimA] * (sizeof(double) + sizeof(size_t)));
+		gradB_buffer = (double*) malloc(sizeof(double) * dimB * k * (fused_per_thread? (size_t)ncores : 1));
+		Asum_buffer = (double*) malloc(sizeof(double) * k * (size_t)ncores);
+		if (gradB_buffer == NULL || Asum_buffer == NULL) { buffer_alloc_error = true; }
+	}
+
+	/* Reduced-precision copies of the fixed matrices - A's one is only needed when B is updated from the CSC data */
+	bool use_lowp = (fixed_prec == prec_float || fixed_prec == prec_bfloat16) && !use_stratified;
+	size_t lowp_elt_size = (fixed_prec == prec_float)? sizeof(float) : sizeof(uint16_t);
+	void *A_lowp = NULL;
+	void *B_lowp = NULL;
+	if (use_lowp)
+	{
+		B_lowp = malloc(lowp_elt_size * dimB * k);
+		if (!use_fused) { A_lowp = malloc(lowp_elt_size * dimA * k); }
+		if (B_lowp == NULL || (!use_fused && A_lowp == NULL)) { buffer_alloc_error = true; }
+	}
+
+	/* CSC data which is needed but not passed gets built during the first half-step for A, or before starting
+	   if the single-precision phase or the stratified scheme need it from the beginning */
+	bool run_f32 = (f32_iters > 0) && !use_cg && dimA <= UINT32_MAX && dimB <= UINT32_MAX;
+	csc_build csc_job = {Xr, Xr_indptr, Xr_indices, dimA, dimB, NULL, NULL, NULL, 0};
+	csc_build *csc_pending = NULL;
+	if (Xc == NULL && (!use_fused || run_f32))
+	{
+		if (use_stratified || run_f32)
+		{
+			build_csc(&csc_job);
+			if (csc_job.status) { buffer_alloc_error = true; }
+			Xc = csc_job.Xc;
+			Xc_indptr = csc_job.Xc_indptr;
+			Xc_indices = csc_job.Xc_indices;
 		}
-		if (buffer_arr == NULL) {
-			buffer_alloc_error = true;
+		else { csc_pending = &csc_job; }
+	}
+
+	/* Packed copies of the data - these are optional, if they can't be allocated (or the values are not exact in
+	   single precision) the original arrays are used. Once packed, the CSC arrays built here are freed, while the
+	   ones passed as inputs are left as they are. */
+	nnz_rec *Xr_packed = NULL;
+	nnz_rec *Xc_packed = NULL;
+	bool pack_csc = packed_nnz && !use_stratified && !use_fused && dimA <= UINT32_MAX && dimB <= UINT32_MAX;
+	if (packed_nnz && !use_stratified && dimA <= UINT32_MAX && dimB <= UINT32_MAX)
+	{
+		Xr_packed = pack_nonzeros(Xr, Xr_indices, Xr_indptr[dimA], true, nthreads);
+		if (pack_csc && Xr_packed != NULL && Xc != NULL) { Xc_packed = pack_nonzeros(Xc, Xc_indices, Xc_indptr[dimB], true, nthreads); }
+		if (Xc_packed != NULL && Xc == csc_job.Xc)
+		{
+			release_split_csc(&csc_job);
+			Xc = NULL;
+			Xc_indices = NULL;
 		}
 	}
 
-	#pragma omp barrier
+	bool use_panel = use_cg || (npass > 1) || (k >= LARGE_K_THRESHOLD) || use_lowp;
+	size_t panel_size = use_panel? (calc_panel_max_nnz(k) * (k + 1)) : 0;
+	/* CG takes 4*k entries, the stratified tiles 2*k (gradient and column sums), and the other schemes k */
+	size_t buffer_size = use_cg? (k * 4) : (use_stratified? (k * 2) : k);
+	/* the panel is optional - if it can't be allocated, rows will be read from their original locations */
+	if (alloc_thread_buffers(buffer_size, panel_size, nthreads)) { buffer_alloc_error = true; }
+
 	if (buffer_alloc_error || cnst_sum == NULL) {
 		fprintf(stderr, "Error: Could not allocate memory for the procedure.\n");
 		goto cleanup;
@@ -336,36 +1517,99 @@ void run_poismf(
 		openblas_set_num_threads(1);
 	#endif
 
-	for (size_t fulliter = 0; fulliter < numiter; fulliter++){
+	/* Optional single-precision phase, which reads packed copies of both the CSR and CSC data */
+	size_t fulliter_start = 0;
+	if (f32_iters > 0 && !use_cg && Xc_indptr != NULL && dimA <= UINT32_MAX && dimB <= UINT32_MAX)
+	{
+		nnz_rec *Xr_p = (Xr_packed != NULL)? Xr_packed : pack_nonzeros(Xr, Xr_indices, Xr_indptr[dimA], false, nthreads);
+		nnz_rec *Xc_p = (Xc_packed != NULL)? Xc_packed : pack_nonzeros(Xc, Xc_indices, Xc_indptr[dimB], false, nthreads);
+		if (Xr_p != NULL && Xc_p != NULL) {
+			fulliter_start = run_f32_phase(A, B, Xr_p, Xr_indptr, Xc_p, Xc_indptr, dimA, dimB, k, l2_reg, l1_reg, &step_size,
+										   (f32_iters < numiter)? f32_iters : numiter, f32_tol, npass,
+										   adapt_threads, adapt_threads? ncores : nthreads);
+			neg_step_sz = -step_size;
+		}
+		if (Xr_p != Xr_packed) { free(Xr_p); }
+		if (Xc_p != Xc_packed) { free(Xc_p); }
+	}
+
+	for (size_t fulliter = fulliter_start; fulliter < numiter; fulliter++){
+
+		if (adapt_threads) { nthreads = resize_threads(nthreads, ncores, &t_next_check, buffer_size, panel_size); }
+
+		if (use_stratified)
+		{
+			stratified_iteration(A, B, Xr, Xr_indptr, Xr_indices, Xc, Xc_indptr, Xc_indices,
+								 dimA, dimB, k, l2_reg, l1_reg, step_size, npass, nblocks, nthreads);
+			step_size *= 0.5;
+			continue;
+		}
 
 		/* Constants to use later */
 		cnst_div = 1 / (1 + 2 * l2_reg * step_size);
-		sum_by_cols(cnst_sum, B, dimB, k, ncores);
+		sum_by_cols(cnst_sum, B, dimB, k, nthreads);
 		if (l1_reg > 0) { for (size_t kk = 0; kk < k; kk++) { cnst_sum[kk] += l1_reg; } }
 
+		if (use_lowp) { refresh_lowp_copy(B_lowp, B, dimB * k, fixed_prec, nthreads); }
+
+		if (use_fused)
+		{
+			cblas_dscal(k_int, neg_step_sz, cnst_sum, 1);
+			pgd_iteration_fused(A, B, B_lowp, fixed_prec, Xr, Xr_indptr, Xr_indices, Xr_packed, dimA, dimB, k, cnst_div, cnst_sum, step_size, l1_reg, npass,
+								gradB_buffer, Asum_buffer, fused_per_thread, nthreads);
+			step_size *= 0.5;
+			neg_step_sz = -step_size;
+			continue;
+		}
+
 		#ifndef _FOR_R
 		if (use_cg) {
-			cg_iteration(A, B, Xr, Xr_indptr, Xr_indices, dimA, k, cnst_sum, npass, l2_reg, ncores);
+			cg_iteration(A, B, B_lowp, fixed_prec, Xr, Xr_indptr, Xr_indices, Xr_packed, dimA, k, cnst_sum, npass, l2_reg, csc_pending, nthreads);
 		} else {
 		#endif
 			cblas_dscal(k_int, neg_step_sz, cnst_sum, 1);
-			pgd_iteration(A, B, Xr, Xr_indptr, Xr_indices, dimA, k, cnst_div, cnst_sum, step_size, npass, ncores);
+			pgd_iteration(A, B, B_lowp, fixed_prec, Xr, Xr_indptr, Xr_indices, Xr_packed, dimA, k, cnst_div, cnst_sum, step_size, npass, csc_pending, nthreads);
 		#ifndef _FOR_R
 		}
 		#endif
 
+		/* From here on the CSC data is needed */
+		if (csc_pending != NULL)
+		{
+			csc_pending = NULL;
+			if (csc_job.status) {
+				fprintf(stderr, "Error: Could not allocate memory for the procedure.\n");
+				goto cleanup;
+			}
+			Xc = csc_job.Xc;
+			Xc_indptr = csc_job.Xc_indptr;
+			Xc_indices = csc_job.Xc_indices;
+			if (pack_csc && Xr_packed != NULL)
+			{
+				Xc_packed = pack_nonzeros(Xc, Xc_indices, Xc_indptr[dimB], true, nthreads);
+				if (Xc_packed != NULL)
+				{
+					release_split_csc(&csc_job);
+					Xc = NULL;
+					Xc_indices = NULL;
+				}
+			}
+		}
+
 
 		/* Same procedure repeated for the B matrix */
-		sum_by_cols(cnst_sum, A, dimA, k, ncores);
+		if (adapt_threads) { nthreads = resize_threads(nthreads, ncores, &t_next_check, buffer_size, panel_size); }
+		if (use_lowp) { refresh_lowp_copy(A_lowp, A, dimA * k, fixed_prec, nthreads); }
+		sum_by_cols(cnst_sum, A, dimA, k, nthreads);
 		if (l1_reg > 0) { for (size_t kk = 0; kk < k; kk++) { cnst_sum[kk] += l1_reg; } }
 
 		#ifndef _FOR_R
 		if (use_cg) {
-			cg_iteration(B, A, Xr, Xc_indptr, Xc_indices, dimB, k, cnst_sum, npass, l2_reg, ncores);
+			cg_iteration(B, A, A_lowp, fixed_prec, Xc, Xc_indptr, Xc_indices, Xc_packed, dimB, k, cnst_sum, npass, l2_reg, NULL, nthreads);
 		} else {
 		#endif
 			cblas_dscal(k_int, neg_step_sz, cnst_sum, 1);
-			pgd_iteration(B, A, Xc, Xc_indptr, Xc_indices, dimB, k, cnst_div, cnst_sum, step_size, npass, ncores);
+			pgd_iteration(B, A, A_lowp, fixed_prec, Xc, Xc_indptr, Xc_indices, Xc_packed, dimB, k, cnst_div, cnst_sum, step_size, npass, NULL, nthreads);
 
 			/* Decrease step size after taking PGD steps in both matrices */
 			step_size *= 0.5;
@@ -378,12 +1622,430 @@ void run_poismf(
 
 	cleanup:
 		free(cnst_sum);
-		#pragma omp parallel
+		free(gradB_buffer);
+		free(Asum_buffer);
+		free(A_lowp);
+		free(B_lowp);
+		free(Xr_packed);
+		free(Xc_packed);
+		free(csc_job.Xc);
+		free(csc_job.Xc_indptr);
+		free(csc_job.Xc_indices);
+		release_thread_buffers(0, nthreads);
+}
+
+/*	Predictions for a block of rows of the dense-input engine are computed for all the columns at once, with the
+	number of rows in the block chosen so that they take about this much memory */
+#define DENSE_BLOCK_BYTES ((size_t)1 << 20)
+
+/*	Takes 'npass' proximal gradient steps on all the rows of A, with B fixed, from a dense matrix X (dimA, dimB) whose
+	entry (i, j) is at X[i*x_row_stride + j*x_col_stride]. For each block of rows, the predicted values are obtained
+	with a matrix multiplication A_blk * t(B), replaced by X / pred where X is non-zero (and by zero elsewhere), and
+	the gradients obtained as (X / pred) * B with a second multiplication. For updating B, swap A and B along with
+	the strides. Returns 0 if it succeeds or 1 if it runs out of memory. */
+int dense_pgd_iteration(double *restrict A, double *restrict B, double *restrict X, size_t x_row_stride, size_t x_col_stride,
+	size_t dimA, size_t dimB, size_t k, double cnst_div, double *restrict cnst_sum, double step_size, size_t npass, int ncores)
+{
+	int k_int = (int) k;
+	int status = 0;
+	size_t block_size = DENSE_BLOCK_BYTES / (dimB * sizeof(double));
+	size_t per_thread = (dimA + (size_t)ncores - 1) / (size_t)ncores;
+	if (block_size > per_thread) { block_size = per_thread; }
+	if (block_size == 0) { block_size = 1; }
+	size_t nblocks = (dimA + block_size - 1) / block_size;
+	/* the ratios are gathered in the order in which X is laid out in memory */
+	bool by_cols = x_row_stride < x_col_stride;
+	double *pred;
+	double *grad;
+	size_t st, nrows;
+	double x;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long blk;
+	#endif
+
+	#pragma omp parallel num_threads(ncores) private(pred, grad, st, nrows, x) firstprivate(A, B, X, x_row_stride, x_col_stride, dimA, dimB, k, k_int, cnst_div, cnst_sum, step_size, npass, block_size, nblocks, by_cols) shared(status)
+	{
+		pred = (double*) malloc(sizeof(double) * block_size * dimB);
+		grad = (double*) malloc(sizeof(double) * block_size * k);
+		if (pred == NULL || grad == NULL) { status = 1; }
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for blk = 0; blk < nblocks; blk++)
 		{
-			free(buffer_arr);
+			if (pred == NULL || grad == NULL) { continue; }
+			st = blk * block_size;
+			nrows = (st + block_size <= dimA)? block_size : (dimA - st);
+
+			for (size_t p = 0; p < npass; p++)
+			{
+				cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, (int)nrows, (int)dimB, k_int,
+							1, A + st*k, k_int, B, k_int, 0, pred, (int)dimB);
+				if (by_cols)
+				{
+					for (size_t j = 0; j < dimB; j++) {
+						for (size_t i = 0; i < nrows; i++) {
+							x = X[(st + i)*x_row_stride + j*x_col_stride];
+							pred[i*dimB + j] = (x != 0)? (x / pred[i*dimB + j]) : 0;
+						}
+					}
+				}
+				else
+				{
+					for (size_t i = 0; i < nrows; i++) {
+						for (size_t j = 0; j < dimB; j++) {
+							x = X[(st + i)*x_row_stride + j*x_col_stride];
+							pred[i*dimB + j] = (x != 0)? (x / pred[i*dimB + j]) : 0;
+						}
+					}
+				}
+				cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, (int)nrows, k_int, (int)dimB,
+							1, pred, (int)dimB, B, k_int, 0, grad, k_int);
+
+				for (size_t i = 0; i < nrows; i++)
+				{
+					cblas_daxpy(k_int, step_size, grad + i*k, 1, A + (st + i)*k, 1);
+					cblas_daxpy(k_int, 1, cnst_sum, 1, A + (st + i)*k, 1);
+					cblas_dscal(k_int, cnst_div, A + (st + i)*k, 1);
+					for (size_t kk = 0; kk < k; kk++) { A[(st + i)*k + kk] = nonneg(A[(st + i)*k + kk]); }
+				}
+			}
 		}
+
+		free(pred);
+		free(grad);
+	}
+	return status;
+}
+
+/*	Same as 'run_poismf' with PGD and alternating iterations, but taking the data as a dense matrix X (dimA, dimB)
+	which is used as-is, without making sparse copies of it. Entry (i, j) is at X[i*x_row_stride + j*x_col_stride],
+	so it can be either row-major (x_row_stride = dimB, x_col_stride = 1) or column-major (x_row_stride = 1,
+	x_col_stride = dimA). The gradients are calculated with matrix multiplications over blocks of rows (see
+	'dense_pgd_iteration'), so each iteration takes time proportional to dimA*dimB*k instead of nnz*k - this is
+	faster than the sparse procedure when a sizeable fraction of the entries are non-zero. With 'adapt_threads', the
+	number of threads is adjusted before the half-steps as in 'run_poismf'.
+	Returns 0 if it succeeds or 1 if it runs out of memory. */
+int run_poismf_dense(
+	double *restrict A, double *restrict B, double *restrict X, size_t x_row_stride, size_t x_col_stride,
+	const size_t dimA, const size_t dimB, const size_t k,
+	const double l2_reg, const double l1_reg, double step_size,
+	const size_t numiter, const size_t npass, const int adapt_threads, const int ncores)
+{
+	int k_int = (int) k;
+	int status = 0;
+	int nthreads = ncores;
+	double t_next_check = 0;
+	double cnst_div;
+	double *cnst_sum = (double*) malloc(sizeof(double) * k);
+	if (cnst_sum == NULL) { return 1; }
+
+	#if defined(_MKL_H_)
+		mkl_set_num_threads_local(1);
+	#elif defined(CBLAS_H)
+		openblas_set_num_threads(1);
+	#endif
+
+	for (size_t fulliter = 0; fulliter < numiter && !status; fulliter++)
+	{
+		cnst_div = 1 / (1 + 2 * l2_reg * step_size);
+
+		if (adapt_threads) { nthreads = adapt_nthreads(nthreads, ncores, &t_next_check); }
+		sum_by_cols(cnst_sum, B, dimB, k, nthreads);
+		if (l1_reg > 0) { for (size_t kk = 0; kk < k; kk++) { cnst_sum[kk] += l1_reg; } }
+		cblas_dscal(k_int, -step_size, cnst_sum, 1);
+		status = dense_pgd_iteration(A, B, X, x_row_stride, x_col_stride, dimA, dimB, k,
+									 cnst_div, cnst_sum, step_size, npass, nthreads);
+		if (status) { break; }
+
+		if (adapt_threads) { nthreads = adapt_nthreads(nthreads, ncores, &t_next_check); }
+		sum_by_cols(cnst_sum, A, dimA, k, nthreads);
+		if (l1_reg > 0) { for (size_t kk = 0; kk < k; kk++) { cnst_sum[kk] += l1_reg; } }
+		cblas_dscal(k_int, -step_size, cnst_sum, 1);
+		status = dense_pgd_iteration(B, A, X, x_col_stride, x_row_stride, dimB, dimA, k,
+									 cnst_div, cnst_sum, step_size, npass, nthreads);
+
+		step_size *= 0.5;
+	}
+
+	free(cnst_sum);
+	return status;
+}
+
+
+/* Min-heap of the 'n' highest scores seen so far, with the lowest one at the root */
+void topn_heap_push(size_t *restrict heap_ix, double *restrict heap_val, size_t *restrict heap_size, size_t n, size_t ix, double val)
+{
+	size_t pos, child, parent;
+	if (*heap_size < n)
+	{
+		pos = (*heap_size)++;
+		while (pos > 0)
+		{
+			parent = (pos - 1) / 2;
+			if (heap_val[parent] <= val) { break; }
+			heap_ix[pos] = heap_ix[parent];
+			heap_val[pos] = heap_val[parent];
+			pos = parent;
+		}
+	}
+
+	else
+	{
+		if (val <= heap_val[0]) { return; }
+		pos = 0;
+		while ((child = 2 * pos + 1) < n)
+		{
+			if (child + 1 < n && heap_val[child + 1] < heap_val[child]) { child++; }
+			if (heap_val[child] >= val) { break; }
+			heap_ix[pos] = heap_ix[child];
+			heap_val[pos] = heap_val[child];
+			pos = child;
+		}
+	}
+	heap_ix[pos] = ix;
+	heap_val[pos] = val;
+}
+
+/* Takes the root out of the heap and puts the last element in its place */
+void topn_heap_pop(size_t *restrict heap_ix, double *restrict heap_val, size_t *restrict heap_size)
+{
+	size_t last = --(*heap_size);
+	size_t ix = heap_ix[last];
+	double val = heap_val[last];
+	size_t pos = 0;
+	size_t child;
+	while ((child = 2 * pos + 1) < last)
+	{
+		if (child + 1 < last && heap_val[child + 1] < heap_val[child]) { child++; }
+		if (heap_val[child] >= val) { break; }
+		heap_ix[pos] = heap_ix[child];
+		heap_val[pos] = heap_val[child];
+		pos = child;
+	}
+	heap_ix[pos] = ix;
+	heap_val[pos] = val;
 }
 
+/*	Sorts a heap with 'heap_size' elements in descending order, popping the lowest element each time.
+	The remaining entries up to 'n' are filled with index SIZE_MAX and score NaN. */
+void topn_heap_sort(size_t *restrict heap_ix, double *restrict heap_val, size_t heap_size, size_t n)
+{
+	size_t nvalid = heap_size;
+	size_t ix_last;
+	double val_last;
+	while (heap_size > 0)
+	{
+		ix_last = heap_ix[0];
+		val_last = heap_val[0];
+		topn_heap_pop(heap_ix, heap_val, &heap_size);
+		heap_ix[heap_size] = ix_last;
+		heap_val[heap_size] = val_last;
+	}
+	for (size_t i = nvalid; i < n; i++) {
+		heap_ix[i] = SIZE_MAX;
+		heap_val[i] = NAN;
+	}
+}
+
+/*	Selects the 'n' items with the highest scores, in descending order. Items with NaN scores are skipped.
+	If there are fewer than 'n' candidates, the remaining entries are filled with index SIZE_MAX and score NaN. */
+void select_topn(size_t *restrict out_ix, double *restrict out_val, double *restrict scores, size_t dim, size_t n)
+{
+	size_t heap_size = 0;
+	for (size_t ix = 0; ix < dim; ix++) {
+		if (!isnan(scores[ix])) { topn_heap_push(out_ix, out_val, &heap_size, n, ix, scores[ix]); }
+	}
+
+	topn_heap_sort(out_ix, out_val, heap_size, n);
+}
+
+/*	Reverse top-N: for each of the 'nsel' rows of 'Bsel' (e.g. the rows of B for some items of interest), finds the 'n'
+	rows of A with the highest predicted values, in descending order. Outputs 'out_ix' and 'out_val' have dimensions
+	nsel*n - see 'select_topn' for the case in which there are fewer than 'n' candidates.
+
+	The rows of A are scored in blocks of TOPN_ROW_BLOCK, for chunks of TOPN_ITEM_CHUNK items at a time, through
+	matrix multiplications. As the factors are non-negative, the scores of an item for the rows in a block are
+	bounded from above by its dot product with the column-wise maxima of the block, so the blocks are visited in
+	decreasing order of this bound, and skipped for the items for which it can't beat the lowest score in their
+	heap. When there are fewer chunks of items than threads, the blocks are also split among threads, each one
+	having its own heaps, which are merged at the end.
+
+	Rows can optionally be excluded for each item by passing them in row-sparse format ('excl_indptr', 'excl_ind'),
+	with one row per row of 'Bsel' and sorted indices. Returns 0 if it succeeds or 1 if it runs out of memory. */
+#define TOPN_ROW_BLOCK 256
+#define TOPN_ITEM_CHUNK 32
+typedef struct block_bound {
+	double bound;
+	size_t block;
+} block_bound;
+
+int cmp_block_bound(const void *a, const void *b)
+{
+	double diff = ((block_bound*)b)->bound - ((block_bound*)a)->bound;
+	return (diff > 0) - (diff < 0);
+}
+
+int topn_rows_for_items(
+	size_t *restrict out_ix, double *restrict out_val,
+	double *restrict A, size_t dimA, double *restrict Bsel, size_t nsel, size_t k, size_t n,
+	size_t *restrict excl_indptr, size_t *restrict excl_ind, int nthreads)
+{
+	if (nsel == 0 || n == 0) { return 0; }
+	if (dimA == 0) {
+		for (size_t item = 0; item < nsel; item++) { topn_heap_sort(out_ix + item*n, out_val + item*n, 0, n); }
+		return 0;
+	}
+
+	int k_int = (int) k;
+	size_t nblocks = (dimA + TOPN_ROW_BLOCK - 1) / TOPN_ROW_BLOCK;
+	size_t nchunks = (nsel + TOPN_ITEM_CHUNK - 1) / TOPN_ITEM_CHUNK;
+	size_t nparts = 1;
+	if (nchunks < (size_t)nthreads && nblocks > 1) {
+		nparts = ((size_t)nthreads + nchunks - 1) / nchunks;
+		nparts = (nparts > nblocks)? nblocks : nparts;
+	}
+	size_t ntasks = nchunks * nparts;
+	int status = 0;
+
+	double *Amax = (double*) malloc(sizeof(double) * nblocks * k);
+	size_t *heap_size = (size_t*) calloc(nparts * nsel, sizeof(size_t));
+	size_t *heap_ix = out_ix;
+	double *heap_val = out_val;
+	if (nparts > 1) {
+		heap_ix = (size_t*) malloc(sizeof(size_t) * nparts * nsel * n);
+		heap_val = (double*) malloc(sizeof(double) * nparts * nsel * n);
+	}
+	if (Amax == NULL || heap_size == NULL || heap_ix == NULL || heap_val == NULL) {
+		status = 1;
+		goto cleanup;
+	}
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long blk, task, item;
+	#endif
+
+	/* column-wise maxima of each block of rows */
+	#pragma omp parallel for schedule(static) num_threads(nthreads) firstprivate(A, Amax, dimA, nblocks, k)
+	for (size_t_for blk = 0; blk < nblocks; blk++)
+	{
+		size_t st_row = blk * TOPN_ROW_BLOCK;
+		size_t end_row = (st_row + TOPN_ROW_BLOCK > dimA)? dimA : (st_row + TOPN_ROW_BLOCK);
+		memcpy(Amax + blk*k, A + st_row*k, sizeof(double) * k);
+		for (size_t row = st_row + 1; row < end_row; row++) {
+			for (size_t kk = 0; kk < k; kk++) {
+				Amax[blk*k + kk] = fmax(Amax[blk*k + kk], A[row*k + kk]);
+			}
+		}
+	}
+
+	#pragma omp parallel num_threads(nthreads) firstprivate(A, dimA, Bsel, nsel, k, k_int, n, excl_indptr, excl_ind, Amax, heap_ix, heap_val, heap_size, nblocks, nparts, ntasks) shared(status)
+	{
+		/* thread-local workspaces, reused for all the tasks that the thread handles */
+		double *bounds = (double*) malloc(sizeof(double) * TOPN_ITEM_CHUNK * nblocks);
+		double *scores = (double*) malloc(sizeof(double) * TOPN_ITEM_CHUNK * TOPN_ROW_BLOCK);
+		block_bound *order = (block_bound*) malloc(sizeof(block_bound) * nblocks);
+		if (bounds == NULL || scores == NULL || order == NULL) { status = 1; }
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for task = 0; task < ntasks; task++)
+		{
+			if (bounds == NULL || scores == NULL || order == NULL) { continue; }
+			size_t part = task % nparts;
+			size_t st_item = (task / nparts) * TOPN_ITEM_CHUNK;
+			size_t nitems = (st_item + TOPN_ITEM_CHUNK > nsel)? (nsel - st_item) : TOPN_ITEM_CHUNK;
+			size_t *hix = heap_ix + (part*nsel + st_item) * n;
+			double *hval = heap_val + (part*nsel + st_item) * n;
+			size_t *hsize = heap_size + part*nsel + st_item;
+
+			/* bounds[item, block] = <Bsel[item], Amax[block]> */
+			cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, (int)nitems, (int)nblocks, k_int,
+						1, Bsel + st_item*k, k_int, Amax, k_int, 0, bounds, (int)nblocks);
+			size_t nord = 0;
+			for (size_t blk = part; blk < nblocks; blk += nparts)
+			{
+				order[nord].block = blk;
+				order[nord].bound = bounds[blk];
+				for (size_t i = 1; i < nitems; i++) {
+					order[nord].bound = fmax(order[nord].bound, bounds[i*nblocks + blk]);
+				}
+				nord++;
+			}
+			qsort(order, nord, sizeof(block_bound), cmp_block_bound);
+
+			for (size_t ord = 0; ord < nord; ord++)
+			{
+				size_t blk = order[ord].block;
+				bool any_open = false;
+				for (size_t i = 0; i < nitems && !any_open; i++) {
+					any_open = hsize[i] < n || bounds[i*nblocks + blk] > hval[i*n];
+				}
+				if (!any_open) { continue; }
+
+				size_t st_row = blk * TOPN_ROW_BLOCK;
+				size_t nrows = (st_row + TOPN_ROW_BLOCK > dimA)? (dimA - st_row) : TOPN_ROW_BLOCK;
+				cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, (int)nitems, (int)nrows, k_int,
+							1, Bsel + st_item*k, k_int, A + st_row*k, k_int, 0, scores, (int)nrows);
+
+				for (size_t i = 0; i < nitems; i++)
+				{
+					if (hsize[i] == n && bounds[i*nblocks + blk] <= hval[i*n]) { continue; }
+					double *row_scores = scores + i*nrows;
+					if (excl_indptr != NULL)
+					{
+						size_t lo = excl_indptr[st_item + i];
+						size_t hi = excl_indptr[st_item + i + 1];
+						size_t mid;
+						while (lo < hi) {
+							mid = lo + (hi - lo) / 2;
+							if (excl_ind[mid] < st_row) { lo = mid + 1; } else { hi = mid; }
+						}
+						for (size_t ptr = lo; ptr < excl_indptr[st_item + i + 1] && excl_ind[ptr] < st_row + nrows; ptr++) {
+							row_scores[excl_ind[ptr] - st_row] = NAN;
+						}
+					}
+					for (size_t row = 0; row < nrows; row++) {
+						if (!isnan(row_scores[row])) {
+							topn_heap_push(hix + i*n, hval + i*n, hsize + i, n, st_row + row, row_scores[row]);
+						}
+					}
+				}
+			}
+		}
+
+		free(bounds);
+		free(scores);
+		free(order);
+	}
+	if (status) { goto cleanup; }
+
+	/* merging the heaps from each part, then sorting them */
+	#pragma omp parallel for schedule(static) num_threads(nthreads) firstprivate(out_ix, out_val, heap_ix, heap_val, heap_size, nsel, n, nparts)
+	for (size_t_for item = 0; item < nsel; item++)
+	{
+		size_t size_out = heap_size[item];
+		if (nparts > 1)
+		{
+			size_out = 0;
+			for (size_t part = 0; part < nparts; part++) {
+				for (size_t i = 0; i < heap_size[part*nsel + item]; i++) {
+					topn_heap_push(out_ix + item*n, out_val + item*n, &size_out, n,
+								   heap_ix[(part*nsel + item)*n + i], heap_val[(part*nsel + item)*n + i]);
+				}
+			}
+		}
+		topn_heap_sort(out_ix + item*n, out_val + item*n, size_out, n);
+	}
+
+	cleanup:
+		free(Amax);
+		free(heap_size);
+		if (nparts > 1) {
+			free(heap_ix);
+			free(heap_val);
+		}
+	return status;
+}
 
 #ifdef _FOR_PYTHON
 /* Generic helper function that predicts multiple combinations of users and items from already-fit A and B matrices */
@@ -402,6 +2064,359 @@ void predict_multiple(double *out, double *A, double *B, size_t *ix_u, size_t *i
 	}
 }
 
+/*	Poisson log-likelihood of the data in a CSR matrix, taking all the missing entries as zeros and
+	without the terms that depend only on the data: sum(X .* log(A*B')) - sum(A*B') */
+double calc_llk(double *A, double *B, double *Xr, size_t *Xr_indptr, size_t *Xr_indices, size_t dimA, size_t dimB, size_t k, int nthreads)
+{
+	int k_int = (int) k;
+	double llk = 0;
+	double *Asum = (double*) malloc(sizeof(double) * k);
+	double *Bsum = (double*) malloc(sizeof(double) * k);
+	if (Asum == NULL || Bsum == NULL) { free(Asum); free(Bsum); return NAN; }
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long ia;
+	#endif
+
+	#pragma omp parallel for schedule(dynamic) num_threads(nthreads) reduction(+:llk) firstprivate(A, B, Xr, Xr_indptr, Xr_indices, k, k_int)
+	for (size_t_for ia = 0; ia < dimA; ia++)
+	{
+		for (size_t i = Xr_indptr[ia]; i < Xr_indptr[ia + 1]; i++) {
+			llk += Xr[i] * log(cblas_ddot(k_int, A + ia*k, 1, B + Xr_indices[i] * k, 1));
+		}
+	}
+
+	/* sum(A*B') = <colsum(A), colsum(B)> */
+	sum_by_cols(Asum, A, dimA, k, nthreads);
+	sum_by_cols(Bsum, B, dimB, k, nthreads);
+	llk -= cblas_ddot(k_int, Asum, 1, Bsum, 1);
+	free(Asum);
+	free(Bsum);
+	return llk;
+}
+
+/*	Top-N items for each of 'nrows' rows of A ('factors', dimensions nrows*k), from a shard of B covering rows
+	'item_offset' to 'item_offset + dim_shard - 1' of the full matrix (e.g. a range of items held by one process).
+	Output indices refer to the full matrix. Items to exclude for each row are passed in row-sparse format
+	('excl_indptr', 'excl_ind', with indices of the full matrix, which might fall outside of the shard), or
+	NULL to not exclude any. Outputs have dimensions nrows*n, with unfilled entries as in 'select_topn'.
+	Returns 0 if it succeeds or 1 if it runs out of memory. */
+int topn_items_shard(
+	size_t *restrict out_ix, double *restrict out_val, double *restrict factors, size_t nrows,
+	double *restrict B_shard, size_t dim_shard, size_t item_offset, size_t k,
+	size_t *restrict excl_indptr, size_t *restrict excl_ind, size_t n, int nthreads)
+{
+	int k_int = (int) k;
+	int status = 0;
+	double *scores;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long row;
+	#endif
+
+	#pragma omp parallel num_threads(nthreads) private(scores) firstprivate(out_ix, out_val, factors, nrows, B_shard, dim_shard, item_offset, k, k_int, excl_indptr, excl_ind, n) shared(status)
+	{
+		scores = (double*) malloc(sizeof(double) * ((dim_shard > 0)? dim_shard : 1));
+		if (scores == NULL) { status = 1; }
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for row = 0; row < nrows; row++)
+		{
+			if (scores == NULL) { continue; }
+			if (dim_shard > 0) {
+				cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)dim_shard, k_int, 1, B_shard, k_int, factors + row*k, 1, 0, scores, 1);
+			}
+			if (excl_indptr != NULL) {
+				for (size_t i = excl_indptr[row]; i < excl_indptr[row + 1]; i++) {
+					if (excl_ind[i] >= item_offset && excl_ind[i] - item_offset < dim_shard) {
+						scores[excl_ind[i] - item_offset] = NAN;
+					}
+				}
+			}
+			select_topn(out_ix + row*n, out_val + row*n, scores, dim_shard, n);
+			for (size_t i = 0; i < n; i++) {
+				if (out_ix[row*n + i] != SIZE_MAX) { out_ix[row*n + i] += item_offset; }
+			}
+		}
+
+		free(scores);
+	}
+	return status;
+}
+
+/*	Merges the top-N lists obtained from different shards (e.g. through 'topn_items_shard') into overall top-N
+	lists. 'part_ix' and 'part_val' have dimensions nparts*nrows*n, with unfilled entries having index SIZE_MAX,
+	and the outputs have dimensions nrows*n, in descending order. */
+void merge_topn(
+	size_t *restrict out_ix, double *restrict out_val,
+	size_t *restrict part_ix, double *restrict part_val, size_t nparts, size_t nrows, size_t n, int nthreads)
+{
+	size_t heap_size;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long row;
+	#endif
+
+	#pragma omp parallel for schedule(static) num_threads(nthreads) private(heap_size) firstprivate(out_ix, out_val, part_ix, part_val, nparts, nrows, n)
+	for (size_t_for row = 0; row < nrows; row++)
+	{
+		heap_size = 0;
+		for (size_t part = 0; part < nparts; part++) {
+			for (size_t i = 0; i < n; i++) {
+				size_t pos = (part*nrows + row)*n + i;
+				if (part_ix[pos] == SIZE_MAX || isnan(part_val[pos])) { break; }
+				topn_heap_push(out_ix + row*n, out_val + row*n, &heap_size, n, part_ix[pos], part_val[pos]);
+			}
+		}
+		topn_heap_sort(out_ix + row*n, out_val + row*n, heap_size, n);
+	}
+}
+
+/*	Item-major blocked layout of B, for scanning the whole catalog when recommending: items are grouped in blocks
+	of 'block_size' (8 or 16), and each block is stored transposed (k rows of 'block_size' entries), with the last
+	one padded with zeros. Scoring a user against a block then takes, for each dimension, one multiply-add of the
+	user factor by a contiguous row of the block, which compilers vectorize across the items of the block, instead
+	of one short dot product with a horizontal sum per item. 'B_blocked' must have 'blocked_size(dimB, k, block_size)'
+	entries. */
+#define MAX_ITEM_BLOCK 16
+size_t blocked_size(size_t dimB, size_t k, size_t block_size)
+{
+	return ((dimB + block_size - 1) / block_size) * block_size * k;
+}
+
+void pack_items_blocked(double *restrict B_blocked, double *restrict B, size_t dimB, size_t k, size_t block_size, int nthreads)
+{
+	size_t nblocks = (dimB + block_size - 1) / block_size;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long blk;
+	#endif
+
+	#pragma omp parallel for schedule(static) num_threads(nthreads) firstprivate(B_blocked, B, dimB, k, block_size, nblocks)
+	for (size_t_for blk = 0; blk < nblocks; blk++)
+	{
+		double *out = B_blocked + blk * block_size * k;
+		for (size_t j = 0; j < block_size; j++)
+		{
+			size_t item = blk * block_size + j;
+			for (size_t kk = 0; kk < k; kk++) {
+				out[kk*block_size + j] = (item < dimB)? B[item*k + kk] : 0;
+			}
+		}
+	}
+}
+
+/*	'bsize' is always passed as a literal, so that the inner loops get a fixed length when inlined.
+	Even and odd dimensions go to separate accumulators, so that consecutive multiply-adds don't wait on each other. */
+static inline void scan_items_block(double *restrict scores, const double *restrict a, const double *restrict blk, size_t k, const size_t bsize)
+{
+	double acc0[MAX_ITEM_BLOCK] = {0};
+	double acc1[MAX_ITEM_BLOCK] = {0};
+	size_t kk;
+	for (kk = 0; kk + 1 < k; kk += 2)
+	{
+		const double a0 = a[kk];
+		const double a1 = a[kk + 1];
+		const double *restrict row0 = blk + kk*bsize;
+		const double *restrict row1 = row0 + bsize;
+		for (size_t j = 0; j < bsize; j++) {
+			acc0[j] += a0 * row0[j];
+			acc1[j] += a1 * row1[j];
+		}
+	}
+	if (kk < k) {
+		for (size_t j = 0; j < bsize; j++) { acc0[j] += a[kk] * blk[kk*bsize + j]; }
+	}
+	for (size_t j = 0; j < bsize; j++) { scores[j] = acc0[j] + acc1[j]; }
+}
+
+/*	Top-N items for a user vector 'a' from B in the blocked layout above, pushing the scores of each block straight
+	into the heap. Items with a non-zero entry in 'excl_mask' (size dimB, or NULL) are skipped. Outputs are as in
+	'select_topn'. */
+void topn_items_blocked(size_t *restrict out_ix, double *restrict out_val, double *restrict a,
+						double *restrict B_blocked, size_t dimB, size_t k, size_t block_size,
+						char *restrict excl_mask, size_t n)
+{
+	double block_scores[MAX_ITEM_BLOCK];
+	size_t nblocks = (dimB + block_size - 1) / block_size;
+	size_t heap_size = 0;
+	size_t st_item, lim;
+	for (size_t blk = 0; blk < nblocks; blk++)
+	{
+		if (block_size == 16) {
+			scan_items_block(block_scores, a, B_blocked + blk*16*k, k, 16);
+		} else {
+			scan_items_block(block_scores, a, B_blocked + blk*8*k, k, 8);
+		}
+
+		st_item = blk * block_size;
+		lim = (dimB - st_item < block_size)? (dimB - st_item) : block_size;
+		for (size_t j = 0; j < lim; j++)
+		{
+			if (heap_size == n && block_scores[j] <= out_val[0]) { continue; }
+			if (excl_mask != NULL && excl_mask[st_item + j]) { continue; }
+			topn_heap_push(out_ix, out_val, &heap_size, n, st_item + j, block_scores[j]);
+		}
+	}
+	topn_heap_sort(out_ix, out_val, heap_size, n);
+}
+
+/*	Obtains the latent factors and top-N items for one session in 'recommend_from_interactions' (see below), using
+	the workspaces of the calling thread: 'scores' (size dimB, not used with 'B_blocked'), 'cg_buffer' (size 4*k),
+	and 'excl_mask' (zero-filled, size dimB, only used with 'B_blocked' and 'exclude_given'). */
+void recommend_session(
+	size_t *restrict out_items, double *restrict out_scores, double *restrict a,
+	double *restrict X, size_t *restrict X_ind, size_t nnz_this,
+	double *restrict B, double *restrict Bsum, size_t dimB, size_t k, double l2_reg,
+	int solver, size_t max_iter, size_t max_feval, double max_seconds,
+	double *restrict B_blocked, size_t block_size, size_t n, int exclude_given,
+	double *restrict scores, double *restrict cg_buffer, char *restrict excl_mask)
+{
+	fold_in_single(a, X, X_ind, nnz_this, B, Bsum, (int)k, l2_reg,
+				   solver, max_iter, max_feval, max_seconds, cg_buffer);
+
+	if (B_blocked != NULL)
+	{
+		if (exclude_given) {
+			for (size_t i = 0; i < nnz_this; i++) { excl_mask[X_ind[i]] = 1; }
+		}
+		topn_items_blocked(out_items, out_scores, a, B_blocked, dimB, k, block_size, excl_mask, n);
+		if (exclude_given) {
+			for (size_t i = 0; i < nnz_this; i++) { excl_mask[X_ind[i]] = 0; }
+		}
+		return;
+	}
+
+	cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)dimB, (int)k, 1, B, (int)k, a, 1, 0, scores, 1);
+	if (exclude_given) {
+		for (size_t i = 0; i < nnz_this; i++) { scores[X_ind[i]] = NAN; }
+	}
+	select_topn(out_items, out_scores, scores, dimB, n);
+}
+
+/*	Obtains latent factors for new users (e.g. anonymous sessions) given their interactions, through
+	'fold_in_single' (see it for the solver options), and recommends the top-N items for each, in parallel.
+	Sessions are passed in row-sparse format (items, counts, sess_indptr) with item indices referring to rows
+	of B. 'Bsum' must already have the L1 regularization added. 'factors' (dimensions nsessions*k) must contain
+	the initial values, and will contain the obtained factors at the end. Outputs 'out_items' and 'out_scores'
+	have dimensions nsessions*n - see 'select_topn' for the case in which there are fewer than 'n' candidates.
+	If passing 'B_blocked' (see 'pack_items_blocked'), the items are scored from it instead of through 'B'. */
+void recommend_from_interactions(
+	size_t *restrict out_items, double *restrict out_scores, double *restrict factors,
+	size_t nsessions, size_t *restrict sess_indptr, size_t *restrict items, double *restrict counts,
+	double *restrict B, double *restrict Bsum, size_t dimB, size_t k, double l2_reg,
+	int solver, size_t max_iter, size_t max_feval, double max_seconds,
+	double *restrict B_blocked, size_t block_size,
+	size_t n, int exclude_given, int nthreads)
+{
+	size_t st, nnz_this;
+	double *scores;
+	double *cg_buffer;
+	char *excl_mask;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long sess;
+	#endif
+
+	#pragma omp parallel num_threads(nthreads) private(st, nnz_this, scores, cg_buffer, excl_mask) firstprivate(out_items, out_scores, factors, nsessions, sess_indptr, items, counts, B, Bsum, dimB, k, l2_reg, solver, max_iter, max_feval, max_seconds, B_blocked, block_size, n, exclude_given)
+	{
+		/* thread-local workspaces, reused for all the sessions that the thread handles */
+		scores = (double*) malloc(sizeof(double) * ((B_blocked == NULL)? dimB : 1));
+		cg_buffer = (double*) malloc(sizeof(double) * k * 4);
+		excl_mask = (B_blocked != NULL && exclude_given)? (char*) calloc(dimB, sizeof(char)) : NULL;
+		if (B_blocked != NULL && exclude_given && excl_mask == NULL) { free(scores); scores = NULL; }
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for sess = 0; sess < nsessions; sess++)
+		{
+			st = sess_indptr[sess];
+			nnz_this = sess_indptr[sess + 1] - st;
+			if (scores == NULL || cg_buffer == NULL) {
+				for (size_t i = 0; i < n; i++) { out_items[sess*n + i] = SIZE_MAX; out_scores[sess*n + i] = NAN; }
+				continue;
+			}
+
+			recommend_session(out_items + sess*n, out_scores + sess*n, factors + sess*k,
+							  counts + st, items + st, nnz_this, B, Bsum, dimB, k, l2_reg,
+							  solver, max_iter, max_feval, max_seconds, B_blocked, block_size, n, exclude_given,
+							  scores, cg_buffer, excl_mask);
+		}
+
+		free(scores);
+		free(cg_buffer);
+		free(excl_mask);
+	}
+}
+
+/*	Same as 'recommend_from_interactions', but with many models stored in the same memory region 'base' (e.g. a
+	mapped model pack file), and each session routed to one of them. Model 'm' has 'model_k[m]' factors and
+	'model_dimB[m]' items, and its B matrix and column sums of B (plus the L1 regularization the model was fitted
+	with) are at byte offsets 'model_offset_B[m]' and 'model_offset_Bsum[m]' of 'base'. Session 'sess' uses model
+	'sess_model[sess]', and has a row of 'max_k' entries in 'factors', of which the first 'model_k' are used. 'max_k'
+	and 'max_dimB' must be the largest among the models used. If passing 'fold_in' = 0, the factors are used as given, and the sessions'
+	items are only used for 'exclude_given'. */
+void recommend_from_pack(
+	size_t *restrict out_items, double *restrict out_scores, double *restrict factors, size_t max_k,
+	size_t nsessions, size_t *restrict sess_model, size_t *restrict sess_indptr, size_t *restrict items, double *restrict counts,
+	char *restrict base, size_t *restrict model_k, size_t *restrict model_dimB,
+	size_t *restrict model_offset_B, size_t *restrict model_offset_Bsum, size_t max_dimB,
+	double l1_reg, double l2_reg, int solver, size_t max_iter, size_t max_feval, double max_seconds,
+	size_t n, int exclude_given, int fold_in, int nthreads)
+{
+	size_t st, nnz_this, model, k, dimB;
+	double *B;
+	double *Bsum;
+	double *scores;
+	double *cg_buffer;
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long sess;
+	#endif
+
+	#pragma omp parallel num_threads(nthreads) private(st, nnz_this, model, k, dimB, B, Bsum, scores, cg_buffer) firstprivate(out_items, out_scores, factors, max_k, nsessions, sess_model, sess_indptr, items, counts, base, model_k, model_dimB, model_offset_B, model_offset_Bsum, max_dimB, l1_reg, l2_reg, solver, max_iter, max_feval, max_seconds, n, exclude_given, fold_in)
+	{
+		/* thread-local workspaces, sized for the largest model */
+		scores = (double*) malloc(sizeof(double) * max_dimB);
+		cg_buffer = (double*) malloc(sizeof(double) * max_k * 5);
+		Bsum = cg_buffer + max_k * 4;
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for sess = 0; sess < nsessions; sess++)
+		{
+			st = sess_indptr[sess];
+			nnz_this = sess_indptr[sess + 1] - st;
+			model = sess_model[sess];
+			k = model_k[model];
+			dimB = model_dimB[model];
+			B = (double*) (base + model_offset_B[model]);
+			if (scores == NULL || cg_buffer == NULL) {
+				for (size_t i = 0; i < n; i++) { out_items[sess*n + i] = SIZE_MAX; out_scores[sess*n + i] = NAN; }
+				continue;
+			}
+
+			if (fold_in)
+			{
+				memcpy(Bsum, base + model_offset_Bsum[model], sizeof(double) * k);
+				for (size_t kk = 0; kk < k; kk++) { Bsum[kk] += l1_reg; }
+				recommend_session(out_items + sess*n, out_scores + sess*n, factors + sess*max_k,
+								  counts + st, items + st, nnz_this, B, Bsum, dimB, k, l2_reg,
+								  solver, max_iter, max_feval, max_seconds, NULL, 0, n, exclude_given,
+								  scores, cg_buffer, NULL);
+				continue;
+			}
+
+			cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)dimB, (int)k, 1, B, (int)k, factors + sess*max_k, 1, 0, scores, 1);
+			if (exclude_given) {
+				for (size_t i = 0; i < nnz_this; i++) { scores[items[st + i]] = NAN; }
+			}
+			select_topn(out_items + sess*n, out_scores + sess*n, scores, dimB, n);
+		}
+
+		free(scores);
+		free(cg_buffer);
+	}
+}
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,330 @@
+/*	C++ interface for fitting Poisson factorization models.
+
+	This is a thin layer over 'run_poismf' (pgd.c) which takes care of converting the inputs to the types
+	used by the C code, building the column-major copy of the data when the chosen solver needs it, and
+	managing the memory of all the intermediate and output objects. Example:
+
+		poismf::Options opts;
+		opts.k = 20;
+		opts.nthreads = 4;
+		poismf::SparseView<double, int> X(values, indices, indptr, nrows, ncols);
+		poismf::Model model = poismf::Trainer<double, int>(opts).fit(X);
+
+	The header can be used on its own. Programs which link to 'trainer_instantiations.cpp' can define
+	POISMF_EXTERN_TEMPLATES before including it to avoid instantiating the most common specializations
+	(double or float values, with int, int64_t or size_t indices) in every translation unit. */
+#ifndef POISMF_HPP
+#define POISMF_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+
+extern "C" {
+	void run_poismf(
+		double *A, double *Xr, size_t *Xr_indptr, size_t *Xr_indices,
+		double *B, double *Xc, size_t *Xc_indptr, size_t *Xc_indices,
+		const size_t dimA, const size_t dimB, const size_t k,
+		const double l2_reg, const double l1_reg, const int use_cg, double step_size,
+		const size_t numiter, const size_t npass, const int iter_scheme, size_t nblocks, const int fixed_prec,
+		const int packed_nnz, const size_t f32_iters, const double f32_tol, const int adapt_threads, const int ncores);
+	int run_poismf_dense(
+		double *A, double *B, double *X, size_t x_row_stride, size_t x_col_stride,
+		const size_t dimA, const size_t dimB, const size_t k,
+		const double l2_reg, const double l1_reg, double step_size,
+		const size_t numiter, const size_t npass, const int adapt_threads, const int ncores);
+	int available_cpus(void);
+}
+
+namespace poismf {
+
+/* These match the enums in pgd.c */
+enum class IterScheme : int { Alternating = 0, Fused = 1, Stratified = 2 };
+enum class Precision : int { Double = 0, Float = 1, BFloat16 = 2 };
+
+/*	Model hyperparameters and solver settings - see the documentation of 'run_poismf' for details.
+	Passing 'nthreads' < 1 will use the processors available to the process (see 'available_cpus'). With
+	'adapt_threads', the number of threads is adjusted during training to the processors available at the
+	time, up to 'nthreads' (or up to all the processors of the computer if passing 'nthreads' < 1). */
+struct Options {
+	size_t k = 50;
+	double l1_reg = 0;
+	double l2_reg = 1e9;
+	size_t niter = 10;
+	size_t npass = 1;
+	double step_size = 1e-7;
+	bool use_cg = false;
+	IterScheme iter_scheme = IterScheme::Alternating;
+	size_t nblocks = 0;
+	Precision fixed_precision = Precision::Double;
+	bool packed_nonzeros = false;
+	size_t float_iters = 0;
+	double float_tol = 0;
+	int nthreads = 1;
+	bool adapt_threads = false;
+	uint64_t seed = 1;
+};
+
+/*	Non-owning view of a sparse matrix in compressed row (CSR) or compressed column (CSC) format.
+	'nrows' is the size of the compressed dimension (so 'indptr' has nrows+1 entries) and 'ncols' the size
+	of the other. For a CSC matrix, these are thus the number of columns and rows, respectively.
+	Indices are zero-based, and must be sorted within each row for the stratified scheme. */
+template <class Real, class Index>
+struct SparseView {
+	const Real *values = nullptr;
+	const Index *indices = nullptr;
+	const Index *indptr = nullptr;
+	size_t nrows = 0;
+	size_t ncols = 0;
+
+	SparseView() = default;
+	SparseView(const Real *values, const Index *indices, const Index *indptr, size_t nrows, size_t ncols)
+		: values(values), indices(indices), indptr(indptr), nrows(nrows), ncols(ncols) {}
+
+	size_t nnz() const { return (nrows == 0 || indptr == nullptr)? 0 : (size_t) indptr[nrows]; }
+};
+
+/*	Non-owning view of a dense matrix of counts, with entry (i, j) at values[i*row_stride + j*col_stride].
+	Rows correspond to rows of A and columns to rows of B. The data is used in-place, without copies. */
+struct DenseView {
+	const double *values = nullptr;
+	size_t nrows = 0;
+	size_t ncols = 0;
+	size_t row_stride = 0;
+	size_t col_stride = 0;
+
+	DenseView() = default;
+	DenseView(const double *values, size_t nrows, size_t ncols, size_t row_stride, size_t col_stride)
+		: values(values), nrows(nrows), ncols(ncols), row_stride(row_stride), col_stride(col_stride) {}
+
+	static DenseView row_major(const double *values, size_t nrows, size_t ncols) { return DenseView(values, nrows, ncols, ncols, 1); }
+	static DenseView col_major(const double *values, size_t nrows, size_t ncols) { return DenseView(values, nrows, ncols, 1, nrows); }
+};
+
+/*	Fitted factor matrices, stored row-major: A is (dimA, k) and B is (dimB, k).
+	These can only be moved, as the matrices might be large. */
+class Model {
+public:
+	Model() = default;
+	Model(size_t dimA, size_t dimB, size_t k) : A_(dimA * k), B_(dimB * k), dimA_(dimA), dimB_(dimB), k_(k) {}
+	Model(Model &&) = default;
+	Model& operator=(Model &&) = default;
+	Model(const Model &) = delete;
+	Model& operator=(const Model &) = delete;
+
+	double* A() { return A_.data(); }
+	double* B() { return B_.data(); }
+	const double* A() const { return A_.data(); }
+	const double* B() const { return B_.data(); }
+	size_t dimA() const { return dimA_; }
+	size_t dimB() const { return dimB_; }
+	size_t k() const { return k_; }
+
+	/*	Releases the underlying storage, e.g. to hand it over to another container without copying. The model
+		is left with zero rows in that matrix (and 'k' = 0 once both are released). */
+	std::vector<double> release_A() { return release(A_, dimA_); }
+	std::vector<double> release_B() { return release(B_, dimB_); }
+
+private:
+	std::vector<double> release(std::vector<double> &mat, size_t &dim)
+	{
+		std::vector<double> out(std::move(mat));
+		mat.clear();
+		dim = 0;
+		if (A_.empty() && B_.empty()) { k_ = 0; }
+		return out;
+	}
+
+	std::vector<double> A_;
+	std::vector<double> B_;
+	size_t dimA_ = 0;
+	size_t dimB_ = 0;
+	size_t k_ = 0;
+};
+
+namespace detail {
+
+inline int resolve_nthreads(int nthreads)
+{
+	if (nthreads >= 1) { return nthreads; }
+	int ncpus = available_cpus();
+	return (ncpus >= 1)? ncpus : 1;
+}
+
+/*	Threads to pass to the training procedures, which is the maximum when these adapt the number */
+inline int train_nthreads(const Options &options)
+{
+	if (!options.adapt_threads || options.nthreads >= 1) { return resolve_nthreads(options.nthreads); }
+	int ncpus = resolve_nthreads(options.nthreads);
+	#ifdef _OPENMP
+	if (omp_get_num_procs() > ncpus) { ncpus = omp_get_num_procs(); }
+	#endif
+	return ncpus;
+}
+
+/*	Returns a pointer to the array as type 'Out', copying it into 'storage' only if the type differs */
+template <class Out, class In>
+Out* as_type(const In *arr, size_t n, std::vector<Out> &storage, int nthreads)
+{
+	if (std::is_same<In, Out>::value) { return reinterpret_cast<Out*>(const_cast<In*>(arr)); }
+	storage.resize(n);
+	Out *out = storage.data();
+	#pragma omp parallel for schedule(static) num_threads(nthreads)
+	for (ptrdiff_t i = 0; i < (ptrdiff_t)n; i++) { out[i] = (Out) arr[i]; }
+	return out;
+}
+
+}
+
+/*	Holds the data in the format that 'run_poismf' takes (double values and size_t indices, in CSR format and
+	in CSC format if passed), pointing to the original arrays whenever their types already match. If the CSC
+	copy is not passed, it's left as NULL for 'run_poismf' to build it while it starts the first half-step.
+	Frees everything that it allocated when destroyed. */
+template <class Real, class Index>
+class Workspace {
+public:
+	typedef SparseView<Real, Index> view_type;
+
+	Workspace(const view_type &Xcsr, const view_type *Xcsc, int nthreads)
+	{
+		size_t nnz = Xcsr.nnz();
+		Xr = detail::as_type(Xcsr.values, nnz, Xr_store, nthreads);
+		Xr_indices = detail::as_type(Xcsr.indices, nnz, Xr_indices_store, nthreads);
+		Xr_indptr = detail::as_type(Xcsr.indptr, Xcsr.nrows + 1, Xr_indptr_store, nthreads);
+
+		if (Xcsc == nullptr) { return; }
+		Xc = detail::as_type(Xcsc->values, nnz, Xc_store, nthreads);
+		Xc_indices = detail::as_type(Xcsc->indices, nnz, Xc_indices_store, nthreads);
+		Xc_indptr = detail::as_type(Xcsc->indptr, Xcsc->nrows + 1, Xc_indptr_store, nthreads);
+	}
+
+	Workspace(Workspace &&) = default;
+	Workspace& operator=(Workspace &&) = default;
+	Workspace(const Workspace &) = delete;
+	Workspace& operator=(const Workspace &) = delete;
+
+	double *Xr = nullptr;
+	size_t *Xr_indices = nullptr;
+	size_t *Xr_indptr = nullptr;
+	double *Xc = nullptr;
+	size_t *Xc_indices = nullptr;
+	size_t *Xc_indptr = nullptr;
+
+private:
+	std::vector<double> Xr_store, Xc_store;
+	std::vector<size_t> Xr_indices_store, Xr_indptr_store, Xc_indices_store, Xc_indptr_store;
+};
+
+/*	Fits models to data in CSR format, with rows corresponding to rows of A and columns to rows of B.
+	Invalid options or inputs are reported by throwing 'std::invalid_argument'. */
+template <class Real = double, class Index = int>
+class Trainer {
+public:
+	typedef SparseView<Real, Index> view_type;
+
+	explicit Trainer(const Options &options = Options()) : options_(options)
+	{
+		if (options_.k == 0) { throw std::invalid_argument("'k' must be positive."); }
+		if (options_.niter == 0) { throw std::invalid_argument("'niter' must be positive."); }
+		if (options_.npass == 0) { throw std::invalid_argument("'npass' must be positive."); }
+		if (options_.l1_reg < 0 || options_.l2_reg < 0) { throw std::invalid_argument("Regularization must be non-negative."); }
+		if (options_.step_size <= 0) { throw std::invalid_argument("'step_size' must be positive."); }
+		if (options_.float_tol < 0) { throw std::invalid_argument("'float_tol' must be non-negative."); }
+	}
+
+	const Options& options() const { return options_; }
+
+	/*	Initializes the factor matrices ~ Gamma(1, 1) and fits them. 'Xcsc' is optional - if not passed, it
+		will be built from 'Xcsr' while the first half-step runs (see 'run_poismf'). */
+	Model fit(const view_type &Xcsr, const view_type *Xcsc = nullptr) const
+	{
+		Model model = random_model(Xcsr.nrows, Xcsr.ncols);
+		fit_inplace(Xcsr, model.A(), model.B(), Xcsc);
+		return model;
+	}
+
+	/* Same as above, but starting from already-initialized matrices A (dimA, k) and B (dimB, k), modified in-place */
+	void fit_inplace(const view_type &Xcsr, double *A, double *B, const view_type *Xcsc = nullptr) const
+	{
+		check_inputs(Xcsr, Xcsc);
+		int nthreads = detail::resolve_nthreads(options_.nthreads);
+		Workspace<Real, Index> ws(Xcsr, Xcsc, nthreads);
+		run_poismf(
+			A, ws.Xr, ws.Xr_indptr, ws.Xr_indices,
+			B, ws.Xc, ws.Xc_indptr, ws.Xc_indices,
+			Xcsr.nrows, Xcsr.ncols, options_.k,
+			options_.l2_reg, options_.l1_reg, (int) options_.use_cg, options_.step_size,
+			options_.niter, options_.npass, (int) options_.iter_scheme, options_.nblocks,
+			(int) options_.fixed_precision, (int) options_.packed_nonzeros,
+			options_.float_iters, options_.float_tol, (int) options_.adapt_threads, detail::train_nthreads(options_));
+	}
+
+	/*	Fits the model to a dense matrix through matrix multiplications (see 'run_poismf_dense'), which is faster
+		than the sparse procedure when a sizeable fraction of the entries are non-zero. Only proximal gradient
+		is supported - 'iter_scheme', 'fixed_precision' and 'packed_nonzeros' are ignored. */
+	Model fit_dense(const DenseView &X) const
+	{
+		Model model = random_model(X.nrows, X.ncols);
+		fit_dense_inplace(X, model.A(), model.B());
+		return model;
+	}
+
+	void fit_dense_inplace(const DenseView &X, double *A, double *B) const
+	{
+		if (X.nrows == 0 || X.ncols == 0) { throw std::invalid_argument("Data must have non-zero dimensions."); }
+		if (X.values == nullptr) { throw std::invalid_argument("Data arrays cannot be null."); }
+		if (options_.use_cg) { throw std::invalid_argument("Dense inputs can only be fitted with proximal gradient."); }
+		int status = run_poismf_dense(
+			A, B, const_cast<double*>(X.values), X.row_stride, X.col_stride,
+			X.nrows, X.ncols, options_.k,
+			options_.l2_reg, options_.l1_reg, options_.step_size,
+			options_.niter, options_.npass, (int) options_.adapt_threads, detail::train_nthreads(options_));
+		if (status != 0) { throw std::bad_alloc(); }
+	}
+
+private:
+	Options options_;
+
+	/* Factor matrices initialized ~ Gamma(1, 1) */
+	Model random_model(size_t dimA, size_t dimB) const
+	{
+		Model model(dimA, dimB, options_.k);
+		std::mt19937_64 rng(options_.seed);
+		std::gamma_distribution<double> gamma(1, 1);
+		for (size_t i = 0; i < model.dimA() * model.k(); i++) { model.A()[i] = gamma(rng); }
+		for (size_t i = 0; i < model.dimB() * model.k(); i++) { model.B()[i] = gamma(rng); }
+		return model;
+	}
+
+	void check_inputs(const view_type &Xcsr, const view_type *Xcsc) const
+	{
+		if (Xcsr.nrows == 0 || Xcsr.ncols == 0) { throw std::invalid_argument("Data must have non-zero dimensions."); }
+		if (Xcsr.values == nullptr || Xcsr.indices == nullptr || Xcsr.indptr == nullptr) {
+			throw std::invalid_argument("Data arrays cannot be null.");
+		}
+		if (Xcsc != nullptr && (Xcsc->nrows != Xcsr.ncols || Xcsc->ncols != Xcsr.nrows || Xcsc->nnz() != Xcsr.nnz())) {
+			throw std::invalid_argument("CSR and CSC matrices don't match.");
+		}
+	}
+};
+
+#ifdef POISMF_EXTERN_TEMPLATES
+extern template class Trainer<double, int>;
+extern template class Trainer<double, int64_t>;
+extern template class Trainer<double, size_t>;
+extern template class Trainer<float, int>;
+extern template class Trainer<float, int64_t>;
+extern template class Trainer<float, size_t>;
+#endif
+
+}
+
+#endif /* POISMF_HPP */
@@ -1,17 +1,35 @@
+#include "poismf.hpp"
 extern "C" {
 	#include <stddef.h>
 	#include <R_ext/BLAS.h>
-	void run_poismf(
-		double *A, double *Xr, size_t *Xr_indptr, size_t *Xr_indices,
-		double *B, double *Xc, size_t *Xc_indptr, size_t *Xc_indices,
-		const size_t dimA, const size_t dimB, const size_t k,
-		const double l2_reg, const double l1_reg, const int use_cg, double step_size,
-		const size_t numiter, const size_t npass, const int ncores);
 	double cblas_ddot(int n, double *x, int incx, double *y, int incy);
 	void cblas_daxpy(int n, double a, double *x, int incx, double *y, int incy);
 	void cblas_dscal(int n, double alpha, double *x, int incx);
+	int topn_rows_for_items(
+		size_t *out_ix, double *out_val,
+		double *A, size_t dimA, double *Bsel, size_t nsel, size_t k, size_t n,
+		size_t *excl_indptr, size_t *excl_ind, int nthreads);
+	int save_model_file(const char *fname, double *A, double *B, size_t dimA, size_t dimB, size_t k,
+		const char *ids, size_t ids_size, const char *seen, size_t seen_size);
+	int read_model_header(const char *fname, size_t *dimA, size_t *dimB, size_t *k, size_t *ids_size,
+		size_t *offset_A, size_t *offset_B, size_t *offset_ids, size_t *seen_size, size_t *offset_seen);
+	int available_cpus(void);
 }
 #include <Rcpp.h>
+#include <Rversion.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#if !defined(_WIN32) && !defined(_WIN64)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#if R_VERSION >= R_Version(3, 6, 0)
+		#include <R_ext/Altrep.h>
+		#define POISMF_MMAP_MODELS
+	#endif
+#endif
 #ifdef _OPENMP
 #if (_OPENMP > 200801) && !defined(_WIN32) && !defined(_WIN64) /* OpenMP > 3.0 */
 		#define size_t_for size_t
@@ -22,47 +40,65 @@ extern "C" {
 	#define size_t_for size_t
 #endif
 
+/* CPUs available to the process according to its affinity and cgroup quota (0 if unknown) */
+// [[Rcpp::export]]
+int r_wrapper_available_cpus()
+{
+	return available_cpus();
+}
+
 // [[Rcpp::export]]
 void r_wrapper_poismf(Rcpp::NumericVector A, Rcpp::NumericVector B, size_t dimA, size_t dimB, size_t k,
 	Rcpp::NumericVector Xr, Rcpp::IntegerVector Xr_ind_int, Rcpp::IntegerVector Xr_indptr_int,
-	Rcpp::NumericVector Xc, Rcpp::IntegerVector Xc_ind_int, Rcpp::IntegerVector Xc_indptr_int,
-	size_t nnz, double l1_reg, double l2_reg, size_t niter, size_t npass, double step_size, int use_cg, int nthreads)
-{
-	/* Convert CSR and CSC matrix indices to size_t */
-	std::vector<size_t> Xr_ind;
-	std::vector<size_t> Xr_indptr;
-	std::vector<size_t> Xc_ind;
-	std::vector<size_t> Xc_indptr;
-	Xr_indptr.reserve(dimA + 1);
-	Xr_ind.reserve(nnz);
-	Xc_indptr.reserve(dimB + 1);
-	Xc_ind.reserve(nnz);
+	size_t nnz, double l1_reg, double l2_reg, size_t niter, size_t npass, double step_size, int use_cg, int iter_scheme, size_t nblocks, int fixed_prec, int packed_nnz,
+	size_t float_iters, double float_tol, int adapt_threads, int nthreads)
+{
+	poismf::Options opts;
+	opts.k = k;
+	opts.l1_reg = l1_reg;
+	opts.l2_reg = l2_reg;
+	opts.niter = niter;
+	opts.npass = npass;
+	opts.step_size = step_size;
+	opts.use_cg = (bool) use_cg;
+	opts.iter_scheme = (poismf::IterScheme) iter_scheme;
+	opts.nblocks = nblocks;
+	opts.fixed_precision = (poismf::Precision) fixed_prec;
+	opts.packed_nonzeros = (bool) packed_nnz;
+	opts.float_iters = float_iters;
+	opts.float_tol = float_tol;
+	opts.nthreads = nthreads;
+	opts.adapt_threads = (bool) adapt_threads;
 
-	#ifdef _OPENMP
-		#if (_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64) /* OpenMP < 3.0 */
-			long i;
-		#endif
-	#endif
+	/* The CSC copy of the data is built by the procedure while fitting */
+	poismf::SparseView<double, int> Xcsr(Xr.begin(), Xr_ind_int.begin(), Xr_indptr_int.begin(), dimA, dimB);
 
-	#pragma omp parallel for schedule(static) num_threads(nthreads)
-	for (size_t_for i = 0; i < nnz; i++) { Xr_ind[i] = Xr_ind_int[i]; }
-	#pragma omp parallel for schedule(static) num_threads(nthreads)
-	for (size_t_for i = 0; i < nnz; i++) { Xc_ind[i] = Xc_ind_int[i]; }
-	#pragma omp parallel for schedule(static) num_threads(nthreads)
-	for (size_t_for i = 0; i < dimA + 1; i++) { Xr_indptr[i] = Xr_indptr_int[i]; }
-	#pragma omp parallel for schedule(static) num_threads(nthreads)
-	for (size_t_for i = 0; i < dimB + 1; i++) { Xc_indptr[i] = Xc_indptr_int[i]; }
+	/* Indices are converted to size_t inside, and the factor matrices are modified in-place */
+	poismf::Trainer<double, int>(opts).fit_inplace(Xcsr, A.begin(), B.begin());
+}
 
-	/* Run procedure */
-	run_poismf(
-		A.begin(), Xr.begin(), (size_t*) &Xr_indptr[0], (size_t*) &Xr_ind[0],
-		B.begin(), Xc.begin(), (size_t*) &Xc_indptr[0], (size_t*) &Xc_ind[0],
-		dimA, dimB, k,
-		l2_reg, l1_reg, use_cg, step_size,
-		niter, npass, nthreads);
+/* 'X' is the full matrix as stored by R (column-major), with rows corresponding to rows of A */
+// [[Rcpp::export]]
+void r_wrapper_poismf_dense(Rcpp::NumericVector A, Rcpp::NumericVector B, size_t dimA, size_t dimB, size_t k,
+	Rcpp::NumericVector X, double l1_reg, double l2_reg, size_t niter, size_t npass, double step_size,
+	int adapt_threads, int nthreads)
+{
+	poismf::Options opts;
+	opts.k = k;
+	opts.l1_reg = l1_reg;
+	opts.l2_reg = l2_reg;
+	opts.niter = niter;
+	opts.npass = npass;
+	opts.step_size = step_size;
+	opts.nthreads = nthreads;
+	opts.adapt_threads = (bool) adapt_threads;
 
-	/* Note: C++ refuses to acknowledge that the vectors of type unsigned long are equivalent to size_t,
-	   so don't use method .begin with the indices arrays */
+	try {
+		poismf::Trainer<double, int>(opts).fit_dense_inplace(poismf::DenseView::col_major(X.begin(), dimA, dimB),
+															 A.begin(), B.begin());
+	} catch (std::bad_alloc &e) {
+		Rcpp::stop("Could not allocate memory.");
+	}
 }
 
 // [[Rcpp::export]]
@@ -80,6 +116,26 @@ void predict_multiple(Rcpp::NumericVector A, Rcpp::NumericVector B, int k, size_
 	for (size_t_for i = 0; i < npred; i++) { out[i] = ddot_(&k, &A[ia[i] * k], &one, &B[ib[i] * k], &one); }
 }
 
+/* Outputs are (n, nsel) matrices with 1-based row indices, and NA where there are fewer than 'n' candidates */
+// [[Rcpp::export]]
+Rcpp::List r_wrapper_top_rows(Rcpp::NumericVector A, size_t dimA, Rcpp::NumericVector Bsel, size_t nsel, size_t k, size_t n, int nthreads)
+{
+	std::vector<size_t> out_ix(nsel * n);
+	Rcpp::NumericVector out_val(nsel * n);
+	int status = topn_rows_for_items(out_ix.data(), out_val.begin(), A.begin(), dimA, Bsel.begin(), nsel, k, n,
+									 NULL, NULL, nthreads);
+	if (status != 0) { Rcpp::stop("Could not allocate memory."); }
+
+	Rcpp::IntegerVector out_ix_R(nsel * n);
+	for (size_t i = 0; i < nsel * n; i++) {
+		out_ix_R[i] = (out_ix[i] == SIZE_MAX)? NA_INTEGER : (int)(out_ix[i] + 1);
+		if (out_ix[i] == SIZE_MAX) { out_val[i] = NA_REAL; }
+	}
+	out_ix_R.attr("dim") = Rcpp::Dimension(n, nsel);
+	out_val.attr("dim") = Rcpp::Dimension(n, nsel);
+	return Rcpp::List::create(Rcpp::_["ix"] = out_ix_R, Rcpp::_["val"] = out_val);
+}
+
 /* Note: this will just pass these functions to package 'nonneg.cg'.
    It was too complicated to work with the DLLs directly, so it's instead used as R -> C -> R -> C -> R,
    even though this is severely sub-optimal */
@@ -140,3 +196,244 @@ void select_topN(Rcpp::NumericVector preds, Rcpp::IntegerVector ix, int topN)
 	std::partial_sort(ix.begin(), ix.begin() + topN, ix.end(),
                       [&preds](const int &a, const int &b){return preds[a - 1] > preds[b - 1];});
 }
+
+/*	Model files - see 'model_io.c' for the format. The IDs section is written in the same format as the
+	Python package: (uint32 length, JSON with hyperparameters), then user and item IDs, each as
+	(uint8 type, uint64 count, data), with type 0 = no IDs, 1 = int64 array, 2 = UTF-8 strings with a
+	uint32 length before each. The seen items stored by the Python package are not used here.
+
+	On systems with 'mmap', the A and B matrices of loaded models can be ALTREP vectors which point into a
+	private (copy-on-write) mapping of the file, so that loading doesn't read the matrices and processes
+	loading the same file share its pages. The mapping is released when both vectors are garbage-collected.
+	Writes to them go to private copies of the pages instead of the file, and serializing them writes their
+	contents. */
+static const char *model_io_error(int status)
+{
+	switch(status)
+	{
+		case 1: return "Could not open file.";
+		case 2: return "Error reading file - might be truncated.";
+		case 3: return "Error writing file.";
+		case 4: return "File is not in the expected format.";
+		case 6: return "Could not allocate memory.";
+		default: return "Unexpected error.";
+	}
+}
+
+static void append_ids(std::string &out, Rcpp::Nullable<Rcpp::CharacterVector> ids)
+{
+	uint8_t type = ids.isNull()? 0 : 2;
+	uint64_t n = ids.isNull()? 0 : Rcpp::CharacterVector(ids.get()).size();
+	out.append((char*) &type, sizeof(uint8_t));
+	out.append((char*) &n, sizeof(uint64_t));
+	if (ids.isNull()) return;
+	Rcpp::CharacterVector ids_vec(ids.get());
+	for (size_t i = 0; i < n; i++)
+	{
+		const char *el = Rf_translateCharUTF8(ids_vec[i]);
+		uint32_t len = strlen(el);
+		out.append((char*) &len, sizeof(uint32_t));
+		out.append(el, len);
+	}
+}
+
+/* Returns NULL for type 0, or a character vector, advancing 'pos' */
+static Rcpp::RObject read_ids(const char *buf, size_t size, size_t &pos)
+{
+	uint8_t type;
+	uint64_t n;
+	if (pos + sizeof(uint8_t) + sizeof(uint64_t) > size) Rcpp::stop(model_io_error(4));
+	memcpy(&type, buf + pos, sizeof(uint8_t));
+	memcpy(&n, buf + pos + sizeof(uint8_t), sizeof(uint64_t));
+	pos += sizeof(uint8_t) + sizeof(uint64_t);
+	if (type == 0) return Rcpp::RObject(R_NilValue);
+
+	Rcpp::CharacterVector out(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		if (type == 1)
+		{
+			int64_t id;
+			if (pos + sizeof(int64_t) > size) Rcpp::stop(model_io_error(4));
+			memcpy(&id, buf + pos, sizeof(int64_t));
+			pos += sizeof(int64_t);
+			out[i] = std::to_string((long long) id);
+		}
+
+		else
+		{
+			uint32_t len;
+			if (pos + sizeof(uint32_t) > size) Rcpp::stop(model_io_error(4));
+			memcpy(&len, buf + pos, sizeof(uint32_t));
+			pos += sizeof(uint32_t);
+			if (pos + len > size) Rcpp::stop(model_io_error(4));
+			out[i] = Rf_mkCharLenCE(buf + pos, len, CE_UTF8);
+			pos += len;
+		}
+	}
+	return out;
+}
+
+#ifdef POISMF_MMAP_MODELS
+struct MappedFile {
+	void *addr;
+	size_t size;
+};
+
+static R_altrep_class_t mmap_real_class;
+
+static void release_mapping(SEXP ptr)
+{
+	MappedFile *mapping = (MappedFile*) R_ExternalPtrAddr(ptr);
+	if (mapping == NULL) return;
+	munmap(mapping->addr, mapping->size);
+	delete mapping;
+	R_ClearExternalPtr(ptr);
+}
+
+/* data1 is the external pointer to the mapping, data2 is (offset in bytes, length) */
+static double* mmap_real_ptr(SEXP x)
+{
+	MappedFile *mapping = (MappedFile*) R_ExternalPtrAddr(R_altrep_data1(x));
+	return (double*) ((char*) mapping->addr + (size_t) REAL(R_altrep_data2(x))[0]);
+}
+
+static R_xlen_t mmap_real_length(SEXP x)
+{
+	return (R_xlen_t) REAL(R_altrep_data2(x))[1];
+}
+
+static void* mmap_real_dataptr(SEXP x, Rboolean writeable)
+{
+	return (void*) mmap_real_ptr(x);
+}
+
+static const void* mmap_real_dataptr_or_null(SEXP x)
+{
+	return (const void*) mmap_real_ptr(x);
+}
+
+static double mmap_real_elt(SEXP x, R_xlen_t i)
+{
+	return mmap_real_ptr(x)[i];
+}
+
+static R_xlen_t mmap_real_get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf)
+{
+	R_xlen_t len = mmap_real_length(x);
+	R_xlen_t ncopy = (len - i) > n? n : (len - i);
+	memcpy(buf, mmap_real_ptr(x) + i, sizeof(double) * ncopy);
+	return ncopy;
+}
+
+static Rboolean mmap_real_inspect(SEXP x, int pre, int deep, int pvec, void (*inspect_subtree)(SEXP, int, int, int))
+{
+	Rprintf("poismf memory-mapped factors (len=%.0f)\n", (double) mmap_real_length(x));
+	return TRUE;
+}
+
+static SEXP mmap_real_vector(SEXP mapping_ptr, size_t offset, size_t length)
+{
+	Rcpp::NumericVector info = Rcpp::NumericVector::create((double) offset, (double) length);
+	return R_new_altrep(mmap_real_class, mapping_ptr, info);
+}
+#endif
+
+// [[Rcpp::init]]
+void poismf_init_altrep(DllInfo *dll)
+{
+	#ifdef POISMF_MMAP_MODELS
+	mmap_real_class = R_make_altreal_class("mmap_real", "poismf", dll);
+	R_set_altrep_Length_method(mmap_real_class, mmap_real_length);
+	R_set_altrep_Inspect_method(mmap_real_class, mmap_real_inspect);
+	R_set_altvec_Dataptr_method(mmap_real_class, mmap_real_dataptr);
+	R_set_altvec_Dataptr_or_null_method(mmap_real_class, mmap_real_dataptr_or_null);
+	R_set_altreal_Elt_method(mmap_real_class, mmap_real_elt);
+	R_set_altreal_Get_region_method(mmap_real_class, mmap_real_get_region);
+	#endif
+}
+
+// [[Rcpp::export]]
+void r_wrapper_save_model(std::string fname, Rcpp::NumericVector A, Rcpp::NumericVector B, size_t dimA, size_t dimB, size_t k,
+	std::string params, Rcpp::Nullable<Rcpp::CharacterVector> ids_A, Rcpp::Nullable<Rcpp::CharacterVector> ids_B)
+{
+	std::string ids;
+	uint32_t params_len = params.size();
+	ids.append((char*) &params_len, sizeof(uint32_t));
+	ids.append(params);
+	append_ids(ids, ids_A);
+	append_ids(ids, ids_B);
+
+	int status = save_model_file(fname.c_str(), A.begin(), B.begin(), dimA, dimB, k, ids.data(), ids.size(), NULL, 0);
+	if (status != 0) Rcpp::stop(model_io_error(status));
+}
+
+/* Outputs A and B with dimensions (k, dimA) and (k, dimB), which is the row-major layout of the file */
+// [[Rcpp::export]]
+Rcpp::List r_wrapper_load_model(std::string fname, bool use_mmap)
+{
+	size_t dimA, dimB, k, ids_size, offset_A, offset_B, offset_ids, seen_size, offset_seen;
+	int status = read_model_header(fname.c_str(), &dimA, &dimB, &k, &ids_size,
+								   &offset_A, &offset_B, &offset_ids, &seen_size, &offset_seen);
+	if (status != 0) Rcpp::stop(model_io_error(status));
+	if (ids_size < sizeof(uint32_t)) Rcpp::stop(model_io_error(4));
+
+	Rcpp::NumericVector A, B;
+	std::string ids(ids_size, '\0');
+
+	#ifdef POISMF_MMAP_MODELS
+	if (use_mmap)
+	{
+		int fd = open(fname.c_str(), O_RDONLY);
+		if (fd < 0) Rcpp::stop(model_io_error(1));
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t) st.st_size < offset_ids + ids_size) {
+			close(fd);
+			Rcpp::stop(model_io_error(2));
+		}
+		void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED) Rcpp::stop("Could not memory-map the file.");
+
+		Rcpp::XPtr<MappedFile> mapping_ptr(new MappedFile{addr, (size_t) st.st_size}, false);
+		R_RegisterCFinalizerEx(mapping_ptr, release_mapping, TRUE);
+		A = mmap_real_vector(mapping_ptr, offset_A, dimA * k);
+		B = mmap_real_vector(mapping_ptr, offset_B, dimB * k);
+		memcpy(&ids[0], (char*) addr + offset_ids, ids_size);
+	}
+
+	else
+	#endif
+	{
+		A = Rcpp::NumericVector(dimA * k);
+		B = Rcpp::NumericVector(dimB * k);
+		FILE *f = fopen(fname.c_str(), "rb");
+		if (f == NULL) Rcpp::stop(model_io_error(1));
+		bool read_ok = fseek(f, offset_A, SEEK_SET) == 0 &&
+					   fread(A.begin(), sizeof(double), dimA * k, f) == dimA * k &&
+					   fread(B.begin(), sizeof(double), dimB * k, f) == dimB * k &&
+					   fread(&ids[0], 1, ids_size, f) == ids_size;
+		fclose(f);
+		if (!read_ok) Rcpp::stop(model_io_error(2));
+	}
+
+	A.attr("dim") = Rcpp::Dimension(k, dimA);
+	B.attr("dim") = Rcpp::Dimension(k, dimB);
+
+	uint32_t params_len;
+	memcpy(&params_len, ids.data(), sizeof(uint32_t));
+	size_t pos = sizeof(uint32_t) + params_len;
+	if (pos > ids_size) Rcpp::stop(model_io_error(4));
+	Rcpp::RObject ids_A = read_ids(ids.data(), ids_size, pos);
+	Rcpp::RObject ids_B = read_ids(ids.data(), ids_size, pos);
+	return Rcpp::List::create(
+		Rcpp::_["A"] = A,
+		Rcpp::_["B"] = B,
+		Rcpp::_["dimA"] = (double) dimA,
+		Rcpp::_["dimB"] = (double) dimB,
+		Rcpp::_["k"] = (int) k,
+		Rcpp::_["params"] = ids.substr(sizeof(uint32_t), params_len),
+		Rcpp::_["ids_A"] = ids_A,
+		Rcpp::_["ids_B"] = ids_B
+	);
+}
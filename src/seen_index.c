@@ -0,0 +1,773 @@
+ /*
+	Poisson Factorization for sparse matrices
+
+	Index of the items seen by each user, for excluding them when recommending.
+
+	The set of items of each user is stored in one of two ways, whichever takes less memory: as a sorted
+	array of 32-bit item indices, or as a bitmap with one bit per item (for heavy users with more than
+	nitems/32 items). Membership checks are then a bit test or a binary search, and when scanning the
+	scores of all the items in order, the sorted arrays are merged with the scan through a cursor, so
+	that excluding the seen items costs O(1) per item either way.
+
+	All the sets live in a single buffer of 32-bit words, referenced by position. Replacing the set of a
+	user writes it in-place if it fits, or at the end of the buffer otherwise, and the buffer is compacted
+	once more than half of it is unused. The index can be serialized to a contiguous block of bytes (e.g.
+	to store it in a model file):
+		uint64: nusers, nitems, nwords
+		uint32: count[nusers], zero-padded to a multiple of 8 bytes
+		uint32: data[nwords], zero-padded to a multiple of 8 bytes
+	with the sets of the users one after the other in 'data'.
+
+	Functions return 0 on success or one of the 'seen_status' codes on failure.
+
+	BSD 2-Clause License
+
+	Copyright (c) 2019, David Cortes
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice, this
+	  list of conditions and the following disclaimer.
+
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+	FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+	DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+	SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+	CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+	OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+/* Aliasing for compiler optimizations */
+#ifdef __cplusplus
+	#if defined(__GNUG__) || defined(__GNUC__) || defined(_MSC_VER) || defined(__clang__) || defined(__INTEL_COMPILER)
+		#define restrict __restrict
+	#else
+		#define restrict 
+	#endif
+#elif defined(_MSC_VER)
+	#define restrict __restrict
+#elif !defined(__STDC_VERSION__) || (__STDC_VERSION__ < 199901L)
+	#define restrict 
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+
+#ifndef size_t_for
+	#ifdef _OPENMP
+		#if (_OPENMP > 200801) && !defined(_WIN32) && !defined(_WIN64) /* OpenMP > 3.0 */
+			#define size_t_for size_t
+		#else
+			#define size_t_for
+		#endif
+	#else
+		#define size_t_for size_t
+	#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum seen_status {
+	seen_ok = 0,
+	seen_out_of_memory = 1,
+	seen_bad_index = 2,
+	seen_bad_format = 3
+} seen_status;
+
+typedef struct seen_index {
+	size_t nusers;
+	size_t nitems;
+	size_t cap_users;
+	uint64_t *start;   /* position in 'data' of the set of each user */
+	uint32_t *count;   /* number of items seen by each user */
+	uint32_t *data;
+	size_t nwords;     /* words used in 'data', including the ones no longer referenced */
+	size_t cap_words;
+	size_t garbage;    /* words no longer referenced */
+} seen_index;
+
+static inline size_t seen_bitmap_words(size_t nitems)
+{
+	return (nitems + 31) / 32;
+}
+
+static inline bool seen_is_bitmap(size_t nitems, size_t count)
+{
+	return count > seen_bitmap_words(nitems);
+}
+
+static inline size_t seen_set_words(size_t nitems, size_t count)
+{
+	return seen_is_bitmap(nitems, count)? seen_bitmap_words(nitems) : count;
+}
+
+/* Whether 'user' has seen 'item' - users and items outside of the index haven't seen anything */
+bool seen_index_contains(const seen_index *idx, size_t user, size_t item)
+{
+	if (user >= idx->nusers || item >= idx->nitems) { return false; }
+	size_t count = idx->count[user];
+	const uint32_t *set = idx->data + idx->start[user];
+	if (seen_is_bitmap(idx->nitems, count))
+	{
+		return (set[item >> 5] >> (item & 31)) & 1;
+	}
+
+	size_t lo = 0, hi = count, mid;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (set[mid] < item) { lo = mid + 1; } else { hi = mid; }
+	}
+	return lo < count && set[lo] == item;
+}
+
+/* Writes the sorted items of a user to 'out' (which must have room for 'count[user]' entries), returning how many */
+size_t seen_index_get_user(const seen_index *idx, size_t user, uint32_t *restrict out)
+{
+	if (user >= idx->nusers) { return 0; }
+	size_t count = idx->count[user];
+	const uint32_t *restrict set = idx->data + idx->start[user];
+	if (!seen_is_bitmap(idx->nitems, count)) {
+		memcpy(out, set, sizeof(uint32_t) * count);
+		return count;
+	}
+
+	size_t nout = 0;
+	uint32_t word;
+	for (size_t w = 0; w < seen_bitmap_words(idx->nitems); w++)
+	{
+		word = set[w];
+		while (word)
+		{
+			int bit = 0;
+			while (!((word >> bit) & 1)) { bit++; }
+			out[nout++] = (uint32_t) (w * 32 + bit);
+			word &= word - 1;
+		}
+	}
+	return nout;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+/* Sorts and removes duplicates, returning the new number of entries */
+static size_t sort_unique_items(uint32_t *items, size_t n)
+{
+	if (n <= 1) { return n; }
+	qsort(items, n, sizeof(uint32_t), cmp_uint32);
+	size_t nout = 1;
+	for (size_t i = 1; i < n; i++)
+	{
+		if (items[i] != items[nout - 1]) { items[nout++] = items[i]; }
+	}
+	return nout;
+}
+
+/* 'items' must be sorted and unique, and 'dest' must have 'seen_set_words' words */
+static void encode_set(uint32_t *restrict dest, const uint32_t *restrict items, size_t count, size_t nitems)
+{
+	if (!seen_is_bitmap(nitems, count)) {
+		memcpy(dest, items, sizeof(uint32_t) * count);
+		return;
+	}
+	memset(dest, 0, sizeof(uint32_t) * seen_bitmap_words(nitems));
+	for (size_t i = 0; i < count; i++)
+	{
+		dest[items[i] >> 5] |= (uint32_t)1 << (items[i] & 31);
+	}
+}
+
+static int reserve_users(seen_index *idx, size_t nusers)
+{
+	if (nusers <= idx->cap_users) { return seen_ok; }
+	size_t new_cap = idx->cap_users + idx->cap_users / 2;
+	if (new_cap < nusers) { new_cap = nusers; }
+	uint64_t *start = (uint64_t*) realloc(idx->start, sizeof(uint64_t) * new_cap);
+	if (start == NULL) { return seen_out_of_memory; }
+	idx->start = start;
+	uint32_t *count = (uint32_t*) realloc(idx->count, sizeof(uint32_t) * new_cap);
+	if (count == NULL) { return seen_out_of_memory; }
+	idx->count = count;
+	idx->cap_users = new_cap;
+	return seen_ok;
+}
+
+static int reserve_words(seen_index *idx, size_t nwords)
+{
+	if (nwords <= idx->cap_words) { return seen_ok; }
+	size_t new_cap = idx->cap_words + idx->cap_words / 2;
+	if (new_cap < nwords) { new_cap = nwords; }
+	uint32_t *data = (uint32_t*) realloc(idx->data, sizeof(uint32_t) * new_cap);
+	if (data == NULL) { return seen_out_of_memory; }
+	idx->data = data;
+	idx->cap_words = new_cap;
+	return seen_ok;
+}
+
+void free_seen_index(seen_index *idx)
+{
+	free(idx->start);
+	free(idx->count);
+	free(idx->data);
+	memset(idx, 0, sizeof(seen_index));
+}
+
+/*	Builds the index from the data in row-sparse format, with one row per user ('indptr' has nusers+1 entries).
+	Indices need not be sorted, and repeated ones count once. The index must be zero-initialized or freed. */
+int seen_index_build(seen_index *idx, size_t nusers, size_t nitems, size_t *restrict indptr, size_t *restrict indices, int nthreads)
+{
+	memset(idx, 0, sizeof(seen_index));
+	if (nitems > UINT32_MAX) { return seen_bad_index; }
+	int status = reserve_users(idx, nusers? nusers : 1);
+	if (status) { return status; }
+	idx->nusers = nusers;
+	idx->nitems = nitems;
+
+	size_t max_row = 0;
+	for (size_t user = 0; user < nusers; user++)
+	{
+		if (indptr[user + 1] - indptr[user] > max_row) { max_row = indptr[user + 1] - indptr[user]; }
+	}
+
+	/* first pass gets the number of unique items of each user, second one writes the sets */
+	uint32_t *buffer;
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long user;
+	#endif
+	for (int pass = 0; pass < 2; pass++)
+	{
+		#pragma omp parallel num_threads(nthreads) private(buffer) shared(status, idx, indptr, indices, nusers, nitems, max_row, pass)
+		{
+			buffer = (uint32_t*) malloc(sizeof(uint32_t) * (max_row? max_row : 1));
+			if (buffer == NULL) { status = seen_out_of_memory; }
+
+			#pragma omp for schedule(dynamic, 256)
+			for (size_t_for user = 0; user < nusers; user++)
+			{
+				if (buffer == NULL) { continue; }
+				size_t n = indptr[user + 1] - indptr[user];
+				bool is_bad = false;
+				for (size_t i = 0; i < n; i++) {
+					if (indices[indptr[user] + i] >= nitems) { is_bad = true; }
+					buffer[i] = (uint32_t) indices[indptr[user] + i];
+				}
+				if (is_bad) { status = seen_bad_index; continue; }
+				n = sort_unique_items(buffer, n);
+				if (pass == 0) {
+					idx->count[user] = (uint32_t) n;
+				} else {
+					encode_set(idx->data + idx->start[user], buffer, n, nitems);
+				}
+			}
+
+			free(buffer);
+		}
+		if (status) { free_seen_index(idx); return status; }
+
+		if (pass == 0)
+		{
+			size_t nwords = 0;
+			for (size_t user = 0; user < nusers; user++) {
+				idx->start[user] = nwords;
+				nwords += seen_set_words(nitems, idx->count[user]);
+			}
+			status = reserve_words(idx, nwords? nwords : 1);
+			if (status) { free_seen_index(idx); return status; }
+			idx->nwords = nwords;
+		}
+	}
+	return seen_ok;
+}
+
+/*	Rewrites all the sets into a new buffer without unused space, re-encoding them for 'new_nitems' items
+	(which can be larger than the current number, e.g. after adding items to the model) */
+int seen_index_compact(seen_index *idx, size_t new_nitems)
+{
+	if (new_nitems > UINT32_MAX || new_nitems < idx->nitems) { return seen_bad_index; }
+	size_t nwords = 0;
+	size_t max_count = 0;
+	for (size_t user = 0; user < idx->nusers; user++) {
+		nwords += seen_set_words(new_nitems, idx->count[user]);
+		if (idx->count[user] > max_count) { max_count = idx->count[user]; }
+	}
+
+	uint32_t *data = (uint32_t*) malloc(sizeof(uint32_t) * (nwords? nwords : 1));
+	uint32_t *buffer = (uint32_t*) malloc(sizeof(uint32_t) * (max_count? max_count : 1));
+	if (data == NULL || buffer == NULL) {
+		free(data); free(buffer);
+		return seen_out_of_memory;
+	}
+
+	size_t pos = 0;
+	size_t count;
+	for (size_t user = 0; user < idx->nusers; user++)
+	{
+		count = seen_index_get_user(idx, user, buffer);
+		encode_set(data + pos, buffer, count, new_nitems);
+		idx->start[user] = pos;
+		pos += seen_set_words(new_nitems, count);
+	}
+
+	free(buffer);
+	free(idx->data);
+	idx->data = data;
+	idx->nwords = nwords;
+	idx->cap_words = nwords? nwords : 1;
+	idx->garbage = 0;
+	idx->nitems = new_nitems;
+	return seen_ok;
+}
+
+/*	Replaces the set of items of a user. Users beyond the current ones are added (with empty sets
+	for the ones in between). */
+int seen_index_set_user(seen_index *idx, size_t user, size_t *restrict items, size_t n)
+{
+	uint32_t *buffer = (uint32_t*) malloc(sizeof(uint32_t) * (n? n : 1));
+	if (buffer == NULL) { return seen_out_of_memory; }
+	for (size_t i = 0; i < n; i++)
+	{
+		if (items[i] >= idx->nitems) { free(buffer); return seen_bad_index; }
+		buffer[i] = (uint32_t) items[i];
+	}
+	n = sort_unique_items(buffer, n);
+	size_t words = seen_set_words(idx->nitems, n);
+	int status = seen_ok;
+
+	if (user >= idx->nusers)
+	{
+		status = reserve_users(idx, user + 1);
+		if (status) { goto cleanup; }
+		for (size_t new_user = idx->nusers; new_user <= user; new_user++) {
+			idx->start[new_user] = idx->nwords;
+			idx->count[new_user] = 0;
+		}
+		idx->nusers = user + 1;
+	}
+
+	size_t old_words = seen_set_words(idx->nitems, idx->count[user]);
+	if (words > old_words)
+	{
+		status = reserve_words(idx, idx->nwords + words);
+		if (status) { goto cleanup; }
+		idx->start[user] = idx->nwords;
+		idx->nwords += words;
+		idx->garbage += old_words;
+	}
+	else {
+		idx->garbage += old_words - words;
+	}
+	encode_set(idx->data + idx->start[user], buffer, n, idx->nitems);
+	idx->count[user] = (uint32_t) n;
+
+	if (idx->garbage > idx->nwords / 2)
+	{
+		status = seen_index_compact(idx, idx->nitems);
+	}
+
+	cleanup:
+		free(buffer);
+		return status;
+}
+
+/* Whether 'user' has the same set of items in both indices, which can have different numbers of items */
+bool seen_index_same_user(const seen_index *a, const seen_index *b, size_t user)
+{
+	size_t count = (user < a->nusers)? a->count[user] : 0;
+	size_t count_b = (user < b->nusers)? b->count[user] : 0;
+	if (count != count_b) { return false; }
+	if (count == 0) { return true; }
+
+	const uint32_t *set = a->data + a->start[user];
+	if (a->nitems == b->nitems)
+	{
+		return memcmp(set, b->data + b->start[user], sizeof(uint32_t) * seen_set_words(a->nitems, count)) == 0;
+	}
+	/* same number of items, so they are the same sets if all of the items of one are in the other */
+	if (!seen_is_bitmap(a->nitems, count))
+	{
+		for (size_t i = 0; i < count; i++) {
+			if (!seen_index_contains(b, user, set[i])) { return false; }
+		}
+		return true;
+	}
+	for (size_t item = 0; item < a->nitems; item++) {
+		if (((set[item >> 5] >> (item & 31)) & 1) && !seen_index_contains(b, user, item)) { return false; }
+	}
+	return true;
+}
+
+/*	Users whose set of items in 'idx' differs from the one in 'prev' (users beyond the ones of an index have empty
+	sets), sorted. 'out' must have space for max(idx->nusers, prev->nusers) entries, and 'nout' gets their number. */
+int seen_index_changed_users(const seen_index *idx, const seen_index *prev, size_t *restrict out, size_t *nout, int nthreads)
+{
+	size_t nusers = (idx->nusers > prev->nusers)? idx->nusers : prev->nusers;
+	bool *changed = (bool*) malloc(sizeof(bool) * (nusers? nusers : 1));
+	if (changed == NULL) { return seen_out_of_memory; }
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long user;
+	#endif
+
+	#pragma omp parallel for schedule(dynamic, 256) num_threads(nthreads) firstprivate(idx, prev, changed, nusers)
+	for (size_t_for user = 0; user < nusers; user++) {
+		changed[user] = !seen_index_same_user(idx, prev, user);
+	}
+
+	*nout = 0;
+	for (size_t user = 0; user < nusers; user++) {
+		if (changed[user]) { out[(*nout)++] = user; }
+	}
+	free(changed);
+	return seen_ok;
+}
+
+/* Selected items, sorted, along with their positions in the selection */
+typedef struct sel_item {
+	size_t item;
+	size_t pos;
+} sel_item;
+
+static int cmp_sel_item(const void *a, const void *b)
+{
+	size_t x = ((const sel_item*)a)->item;
+	size_t y = ((const sel_item*)b)->item;
+	return (x > y) - (x < y);
+}
+
+#define NOT_SELECTED UINT32_MAX
+
+/*	For each entry of 'sel' with this item, if 'out_ind' is NULL, increments the entry of its position in 'counts',
+	otherwise writes 'user' at the position given by that entry and advances it */
+static inline void add_match(const sel_item *restrict sel, size_t nsel, const uint32_t *restrict first_sel, size_t item,
+	size_t user, size_t *restrict counts, size_t *restrict out_ind)
+{
+	if (first_sel[item] == NOT_SELECTED) { return; }
+	for (size_t j = first_sel[item]; j < nsel && sel[j].item == item; j++)
+	{
+		if (out_ind == NULL) { counts[sel[j].pos]++; } else { out_ind[counts[sel[j].pos]++] = user; }
+	}
+}
+
+/*	Finds which of the selected items 'user' has seen (see 'add_match'). 'first_sel' has, for each item, its first
+	position in 'sel' (or NOT_SELECTED), so that each item of the user is looked up in constant time, except for
+	bitmaps with more items than the selection, which are tested for each selected item instead. */
+static void match_user_items(const seen_index *idx, size_t user, const sel_item *restrict sel, size_t nsel,
+	const uint32_t *restrict first_sel, size_t *restrict counts, size_t *restrict out_ind)
+{
+	size_t count = idx->count[user];
+	if (count == 0) { return; }
+	const uint32_t *restrict set = idx->data + idx->start[user];
+
+	if (!seen_is_bitmap(idx->nitems, count))
+	{
+		for (size_t i = 0; i < count; i++) {
+			add_match(sel, nsel, first_sel, set[i], user, counts, out_ind);
+		}
+		return;
+	}
+
+	if (count > nsel)
+	{
+		for (size_t j = 0; j < nsel; j++)
+		{
+			if (sel[j].item < idx->nitems && ((set[sel[j].item >> 5] >> (sel[j].item & 31)) & 1)) {
+				if (out_ind == NULL) { counts[sel[j].pos]++; } else { out_ind[counts[sel[j].pos]++] = user; }
+			}
+		}
+		return;
+	}
+
+	uint32_t word;
+	int bit;
+	for (size_t w = 0; w < seen_bitmap_words(idx->nitems); w++)
+	{
+		word = set[w];
+		while (word)
+		{
+			bit = 0;
+			while (!((word >> bit) & 1)) { bit++; }
+			add_match(sel, nsel, first_sel, w * 32 + bit, user, counts, out_ind);
+			word &= word - 1;
+		}
+	}
+}
+
+/*	Users who have seen each of 'nsel' items, in the row-sparse format taken by 'topn_rows_for_items' (one row per
+	item, users sorted). Call first with 'out_ind' as NULL to get the counts in 'out_indptr' (size nsel+1),
+	then again with 'out_ind' having 'out_indptr[nsel]' entries.
+	Users are split into contiguous blocks which are processed in parallel, each one counting its matches per
+	item, so that in the second call the blocks know where to write their users without synchronizing. The
+	selection is inverted first into a table with the position of each item in it, so the cost is linear in
+	the number of seen items regardless of how many are selected. */
+int seen_index_users_for_items(const seen_index *idx, size_t *restrict items, size_t nsel,
+	size_t *restrict out_indptr, size_t *restrict out_ind, int nthreads)
+{
+	size_t nusers = idx->nusers;
+	size_t nblocks = (size_t)(nthreads > 0? nthreads : 1) * 4;
+	if (nblocks > nusers) { nblocks = nusers? nusers : 1; }
+	size_t block_size = (nusers + nblocks - 1) / nblocks;
+	if (nsel >= NOT_SELECTED) { return seen_bad_index; }
+	sel_item *sel = (sel_item*) malloc(sizeof(sel_item) * (nsel? nsel : 1));
+	size_t *counts = (size_t*) calloc(nblocks * (nsel? nsel : 1), sizeof(size_t));
+	uint32_t *first_sel = (uint32_t*) malloc(sizeof(uint32_t) * (idx->nitems? idx->nitems : 1));
+	if (sel == NULL || counts == NULL || first_sel == NULL) {
+		free(sel);
+		free(counts);
+		free(first_sel);
+		return seen_out_of_memory;
+	}
+	for (size_t i = 0; i < nsel; i++) {
+		sel[i].item = items[i];
+		sel[i].pos = i;
+	}
+	qsort(sel, nsel, sizeof(sel_item), cmp_sel_item);
+	for (size_t item = 0; item < idx->nitems; item++) { first_sel[item] = NOT_SELECTED; }
+	for (size_t j = nsel; j > 0; j--) {
+		if (sel[j - 1].item < idx->nitems) { first_sel[sel[j - 1].item] = (uint32_t) (j - 1); }
+	}
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long block;
+	#endif
+
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads) firstprivate(idx, sel, nsel, first_sel, counts, nusers, block_size)
+	for (size_t_for block = 0; block < nblocks; block++)
+	{
+		size_t end = ((size_t)block + 1) * block_size;
+		for (size_t user = (size_t)block * block_size; user < end && user < nusers; user++) {
+			match_user_items(idx, user, sel, nsel, first_sel, counts + (size_t)block * nsel, NULL);
+		}
+	}
+
+	if (out_ind == NULL)
+	{
+		out_indptr[0] = 0;
+		for (size_t i = 0; i < nsel; i++)
+		{
+			out_indptr[i + 1] = out_indptr[i];
+			for (size_t b = 0; b < nblocks; b++) { out_indptr[i + 1] += counts[b * nsel + i]; }
+		}
+		goto cleanup;
+	}
+
+	/* each block starts writing the users of an item after the ones from the blocks before it */
+	size_t next, nthis;
+	for (size_t i = 0; i < nsel; i++)
+	{
+		next = out_indptr[i];
+		for (size_t b = 0; b < nblocks; b++)
+		{
+			nthis = counts[b * nsel + i];
+			counts[b * nsel + i] = next;
+			next += nthis;
+		}
+	}
+
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthreads) firstprivate(idx, sel, nsel, first_sel, counts, nusers, block_size, out_ind)
+	for (size_t_for block = 0; block < nblocks; block++)
+	{
+		size_t end = ((size_t)block + 1) * block_size;
+		for (size_t user = (size_t)block * block_size; user < end && user < nusers; user++) {
+			match_user_items(idx, user, sel, nsel, first_sel, counts + (size_t)block * nsel, out_ind);
+		}
+	}
+
+	cleanup:
+		free(sel);
+		free(counts);
+		free(first_sel);
+		return seen_ok;
+}
+
+size_t seen_index_memory(const seen_index *idx)
+{
+	return idx->cap_users * (sizeof(uint64_t) + sizeof(uint32_t)) + idx->cap_words * sizeof(uint32_t);
+}
+
+static inline size_t pad8(size_t nbytes)
+{
+	return (nbytes + 7) & ~((size_t)7);
+}
+
+size_t seen_index_serialized_size(const seen_index *idx)
+{
+	return 3 * sizeof(uint64_t)
+		+ pad8(idx->nusers * sizeof(uint32_t))
+		+ pad8((idx->nwords - idx->garbage) * sizeof(uint32_t));
+}
+
+/* Writes the index to 'out', which must have 'seen_index_serialized_size' bytes */
+void seen_index_serialize(const seen_index *idx, char *out)
+{
+	uint64_t header[3];
+	size_t live_words = idx->nwords - idx->garbage;
+	header[0] = idx->nusers; header[1] = idx->nitems; header[2] = live_words;
+	memset(out, 0, seen_index_serialized_size(idx));
+	memcpy(out, header, sizeof(header));
+	out += sizeof(header);
+	if (idx->nusers) { memcpy(out, idx->count, idx->nusers * sizeof(uint32_t)); }
+	out += pad8(idx->nusers * sizeof(uint32_t));
+	uint32_t *data = (uint32_t*) out;
+	for (size_t user = 0; user < idx->nusers; user++)
+	{
+		size_t words = seen_set_words(idx->nitems, idx->count[user]);
+		memcpy(data, idx->data + idx->start[user], words * sizeof(uint32_t));
+		data += words;
+	}
+}
+
+/* Reads an index written by 'seen_index_serialize'. The index must be zero-initialized or freed. */
+int seen_index_deserialize(seen_index *idx, const char *buf, size_t size)
+{
+	uint64_t header[3];
+	memset(idx, 0, sizeof(seen_index));
+	if (size < sizeof(header)) { return seen_bad_format; }
+	memcpy(header, buf, sizeof(header));
+	size_t nusers = header[0], nitems = header[1], nwords = header[2];
+	if (nitems > UINT32_MAX || size != 3 * sizeof(uint64_t) + pad8(nusers * sizeof(uint32_t)) + pad8(nwords * sizeof(uint32_t)))
+	{
+		return seen_bad_format;
+	}
+
+	if (reserve_users(idx, nusers? nusers : 1) || reserve_words(idx, nwords? nwords : 1)) {
+		free_seen_index(idx);
+		return seen_out_of_memory;
+	}
+	idx->nusers = nusers;
+	idx->nitems = nitems;
+	idx->nwords = nwords;
+	buf += sizeof(header);
+	if (nusers) { memcpy(idx->count, buf, nusers * sizeof(uint32_t)); }
+	buf += pad8(nusers * sizeof(uint32_t));
+	if (nwords) { memcpy(idx->data, buf, nwords * sizeof(uint32_t)); }
+
+	size_t pos = 0;
+	for (size_t user = 0; user < nusers; user++)
+	{
+		idx->start[user] = pos;
+		pos += seen_set_words(nitems, idx->count[user]);
+	}
+	if (pos != nwords) {
+		free_seen_index(idx);
+		return seen_bad_format;
+	}
+	for (size_t user = 0; user < nusers; user++)
+	{
+		if (seen_is_bitmap(nitems, idx->count[user])) { continue; }
+		for (size_t i = 0; i < idx->count[user]; i++) {
+			if (idx->data[idx->start[user] + i] >= nitems || (i && idx->data[idx->start[user] + i] <= idx->data[idx->start[user] + i - 1])) {
+				free_seen_index(idx);
+				return seen_bad_format;
+			}
+		}
+	}
+	return seen_ok;
+}
+
+#ifdef _FOR_PYTHON
+
+#include "findblas.h"  /* https://www.github.com/david-cortes/findblas */
+
+/* From 'pgd.c' */
+void topn_heap_push(size_t *restrict heap_ix, double *restrict heap_val, size_t *restrict heap_size, size_t n, size_t ix, double val);
+void topn_heap_sort(size_t *restrict heap_ix, double *restrict heap_val, size_t heap_size, size_t n);
+
+/*	Pushes the scores of all the items into the top-N heap of a user, skipping the ones in the index. Scores that
+	can't enter the heap are discarded before looking at the index, and for users stored as sorted arrays, the
+	cursor into the array only moves forward as the items are visited in order. */
+static void push_unseen(size_t *restrict out_ix, double *restrict out_val, size_t *restrict heap_size, size_t n,
+	const double *restrict scores, size_t dim, const seen_index *idx, size_t user)
+{
+	size_t count = (user < idx->nusers)? idx->count[user] : 0;
+	const uint32_t *restrict set = (count > 0)? (idx->data + idx->start[user]) : NULL;
+	size_t nitems_idx = idx->nitems;
+
+	if (count > 0 && seen_is_bitmap(nitems_idx, count))
+	{
+		for (size_t item = 0; item < dim; item++)
+		{
+			if (isnan(scores[item]) || (*heap_size == n && scores[item] <= out_val[0])) { continue; }
+			if (item < nitems_idx && ((set[item >> 5] >> (item & 31)) & 1)) { continue; }
+			topn_heap_push(out_ix, out_val, heap_size, n, item, scores[item]);
+		}
+		return;
+	}
+
+	size_t cursor = 0;
+	for (size_t item = 0; item < dim; item++)
+	{
+		if (isnan(scores[item]) || (*heap_size == n && scores[item] <= out_val[0])) { continue; }
+		while (cursor < count && set[cursor] < item) { cursor++; }
+		if (cursor < count && set[cursor] == item) { continue; }
+		topn_heap_push(out_ix, out_val, heap_size, n, item, scores[item]);
+	}
+}
+
+/*	Top-N items for rows 'users' of A, excluding the items that each one has in the index (or none if 'idx' is NULL).
+	Outputs have dimensions nusers*n, with unfilled entries as in 'select_topn'. Returns 0 if it succeeds or 1 if it
+	runs out of memory. */
+int topn_items_seen(
+	size_t *restrict out_ix, double *restrict out_val, double *restrict A, size_t *restrict users, size_t nusers,
+	double *restrict B, size_t dimB, size_t k, const seen_index *idx, size_t n, int nthreads)
+{
+	int k_int = (int) k;
+	int status = 0;
+	double *scores;
+	size_t heap_size;
+	seen_index empty_index;
+	memset(&empty_index, 0, sizeof(seen_index));
+	if (idx == NULL) { idx = &empty_index; }
+
+	#if defined(_OPENMP) && ((_OPENMP < 200801) || defined(_WIN32) || defined(_WIN64))
+	long row;
+	#endif
+
+	#pragma omp parallel num_threads(nthreads) private(scores, heap_size) firstprivate(out_ix, out_val, A, users, nusers, B, dimB, k, k_int, idx, n) shared(status)
+	{
+		scores = (double*) malloc(sizeof(double) * (dimB? dimB : 1));
+		if (scores == NULL) { status = 1; }
+
+		#pragma omp for schedule(dynamic)
+		for (size_t_for row = 0; row < nusers; row++)
+		{
+			if (scores == NULL) { continue; }
+			cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)dimB, k_int, 1, B, k_int, A + users[row]*k, 1, 0, scores, 1);
+			heap_size = 0;
+			push_unseen(out_ix + row*n, out_val + row*n, &heap_size, n, scores, dimB, idx, users[row]);
+			topn_heap_sort(out_ix + row*n, out_val + row*n, heap_size, n);
+		}
+
+		free(scores);
+	}
+	return status;
+}
+
+#endif /* _FOR_PYTHON */
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,13 @@
+/* Explicit instantiations of the C++ interface - see 'poismf.hpp' */
+#include "poismf.hpp"
+
+namespace poismf {
+
+template class Trainer<double, int>;
+template class Trainer<double, int64_t>;
+template class Trainer<double, size_t>;
+template class Trainer<float, int>;
+template class Trainer<float, int64_t>;
+template class Trainer<float, size_t>;
+
+}
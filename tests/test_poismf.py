@@ -0,0 +1,144 @@
+import numpy as np, pandas as pd
+import copy, pickle
+import pytest
+from poismf import PoisMF, ShardCoordinator, ModelPack
+
+def _make_data(seed = 123, nusers = 300, nitems = 200, nnz = 6000):
+    rng = np.random.default_rng(seed)
+    df = pd.DataFrame({
+        "UserId" : 1000 + rng.integers(nusers, size = nnz),
+        "ItemId" : 5000 + rng.integers(nitems, size = nnz),
+        "Count"  : 1. + rng.poisson(1, size = nnz)
+    })
+    return df.drop_duplicates(["UserId", "ItemId"]).reset_index(drop = True)
+
+def _fit(df, **kwargs):
+    params = dict(k = 4, l1_reg = 5., l2_reg = 1e3, initial_step = 1e-3, niter = 10, nthreads = 1)
+    params.update(kwargs)
+    return PoisMF(**params).fit(df)
+
+@pytest.fixture(scope = "module")
+def data():
+    return _make_data()
+
+@pytest.fixture(scope = "module")
+def model(data):
+    return _fit(data)
+
+def _seen_items(df, user):
+    return set(df.ItemId[df.UserId == user])
+
+def _brute_topN(model, df, user, n):
+    scores = model.B @ model.A[model.user_dict_[user]]
+    seen = [model.item_dict_[i] for i in _seen_items(df, user)]
+    scores[seen] = -np.inf
+    top = np.argsort(-scores)[:n]
+    return model.item_mapping_[top], scores[top]
+
+def _assert_same_model(m1, m2):
+    np.testing.assert_array_equal(np.asarray(m1.A), np.asarray(m2.A))
+    np.testing.assert_array_equal(np.asarray(m1.B), np.asarray(m2.B))
+    np.testing.assert_array_equal(m1.user_mapping_, m2.user_mapping_)
+    np.testing.assert_array_equal(m1.item_mapping_, m2.item_mapping_)
+
+
+def test_fit_chunks_matches_fit(data):
+    full = _fit(data)
+    chunks = [data.iloc[st:st + 1000] for st in range(0, data.shape[0], 1000)]
+    chunked = PoisMF(**{p : getattr(full, p) for p in ["k", "l1_reg", "l2_reg", "initial_step", "niter", "nthreads"]})
+    chunked.fit_chunks(iter(chunks), nnz_hint = data.shape[0])
+    _assert_same_model(full, chunked)
+
+def test_topN_batch_matches_brute_force(model, data):
+    users = model.user_mapping_[::7]
+    recs, scores = model.topN_batch(users, n = 10, return_scores = True)
+    for user, rec, sc in zip(users, recs, scores):
+        ref_items, ref_scores = _brute_topN(model, data, user, 10)
+        np.testing.assert_array_equal(rec, ref_items)
+        np.testing.assert_allclose(sc, ref_scores)
+        assert not (set(rec) & _seen_items(data, user))
+        np.testing.assert_array_equal(model.topN(user, n = 10), rec)
+
+def test_top_users_matches_brute_force(model, data):
+    items = np.r_[model.item_mapping_[::9], model.item_mapping_[3]]
+    users, scores = model.top_users(items, n = 15, return_scores = True)
+    for item, top, sc in zip(items, users, scores):
+        pred = model.A @ model.B[model.item_dict_[item]]
+        seen = [model.user_dict_[u] for u in data.UserId[data.ItemId == item]]
+        pred[seen] = -np.inf
+        ref = np.argsort(-pred)[:15]
+        np.testing.assert_array_equal(top, model.user_mapping_[ref])
+        np.testing.assert_allclose(sc, pred[ref])
+
+@pytest.mark.parametrize("mmap_mode", [None, "r", "c"])
+def test_save_load_roundtrip(model, tmp_path, mmap_mode):
+    fname = str(tmp_path / "model.bin")
+    model.save_model(fname)
+    loaded = PoisMF.load_model(fname, mmap_mode = mmap_mode)
+    _assert_same_model(model, loaded)
+    np.testing.assert_allclose(loaded.Bsum, model.Bsum)
+    users = model.user_mapping_[:20]
+    for r1, r2 in zip(model.topN_batch(users), loaded.topN_batch(users)):
+        np.testing.assert_array_equal(r1, r2)
+
+def test_delta_roundtrip_with_seen_items(model, data, tmp_path):
+    fname = str(tmp_path / "model.bin")
+    delta = str(tmp_path / "delta.bin")
+    model.save_model(fname)
+    newer = copy.deepcopy(model)
+    existing = model.user_mapping_[3]
+    new_items = model.item_mapping_[[0, 1, 2]]
+    newer.add_user(existing, pd.DataFrame({"ItemId" : new_items, "Count" : [3., 1., 2.]}), update_existing = True)
+    newer.add_user(-1, pd.DataFrame({"ItemId" : model.item_mapping_[[4, 5]], "Count" : [2., 2.]}))
+    changed = newer.export_delta(model, delta)
+    assert changed["users"] == 2
+
+    in_memory = PoisMF.load_model(fname)
+    in_memory.apply_delta(delta)
+    PoisMF.apply_delta_to_file(fname, delta)
+    from_file = PoisMF.load_model(fname)
+    for updated in [in_memory, from_file]:
+        _assert_same_model(newer, updated)
+        for user in [existing, -1, model.user_mapping_[4]]:
+            np.testing.assert_array_equal(updated.topN(user, n = 20), newer.topN(user, n = 20))
+        assert not (set(updated.topN(existing, n = 50)) & set(new_items))
+
+def test_recommend_from_interactions_matches_predict_factors(model):
+    items = model.item_mapping_[[1, 5, 9, 20]]
+    counts = np.array([1., 2., 3., 1.])
+    factors = model.predict_factors(pd.DataFrame({"ItemId" : items, "Count" : counts}), l1_reg = 0.1)
+    rec, scores = model.recommend_from_interactions(items, counts, n = 5, return_scores = True, l1_reg = 0.1)
+    pred = model.B @ factors
+    pred[[model.item_dict_[i] for i in items]] = -np.inf
+    ref = np.argsort(-pred)[:5]
+    np.testing.assert_array_equal(rec, model.item_mapping_[ref])
+    np.testing.assert_allclose(scores, pred[ref])
+
+def test_shards_and_pack_match_full_model(model, tmp_path):
+    items = model.item_mapping_[[1, 5, 9, 20]]
+    counts = np.array([1., 2., 3., 1.])
+    rec, scores = model.recommend_from_interactions(items, counts, n = 5, return_scores = True, l1_reg = 0.1)
+
+    coordinator = ShardCoordinator(model.make_item_shards(3))
+    rec_shards, scores_shards = coordinator.recommend_from_interactions(items, counts, n = 5, return_scores = True,
+                                                                       l1_reg = 0.1)
+    np.testing.assert_array_equal(rec_shards, rec)
+    np.testing.assert_allclose(scores_shards, scores)
+
+    fname = str(tmp_path / "pack.bin")
+    other = _fit(_make_data(seed = 1), k = 6, l1_reg = 0.)
+    ModelPack.write(fname, {"main" : model, "other" : other})
+    pack = ModelPack(fname)
+    rec_pack, scores_pack = pack.recommend_from_interactions(["main"], [items], [counts], n = 5, return_scores = True,
+                                                             l1_reg = 0.1)
+    np.testing.assert_array_equal(rec_pack[0], rec)
+    np.testing.assert_allclose(scores_pack[0], scores)
+    np.testing.assert_allclose(pack.get_model("main").Bsum, model.Bsum)
+
+def test_pickle_roundtrip(model):
+    unpickled = pickle.loads(pickle.dumps(model, protocol = pickle.HIGHEST_PROTOCOL))
+    _assert_same_model(model, unpickled)
+    np.testing.assert_allclose(unpickled.Bsum, model.Bsum)
+    users = model.user_mapping_[:20]
+    for r1, r2 in zip(model.topN_batch(users), unpickled.topN_batch(users)):
+        np.testing.assert_array_equal(r1, r2)